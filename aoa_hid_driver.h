@@ -0,0 +1,286 @@
+#ifndef AOA_HID_DRIVER_H
+#define AOA_HID_DRIVER_H
+
+/*
+    Definitions shared between the driver and userspace programs using the device files
+*/
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define AOA_HID_MAX_REPORT_SIZE 64
+// Phones are numbered by the minor of their device files, from 0 to AOA_HID_MAX_PHONES - 1
+#define AOA_HID_MAX_PHONES 64
+
+#define AOA_HID_IOCTL_MAGIC 0xAA
+
+/*
+    Input reports of the driver's own descriptor, for raw reports, raw batches and synchronized dispatch
+    Keyboard: report ID, modifier, keycode
+    Mouse: report ID, buttons, x, y, then wheel and pan as 16 bit little endian in 1/AOA_HID_SCROLL_UNITS_PER_NOTCH of a notch, all signed
+    Consumer: report ID, 16 bit little endian usage
+    Gamepad: report ID, 16 buttons little endian, hat, left x, left y, right x, right y, left trigger, right trigger
+*/
+#define AOA_HID_REPORT_ID_KEYBOARD 0x01
+#define AOA_HID_REPORT_ID_MOUSE 0x02
+#define AOA_HID_REPORT_ID_CONSUMER 0x03
+#define AOA_HID_REPORT_ID_GAMEPAD 0x04
+
+// Sizes including the report ID
+#define AOA_HID_REPORT_SIZE_KEYBOARD 3
+#define AOA_HID_REPORT_SIZE_MOUSE 8
+#define AOA_HID_REPORT_SIZE_CONSUMER 3
+#define AOA_HID_REPORT_SIZE_GAMEPAD 10
+
+// The mouse declares a Resolution Multiplier, phones count a wheel or pan notch as this many units of the report
+#define AOA_HID_SCROLL_UNITS_PER_NOTCH 120
+
+/*
+    Completion records
+
+    Reading /dev/android_keyboardN, /dev/android_mouseN, /dev/android_volumeN, /dev/android_brightnessN or /dev/android_rawN
+    returns one record for every write, or raw batch, once all of its reports have been transferred to the phone.
+    Sequence numbers count the writes and batches since the device file was opened, starting at 1.
+    Timestamps are CLOCK_MONOTONIC nanoseconds, reads only return whole records.
+*/
+struct aoa_hid_completion {
+    __u64 sequence;
+    __s32 status;       // 0 or the negative errno the write failed with
+    __u32 reserved;
+    __u64 submit_ns;
+    __u64 complete_ns;
+};
+
+// Blocks until everything submitted through the file before the call has completed
+#define AOA_HID_IOCTL_FENCE _IO(AOA_HID_IOCTL_MAGIC, 0x18)
+// Returns the number of completion records that were dropped because nobody read them
+#define AOA_HID_IOCTL_COMPLETIONS_DROPPED _IOR(AOA_HID_IOCTL_MAGIC, 0x19, __u32)
+
+/*
+    Cancelling and flushing, on every per-phone device file except /dev/android_accessoryN
+
+    AOA_HID_IOCTL_CANCEL discards the input queued through the file: keyboard text, a running script, reports waiting for replay,
+    an unsent gamepad snapshot or the rest of a raw batch. AOA_HID_IOCTL_CANCEL_PHONE discards the input queued through every device
+    file of the phone and also aborts the reports in flight and the writes waiting to send one, which fail with ECANCELED.
+    Both then send reports with nothing pressed, so no key or button stays down, and return the number of discarded characters,
+    reports, records, snapshots and scripts. Writes and batches that were cut short get ECANCELED in their completion record.
+    AOA_HID_IOCTL_FLUSH blocks until nothing is queued or in flight for the phone, it can be interrupted by signals.
+*/
+#define AOA_HID_IOCTL_CANCEL _IO(AOA_HID_IOCTL_MAGIC, 0x28)
+#define AOA_HID_IOCTL_CANCEL_PHONE _IO(AOA_HID_IOCTL_MAGIC, 0x29)
+#define AOA_HID_IOCTL_FLUSH _IO(AOA_HID_IOCTL_MAGIC, 0x2A)
+
+/*
+    /dev/android_recordN
+
+    Reading returns the reports captured while capturing is enabled, writing queues reports for replay.
+    Both directions use the same stream format: a header immediately followed by header.size report bytes.
+    Written records must hold 1 to AOA_HID_MAX_REPORT_SIZE report bytes, a write fails with EINVAL at the first record that does not.
+    Timestamps are CLOCK_MONOTONIC nanoseconds, only the difference between timestamps matters for replay.
+*/
+struct aoa_hid_record_header {
+    __u64 timestamp_ns;
+    __u16 size;
+} __attribute__((packed));
+
+#define AOA_HID_IOCTL_CAPTURE_START _IO(AOA_HID_IOCTL_MAGIC, 0x01)
+#define AOA_HID_IOCTL_CAPTURE_STOP _IO(AOA_HID_IOCTL_MAGIC, 0x02)
+// Returns the number of records that were dropped because the capture buffer was full
+#define AOA_HID_IOCTL_CAPTURE_DROPPED _IOR(AOA_HID_IOCTL_MAGIC, 0x03, __u32)
+// Discards all reports still waiting to be replayed
+#define AOA_HID_IOCTL_REPLAY_CANCEL _IO(AOA_HID_IOCTL_MAGIC, 0x04)
+
+/*
+    /dev/android_keyboardN
+
+    Writes of any length are queued in a per-phone ring and typed in the background, writes block while the ring is full.
+*/
+// Returns the number of characters that were written but not typed yet
+#define AOA_HID_IOCTL_KEYBOARD_PENDING _IOR(AOA_HID_IOCTL_MAGIC, 0x08, __u32)
+
+/*
+    /dev/android_gamepadN
+
+    Each write is one or more whole struct aoa_hid_gamepad_state snapshots. Only the latest snapshot is sent, at most at the
+    configured rate and only when it differs from the last one sent, so axis updates in between are coalesced.
+    A button or hat change is never coalesced away, a write that would overwrite one before it was sent blocks until it was.
+*/
+#define AOA_HID_GAMEPAD_HAT_CENTERED 8
+
+struct aoa_hid_gamepad_state {
+    __u16 buttons;          // Bit n is button n + 1
+    __u8 hat;               // 0 is up, clockwise in steps of 45 degrees up to 7, or AOA_HID_GAMEPAD_HAT_CENTERED
+    __u8 reserved;
+    __s8 left_x;
+    __s8 left_y;
+    __s8 right_x;
+    __s8 right_y;
+    __u8 left_trigger;
+    __u8 right_trigger;
+    __u16 reserved2;
+};
+
+// Maximum number of reports per second, between 1 and 1000, reset to 125 when the device file is opened
+#define AOA_HID_IOCTL_GAMEPAD_SET_RATE _IOW(AOA_HID_IOCTL_MAGIC, 0x1C, __u32)
+
+/*
+    /dev/android_rawN
+
+    Each write is a single report starting with its report ID, the size has to match the size declared in the HID descriptor.
+    AOA_HID_IOCTL_RAW_SUBMIT sends an array of reports in order, waiting delay_us after each report.
+*/
+struct aoa_hid_raw_entry {
+    __u8 report[AOA_HID_MAX_REPORT_SIZE];
+    __u16 size;
+    __u16 reserved;
+    __u32 delay_us;
+};
+
+struct aoa_hid_raw_batch {
+    __u64 entries;      // Userspace pointer to an array of struct aoa_hid_raw_entry
+    __u32 count;
+    __u32 submitted;    // Set by the driver to the number of reports that were sent
+};
+
+#define AOA_HID_IOCTL_RAW_SUBMIT _IOWR(AOA_HID_IOCTL_MAGIC, 0x0C, struct aoa_hid_raw_batch)
+
+/*
+    AOA_HID_IOCTL_RAW_REREGISTER unregisters the HID device on the phone and registers it again while the accessory stays
+    connected, optionally with a different descriptor. Reports written to the raw device are then checked against that descriptor.
+*/
+#define AOA_HID_MAX_DESCRIPTOR_SIZE 4096
+
+#define AOA_HID_DESCRIPTOR_KEEP 0       // Registers the current descriptor again, descriptor and size are ignored
+#define AOA_HID_DESCRIPTOR_SET 1        // Registers the descriptor passed in descriptor and size
+#define AOA_HID_DESCRIPTOR_DEFAULT 2    // Goes back to the driver's own descriptor
+
+struct aoa_hid_descriptor {
+    __u64 descriptor;   // Userspace pointer to the report descriptor
+    __u32 size;
+    __u32 mode;
+};
+
+#define AOA_HID_IOCTL_RAW_REREGISTER _IOW(AOA_HID_IOCTL_MAGIC, 0x0D, struct aoa_hid_descriptor)
+
+/*
+    /dev/android_sync
+
+    AOA_HID_IOCTL_SYNC_SUBMIT sends the same reports to several phones at once. The transfers are prepared in advance and
+    released together from a timer at an absolute CLOCK_MONOTONIC deadline, entry i + 1 is released delay_us of entry i later.
+    The call returns once every phone has acknowledged every report or failed, with the result for each selected phone.
+    Selected phones that are not attached are skipped with status -ENODEV, the call fails with ENODEV only when none is attached.
+*/
+#define AOA_HID_SYNC_MAX_ENTRIES 16
+
+struct aoa_hid_sync_result {
+    __s32 status;       // 0 or the negative errno of the first report that failed
+    __u32 reserved;
+    __s64 offset_ns;    // Time at which the phone acknowledged the first report, relative to the deadline
+};
+
+struct aoa_hid_sync_submit {
+    __u64 deadline_ns;
+    __u64 minors;       // Bit n selects the phone at minor n
+    __u64 entries;      // Userspace pointer to an array of struct aoa_hid_raw_entry
+    __u32 count;
+    __u32 reserved;
+    __u64 skew_ns;      // Set by the driver: largest difference of offset_ns between phones that succeeded
+    struct aoa_hid_sync_result results[AOA_HID_MAX_PHONES];    // Set by the driver, indexed by minor
+};
+
+#define AOA_HID_IOCTL_SYNC_SUBMIT _IOWR(AOA_HID_IOCTL_MAGIC, 0x20, struct aoa_hid_sync_submit)
+
+/*
+    Generic netlink family AOA_HID_GENL_NAME
+
+    Lets a single process manage many phones: known device ids are added and removed in bulk, AOA_HID_CMD_GET_PHONES is a dump
+    request with one message per attached phone, and the AOA_HID_GENL_EVENTS multicast group reports phones as they come and go.
+    Adding and removing known device ids needs CAP_NET_ADMIN.
+*/
+#define AOA_HID_GENL_NAME "aoa_hid"
+#define AOA_HID_GENL_VERSION 1
+#define AOA_HID_GENL_EVENTS "events"
+
+enum aoa_hid_genl_command {
+    AOA_HID_CMD_UNSPEC,
+    AOA_HID_CMD_ADD_KNOWN,          // One AOA_HID_ATTR_DEVICE_ID for each id, all of them are added or none
+    AOA_HID_CMD_REMOVE_KNOWN,       // One AOA_HID_ATTR_DEVICE_ID for each id, ids that are not known are ignored
+    AOA_HID_CMD_GET_KNOWN,          // The reply has one AOA_HID_ATTR_DEVICE_ID for each known id
+    AOA_HID_CMD_GET_PHONES,         // Dump of the attached phones
+    AOA_HID_CMD_EVENT,              // Sent to the AOA_HID_GENL_EVENTS group only
+    __AOA_HID_CMD_MAX
+};
+#define AOA_HID_CMD_MAX (__AOA_HID_CMD_MAX - 1)
+
+enum aoa_hid_genl_attribute {
+    AOA_HID_ATTR_UNSPEC,
+    AOA_HID_ATTR_DEVICE_ID,         // u32, (vendor id << 16) | product id
+    AOA_HID_ATTR_MINOR,             // u32, minor of the device files of the phone
+    AOA_HID_ATTR_SERIAL,            // string, USB serial number when the phone has one
+    AOA_HID_ATTR_PATH,              // string, USB port path such as 1-2.3, stays the same across the accessory mode re-enumeration
+    AOA_HID_ATTR_HEALTH,            // u32, AOA_HID_HEALTH_*
+    AOA_HID_ATTR_EVENT,             // u32, AOA_HID_EVENT_*
+    AOA_HID_ATTR_ERROR,             // s32, negative errno
+    __AOA_HID_ATTR_MAX
+};
+#define AOA_HID_ATTR_MAX (__AOA_HID_ATTR_MAX - 1)
+
+#define AOA_HID_HEALTH_HEALTHY 0
+#define AOA_HID_HEALTH_DEGRADED 1
+#define AOA_HID_HEALTH_FAILED 2
+
+// Events before the handshake carry the id and path of the phone, later ones also its minor
+#define AOA_HID_EVENT_ATTACHED 1            // A known phone supporting AOAv2 was plugged in
+#define AOA_HID_EVENT_HANDSHAKE_DONE 2      // The phone was asked to switch to accessory mode and will re-enumerate
+#define AOA_HID_EVENT_HID_REGISTERED 3      // The HID device was registered, also after re-registration
+#define AOA_HID_EVENT_TRANSFER_FAILED 4     // The phone was marked failed, AOA_HID_ATTR_ERROR is the transfer error
+#define AOA_HID_EVENT_DETACHED 5            // The device files of the phone were removed
+#define AOA_HID_EVENT_DISCONNECTED 6        // The phone dropped off the bus, its minor and device files are kept for the reattach grace period
+
+/*
+    /dev/android_scriptN
+
+    A script is loaded once with AOA_HID_IOCTL_SCRIPT_LOAD on any script device file and can then be run by handle on any phone.
+    The bytecode is a sequence of instructions, an opcode byte followed by its operands, multi-byte operands are little endian.
+    Reading the device file blocks until the script running on the phone has finished and returns a struct aoa_hid_script_status.
+*/
+#define AOA_HID_SCRIPT_OP_END 0x00          // Stops the script, also implied at the end of the bytecode
+#define AOA_HID_SCRIPT_OP_KEY 0x01          // u8 modifiers, u8 keycode: press and release a key
+#define AOA_HID_SCRIPT_OP_TEXT 0x02         // u8 length, length characters: typed the same way as writes to the keyboard
+#define AOA_HID_SCRIPT_OP_POINTER 0x03      // s8 x, s8 y, s8 wheel: relative pointer movement, the wheel in whole notches
+#define AOA_HID_SCRIPT_OP_CLICK 0x04        // Press and release the pointer button
+#define AOA_HID_SCRIPT_OP_CONSUMER 0x05     // u16 usage: press and release a consumer control usage
+#define AOA_HID_SCRIPT_OP_DELAY 0x06        // u16 milliseconds
+#define AOA_HID_SCRIPT_OP_LOOP 0x07         // u16 count: executes the instructions up to the matching END_LOOP count times
+#define AOA_HID_SCRIPT_OP_END_LOOP 0x08
+#define AOA_HID_SCRIPT_OP_REPEAT 0x09       // u8 count: executes the next instruction count times
+
+#define AOA_HID_SCRIPT_MAX_SIZE 4096
+#define AOA_HID_SCRIPT_MAX_LOOP_DEPTH 4
+
+#define AOA_HID_SCRIPT_STATE_IDLE 0
+#define AOA_HID_SCRIPT_STATE_RUNNING 1
+#define AOA_HID_SCRIPT_STATE_DONE 2
+#define AOA_HID_SCRIPT_STATE_CANCELLED 3
+#define AOA_HID_SCRIPT_STATE_FAILED 4
+
+struct aoa_hid_script_load {
+    __u64 bytecode;     // Userspace pointer to the bytecode
+    __u32 size;
+    __u32 handle;       // Set by the driver
+};
+
+struct aoa_hid_script_status {
+    __u32 handle;
+    __u32 state;
+    __s32 error;        // Negative errno when state is AOA_HID_SCRIPT_STATE_FAILED
+    __u32 offset;       // Bytecode offset of the instruction being executed or that failed
+};
+
+#define AOA_HID_IOCTL_SCRIPT_LOAD _IOWR(AOA_HID_IOCTL_MAGIC, 0x10, struct aoa_hid_script_load)
+#define AOA_HID_IOCTL_SCRIPT_UNLOAD _IOW(AOA_HID_IOCTL_MAGIC, 0x11, __u32)
+#define AOA_HID_IOCTL_SCRIPT_RUN _IOW(AOA_HID_IOCTL_MAGIC, 0x12, __u32)
+#define AOA_HID_IOCTL_SCRIPT_CANCEL _IO(AOA_HID_IOCTL_MAGIC, 0x13)
+#define AOA_HID_IOCTL_SCRIPT_STATUS _IOR(AOA_HID_IOCTL_MAGIC, 0x14, struct aoa_hid_script_status)
+
+#endif
@@ -0,0 +1,417 @@
+#include "aoa_hid.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+// The driver accepts any number of entries in a batch, this is only the first allocation
+#define BATCH_INITIAL_CAPACITY 64
+
+struct aoa_hid_phone {
+    int minor;
+    int fds[AOA_HID_NUM_NODES];
+    // Sequence number of the last write that got a completion record
+    int64_t sequences[AOA_HID_NUM_NODES];
+};
+
+static const char* node_names[AOA_HID_NUM_NODES] = {
+    [AOA_HID_NODE_KEYBOARD] = "keyboard",
+    [AOA_HID_NODE_MOUSE] = "mouse",
+    [AOA_HID_NODE_VOLUME] = "volume",
+    [AOA_HID_NODE_BRIGHTNESS] = "brightness",
+    [AOA_HID_NODE_RAW] = "raw",
+    [AOA_HID_NODE_GAMEPAD] = "gamepad",
+};
+
+/*
+    Forward declarations for private functions for this aoa_hid.c file
+*/
+static int get_node_fd(struct aoa_hid_phone* phone, enum aoa_hid_node node);
+static int64_t write_node(struct aoa_hid_phone* phone, enum aoa_hid_node node, const void* buffer, size_t size);
+static bool has_completion_record(enum aoa_hid_node node);
+static int step_byte(int step, uint8_t* byte);
+static int reserve_batch(struct aoa_hid_batch* batch, uint32_t count);
+static void encode_mouse(uint8_t* report, uint8_t buttons, int8_t x, int8_t y, int16_t wheel, int16_t pan);
+
+struct aoa_hid_phone* aoa_hid_open(int minor){
+    if(minor < 0 || minor >= AOA_HID_MAX_PHONES){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct aoa_hid_phone* phone = calloc(1, sizeof(struct aoa_hid_phone));
+    if(!phone){
+        return NULL;
+    }
+
+    phone->minor = minor;
+    for(int i=0; i<AOA_HID_NUM_NODES; i++){
+        phone->fds[i] = -1;
+    }
+
+    // Every phone has a keyboard, opening it right away tells whether the phone is attached
+    int ret = get_node_fd(phone, AOA_HID_NODE_KEYBOARD);
+    if(ret < 0){
+        free(phone);
+        errno = -ret;
+        return NULL;
+    }
+
+    return phone;
+}
+
+void aoa_hid_close(struct aoa_hid_phone* phone){
+    if(!phone){
+        return;
+    }
+
+    for(int i=0; i<AOA_HID_NUM_NODES; i++){
+        if(phone->fds[i] >= 0){
+            close(phone->fds[i]);
+        }
+    }
+    free(phone);
+}
+
+int aoa_hid_get_minor(const struct aoa_hid_phone* phone){
+    return phone->minor;
+}
+
+int64_t aoa_hid_type(struct aoa_hid_phone* phone, const char* text, size_t length){
+    int fd = get_node_fd(phone, AOA_HID_NODE_KEYBOARD);
+    if(fd < 0){
+        return fd;
+    }
+
+    // The driver queues writes of any length, a write only comes back short when interrupted, every part gets its own record
+    size_t written = 0;
+    while(written < length){
+        ssize_t ret = write(fd, text + written, length - written);
+        if(ret < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -errno;
+        }
+
+        phone->sequences[AOA_HID_NODE_KEYBOARD]++;
+        written += ret;
+    }
+
+    return phone->sequences[AOA_HID_NODE_KEYBOARD];
+}
+
+int64_t aoa_hid_mouse(struct aoa_hid_phone* phone, int8_t x, int8_t y, int8_t wheel, bool click){
+    uint8_t write[4] = {(uint8_t)x, (uint8_t)y, (uint8_t)wheel, click ? 1 : 0};
+    return write_node(phone, AOA_HID_NODE_MOUSE, write, sizeof(write));
+}
+
+int64_t aoa_hid_scroll(struct aoa_hid_phone* phone, int16_t vertical, int16_t horizontal){
+    uint8_t write[8] = {0, 0, 0, 0, (uint16_t)vertical & 0xFF, (uint16_t)vertical >> 8, (uint16_t)horizontal & 0xFF, (uint16_t)horizontal >> 8};
+    return write_node(phone, AOA_HID_NODE_MOUSE, write, sizeof(write));
+}
+
+int64_t aoa_hid_volume(struct aoa_hid_phone* phone, int step){
+    uint8_t write;
+    if(step_byte(step, &write)){
+        return -EINVAL;
+    }
+
+    return write_node(phone, AOA_HID_NODE_VOLUME, &write, sizeof(write));
+}
+
+int64_t aoa_hid_brightness(struct aoa_hid_phone* phone, int step){
+    uint8_t write;
+    if(step_byte(step, &write)){
+        return -EINVAL;
+    }
+
+    return write_node(phone, AOA_HID_NODE_BRIGHTNESS, &write, sizeof(write));
+}
+
+int64_t aoa_hid_raw(struct aoa_hid_phone* phone, const uint8_t* report, uint16_t size){
+    return write_node(phone, AOA_HID_NODE_RAW, report, size);
+}
+
+int aoa_hid_gamepad(struct aoa_hid_phone* phone, const struct aoa_hid_gamepad_state* state){
+    int64_t ret = write_node(phone, AOA_HID_NODE_GAMEPAD, state, sizeof(*state));
+    return ret < 0 ? (int)ret : 0;
+}
+
+void aoa_hid_batch_init(struct aoa_hid_batch* batch){
+    memset(batch, 0, sizeof(*batch));
+}
+
+void aoa_hid_batch_free(struct aoa_hid_batch* batch){
+    free(batch->entries);
+    aoa_hid_batch_init(batch);
+}
+
+void aoa_hid_batch_clear(struct aoa_hid_batch* batch){
+    batch->count = 0;
+    batch->submitted = 0;
+}
+
+int aoa_hid_batch_add_raw(struct aoa_hid_batch* batch, const uint8_t* report, uint16_t size, uint32_t delay_us){
+    if(size == 0 || size > AOA_HID_MAX_REPORT_SIZE){
+        return -EINVAL;
+    }
+
+    int ret = reserve_batch(batch, 1);
+    if(ret){
+        return ret;
+    }
+
+    struct aoa_hid_raw_entry* entry = &batch->entries[batch->count++];
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->report, report, size);
+    entry->size = size;
+    entry->delay_us = delay_us;
+    return 0;
+}
+
+int aoa_hid_batch_add_mouse(struct aoa_hid_batch* batch, int8_t x, int8_t y, int8_t wheel, bool click, uint32_t delay_us){
+    uint8_t report[AOA_HID_REPORT_SIZE_MOUSE];
+    encode_mouse(report, click ? 1 : 0, x, y, wheel * AOA_HID_SCROLL_UNITS_PER_NOTCH, 0);
+
+    // Like a write to the mouse device, a click is a press with the movement followed by a release without it
+    if(!click){
+        return aoa_hid_batch_add_raw(batch, report, sizeof(report), delay_us);
+    }
+
+    int ret = reserve_batch(batch, 2);
+    if(ret){
+        return ret;
+    }
+
+    aoa_hid_batch_add_raw(batch, report, sizeof(report), 0);
+    uint8_t release[AOA_HID_REPORT_SIZE_MOUSE];
+    encode_mouse(release, 0, 0, 0, 0, 0);
+    return aoa_hid_batch_add_raw(batch, release, sizeof(release), delay_us);
+}
+
+int aoa_hid_batch_add_scroll(struct aoa_hid_batch* batch, int16_t vertical, int16_t horizontal, uint32_t delay_us){
+    // -32768 is outside the declared range, the unit that does not fit goes into a second report
+    int16_t wheel = vertical < -32767 ? -32767 : vertical;
+    int16_t pan = horizontal < -32767 ? -32767 : horizontal;
+    uint8_t report[AOA_HID_REPORT_SIZE_MOUSE];
+    encode_mouse(report, 0, 0, 0, wheel, pan);
+    if(wheel == vertical && pan == horizontal){
+        return aoa_hid_batch_add_raw(batch, report, sizeof(report), delay_us);
+    }
+
+    int ret = reserve_batch(batch, 2);
+    if(ret){
+        return ret;
+    }
+
+    aoa_hid_batch_add_raw(batch, report, sizeof(report), 0);
+    encode_mouse(report, 0, 0, 0, vertical - wheel, horizontal - pan);
+    return aoa_hid_batch_add_raw(batch, report, sizeof(report), delay_us);
+}
+
+int aoa_hid_batch_add_consumer(struct aoa_hid_batch* batch, uint16_t usage, uint32_t delay_us){
+    int ret = reserve_batch(batch, 2);
+    if(ret){
+        return ret;
+    }
+
+    uint8_t press[AOA_HID_REPORT_SIZE_CONSUMER] = {AOA_HID_REPORT_ID_CONSUMER, usage & 0xFF, usage >> 8};
+    uint8_t release[AOA_HID_REPORT_SIZE_CONSUMER] = {AOA_HID_REPORT_ID_CONSUMER, 0, 0};
+    aoa_hid_batch_add_raw(batch, press, sizeof(press), 0);
+    return aoa_hid_batch_add_raw(batch, release, sizeof(release), delay_us);
+}
+
+int64_t aoa_hid_batch_submit(struct aoa_hid_phone* phone, struct aoa_hid_batch* batch){
+    int fd = get_node_fd(phone, AOA_HID_NODE_RAW);
+    if(fd < 0){
+        return fd;
+    }
+
+    struct aoa_hid_raw_batch request = {
+        .entries = (uint64_t)(uintptr_t)batch->entries,
+        .count = batch->count,
+        .submitted = 0
+    };
+
+    // Every batch that reaches the driver gets a record, also one that fails before anything was sent
+    int ret = ioctl(fd, AOA_HID_IOCTL_RAW_SUBMIT, &request);
+    batch->submitted = request.submitted;
+    phone->sequences[AOA_HID_NODE_RAW]++;
+    return ret < 0 ? -errno : phone->sequences[AOA_HID_NODE_RAW];
+}
+
+int aoa_hid_completion_fd(struct aoa_hid_phone* phone, enum aoa_hid_node node){
+    if(node == AOA_HID_NODE_GAMEPAD){
+        return -EINVAL;
+    }
+
+    return get_node_fd(phone, node);
+}
+
+int aoa_hid_read_completions(struct aoa_hid_phone* phone, enum aoa_hid_node node, struct aoa_hid_completion* records, int max_records, bool wait){
+    int fd = aoa_hid_completion_fd(phone, node);
+    if(fd < 0){
+        return fd;
+    }
+
+    // The files are kept blocking for the writes, a poll without timeout makes the read non-blocking
+    if(!wait){
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        int ret = poll(&pfd, 1, 0);
+        if(ret < 0){
+            return -errno;
+        }
+        if(ret == 0){
+            return 0;
+        }
+    }
+
+    ssize_t ret;
+    do{
+        ret = read(fd, records, (size_t)max_records * sizeof(struct aoa_hid_completion));
+    }while(ret < 0 && errno == EINTR);
+
+    if(ret < 0){
+        return -errno;
+    }
+
+    return ret / sizeof(struct aoa_hid_completion);
+}
+
+int aoa_hid_wait_completion(struct aoa_hid_phone* phone, enum aoa_hid_node node, int64_t sequence, struct aoa_hid_completion* record){
+    for(;;){
+        int ret = aoa_hid_read_completions(phone, node, record, 1, true);
+        if(ret < 0){
+            return ret;
+        }
+
+        if((int64_t)record->sequence >= sequence){
+            return 0;
+        }
+    }
+}
+
+int aoa_hid_fence(struct aoa_hid_phone* phone, enum aoa_hid_node node){
+    int fd = aoa_hid_completion_fd(phone, node);
+    if(fd < 0){
+        return fd;
+    }
+
+    return ioctl(fd, AOA_HID_IOCTL_FENCE) < 0 ? -errno : 0;
+}
+
+int aoa_hid_cancel(struct aoa_hid_phone* phone){
+    int fd = get_node_fd(phone, AOA_HID_NODE_KEYBOARD);
+    if(fd < 0){
+        return fd;
+    }
+
+    int ret = ioctl(fd, AOA_HID_IOCTL_CANCEL_PHONE);
+    return ret < 0 ? -errno : ret;
+}
+
+int aoa_hid_flush(struct aoa_hid_phone* phone){
+    int fd = get_node_fd(phone, AOA_HID_NODE_KEYBOARD);
+    if(fd < 0){
+        return fd;
+    }
+
+    return ioctl(fd, AOA_HID_IOCTL_FLUSH) < 0 ? -errno : 0;
+}
+
+static int get_node_fd(struct aoa_hid_phone* phone, enum aoa_hid_node node){
+    if(phone->fds[node] >= 0){
+        return phone->fds[node];
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/android_%s%d", node_names[node], phone->minor);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0){
+        return -errno;
+    }
+
+    phone->fds[node] = fd;
+    return fd;
+}
+
+static int64_t write_node(struct aoa_hid_phone* phone, enum aoa_hid_node node, const void* buffer, size_t size){
+    int fd = get_node_fd(phone, node);
+    if(fd < 0){
+        return fd;
+    }
+
+    ssize_t ret = write(fd, buffer, size);
+    if(ret < 0){
+        int error = errno;
+        if(has_completion_record(node)){
+            phone->sequences[node]++;
+        }
+        return -error;
+    }
+
+    phone->sequences[node]++;
+    return phone->sequences[node];
+}
+
+// The mouse, volume, brightness and raw files give every write a record, whatever it failed with
+// A failed keyboard write queued nothing and has none, text that was queued is reported as a short write instead
+static bool has_completion_record(enum aoa_hid_node node){
+    switch(node){
+        case AOA_HID_NODE_KEYBOARD:
+        case AOA_HID_NODE_GAMEPAD:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static int step_byte(int step, uint8_t* byte){
+    switch(step){
+        case 1:
+            *byte = 0x01;
+            return 0;
+        case -1:
+            *byte = 0xFF;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+static int reserve_batch(struct aoa_hid_batch* batch, uint32_t count){
+    if(batch->count + count <= batch->capacity){
+        return 0;
+    }
+
+    uint32_t capacity = batch->capacity ? batch->capacity : BATCH_INITIAL_CAPACITY;
+    while(capacity < batch->count + count){
+        capacity *= 2;
+    }
+
+    struct aoa_hid_raw_entry* entries = realloc(batch->entries, (size_t)capacity * sizeof(struct aoa_hid_raw_entry));
+    if(!entries){
+        return -ENOMEM;
+    }
+
+    batch->entries = entries;
+    batch->capacity = capacity;
+    return 0;
+}
+
+static void encode_mouse(uint8_t* report, uint8_t buttons, int8_t x, int8_t y, int16_t wheel, int16_t pan){
+    report[0] = AOA_HID_REPORT_ID_MOUSE;
+    report[1] = buttons;
+    report[2] = (uint8_t)x;
+    report[3] = (uint8_t)y;
+    report[4] = (uint16_t)wheel & 0xFF;
+    report[5] = (uint16_t)wheel >> 8;
+    report[6] = (uint16_t)pan & 0xFF;
+    report[7] = (uint16_t)pan >> 8;
+}
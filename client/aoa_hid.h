@@ -0,0 +1,115 @@
+#ifndef AOA_HID_H
+#define AOA_HID_H
+
+/*
+    Userspace library for the device files of aoa_hid_driver
+
+    A phone is opened once by its minor and its device files are opened on first use and then kept open, so sending an event
+    costs a single write or ioctl. Functions return a negative errno on failure.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "../aoa_hid_driver.h"
+
+#define AOA_HID_SERIAL_SIZE 128
+#define AOA_HID_PATH_SIZE 32
+
+struct aoa_hid_phone_info {
+    int minor;
+    uint32_t device_id;         // (vendor id << 16) | product id, 0 when unknown
+    int health;                 // AOA_HID_HEALTH_*
+    char serial[AOA_HID_SERIAL_SIZE];   // Empty when the phone has none or the netlink family is not available
+    char path[AOA_HID_PATH_SIZE];
+};
+
+/*
+    Discovery
+
+    Phones are listed through the generic netlink family of the driver, with a scan of /dev as fallback that only knows minors
+    Returns the number of attached phones, at most max_phones of them are filled in
+*/
+int aoa_hid_list_phones(struct aoa_hid_phone_info* phones, int max_phones);
+// Minor of the attached phone with the serial number, -ENODEV when there is none
+int aoa_hid_find_phone(const char* serial);
+
+// Device files of a phone that have completion records, used to select the file for the completion functions
+enum aoa_hid_node {
+    AOA_HID_NODE_KEYBOARD,
+    AOA_HID_NODE_MOUSE,
+    AOA_HID_NODE_VOLUME,
+    AOA_HID_NODE_BRIGHTNESS,
+    AOA_HID_NODE_RAW,
+    AOA_HID_NODE_GAMEPAD,       // No completion records
+    AOA_HID_NUM_NODES
+};
+
+struct aoa_hid_phone;
+
+// Returns NULL and sets errno when the phone is not attached
+struct aoa_hid_phone* aoa_hid_open(int minor);
+void aoa_hid_close(struct aoa_hid_phone* phone);
+int aoa_hid_get_minor(const struct aoa_hid_phone* phone);
+
+/*
+    Sending
+
+    Each call is one write and returns the sequence number of the completion record it will get on the device file. Text is
+    queued by the driver and typed in the background, the other calls return once their reports have been sent.
+*/
+int64_t aoa_hid_type(struct aoa_hid_phone* phone, const char* text, size_t length);
+// The wheel is in notches
+int64_t aoa_hid_mouse(struct aoa_hid_phone* phone, int8_t x, int8_t y, int8_t wheel, bool click);
+// High resolution scrolling in 1/AOA_HID_SCROLL_UNITS_PER_NOTCH of a notch, positive scrolls up and right
+int64_t aoa_hid_scroll(struct aoa_hid_phone* phone, int16_t vertical, int16_t horizontal);
+// Step is 1 for up and -1 for down
+int64_t aoa_hid_volume(struct aoa_hid_phone* phone, int step);
+int64_t aoa_hid_brightness(struct aoa_hid_phone* phone, int step);
+int64_t aoa_hid_raw(struct aoa_hid_phone* phone, const uint8_t* report, uint16_t size);
+// Returns 0, the gamepad coalesces snapshots and has no completion records
+int aoa_hid_gamepad(struct aoa_hid_phone* phone, const struct aoa_hid_gamepad_state* state);
+
+/*
+    Batches
+
+    Reports collected in a batch are sent with a single AOA_HID_IOCTL_RAW_SUBMIT, which is the fastest way to send many of them.
+    Presses are followed by their release, delay_us is waited after the last report of an entry.
+*/
+struct aoa_hid_batch {
+    struct aoa_hid_raw_entry* entries;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t submitted;         // Reports sent by the last submit
+};
+
+void aoa_hid_batch_init(struct aoa_hid_batch* batch);
+void aoa_hid_batch_free(struct aoa_hid_batch* batch);
+void aoa_hid_batch_clear(struct aoa_hid_batch* batch);
+int aoa_hid_batch_add_raw(struct aoa_hid_batch* batch, const uint8_t* report, uint16_t size, uint32_t delay_us);
+int aoa_hid_batch_add_mouse(struct aoa_hid_batch* batch, int8_t x, int8_t y, int8_t wheel, bool click, uint32_t delay_us);
+int aoa_hid_batch_add_scroll(struct aoa_hid_batch* batch, int16_t vertical, int16_t horizontal, uint32_t delay_us);
+int aoa_hid_batch_add_consumer(struct aoa_hid_batch* batch, uint16_t usage, uint32_t delay_us);
+// The whole batch gets one completion record on the raw device file
+int64_t aoa_hid_batch_submit(struct aoa_hid_phone* phone, struct aoa_hid_batch* batch);
+
+/*
+    Completions
+
+    The file descriptor can be polled for readable records, reads return whole struct aoa_hid_completion records
+    Sequence numbers count the writes to the device file since aoa_hid_open, starting at 1
+*/
+int aoa_hid_completion_fd(struct aoa_hid_phone* phone, enum aoa_hid_node node);
+// Returns the number of records read, 0 when none is available and wait is not set
+int aoa_hid_read_completions(struct aoa_hid_phone* phone, enum aoa_hid_node node, struct aoa_hid_completion* records, int max_records, bool wait);
+// Reads records until the one with the sequence number, records read on the way are dropped
+int aoa_hid_wait_completion(struct aoa_hid_phone* phone, enum aoa_hid_node node, int64_t sequence, struct aoa_hid_completion* record);
+// Blocks until everything written to the device file has completed
+int aoa_hid_fence(struct aoa_hid_phone* phone, enum aoa_hid_node node);
+
+// Discards everything queued for the phone and releases all keys, returns the number of discarded events
+int aoa_hid_cancel(struct aoa_hid_phone* phone);
+// Blocks until nothing is queued or in flight for the phone
+int aoa_hid_flush(struct aoa_hid_phone* phone);
+
+#endif
@@ -0,0 +1,477 @@
+#include "aoa_hid.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_COUNT 1000
+// Completion records are drained after every write, the driver keeps 64 per file
+#define BENCH_READ_RECORDS 64
+
+#define BENCH_MODE_MOUSE 0      // One write per event, latency per event from the completion records
+#define BENCH_MODE_BATCH 1      // All events in one raw batch, the fastest path
+
+struct bench {
+    int minor;
+    int mode;
+    int count;
+    pthread_t thread;
+    // Results
+    int error;
+    int completed;
+    double events_per_second;
+    uint64_t* latencies_ns;
+    int num_latencies;
+};
+
+/*
+    Forward declarations for private functions for this aoa_hid_cli.c file
+*/
+static void usage(void);
+static int parse_phone(const char* argument);
+static int parse_step(const char* argument);
+static int run_list(void);
+static int run_type(int argc, char** argv);
+static int run_mouse(int argc, char** argv);
+static int run_scroll(int argc, char** argv);
+static int run_scroll(int argc, char** argv){
+    if(argc < 2 || argc > 3){
+        usage();
+        return -EINVAL;
+    }
+
+    int minor = parse_phone(argv[0]);
+    if(minor < 0){
+        return minor;
+    }
+
+    struct aoa_hid_phone* phone = aoa_hid_open(minor);
+    if(!phone){
+        return -errno;
+    }
+
+    int16_t vertical = atoi(argv[1]);
+    int16_t horizontal = argc > 2 ? atoi(argv[2]) : 0;
+    int64_t ret = aoa_hid_scroll(phone, vertical, horizontal);
+
+    aoa_hid_close(phone);
+    return ret < 0 ? (int)ret : 0;
+}
+
+static int run_step(int argc, char** argv, int64_t (*send)(struct aoa_hid_phone*, int));
+static int run_phone_ioctl(int argc, char** argv, int (*call)(struct aoa_hid_phone*));
+static int run_bench(int argc, char** argv);
+static void* bench_thread(void* argument);
+static int bench_mouse(struct aoa_hid_phone* phone, struct bench* bench);
+static int bench_batch(struct aoa_hid_phone* phone, struct bench* bench);
+static void print_bench(struct bench* bench);
+static int compare_u64(const void* a, const void* b);
+static uint64_t now_ns(void);
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        usage();
+        return 2;
+    }
+
+    const char* command = argv[1];
+    int ret;
+    if(!strcmp(command, "list")){
+        ret = run_list();
+    }
+    else if(!strcmp(command, "type")){
+        ret = run_type(argc - 2, argv + 2);
+    }
+    else if(!strcmp(command, "mouse")){
+        ret = run_mouse(argc - 2, argv + 2);
+    }
+    else if(!strcmp(command, "scroll")){
+        ret = run_scroll(argc - 2, argv + 2);
+    }
+    else if(!strcmp(command, "volume")){
+        ret = run_step(argc - 2, argv + 2, aoa_hid_volume);
+    }
+    else if(!strcmp(command, "brightness")){
+        ret = run_step(argc - 2, argv + 2, aoa_hid_brightness);
+    }
+    else if(!strcmp(command, "cancel")){
+        ret = run_phone_ioctl(argc - 2, argv + 2, aoa_hid_cancel);
+    }
+    else if(!strcmp(command, "flush")){
+        ret = run_phone_ioctl(argc - 2, argv + 2, aoa_hid_flush);
+    }
+    else if(!strcmp(command, "bench")){
+        ret = run_bench(argc - 2, argv + 2);
+    }
+    else{
+        usage();
+        return 2;
+    }
+
+    if(ret < 0){
+        fprintf(stderr, "aoa-hid: %s: %s\n", command, strerror(-ret));
+        return 1;
+    }
+
+    return 0;
+}
+
+static void usage(void){
+    fprintf(stderr,
+        "Usage: aoa-hid <command> [arguments]\n"
+        "\n"
+        "A phone is given by its minor number or its serial number\n"
+        "\n"
+        "  list                                   List the attached phones\n"
+        "  type <phone> <text>                    Type the text\n"
+        "  mouse <phone> <x> <y> [wheel] [click]  Move, scroll and click\n"
+        "  scroll <phone> <vertical> [horizontal] Scroll by 1/120 of a notch, positive is up and right\n"
+        "  volume <phone> up|down                 Change the volume\n"
+        "  brightness <phone> up|down             Change the brightness\n"
+        "  cancel <phone>                         Discard everything queued for the phone\n"
+        "  flush <phone>                          Wait until everything queued for the phone was sent\n"
+        "  bench [-n count] [-b] <phone>...|all   Measure events per second and latency, -b sends one raw batch\n");
+}
+
+static int parse_phone(const char* argument){
+    char* end;
+    long minor = strtol(argument, &end, 10);
+    if(*argument && !*end){
+        return (minor >= 0 && minor < AOA_HID_MAX_PHONES) ? (int)minor : -EINVAL;
+    }
+
+    return aoa_hid_find_phone(argument);
+}
+
+static int parse_step(const char* argument){
+    if(!strcmp(argument, "up")){
+        return 1;
+    }
+    if(!strcmp(argument, "down")){
+        return -1;
+    }
+    return 0;
+}
+
+static int run_list(void){
+    struct aoa_hid_phone_info phones[AOA_HID_MAX_PHONES];
+    int count = aoa_hid_list_phones(phones, AOA_HID_MAX_PHONES);
+    if(count < 0){
+        return count;
+    }
+
+    static const char* health_names[] = {"healthy", "degraded", "failed"};
+    for(int i=0; i<count && i<AOA_HID_MAX_PHONES; i++){
+        struct aoa_hid_phone_info* phone = &phones[i];
+        printf("%d %04x:%04x %s %s %s\n", phone->minor, phone->device_id >> 16, phone->device_id & 0xFFFF,
+            phone->path[0] ? phone->path : "-", phone->serial[0] ? phone->serial : "-",
+            (phone->health >= 0 && phone->health <= 2) ? health_names[phone->health] : "-");
+    }
+
+    return 0;
+}
+
+static int run_type(int argc, char** argv){
+    if(argc != 2){
+        usage();
+        return -EINVAL;
+    }
+
+    int minor = parse_phone(argv[0]);
+    if(minor < 0){
+        return minor;
+    }
+
+    struct aoa_hid_phone* phone = aoa_hid_open(minor);
+    if(!phone){
+        return -errno;
+    }
+
+    // The driver returns before the text is typed, the record tells when it was
+    int64_t sequence = aoa_hid_type(phone, argv[1], strlen(argv[1]));
+    int ret = sequence < 0 ? (int)sequence : 0;
+    if(sequence > 0){
+        struct aoa_hid_completion record;
+        ret = aoa_hid_wait_completion(phone, AOA_HID_NODE_KEYBOARD, sequence, &record);
+        if(!ret){
+            ret = record.status;
+        }
+    }
+
+    aoa_hid_close(phone);
+    return ret;
+}
+
+static int run_mouse(int argc, char** argv){
+    if(argc < 3 || argc > 5){
+        usage();
+        return -EINVAL;
+    }
+
+    int minor = parse_phone(argv[0]);
+    if(minor < 0){
+        return minor;
+    }
+
+    struct aoa_hid_phone* phone = aoa_hid_open(minor);
+    if(!phone){
+        return -errno;
+    }
+
+    int8_t x = atoi(argv[1]);
+    int8_t y = atoi(argv[2]);
+    int8_t wheel = argc > 3 ? atoi(argv[3]) : 0;
+    bool click = argc > 4 && !strcmp(argv[4], "click");
+    int64_t ret = aoa_hid_mouse(phone, x, y, wheel, click);
+
+    aoa_hid_close(phone);
+    return ret < 0 ? (int)ret : 0;
+}
+
+static int run_step(int argc, char** argv, int64_t (*send)(struct aoa_hid_phone*, int)){
+    if(argc != 2 || !parse_step(argv[1])){
+        usage();
+        return -EINVAL;
+    }
+
+    int minor = parse_phone(argv[0]);
+    if(minor < 0){
+        return minor;
+    }
+
+    struct aoa_hid_phone* phone = aoa_hid_open(minor);
+    if(!phone){
+        return -errno;
+    }
+
+    int64_t ret = send(phone, parse_step(argv[1]));
+
+    aoa_hid_close(phone);
+    return ret < 0 ? (int)ret : 0;
+}
+
+static int run_phone_ioctl(int argc, char** argv, int (*call)(struct aoa_hid_phone*)){
+    if(argc != 1){
+        usage();
+        return -EINVAL;
+    }
+
+    int minor = parse_phone(argv[0]);
+    if(minor < 0){
+        return minor;
+    }
+
+    struct aoa_hid_phone* phone = aoa_hid_open(minor);
+    if(!phone){
+        return -errno;
+    }
+
+    int ret = call(phone);
+    if(ret > 0){
+        printf("%d\n", ret);
+    }
+
+    aoa_hid_close(phone);
+    return ret < 0 ? ret : 0;
+}
+
+static int run_bench(int argc, char** argv){
+    int count = BENCH_DEFAULT_COUNT;
+    int mode = BENCH_MODE_MOUSE;
+    int opt;
+    optind = 1;
+    // getopt skips argv[0], which is the last word of the command here
+    while((opt = getopt(argc + 1, argv - 1, "n:b")) != -1){
+        switch(opt){
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'b':
+                mode = BENCH_MODE_BATCH;
+                break;
+            default:
+                usage();
+                return -EINVAL;
+        }
+    }
+
+    int first = optind - 1;
+    if(count <= 0 || first >= argc){
+        usage();
+        return -EINVAL;
+    }
+
+    int minors[AOA_HID_MAX_PHONES];
+    int num_phones = 0;
+    if(!strcmp(argv[first], "all")){
+        struct aoa_hid_phone_info phones[AOA_HID_MAX_PHONES];
+        int found = aoa_hid_list_phones(phones, AOA_HID_MAX_PHONES);
+        if(found < 0){
+            return found;
+        }
+        for(int i=0; i<found && i<AOA_HID_MAX_PHONES; i++){
+            minors[num_phones++] = phones[i].minor;
+        }
+    }
+    else{
+        for(int i=first; i<argc && num_phones<AOA_HID_MAX_PHONES; i++){
+            int minor = parse_phone(argv[i]);
+            if(minor < 0){
+                return minor;
+            }
+            minors[num_phones++] = minor;
+        }
+    }
+
+    if(num_phones == 0){
+        return -ENODEV;
+    }
+
+    // Every phone gets a thread of its own, the phones are measured at the same time like they are used
+    struct bench* benches = calloc(num_phones, sizeof(struct bench));
+    if(!benches){
+        return -ENOMEM;
+    }
+
+    for(int i=0; i<num_phones; i++){
+        benches[i].minor = minors[i];
+        benches[i].mode = mode;
+        benches[i].count = count;
+        if(pthread_create(&benches[i].thread, NULL, bench_thread, &benches[i])){
+            benches[i].error = -EAGAIN;
+            benches[i].thread = 0;
+        }
+    }
+
+    int ret = 0;
+    for(int i=0; i<num_phones; i++){
+        if(benches[i].thread){
+            pthread_join(benches[i].thread, NULL);
+        }
+        print_bench(&benches[i]);
+        if(benches[i].error && !ret){
+            ret = benches[i].error;
+        }
+        free(benches[i].latencies_ns);
+    }
+
+    free(benches);
+    return ret;
+}
+
+static void* bench_thread(void* argument){
+    struct bench* bench = argument;
+
+    struct aoa_hid_phone* phone = aoa_hid_open(bench->minor);
+    if(!phone){
+        bench->error = -errno;
+        return NULL;
+    }
+
+    bench->latencies_ns = calloc(bench->count, sizeof(uint64_t));
+    if(!bench->latencies_ns){
+        bench->error = -ENOMEM;
+        aoa_hid_close(phone);
+        return NULL;
+    }
+
+    bench->error = bench->mode == BENCH_MODE_BATCH ? bench_batch(phone, bench) : bench_mouse(phone, bench);
+    aoa_hid_close(phone);
+    return NULL;
+}
+
+// Moves the pointer one step right and back, so the pointer ends where it started
+static int bench_mouse(struct aoa_hid_phone* phone, struct bench* bench){
+    struct aoa_hid_completion records[BENCH_READ_RECORDS];
+    uint64_t first_submit_ns = 0;
+    uint64_t last_complete_ns = 0;
+
+    for(int i=0; i<bench->count; i++){
+        int64_t sequence = aoa_hid_mouse(phone, (i % 2) ? -1 : 1, 0, 0, false);
+        if(sequence < 0){
+            return (int)sequence;
+        }
+
+        int read = aoa_hid_read_completions(phone, AOA_HID_NODE_MOUSE, records, BENCH_READ_RECORDS, false);
+        for(int j=0; j<read; j++){
+            if(records[j].status){
+                return records[j].status;
+            }
+            if(!first_submit_ns){
+                first_submit_ns = records[j].submit_ns;
+            }
+            last_complete_ns = records[j].complete_ns;
+            bench->latencies_ns[bench->num_latencies++] = records[j].complete_ns - records[j].submit_ns;
+        }
+    }
+
+    bench->completed = bench->count;
+    if(last_complete_ns > first_submit_ns && bench->num_latencies > 1){
+        bench->events_per_second = (double)bench->num_latencies * 1e9 / (double)(last_complete_ns - first_submit_ns);
+    }
+
+    return 0;
+}
+
+static int bench_batch(struct aoa_hid_phone* phone, struct bench* bench){
+    struct aoa_hid_batch batch;
+    aoa_hid_batch_init(&batch);
+
+    int ret = 0;
+    for(int i=0; i<bench->count && !ret; i++){
+        ret = aoa_hid_batch_add_mouse(&batch, (i % 2) ? -1 : 1, 0, 0, false, 0);
+    }
+
+    if(!ret){
+        uint64_t start_ns = now_ns();
+        int64_t sequence = aoa_hid_batch_submit(phone, &batch);
+        uint64_t elapsed_ns = now_ns() - start_ns;
+        ret = sequence < 0 ? (int)sequence : 0;
+
+        // A batch gets a single record, the latency is the one of the whole batch
+        bench->completed = batch.submitted;
+        if(elapsed_ns){
+            bench->events_per_second = (double)batch.submitted * 1e9 / (double)elapsed_ns;
+        }
+        bench->latencies_ns[bench->num_latencies++] = elapsed_ns;
+    }
+
+    aoa_hid_batch_free(&batch);
+    return ret;
+}
+
+static void print_bench(struct bench* bench){
+    if(bench->error){
+        printf("%d error=%s completed=%d\n", bench->minor, strerror(-bench->error), bench->completed);
+        return;
+    }
+
+    uint64_t total_ns = 0;
+    qsort(bench->latencies_ns, bench->num_latencies, sizeof(uint64_t), compare_u64);
+    for(int i=0; i<bench->num_latencies; i++){
+        total_ns += bench->latencies_ns[i];
+    }
+
+    int n = bench->num_latencies;
+    printf("%d events=%d events_per_s=%.0f avg_us=%llu p50_us=%llu p99_us=%llu max_us=%llu\n", bench->minor, bench->completed, bench->events_per_second,
+        n ? (unsigned long long)(total_ns / n / 1000) : 0ULL,
+        n ? (unsigned long long)(bench->latencies_ns[n / 2] / 1000) : 0ULL,
+        n ? (unsigned long long)(bench->latencies_ns[(n * 99) / 100] / 1000) : 0ULL,
+        n ? (unsigned long long)(bench->latencies_ns[n - 1] / 1000) : 0ULL);
+}
+
+static int compare_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,220 @@
+#include "aoa_hid.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+
+#define NETLINK_BUFFER_SIZE 16384
+
+// Request with room for a single string attribute, the family name or nothing
+struct genl_request {
+    struct nlmsghdr header;
+    struct genlmsghdr genl;
+    char attributes[64];
+};
+
+/*
+    Forward declarations for private functions for this discovery.c file
+*/
+static int open_genl_socket(void);
+static int send_genl_request(int sock, uint16_t family, uint8_t cmd, uint16_t flags, uint16_t attribute, const char* value);
+static int resolve_family(int sock);
+static int dump_phones(int sock, int family, struct aoa_hid_phone_info* phones, int max_phones);
+static void parse_phone(struct genlmsghdr* genl, int length, struct aoa_hid_phone_info* phone);
+static int scan_phones(struct aoa_hid_phone_info* phones, int max_phones);
+
+int aoa_hid_list_phones(struct aoa_hid_phone_info* phones, int max_phones){
+    int sock = open_genl_socket();
+    if(sock < 0){
+        return scan_phones(phones, max_phones);
+    }
+
+    // Drivers from before the netlink family only have the device files
+    int family = resolve_family(sock);
+    if(family < 0){
+        close(sock);
+        return scan_phones(phones, max_phones);
+    }
+
+    int ret = dump_phones(sock, family, phones, max_phones);
+    close(sock);
+    return ret;
+}
+
+int aoa_hid_find_phone(const char* serial){
+    struct aoa_hid_phone_info phones[AOA_HID_MAX_PHONES];
+    int count = aoa_hid_list_phones(phones, AOA_HID_MAX_PHONES);
+    if(count < 0){
+        return count;
+    }
+
+    for(int i=0; i<count && i<AOA_HID_MAX_PHONES; i++){
+        if(!strcmp(phones[i].serial, serial)){
+            return phones[i].minor;
+        }
+    }
+
+    return -ENODEV;
+}
+
+static int open_genl_socket(void){
+    int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if(sock < 0){
+        return -errno;
+    }
+
+    struct sockaddr_nl address = {.nl_family = AF_NETLINK};
+    if(bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0){
+        int error = errno;
+        close(sock);
+        return -error;
+    }
+
+    return sock;
+}
+
+static int send_genl_request(int sock, uint16_t family, uint8_t cmd, uint16_t flags, uint16_t attribute, const char* value){
+    struct genl_request request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+    request.header.nlmsg_type = family;
+    request.header.nlmsg_flags = NLM_F_REQUEST | flags;
+    request.header.nlmsg_seq = 1;
+    request.genl.cmd = cmd;
+    request.genl.version = 1;
+
+    if(value){
+        size_t size = strlen(value) + 1;
+        if(NLA_HDRLEN + size > sizeof(request.attributes)){
+            return -EINVAL;
+        }
+
+        struct nlattr* nla = (struct nlattr*)request.attributes;
+        nla->nla_type = attribute;
+        nla->nla_len = NLA_HDRLEN + size;
+        memcpy((char*)nla + NLA_HDRLEN, value, size);
+        request.header.nlmsg_len += NLA_ALIGN(nla->nla_len);
+    }
+
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if(sendto(sock, &request, request.header.nlmsg_len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0){
+        return -errno;
+    }
+
+    return 0;
+}
+
+static int resolve_family(int sock){
+    int ret = send_genl_request(sock, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 0, CTRL_ATTR_FAMILY_NAME, AOA_HID_GENL_NAME);
+    if(ret){
+        return ret;
+    }
+
+    char buffer[NETLINK_BUFFER_SIZE];
+    ssize_t length = recv(sock, buffer, sizeof(buffer), 0);
+    if(length < 0){
+        return -errno;
+    }
+
+    struct nlmsghdr* header = (struct nlmsghdr*)buffer;
+    if(!NLMSG_OK(header, (size_t)length) || header->nlmsg_type == NLMSG_ERROR){
+        return -ENOENT;
+    }
+
+    struct genlmsghdr* genl = NLMSG_DATA(header);
+    int remaining = header->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    for(struct nlattr* nla = (struct nlattr*)((char*)genl + GENL_HDRLEN); remaining >= (int)NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= remaining;
+        remaining -= NLA_ALIGN(nla->nla_len), nla = (struct nlattr*)((char*)nla + NLA_ALIGN(nla->nla_len))){
+        if(nla->nla_type == CTRL_ATTR_FAMILY_ID){
+            return *(uint16_t*)((char*)nla + NLA_HDRLEN);
+        }
+    }
+
+    return -ENOENT;
+}
+
+static int dump_phones(int sock, int family, struct aoa_hid_phone_info* phones, int max_phones){
+    int ret = send_genl_request(sock, family, AOA_HID_CMD_GET_PHONES, NLM_F_DUMP, 0, NULL);
+    if(ret){
+        return ret;
+    }
+
+    int count = 0;
+    char buffer[NETLINK_BUFFER_SIZE];
+    for(;;){
+        ssize_t length = recv(sock, buffer, sizeof(buffer), 0);
+        if(length < 0){
+            return -errno;
+        }
+
+        for(struct nlmsghdr* header = (struct nlmsghdr*)buffer; NLMSG_OK(header, (size_t)length); header = NLMSG_NEXT(header, length)){
+            if(header->nlmsg_type == NLMSG_DONE){
+                return count;
+            }
+
+            if(header->nlmsg_type == NLMSG_ERROR){
+                struct nlmsgerr* error = NLMSG_DATA(header);
+                return error->error ? error->error : count;
+            }
+
+            // Phones beyond max_phones are only counted
+            if(count < max_phones){
+                parse_phone(NLMSG_DATA(header), header->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), &phones[count]);
+            }
+            count++;
+        }
+    }
+}
+
+static void parse_phone(struct genlmsghdr* genl, int length, struct aoa_hid_phone_info* phone){
+    memset(phone, 0, sizeof(*phone));
+    phone->minor = -1;
+
+    int remaining = length;
+    for(struct nlattr* nla = (struct nlattr*)((char*)genl + GENL_HDRLEN); remaining >= (int)NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= remaining;
+        remaining -= NLA_ALIGN(nla->nla_len), nla = (struct nlattr*)((char*)nla + NLA_ALIGN(nla->nla_len))){
+        void* data = (char*)nla + NLA_HDRLEN;
+        int size = nla->nla_len - NLA_HDRLEN;
+
+        switch(nla->nla_type){
+            case AOA_HID_ATTR_MINOR:
+                phone->minor = *(uint32_t*)data;
+                break;
+            case AOA_HID_ATTR_DEVICE_ID:
+                phone->device_id = *(uint32_t*)data;
+                break;
+            case AOA_HID_ATTR_HEALTH:
+                phone->health = *(uint32_t*)data;
+                break;
+            case AOA_HID_ATTR_SERIAL:
+                snprintf(phone->serial, sizeof(phone->serial), "%.*s", size, (char*)data);
+                break;
+            case AOA_HID_ATTR_PATH:
+                snprintf(phone->path, sizeof(phone->path), "%.*s", size, (char*)data);
+                break;
+        }
+    }
+}
+
+static int scan_phones(struct aoa_hid_phone_info* phones, int max_phones){
+    int count = 0;
+    for(int minor=0; minor<AOA_HID_MAX_PHONES; minor++){
+        char path[64];
+        snprintf(path, sizeof(path), "/dev/android_keyboard%d", minor);
+        if(access(path, F_OK)){
+            continue;
+        }
+
+        if(count < max_phones){
+            memset(&phones[count], 0, sizeof(phones[count]));
+            phones[count].minor = minor;
+        }
+        count++;
+    }
+
+    return count;
+}
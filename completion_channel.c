@@ -0,0 +1,157 @@
+#include "completion_channel.h"
+#include "usb.h"
+#include "reattach.h"
+#include "aoa_hid_driver.h"
+
+#include <linux/uaccess.h>
+
+#define COMPLETION_CHANNEL_RECORDS 64
+
+/*
+    Forward declarations for private functions for this completion_channel.c file
+*/
+static int wait_completion_fence(struct completion_channel* channel);
+
+int alloc_completion_channel(struct completion_channel* channel, int minor){
+    if(kfifo_alloc(&channel->records, COMPLETION_CHANNEL_RECORDS * sizeof(struct aoa_hid_completion), GFP_KERNEL)){
+        return -ENOMEM;
+    }
+
+    channel->minor = minor;
+    spin_lock_init(&channel->lock);
+    init_waitqueue_head(&channel->wait);
+    channel->submitted = 0;
+    channel->completed = 0;
+    channel->dropped = 0;
+    channel->generation = 0;
+    return 0;
+}
+
+void free_completion_channel(struct completion_channel* channel){
+    kfifo_free(&channel->records);
+}
+
+void reset_completion_channel(struct completion_channel* channel){
+    unsigned long flags;
+    spin_lock_irqsave(&channel->lock, flags);
+    kfifo_reset(&channel->records);
+    channel->submitted = 0;
+    channel->completed = 0;
+    channel->dropped = 0;
+    channel->generation++;
+    spin_unlock_irqrestore(&channel->lock, flags);
+}
+
+void disconnect_completion_channel(struct completion_channel* channel){
+    wake_up_interruptible(&channel->wait);
+}
+
+void begin_completion(struct completion_channel* channel, struct completion_ticket* ticket){
+    unsigned long flags;
+    spin_lock_irqsave(&channel->lock, flags);
+    ticket->sequence = ++channel->submitted;
+    ticket->generation = channel->generation;
+    spin_unlock_irqrestore(&channel->lock, flags);
+    ticket->submit_ns = ktime_get_ns();
+}
+
+void end_completion(struct completion_channel* channel, const struct completion_ticket* ticket, int status){
+    struct aoa_hid_completion record = {
+        .sequence = ticket->sequence,
+        .status = status,
+        .reserved = 0,
+        .submit_ns = ticket->submit_ns,
+        .complete_ns = ktime_get_ns()
+    };
+
+    unsigned long flags;
+    spin_lock_irqsave(&channel->lock, flags);
+    // A ticket from before the file was reopened belongs to nobody
+    if(ticket->generation == channel->generation){
+        channel->completed++;
+        if(kfifo_avail(&channel->records) >= sizeof(record)){
+            kfifo_in(&channel->records, &record, sizeof(record));
+        }
+        else{
+            channel->dropped++;
+        }
+    }
+    spin_unlock_irqrestore(&channel->lock, flags);
+
+    wake_up_interruptible(&channel->wait);
+}
+
+ssize_t read_completions(struct completion_channel* channel, struct file* File, char __user* user_buffer, size_t count){
+    if(count < sizeof(struct aoa_hid_completion)){
+        return -EINVAL;
+    }
+
+    if(kfifo_is_empty(&channel->records)){
+        if(!is_phone_present(channel->minor)){
+            return -ENODEV;
+        }
+
+        if(File->f_flags & O_NONBLOCK){
+            return -EAGAIN;
+        }
+
+        if(wait_event_interruptible(channel->wait, !kfifo_is_empty(&channel->records) || !is_phone_present(channel->minor))){
+            return -ERESTARTSYS;
+        }
+
+        if(kfifo_is_empty(&channel->records)){
+            return -ENODEV;
+        }
+    }
+
+    // The device file is opened at most once, so there is a single consumer and no lock is needed here
+    // Only whole records are copied
+    unsigned int len = min_t(size_t, kfifo_len(&channel->records), count);
+    len -= len % sizeof(struct aoa_hid_completion);
+    unsigned int copied = 0;
+    int ret = kfifo_to_user(&channel->records, user_buffer, len, &copied);
+    if(ret){
+        return ret;
+    }
+
+    return copied;
+}
+
+__poll_t poll_completions(struct completion_channel* channel, struct file* File, poll_table* wait){
+    poll_wait(File, &channel->wait, wait);
+
+    if(!kfifo_is_empty(&channel->records)){
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return 0;
+}
+
+long completion_ioctl(struct completion_channel* channel, unsigned int cmd, unsigned long arg){
+    switch(cmd){
+        case AOA_HID_IOCTL_FENCE:
+            return wait_completion_fence(channel);
+        case AOA_HID_IOCTL_COMPLETIONS_DROPPED:
+            return put_user(READ_ONCE(channel->dropped), (u32 __user*)arg);
+        case AOA_HID_IOCTL_CANCEL_PHONE:
+            return cancel_phone_input(channel->minor);
+        case AOA_HID_IOCTL_FLUSH:
+            return flush_phone_input(channel->minor);
+        default:
+            return -ENOTTY;
+    }
+}
+
+static int wait_completion_fence(struct completion_channel* channel){
+    unsigned long flags;
+    spin_lock_irqsave(&channel->lock, flags);
+    u64 target = channel->submitted;
+    spin_unlock_irqrestore(&channel->lock, flags);
+
+    // Submissions still complete after a disconnect, with -ENODEV, so this does not wait for a phone that is gone
+    if(wait_event_interruptible(channel->wait, READ_ONCE(channel->completed) >= target)){
+        return -ERESTARTSYS;
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef COMPLETION_CHANNEL_H
+#define COMPLETION_CHANNEL_H
+
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/fs.h>
+
+/*
+    Stream of struct aoa_hid_completion records for a device file, one record for every write or batch submitted through it
+    Device files are opened at most once, so each minor of a device type has one channel that is reset when the file is opened
+*/
+struct completion_channel {
+    int minor;
+    struct kfifo records;
+    // Protects the producer side of records, submitted and completed
+    spinlock_t lock;
+    wait_queue_head_t wait;
+    u64 submitted;      // Sequence number of the last submission, sequence numbers start at 1
+    u64 completed;      // Number of submissions that have completed
+    u32 dropped;
+    u32 generation;     // Incremented on every reset so that tickets from a previous open are ignored
+};
+
+struct completion_ticket {
+    u64 sequence;
+    u64 submit_ns;
+    u32 generation;
+};
+
+int alloc_completion_channel(struct completion_channel* channel, int minor);
+void free_completion_channel(struct completion_channel* channel);
+// Forgets all records and restarts the sequence numbers, called when the device file is opened
+void reset_completion_channel(struct completion_channel* channel);
+// Wakes readers and fences so that they notice the phone is gone
+void disconnect_completion_channel(struct completion_channel* channel);
+
+// Taken first by every write, also one that fails before anything was sent, so that clients can count the records
+void begin_completion(struct completion_channel* channel, struct completion_ticket* ticket);
+// Safe to call from atomic context
+void end_completion(struct completion_channel* channel, const struct completion_ticket* ticket, int status);
+
+ssize_t read_completions(struct completion_channel* channel, struct file* File, char __user* user_buffer, size_t count);
+__poll_t poll_completions(struct completion_channel* channel, struct file* File, poll_table* wait);
+// Handles the ioctls shared by all device files with a completion channel, including the ones for the whole phone, returns -ENOTTY for any other cmd
+long completion_ioctl(struct completion_channel* channel, unsigned int cmd, unsigned long arg);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef CUSED_COMPAT_LINUX_KERNEL_H
+#define CUSED_COMPAT_LINUX_KERNEL_H
+
+/*
+    Stands in for the kernel's linux/kernel.h when ../reports.c and ../device_ids.c are built into the daemon
+    Only what those files use is defined here, with the same meaning as in the kernel
+*/
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef int8_t s8;
+typedef uint16_t u16;
+typedef int16_t s16;
+typedef uint32_t u32;
+typedef int32_t s32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define clamp(val, lo, hi) ((val) < (lo) ? (lo) : (val) > (hi) ? (hi) : (val))
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef CUSED_H
+#define CUSED_H
+
+/*
+    Userspace backend of aoa_hid_driver: libusb for the phones, CUSE for the device files
+
+    Everything runs on one thread. The main loop polls the CUSE sessions of all device files together with the file descriptors
+    of libusb, and every report is an asynchronous control transfer, so all phones have a report on the bus at the same time.
+*/
+
+#define FUSE_USE_VERSION 31
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <libusb.h>
+#include <fuse_lowlevel.h>
+#include "../aoa_hid_driver.h"
+// The report encoding and the id lookup are the driver's own, built with the definitions in compat/linux/kernel.h
+#include "../reports.h"
+#include "../device_ids.h"
+
+// https://source.android.com/docs/core/interaction/accessories/aoa2
+#define ACCESSORY_GET_PROTOCOL 51
+#define ACCESSORY_SEND_STRING 52
+#define ACCESSORY_START 53
+#define ACCESSORY_REGISTER_HID 54
+#define ACCESSORY_UNREGISTER_HID 55
+#define ACCESSORY_SET_HID_REPORT_DESC 56
+#define ACCESSORY_SEND_HID_EVENT 57
+#define ACCESSORY_HID_ID 1
+#define ACCESSORY_VENDOR_ID 0x18D1
+#define ACCESSORY_MIN_PRODUCT_ID 0x2D00
+#define ACCESSORY_MAX_PRODUCT_ID 0x2D05
+
+#define CONTROL_TIMEOUT_MS 1000
+// GET_PROTOCOL timeout for devices that are not known, like the driver's auto discovery
+#define DISCOVERY_TIMEOUT_MS 100
+#define MAX_KNOWN_DEVICES 25
+
+// Transmission classes like in the driver, a waiting report of a lower class goes first
+#define CLASS_POINTER 0
+#define CLASS_CONSUMER 1
+#define CLASS_BULK 2
+#define NUM_CLASSES 3
+
+// Reports waiting per phone and class, a keyboard write that does not fit waits until it does
+#define QUEUE_SIZE 4096
+// Transient errors are retried like in the driver: 10 ms, 20 ms
+#define MAX_RETRIES 2
+#define RETRY_BACKOFF_US 10000
+
+#define NODE_KEYBOARD 0
+#define NODE_MOUSE 1
+#define NODE_VOLUME 2
+#define NODE_BRIGHTNESS 3
+#define NODE_GAMEPAD 4
+#define NUM_NODES 5
+
+struct config {
+    uint32_t known_ids[MAX_KNOWN_DEVICES];  // (vendor id << 16) | product id
+    int num_known_ids;
+    bool auto_discovery;
+    uint32_t gap_us;                        // Between a press and its release and between key presses
+};
+
+// A write to a device file, answered once the last of its reports has been transferred
+struct write_request {
+    fuse_req_t req;
+    size_t size;
+    int remaining;
+    int error;
+};
+
+struct report {
+    uint8_t data[AOA_HID_MAX_REPORT_SIZE];
+    uint16_t size;
+    bool paced;                             // Waits for the gap after the previous report of its class
+    struct write_request* request;          // NULL for reports nobody waits for
+};
+
+struct report_queue {
+    struct report reports[QUEUE_SIZE];
+    int head;
+    int count;
+    uint64_t last_sent_ns;
+};
+
+struct phone;
+
+struct node {
+    struct phone* phone;
+    int kind;
+    struct fuse_session* session;
+    int fd;
+    bool open;
+    // Write waiting for room in the queue, for the keyboard only the text that did not fit yet
+    fuse_req_t blocked_req;
+    char* blocked_text;
+    size_t blocked_size;
+    size_t blocked_total;
+};
+
+struct phone {
+    int minor;
+    libusb_device* device;
+    libusb_device_handle* handle;
+    bool gone;
+    struct report_queue queues[NUM_CLASSES];
+    // Only one report per phone is on the bus at a time, like in the driver
+    struct libusb_transfer* transfer;
+    bool in_flight;
+    struct report current;
+    int current_class;
+    // Gamepad report that is still queued, a newer snapshot with the same buttons and hat replaces it
+    struct report* gamepad_pending;
+    int attempts;
+    uint64_t retry_at_ns;
+    struct node nodes[NUM_NODES];
+};
+
+/*
+    main.c
+*/
+extern struct config config;
+uint64_t now_ns(void);
+
+/*
+    phone.c
+*/
+// Called for devices that arrived, does the accessory handshake or registers the HID device of a phone in accessory mode
+void attach_device(libusb_device* device);
+void detach_device(libusb_device* device);
+void detach_all_devices(void);
+struct phone* get_phone(int minor);
+// Room for count more reports in the queue of the class
+bool has_queue_room(struct phone* phone, int transfer_class, int count);
+// The queue must have room, the request is answered when the last of its reports completes
+void queue_report(struct phone* phone, int transfer_class, const uint8_t* data, uint16_t size, bool paced, struct write_request* request);
+// Queues a gamepad report or, when only the axes changed, replaces the one that is still waiting, returns false when the queue is full
+bool queue_gamepad_report(struct phone* phone, const uint8_t* report);
+// Starts the next due report of every idle phone, returns the time in ns until the next report is due, -1 when none is waiting
+int64_t pump_phones(void);
+
+/*
+    nodes.c
+*/
+int create_nodes(struct phone* phone);
+void destroy_nodes(struct phone* phone);
+// Processes the requests waiting on the session of a device file
+void process_node(struct node* node);
+// Queues what a blocked write still has to send once there is room
+void retry_blocked_write(struct node* node);
+void finish_request(struct write_request* request);
+
+#endif
@@ -0,0 +1,231 @@
+#include "cused.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Hotplug events waiting for the main loop, libusb does not allow transfers from inside the callback
+#define MAX_PENDING_EVENTS 128
+#define MAX_POLL_FDS (AOA_HID_MAX_PHONES * NUM_NODES + 32)
+
+struct hotplug_event {
+    libusb_device* device;
+    bool arrived;
+};
+
+/*
+    Forward declarations for private functions for this main.c file
+*/
+static int parse_arguments(int argc, char** argv);
+static void usage(const char* name);
+static void handle_signal(int signal);
+static int hotplug_callback(libusb_context* context, libusb_device* device, libusb_hotplug_event event, void* user_data);
+static void handle_hotplug_events(void);
+static void run_event_loop(libusb_context* context);
+
+struct config config = {
+    .known_ids = {0},
+    .num_known_ids = 0,
+    .auto_discovery = false,
+    .gap_us = 10000
+};
+
+static volatile sig_atomic_t stop;
+static struct hotplug_event pending_events[MAX_PENDING_EVENTS];
+static int num_pending_events;
+
+int main(int argc, char** argv){
+    if(parse_arguments(argc, argv)){
+        usage(argv[0]);
+        return 2;
+    }
+
+    libusb_context* context;
+    int ret = libusb_init(&context);
+    if(ret){
+        fprintf(stderr, "aoa-hid-cused - Error initializing libusb: %s\n", libusb_error_name(ret));
+        return 1;
+    }
+
+    if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)){
+        fprintf(stderr, "aoa-hid-cused - libusb has no hotplug support on this system\n");
+        libusb_exit(context);
+        return 1;
+    }
+
+    struct sigaction action = {.sa_handler = handle_signal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    // Devices that are already plugged in arrive through the callback as well
+    libusb_hotplug_callback_handle callback;
+    ret = libusb_hotplug_register_callback(context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+        LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &callback);
+    if(ret){
+        fprintf(stderr, "aoa-hid-cused - Error registering hotplug callback: %s\n", libusb_error_name(ret));
+        libusb_exit(context);
+        return 1;
+    }
+
+    run_event_loop(context);
+
+    // Reports in flight are cancelled, their completions free the phones
+    detach_all_devices();
+    struct timeval zero = {0};
+    for(int i=0; i<AOA_HID_MAX_PHONES; i++){
+        while(get_phone(i)){
+            libusb_handle_events_timeout_completed(context, &zero, NULL);
+        }
+    }
+
+    libusb_hotplug_deregister_callback(context, callback);
+    handle_hotplug_events();
+    libusb_exit(context);
+    return 0;
+}
+
+uint64_t now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int parse_arguments(int argc, char** argv){
+    int option;
+    while((option = getopt(argc, argv, "d:ag:")) != -1){
+        switch(option){
+            case 'd': {
+                unsigned int vendor_id, product_id;
+                if(sscanf(optarg, "%x:%x", &vendor_id, &product_id) != 2 || vendor_id > 0xFFFF || product_id > 0xFFFF){
+                    return -1;
+                }
+                if(config.num_known_ids == MAX_KNOWN_DEVICES){
+                    fprintf(stderr, "aoa-hid-cused - At most %d devices can be given\n", MAX_KNOWN_DEVICES);
+                    return -1;
+                }
+                config.known_ids[config.num_known_ids++] = (vendor_id << 16) | product_id;
+                break;
+            }
+            case 'a':
+                config.auto_discovery = true;
+                break;
+            case 'g':
+                config.gap_us = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return optind == argc ? 0 : -1;
+}
+
+static void usage(const char* name){
+    fprintf(stderr,
+        "Usage: %s [-d vendor:product]... [-a] [-g gap_us]\n"
+        "  -d  phone to switch to accessory mode, in hex like 04e8:6860, can be repeated\n"
+        "  -a  also try unknown devices that look like phones\n"
+        "  -g  microseconds between a press and its release and between key presses, 10000 by default\n",
+        name);
+}
+
+static void handle_signal(int signal){
+    (void)signal;
+    stop = 1;
+}
+
+static int hotplug_callback(libusb_context* context, libusb_device* device, libusb_hotplug_event event, void* user_data){
+    (void)context;
+    (void)user_data;
+
+    if(num_pending_events == MAX_PENDING_EVENTS){
+        fprintf(stderr, "aoa-hid-cused - Too many hotplug events, one was dropped\n");
+        return 0;
+    }
+
+    pending_events[num_pending_events].device = libusb_ref_device(device);
+    pending_events[num_pending_events].arrived = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED;
+    num_pending_events++;
+    return 0;
+}
+
+static void handle_hotplug_events(void){
+    for(int i=0; i<num_pending_events; i++){
+        // Only the references are dropped while shutting down
+        if(!stop && pending_events[i].arrived){
+            attach_device(pending_events[i].device);
+        }
+        else if(!stop){
+            detach_device(pending_events[i].device);
+        }
+        libusb_unref_device(pending_events[i].device);
+    }
+    num_pending_events = 0;
+}
+
+// One poll over the device files of all phones and the file descriptors of libusb, reports are started whenever they are due
+static void run_event_loop(libusb_context* context){
+    struct pollfd fds[MAX_POLL_FDS];
+    struct phone* fd_phones[MAX_POLL_FDS];
+    int fd_minors[MAX_POLL_FDS];
+    struct timeval zero = {0};
+
+    while(!stop){
+        handle_hotplug_events();
+        int64_t next_report_ns = pump_phones();
+
+        int num_fds = 0;
+        for(int i=0; i<AOA_HID_MAX_PHONES; i++){
+            struct phone* phone = get_phone(i);
+            for(int j=0; phone && j<NUM_NODES; j++){
+                fds[num_fds] = (struct pollfd){.fd = phone->nodes[j].fd, .events = POLLIN};
+                fd_phones[num_fds] = phone;
+                fd_minors[num_fds++] = i;
+            }
+        }
+
+        int num_node_fds = num_fds;
+        const struct libusb_pollfd** usb_fds = libusb_get_pollfds(context);
+        for(int i=0; usb_fds && usb_fds[i] && num_fds<MAX_POLL_FDS; i++){
+            fds[num_fds++] = (struct pollfd){.fd = usb_fds[i]->fd, .events = usb_fds[i]->events};
+        }
+        libusb_free_pollfds(usb_fds);
+
+        // Wakes up for whichever comes first: a libusb timeout or the next paced or retried report
+        int timeout_ms = -1;
+        struct timeval usb_timeout;
+        if(libusb_get_next_timeout(context, &usb_timeout) == 1){
+            timeout_ms = usb_timeout.tv_sec * 1000 + (usb_timeout.tv_usec + 999) / 1000;
+        }
+        if(next_report_ns >= 0){
+            int report_ms = (next_report_ns + 999999) / 1000000;
+            if(timeout_ms < 0 || report_ms < timeout_ms){
+                timeout_ms = report_ms;
+            }
+        }
+
+        if(poll(fds, num_fds, timeout_ms) < 0){
+            if(errno != EINTR){
+                fprintf(stderr, "aoa-hid-cused - poll failed: %s\n", strerror(errno));
+                return;
+            }
+            continue;
+        }
+
+        // Completions first, so writes see the room they made in the queues
+        libusb_handle_events_timeout_completed(context, &zero, NULL);
+
+        for(int i=0; i<num_node_fds; i++){
+            // The phone may have gone in a completion, its nodes are gone with it
+            struct phone* phone = get_phone(fd_minors[i]);
+            if((fds[i].revents & (POLLIN | POLLERR)) && phone && phone == fd_phones[i]){
+                process_node(&phone->nodes[i % NUM_NODES]);
+            }
+        }
+    }
+}
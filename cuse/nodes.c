@@ -0,0 +1,432 @@
+#include "cused.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <cuse_lowlevel.h>
+
+// Write size of the driver's volume and brightness files, the mouse's are in reports.h
+#define STEP_WRITE_SIZE 1
+
+/*
+    Forward declarations for private functions for this nodes.c file
+*/
+static int create_node(struct phone* phone, int kind);
+static void destroy_node(struct node* node);
+static void node_open(fuse_req_t req, struct fuse_file_info* fi);
+static void node_release(fuse_req_t req, struct fuse_file_info* fi);
+static void node_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info* fi);
+static void node_write(fuse_req_t req, const char* buf, size_t size, off_t off, struct fuse_file_info* fi);
+static void node_ioctl(fuse_req_t req, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, const void* in_buf, size_t in_bufsz, size_t out_bufsz);
+static void write_node(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock);
+static void block_write(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock);
+static size_t queue_keyboard_text(struct phone* phone, const char* text, size_t size);
+static void write_keyboard(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock);
+static void write_mouse(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock);
+static void write_step(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock, uint16_t up_usage, uint16_t down_usage);
+static void write_gamepad(struct node* node, fuse_req_t req, const char* buf, size_t size);
+
+static const char* node_names[NUM_NODES] = {"keyboard", "mouse", "volume", "brightness", "gamepad"};
+
+static const struct cuse_lowlevel_ops node_ops = {
+    .open = node_open,
+    .release = node_release,
+    .read = node_read,
+    .write = node_write,
+    .ioctl = node_ioctl
+};
+
+int create_nodes(struct phone* phone){
+    for(int i=0; i<NUM_NODES; i++){
+        if(create_node(phone, i)){
+            for(int j=0; j<i; j++){
+                destroy_node(&phone->nodes[j]);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void destroy_nodes(struct phone* phone){
+    for(int i=0; i<NUM_NODES; i++){
+        destroy_node(&phone->nodes[i]);
+    }
+}
+
+void process_node(struct node* node){
+    struct fuse_buf buffer = {.mem = NULL};
+    int ret = fuse_session_receive_buf(node->session, &buffer);
+    if(ret > 0){
+        fuse_session_process_buf(node->session, &buffer);
+    }
+    free(buffer.mem);
+}
+
+void retry_blocked_write(struct node* node){
+    if(!node->blocked_req){
+        return;
+    }
+
+    // Mouse, volume and brightness writes are written again as a whole, they block again while their reports still do not fit
+    if(node->kind != NODE_KEYBOARD){
+        fuse_req_t req = node->blocked_req;
+        char* buf = node->blocked_text;
+        node->blocked_req = NULL;
+        node->blocked_text = NULL;
+        write_node(node, req, buf, node->blocked_size, false);
+        free(buf);
+        return;
+    }
+
+    size_t queued = queue_keyboard_text(node->phone, node->blocked_text, node->blocked_size);
+    if(queued < node->blocked_size){
+        memmove(node->blocked_text, node->blocked_text + queued, node->blocked_size - queued);
+        node->blocked_size -= queued;
+        return;
+    }
+
+    fuse_reply_write(node->blocked_req, node->blocked_total);
+    free(node->blocked_text);
+    node->blocked_req = NULL;
+    node->blocked_text = NULL;
+}
+
+void finish_request(struct write_request* request){
+    if(--request->remaining > 0){
+        return;
+    }
+
+    if(request->error){
+        fuse_reply_err(request->req, -request->error);
+    }
+    else{
+        fuse_reply_write(request->req, request->size);
+    }
+    free(request);
+}
+
+// The device file appears once the kernel's CUSE_INIT has been processed by the main loop
+static int create_node(struct phone* phone, int kind){
+    struct node* node = &phone->nodes[kind];
+    memset(node, 0, sizeof(*node));
+    node->phone = phone;
+    node->kind = kind;
+    node->fd = -1;
+
+    char devname[64];
+    snprintf(devname, sizeof(devname), "DEVNAME=android_%s%d", node_names[kind], phone->minor);
+    const char* dev_info_argv[] = {devname};
+    struct cuse_info info = {
+        .dev_info_argc = 1,
+        .dev_info_argv = dev_info_argv
+    };
+
+    char* argv[] = {"aoa-hid-cused"};
+    struct fuse_args args = FUSE_ARGS_INIT(1, argv);
+    node->session = cuse_lowlevel_new(&args, &info, &node_ops, node);
+    if(!node->session){
+        fprintf(stderr, "aoa-hid-cused - Error creating CUSE session for android_%s%d\n", node_names[kind], phone->minor);
+        return -1;
+    }
+
+    // The session is mounted on the file descriptor instead of cuse_lowlevel_setup, which would take over the signal handlers of the daemon
+    int fd = open("/dev/cuse", O_RDWR | O_CLOEXEC);
+    if(fd < 0){
+        fprintf(stderr, "aoa-hid-cused - Error opening /dev/cuse: %s\n", strerror(errno));
+        goto create_node_error0;
+    }
+
+    char mountpoint[32];
+    snprintf(mountpoint, sizeof(mountpoint), "/dev/fd/%d", fd);
+    if(fuse_session_mount(node->session, mountpoint)){
+        close(fd);
+        goto create_node_error0;
+    }
+
+    node->fd = fuse_session_fd(node->session);
+    return 0;
+
+create_node_error0:
+    fuse_session_destroy(node->session);
+    node->session = NULL;
+    return -1;
+}
+
+static void destroy_node(struct node* node){
+    if(!node->session){
+        return;
+    }
+
+    if(node->blocked_req){
+        fuse_reply_err(node->blocked_req, ENODEV);
+        free(node->blocked_text);
+        node->blocked_req = NULL;
+        node->blocked_text = NULL;
+    }
+
+    // Closes the CUSE file descriptor, which removes the device file
+    fuse_session_unmount(node->session);
+    fuse_session_destroy(node->session);
+    node->session = NULL;
+    node->fd = -1;
+}
+
+static void node_open(fuse_req_t req, struct fuse_file_info* fi){
+    struct node* node = fuse_req_userdata(req);
+    if(node->open){
+        fuse_reply_err(req, EBUSY);
+        return;
+    }
+
+    node->open = true;
+    fi->nonseekable = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void node_release(fuse_req_t req, struct fuse_file_info* fi){
+    struct node* node = fuse_req_userdata(req);
+    (void)fi;
+    node->open = false;
+    fuse_reply_err(req, 0);
+}
+
+static void node_write(fuse_req_t req, const char* buf, size_t size, off_t off, struct fuse_file_info* fi){
+    struct node* node = fuse_req_userdata(req);
+    (void)off;
+
+    if(node->phone->gone){
+        fuse_reply_err(req, ENODEV);
+        return;
+    }
+
+    // A write that is blocked keeps its place, later ones would overtake it
+    if(node->blocked_req){
+        fuse_reply_err(req, EBUSY);
+        return;
+    }
+
+    write_node(node, req, buf, size, fi->flags & O_NONBLOCK);
+}
+
+static void write_node(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock){
+    switch(node->kind){
+        case NODE_KEYBOARD:
+            write_keyboard(node, req, buf, size, nonblock);
+            break;
+        case NODE_MOUSE:
+            write_mouse(node, req, buf, size, nonblock);
+            break;
+        case NODE_VOLUME:
+            write_step(node, req, buf, size, nonblock, CONSUMER_USAGE_VOLUME_UP, CONSUMER_USAGE_VOLUME_DOWN);
+            break;
+        case NODE_BRIGHTNESS:
+            write_step(node, req, buf, size, nonblock, CONSUMER_USAGE_BRIGHTNESS_UP, CONSUMER_USAGE_BRIGHTNESS_DOWN);
+            break;
+        case NODE_GAMEPAD:
+            write_gamepad(node, req, buf, size);
+            break;
+    }
+}
+
+// Keeps a write whose reports do not fit the queue until finish_report makes room, like the driver's blocking writes
+static void block_write(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock){
+    if(nonblock){
+        fuse_reply_err(req, EAGAIN);
+        return;
+    }
+
+    node->blocked_text = malloc(size);
+    if(!node->blocked_text){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    memcpy(node->blocked_text, buf, size);
+    node->blocked_size = size;
+    node->blocked_total = size;
+    node->blocked_req = req;
+}
+
+// The daemon keeps no completion records, reading them fails instead of blocking forever
+static void node_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info* fi){
+    (void)size;
+    (void)off;
+    (void)fi;
+    fuse_reply_err(req, EOPNOTSUPP);
+}
+
+// None of the driver's ioctls is implemented, they fail with EOPNOTSUPP so callers can tell them from ioctls nobody knows
+static void node_ioctl(fuse_req_t req, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, const void* in_buf, size_t in_bufsz, size_t out_bufsz){
+    (void)arg;
+    (void)fi;
+    (void)flags;
+    (void)in_buf;
+    (void)in_bufsz;
+    (void)out_bufsz;
+    fuse_reply_err(req, _IOC_TYPE((unsigned int)cmd) == AOA_HID_IOCTL_MAGIC ? EOPNOTSUPP : ENOTTY);
+}
+
+// Queues the press and release of every character that fits, characters without a key are skipped like in the driver
+static size_t queue_keyboard_text(struct phone* phone, const char* text, size_t size){
+    size_t queued = 0;
+    for(; queued < size; queued++){
+        uint8_t modifier, keycode;
+        if(!get_keyboard_keys(text[queued], &modifier, &keycode)){
+            continue;
+        }
+
+        if(!has_queue_room(phone, CLASS_BULK, 2)){
+            break;
+        }
+
+        uint8_t report[AOA_HID_REPORT_SIZE_KEYBOARD];
+        encode_keyboard_report(report, modifier, keycode);
+        queue_report(phone, CLASS_BULK, report, sizeof(report), true, NULL);
+        encode_keyboard_report(report, 0x00, 0x00);
+        queue_report(phone, CLASS_BULK, report, sizeof(report), true, NULL);
+    }
+
+    return queued;
+}
+
+// Like the driver the write returns once the text is queued, it only waits while the queue is full
+static void write_keyboard(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock){
+    size_t queued = queue_keyboard_text(node->phone, buf, size);
+    if(queued == size){
+        fuse_reply_write(req, size);
+        return;
+    }
+
+    if(nonblock){
+        if(queued){
+            fuse_reply_write(req, queued);
+        }
+        else{
+            fuse_reply_err(req, EAGAIN);
+        }
+        return;
+    }
+
+    node->blocked_text = malloc(size - queued);
+    if(!node->blocked_text){
+        fuse_reply_write(req, queued);
+        return;
+    }
+
+    memcpy(node->blocked_text, buf + queued, size - queued);
+    node->blocked_size = size - queued;
+    node->blocked_total = size;
+    node->blocked_req = req;
+}
+
+// The write is answered once all its reports are on the phone, like the driver's mouse device
+static void write_mouse(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock){
+    if(size != MOUSE_WRITE_SIZE && size != MOUSE_SHORT_WRITE_SIZE){
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    uint8_t write[MOUSE_WRITE_SIZE] = {0};
+    memcpy(write, buf, size);
+
+    uint8_t reports[(MOUSE_WRITE_MAX_REPORTS + 1) * MOUSE_REPORT_SIZE];
+    int num_reports = encode_mouse_write(write, reports);
+    if(num_reports < 0){
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    // A click is followed by the release
+    if(write[3] == 1){
+        encode_mouse_report(reports + num_reports * AOA_HID_REPORT_SIZE_MOUSE, 0x00, 0, 0, 0, 0);
+        num_reports++;
+    }
+
+    if(!has_queue_room(node->phone, CLASS_POINTER, num_reports)){
+        block_write(node, req, buf, size, nonblock);
+        return;
+    }
+
+    struct write_request* request = calloc(1, sizeof(struct write_request));
+    if(!request){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    request->req = req;
+    request->size = size;
+    request->remaining = num_reports;
+    for(int i=0; i<num_reports; i++){
+        queue_report(node->phone, CLASS_POINTER, reports + i * AOA_HID_REPORT_SIZE_MOUSE, AOA_HID_REPORT_SIZE_MOUSE, false, request);
+    }
+}
+
+// 0x01 presses the up usage and 0xFF the down usage, the release follows after the gap
+static void write_step(struct node* node, fuse_req_t req, const char* buf, size_t size, bool nonblock, uint16_t up_usage, uint16_t down_usage){
+    uint16_t usage;
+    if(size != STEP_WRITE_SIZE || get_step_usage((uint8_t)buf[0], up_usage, down_usage, &usage)){
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    if(!has_queue_room(node->phone, CLASS_CONSUMER, 2)){
+        block_write(node, req, buf, size, nonblock);
+        return;
+    }
+
+    struct write_request* request = calloc(1, sizeof(struct write_request));
+    if(!request){
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    request->req = req;
+    request->size = size;
+    request->remaining = 2;
+
+    uint8_t report[CONSUMER_REPORT_SIZE];
+    encode_consumer_report(report, usage);
+    queue_report(node->phone, CLASS_CONSUMER, report, sizeof(report), false, request);
+    encode_consumer_report(report, 0x00);
+    queue_report(node->phone, CLASS_CONSUMER, report, sizeof(report), true, request);
+}
+
+// Like the driver only the latest snapshot matters, it is sent as soon as the phone is free instead of at a fixed rate
+static void write_gamepad(struct node* node, fuse_req_t req, const char* buf, size_t size){
+    if(size == 0 || size % sizeof(struct aoa_hid_gamepad_state)){
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    size_t written = 0;
+    int error = 0;
+    for(; written < size; written += sizeof(struct aoa_hid_gamepad_state)){
+        struct aoa_hid_gamepad_state snapshot;
+        memcpy(&snapshot, buf + written, sizeof(snapshot));
+        if(snapshot.hat > AOA_HID_GAMEPAD_HAT_CENTERED){
+            error = EINVAL;
+            break;
+        }
+
+        uint8_t report[GAMEPAD_REPORT_SIZE];
+        encode_gamepad_report(report, &snapshot);
+        if(!queue_gamepad_report(node->phone, report)){
+            error = EAGAIN;
+            break;
+        }
+    }
+
+    // Snapshots before a bad one are kept, like a partial write to the driver
+    if(written){
+        fuse_reply_write(req, written);
+    }
+    else{
+        fuse_reply_err(req, error);
+    }
+}
@@ -0,0 +1,453 @@
+#include "cused.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MANUFACTURER_STRING "Not a Real Manufacturer"
+#define MODEL_STRING "Not a Real Model"
+#define DESCRIPTION_STRING "Connection for using HID over the AOAv2 protocol"
+#define VERSION_STRING "1.0"
+
+// The collections in the order of the driver's HID functions, volume and brightness share the consumer collection
+static const struct report_descriptor* const collections[] = {
+    &keyboard_report_descriptor,
+    &mouse_report_descriptor,
+    &consumer_report_descriptor,
+    &gamepad_report_descriptor
+};
+
+/*
+    Forward declarations for private functions for this phone.c file
+*/
+static bool is_known_device(uint16_t vendor_id, uint16_t product_id);
+static bool is_discovery_candidate(libusb_device* device);
+static void start_accessory(libusb_device* device, bool known);
+static void add_phone(libusb_device* device);
+static int register_hid(libusb_device_handle* handle, uint8_t max_packet_size);
+static uint16_t build_descriptor(uint8_t* descriptor);
+static void remove_phone(struct phone* phone);
+static bool pick_report(struct phone* phone, uint64_t now, int64_t* wait_ns);
+static void submit_report(struct phone* phone);
+static void report_transfer_complete(struct libusb_transfer* transfer);
+static void finish_report(struct phone* phone, int error);
+static bool is_transient_error(enum libusb_transfer_status status);
+
+static struct phone* phones[AOA_HID_MAX_PHONES];
+
+void attach_device(libusb_device* device){
+    struct libusb_device_descriptor descriptor;
+    if(libusb_get_device_descriptor(device, &descriptor)){
+        return;
+    }
+
+    if(descriptor.idVendor == ACCESSORY_VENDOR_ID && descriptor.idProduct >= ACCESSORY_MIN_PRODUCT_ID && descriptor.idProduct <= ACCESSORY_MAX_PRODUCT_ID){
+        add_phone(device);
+        return;
+    }
+
+    bool known = is_known_device(descriptor.idVendor, descriptor.idProduct);
+    if(known || (config.auto_discovery && is_discovery_candidate(device))){
+        start_accessory(device, known);
+    }
+}
+
+void detach_device(libusb_device* device){
+    for(int i=0; i<AOA_HID_MAX_PHONES; i++){
+        if(phones[i] && phones[i]->device == device){
+            phones[i]->gone = true;
+            // A report in flight is finished by its completion, which frees the phone
+            if(!phones[i]->in_flight){
+                remove_phone(phones[i]);
+            }
+            return;
+        }
+    }
+}
+
+void detach_all_devices(void){
+    for(int i=0; i<AOA_HID_MAX_PHONES; i++){
+        if(phones[i]){
+            phones[i]->gone = true;
+            if(phones[i]->in_flight){
+                libusb_cancel_transfer(phones[i]->transfer);
+            }
+            else{
+                remove_phone(phones[i]);
+            }
+        }
+    }
+}
+
+struct phone* get_phone(int minor){
+    return phones[minor];
+}
+
+bool has_queue_room(struct phone* phone, int transfer_class, int count){
+    return phone->queues[transfer_class].count + count <= QUEUE_SIZE;
+}
+
+void queue_report(struct phone* phone, int transfer_class, const uint8_t* data, uint16_t size, bool paced, struct write_request* request){
+    struct report_queue* queue = &phone->queues[transfer_class];
+    struct report* report = &queue->reports[(queue->head + queue->count) % QUEUE_SIZE];
+    memcpy(report->data, data, size);
+    report->size = size;
+    report->paced = paced;
+    report->request = request;
+    queue->count++;
+}
+
+bool queue_gamepad_report(struct phone* phone, const uint8_t* report){
+    // Buttons and hat are bytes 1 to 3, a change of them is never coalesced away like in the driver
+    struct report* pending = phone->gamepad_pending;
+    if(pending && !memcmp(pending->data + 1, report + 1, 3)){
+        memcpy(pending->data, report, GAMEPAD_REPORT_SIZE);
+        return true;
+    }
+
+    if(!has_queue_room(phone, CLASS_POINTER, 1)){
+        return false;
+    }
+
+    struct report_queue* queue = &phone->queues[CLASS_POINTER];
+    queue_report(phone, CLASS_POINTER, report, GAMEPAD_REPORT_SIZE, false, NULL);
+    phone->gamepad_pending = &queue->reports[(queue->head + queue->count - 1) % QUEUE_SIZE];
+    return true;
+}
+
+int64_t pump_phones(void){
+    uint64_t now = now_ns();
+    int64_t next = -1;
+
+    for(int i=0; i<AOA_HID_MAX_PHONES; i++){
+        struct phone* phone = phones[i];
+        if(!phone || phone->in_flight || phone->gone){
+            continue;
+        }
+
+        int64_t wait_ns = -1;
+        if(pick_report(phone, now, &wait_ns)){
+            submit_report(phone);
+        }
+        else if(wait_ns >= 0 && (next < 0 || wait_ns < next)){
+            next = wait_ns;
+        }
+    }
+
+    return next;
+}
+
+static bool is_known_device(uint16_t vendor_id, uint16_t product_id){
+    uint32_t id = ((uint32_t)vendor_id << 16) | product_id;
+    return find_device_id(config.known_ids, config.num_known_ids, id) >= 0;
+}
+
+// Same heuristics as the driver's auto discovery: no hubs, no HID devices and at least one interface a phone would have
+static bool is_discovery_candidate(libusb_device* device){
+    struct libusb_config_descriptor* configuration;
+    if(libusb_get_active_config_descriptor(device, &configuration)){
+        return false;
+    }
+
+    bool has_phone_interface = false;
+    bool has_hid_interface = false;
+    for(int i=0; i<configuration->bNumInterfaces; i++){
+        if(configuration->interface[i].num_altsetting == 0){
+            continue;
+        }
+
+        switch(configuration->interface[i].altsetting[0].bInterfaceClass){
+            case LIBUSB_CLASS_HID:
+            case LIBUSB_CLASS_HUB:
+                has_hid_interface = true;
+                break;
+            case LIBUSB_CLASS_IMAGE:
+            case LIBUSB_CLASS_VENDOR_SPEC:
+            case LIBUSB_CLASS_COMM:
+            case LIBUSB_CLASS_DATA:
+            case LIBUSB_CLASS_WIRELESS:
+            case LIBUSB_CLASS_MISCELLANEOUS:
+                has_phone_interface = true;
+                break;
+            default:
+                break;
+        }
+    }
+
+    libusb_free_config_descriptor(configuration);
+    return has_phone_interface && !has_hid_interface;
+}
+
+// The handshake of android_default_probe, the phone then re-enumerates in accessory mode and arrives again
+static void start_accessory(libusb_device* device, bool known){
+    libusb_device_handle* handle;
+    if(libusb_open(device, &handle)){
+        return;
+    }
+
+    uint8_t protocol[2] = {0};
+    int ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR, ACCESSORY_GET_PROTOCOL, 0, 0, protocol, sizeof(protocol), known ? CONTROL_TIMEOUT_MS : DISCOVERY_TIMEOUT_MS);
+    if(ret != sizeof(protocol) || (protocol[0] | (protocol[1] << 8)) != 2){
+        if(known){
+            fprintf(stderr, "aoa-hid-cused - Android device found but does not support AOAv2, get protocol returned %d\n", ret < 0 ? ret : protocol[0] | (protocol[1] << 8));
+        }
+        libusb_close(handle);
+        return;
+    }
+
+    static const char* strings[] = {MANUFACTURER_STRING, MODEL_STRING, DESCRIPTION_STRING, VERSION_STRING};
+    for(int i=0; i<4; i++){
+        int size = strlen(strings[i]) + 1;
+        ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, ACCESSORY_SEND_STRING, 0, i, (unsigned char*)strings[i], size, CONTROL_TIMEOUT_MS);
+        if(ret != size){
+            fprintf(stderr, "aoa-hid-cused - Error sending string %d to android device, libusb_control_transfer returned %d instead of %d\n", i, ret, size);
+            libusb_close(handle);
+            return;
+        }
+    }
+
+    ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, ACCESSORY_START, 0, 0, NULL, 0, CONTROL_TIMEOUT_MS);
+    if(ret != 0){
+        fprintf(stderr, "aoa-hid-cused - Error starting accessory mode on android device, libusb_control_transfer returned %d instead of 0\n", ret);
+    }
+
+    libusb_close(handle);
+}
+
+// The setup of android_accessory_mode_probe: a minor, the HID device on the phone and the device files
+static void add_phone(libusb_device* device){
+    int minor = -1;
+    for(int i=0; i<AOA_HID_MAX_PHONES && minor < 0; i++){
+        if(!phones[i]){
+            minor = i;
+        }
+    }
+    if(minor < 0){
+        fprintf(stderr, "aoa-hid-cused - No free minor for android device\n");
+        return;
+    }
+
+    struct phone* phone = calloc(1, sizeof(struct phone));
+    if(!phone){
+        return;
+    }
+
+    phone->minor = minor;
+    phone->device = libusb_ref_device(device);
+    phone->transfer = libusb_alloc_transfer(0);
+    if(!phone->transfer){
+        goto add_phone_error0;
+    }
+
+    if(libusb_open(device, &phone->handle)){
+        fprintf(stderr, "aoa-hid-cused - Error opening android device in accessory mode\n");
+        goto add_phone_error1;
+    }
+
+    struct libusb_device_descriptor descriptor;
+    libusb_get_device_descriptor(device, &descriptor);
+    if(register_hid(phone->handle, descriptor.bMaxPacketSize0)){
+        goto add_phone_error2;
+    }
+
+    phones[minor] = phone;
+    if(create_nodes(phone)){
+        phones[minor] = NULL;
+        goto add_phone_error2;
+    }
+
+    return;
+
+add_phone_error2:
+    libusb_close(phone->handle);
+
+add_phone_error1:
+    libusb_free_transfer(phone->transfer);
+
+add_phone_error0:
+    libusb_unref_device(phone->device);
+    free(phone);
+}
+
+static int register_hid(libusb_device_handle* handle, uint8_t max_packet_size){
+    uint8_t descriptor[AOA_HID_MAX_DESCRIPTOR_SIZE];
+    uint16_t size = build_descriptor(descriptor);
+
+    int ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, ACCESSORY_REGISTER_HID, ACCESSORY_HID_ID, size, NULL, 0, CONTROL_TIMEOUT_MS);
+    if(ret != 0){
+        fprintf(stderr, "aoa-hid-cused - Error registering HID device, libusb_control_transfer returned %d instead of 0\n", ret);
+        return -1;
+    }
+
+    // The descriptor goes in pieces of at most the endpoint 0 packet size, like the driver sends it
+    for(uint16_t offset=0; offset<size; offset+=max_packet_size){
+        uint16_t length = size - offset < max_packet_size ? size - offset : max_packet_size;
+        ret = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, ACCESSORY_SET_HID_REPORT_DESC, ACCESSORY_HID_ID, offset, descriptor + offset, length, CONTROL_TIMEOUT_MS);
+        if(ret != length){
+            fprintf(stderr, "aoa-hid-cused - Error sending HID descriptor, libusb_control_transfer returned %d instead of %d\n", ret, length);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Same descriptor as the driver registers, put together from the driver's collections
+static uint16_t build_descriptor(uint8_t* descriptor){
+    uint16_t size = 0;
+    for(size_t i=0; i<sizeof(collections) / sizeof(collections[0]); i++){
+        memcpy(descriptor + size, collections[i]->data, collections[i]->size);
+        size += collections[i]->size;
+    }
+
+    return size;
+}
+
+// Writes still waiting for reports of the phone fail with ENODEV
+static void remove_phone(struct phone* phone){
+    // A report waiting to be retried is not on the bus, nothing else would answer its write
+    if(phone->attempts > 0){
+        finish_report(phone, -ENODEV);
+    }
+
+    for(int i=0; i<NUM_CLASSES; i++){
+        struct report_queue* queue = &phone->queues[i];
+        for(; queue->count > 0; queue->count--){
+            struct report* report = &queue->reports[queue->head];
+            queue->head = (queue->head + 1) % QUEUE_SIZE;
+            if(report->request){
+                report->request->error = -ENODEV;
+                finish_request(report->request);
+            }
+        }
+    }
+
+    destroy_nodes(phone);
+    phones[phone->minor] = NULL;
+
+    libusb_close(phone->handle);
+    libusb_free_transfer(phone->transfer);
+    libusb_unref_device(phone->device);
+    free(phone);
+}
+
+// Takes the first report of the lowest class that is due, or tells how long until one is
+static bool pick_report(struct phone* phone, uint64_t now, int64_t* wait_ns){
+    if(phone->attempts > 0){
+        if(now >= phone->retry_at_ns){
+            return true;
+        }
+        *wait_ns = phone->retry_at_ns - now;
+        return false;
+    }
+
+    for(int i=0; i<NUM_CLASSES; i++){
+        struct report_queue* queue = &phone->queues[i];
+        if(queue->count == 0){
+            continue;
+        }
+
+        struct report* report = &queue->reports[queue->head];
+        uint64_t due = report->paced ? queue->last_sent_ns + (uint64_t)config.gap_us * 1000 : 0;
+        if(now < due){
+            if(*wait_ns < 0 || (int64_t)(due - now) < *wait_ns){
+                *wait_ns = due - now;
+            }
+            continue;
+        }
+
+        phone->current = *report;
+        phone->current_class = i;
+        if(report == phone->gamepad_pending){
+            phone->gamepad_pending = NULL;
+        }
+        queue->head = (queue->head + 1) % QUEUE_SIZE;
+        queue->count--;
+        return true;
+    }
+
+    return false;
+}
+
+static void submit_report(struct phone* phone){
+    unsigned char* buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + phone->current.size);
+    if(!buffer){
+        finish_report(phone, -ENOMEM);
+        return;
+    }
+
+    libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR, ACCESSORY_SEND_HID_EVENT, ACCESSORY_HID_ID, 0, phone->current.size);
+    memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, phone->current.data, phone->current.size);
+    libusb_fill_control_transfer(phone->transfer, phone->handle, buffer, report_transfer_complete, phone, CONTROL_TIMEOUT_MS);
+    phone->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    int ret = libusb_submit_transfer(phone->transfer);
+    if(ret){
+        free(buffer);
+        phone->transfer->buffer = NULL;
+        finish_report(phone, ret == LIBUSB_ERROR_NO_DEVICE ? -ENODEV : -EIO);
+        return;
+    }
+
+    phone->in_flight = true;
+}
+
+static void report_transfer_complete(struct libusb_transfer* transfer){
+    struct phone* phone = transfer->user_data;
+    phone->in_flight = false;
+
+    if(phone->gone){
+        finish_report(phone, -ENODEV);
+        remove_phone(phone);
+        return;
+    }
+
+    if(transfer->status == LIBUSB_TRANSFER_COMPLETED){
+        finish_report(phone, 0);
+        return;
+    }
+
+    // Like in the driver a movement or volume step that timed out may have been applied already and is not sent again
+    bool retry = transfer->status != LIBUSB_TRANSFER_TIMED_OUT || phone->current_class == CLASS_BULK;
+    if(retry && is_transient_error(transfer->status) && phone->attempts < MAX_RETRIES){
+        phone->retry_at_ns = now_ns() + ((uint64_t)RETRY_BACKOFF_US << phone->attempts) * 1000;
+        phone->attempts++;
+        return;
+    }
+
+    finish_report(phone, transfer->status == LIBUSB_TRANSFER_NO_DEVICE ? -ENODEV : -EIO);
+}
+
+static void finish_report(struct phone* phone, int error){
+    phone->attempts = 0;
+    phone->queues[phone->current_class].last_sent_ns = now_ns();
+
+    struct write_request* request = phone->current.request;
+    if(request){
+        if(error && !request->error){
+            request->error = error;
+        }
+        finish_request(request);
+    }
+
+    // Room in a queue lets the writes that were blocked on it continue
+    if(!phone->gone){
+        switch(phone->current_class){
+            case CLASS_POINTER:
+                retry_blocked_write(&phone->nodes[NODE_MOUSE]);
+                break;
+            case CLASS_CONSUMER:
+                retry_blocked_write(&phone->nodes[NODE_VOLUME]);
+                retry_blocked_write(&phone->nodes[NODE_BRIGHTNESS]);
+                break;
+            case CLASS_BULK:
+                retry_blocked_write(&phone->nodes[NODE_KEYBOARD]);
+                break;
+        }
+    }
+}
+
+static bool is_transient_error(enum libusb_transfer_status status){
+    return status == LIBUSB_TRANSFER_TIMED_OUT || status == LIBUSB_TRANSFER_STALL || status == LIBUSB_TRANSFER_ERROR;
+}
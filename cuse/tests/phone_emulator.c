@@ -0,0 +1,344 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+/*
+    An Android phone for testing aoa-hid-cused without one, emulated with raw_gadget on a dummy_hcd bus
+
+    The phone enumerates with a vendor interface like a phone with adb, answers the AOAv2 handshake and then re-enumerates
+    in accessory mode. There it accepts the HID device and prints what it receives on stdout, one line each:
+        string <index> <text>
+        descriptor <hex bytes>
+        report <hex bytes>
+*/
+
+#define VENDOR_ID 0x18D1
+#define PHONE_PRODUCT_ID 0x4EE7
+#define ACCESSORY_PRODUCT_ID 0x2D00
+#define EP0_MAX_PACKET_SIZE 64
+
+// https://source.android.com/docs/core/interaction/accessories/aoa2
+#define ACCESSORY_GET_PROTOCOL 51
+#define ACCESSORY_SEND_STRING 52
+#define ACCESSORY_START 53
+#define ACCESSORY_REGISTER_HID 54
+#define ACCESSORY_UNREGISTER_HID 55
+#define ACCESSORY_SET_HID_REPORT_DESC 56
+#define ACCESSORY_SEND_HID_EVENT 57
+#define ACCESSORY_PROTOCOL_VERSION 2
+
+#define MAX_TRANSFER_SIZE 4096
+// Older headers do not name the events raw_gadget reports since Linux 6.2
+#define RAW_EVENT_DISCONNECT 6
+
+struct control_event {
+    struct usb_raw_event event;
+    struct usb_ctrlrequest request;
+    uint8_t data[MAX_TRANSFER_SIZE];
+};
+
+struct ep0_io {
+    struct usb_raw_ep_io io;
+    uint8_t data[MAX_TRANSFER_SIZE];
+};
+
+struct phone_config_descriptor {
+    struct usb_config_descriptor config;
+    struct usb_interface_descriptor interface;
+} __attribute__((packed));
+
+/*
+    Forward declarations for private functions for this phone_emulator.c file
+*/
+static int start_gadget(const char* driver, const char* device, uint16_t product_id);
+static bool run_gadget(int fd, bool accessory);
+static bool handle_standard_request(int fd, const struct usb_ctrlrequest* request, uint16_t product_id);
+static bool handle_vendor_request(int fd, const struct usb_ctrlrequest* request, bool accessory, bool* started);
+static int ep0_write(int fd, const void* data, int length);
+static int ep0_read(int fd, void* data, int length);
+static void print_hex(const char* label, const uint8_t* data, int length);
+
+static uint8_t hid_descriptor[MAX_TRANSFER_SIZE];
+static int hid_descriptor_size;
+static int hid_descriptor_received;
+
+int main(int argc, char** argv){
+    const char* driver = argc > 1 ? argv[1] : "dummy_udc";
+    const char* device = argc > 2 ? argv[2] : "dummy_udc.0";
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // The handshake ends with the phone leaving the bus, it comes back as an accessory
+    int fd = start_gadget(driver, device, PHONE_PRODUCT_ID);
+    if(fd < 0){
+        return 1;
+    }
+    bool started = run_gadget(fd, false);
+    close(fd);
+    if(!started){
+        return 1;
+    }
+
+    fd = start_gadget(driver, device, ACCESSORY_PRODUCT_ID);
+    if(fd < 0){
+        return 1;
+    }
+    run_gadget(fd, true);
+    close(fd);
+    return 0;
+}
+
+static int start_gadget(const char* driver, const char* device, uint16_t product_id){
+    int fd = open("/dev/raw-gadget", O_RDWR);
+    if(fd < 0){
+        fprintf(stderr, "phone_emulator - Error opening /dev/raw-gadget: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct usb_raw_init init = {.speed = USB_SPEED_HIGH};
+    snprintf((char*)init.driver_name, sizeof(init.driver_name), "%s", driver);
+    snprintf((char*)init.device_name, sizeof(init.device_name), "%s", device);
+    if(ioctl(fd, USB_RAW_IOCTL_INIT, &init) || ioctl(fd, USB_RAW_IOCTL_RUN, 0)){
+        fprintf(stderr, "phone_emulator - Error starting gadget on %s: %s\n", device, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    fprintf(stderr, "phone_emulator - Attached as %04x:%04x\n", VENDOR_ID, product_id);
+    return fd;
+}
+
+// Serves endpoint 0 until the handshake is done or the host goes away, returns whether accessory mode was started
+static bool run_gadget(int fd, bool accessory){
+    uint16_t product_id = accessory ? ACCESSORY_PRODUCT_ID : PHONE_PRODUCT_ID;
+    bool started = false;
+
+    while(!started){
+        struct control_event event = {.event.length = sizeof(event.request) + sizeof(event.data)};
+        if(ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, &event)){
+            if(errno == EINTR){
+                continue;
+            }
+            fprintf(stderr, "phone_emulator - Error fetching event: %s\n", strerror(errno));
+            return false;
+        }
+
+        if(event.event.type == RAW_EVENT_DISCONNECT){
+            return false;
+        }
+
+        if(event.event.type != USB_RAW_EVENT_CONTROL){
+            continue;
+        }
+
+        bool handled;
+        if((event.request.bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD){
+            handled = handle_standard_request(fd, &event.request, product_id);
+        }
+        else if((event.request.bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR){
+            handled = handle_vendor_request(fd, &event.request, accessory, &started);
+        }
+        else{
+            handled = false;
+        }
+
+        if(!handled){
+            ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0);
+        }
+    }
+
+    return started;
+}
+
+static bool handle_standard_request(int fd, const struct usb_ctrlrequest* request, uint16_t product_id){
+    static const struct usb_device_descriptor device_descriptor_template = {
+        .bLength = USB_DT_DEVICE_SIZE,
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = 0x0200,
+        .bMaxPacketSize0 = EP0_MAX_PACKET_SIZE,
+        .idVendor = VENDOR_ID,
+        .bcdDevice = 0x0100,
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = 3,
+        .bNumConfigurations = 1
+    };
+    // No endpoints, the daemon only uses endpoint 0
+    static const struct phone_config_descriptor config_descriptor = {
+        .config = {
+            .bLength = USB_DT_CONFIG_SIZE,
+            .bDescriptorType = USB_DT_CONFIG,
+            .wTotalLength = sizeof(struct phone_config_descriptor),
+            .bNumInterfaces = 1,
+            .bConfigurationValue = 1,
+            .bmAttributes = USB_CONFIG_ATT_ONE,
+            .bMaxPower = 250
+        },
+        .interface = {
+            .bLength = USB_DT_INTERFACE_SIZE,
+            .bDescriptorType = USB_DT_INTERFACE,
+            .bInterfaceNumber = 0,
+            .bNumEndpoints = 0,
+            .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+            .bInterfaceSubClass = 0x42,
+            .bInterfaceProtocol = 0x01
+        }
+    };
+    static const char* strings[] = {"Emulated Manufacturer", "Emulated Phone", "EMULATED0001"};
+
+    switch(request->bRequest){
+        case USB_REQ_GET_DESCRIPTOR:
+            switch(request->wValue >> 8){
+                case USB_DT_DEVICE: {
+                    struct usb_device_descriptor device_descriptor = device_descriptor_template;
+                    device_descriptor.idProduct = product_id;
+                    return ep0_write(fd, &device_descriptor, request->wLength < sizeof(device_descriptor) ? request->wLength : sizeof(device_descriptor)) >= 0;
+                }
+                case USB_DT_CONFIG:
+                    return ep0_write(fd, &config_descriptor, request->wLength < sizeof(config_descriptor) ? request->wLength : sizeof(config_descriptor)) >= 0;
+                case USB_DT_STRING: {
+                    uint8_t index = request->wValue & 0xFF;
+                    uint8_t descriptor[2 + 2 * 64] = {0};
+                    descriptor[1] = USB_DT_STRING;
+                    if(index == 0){
+                        // English (United States)
+                        descriptor[0] = 4;
+                        descriptor[2] = 0x09;
+                        descriptor[3] = 0x04;
+                    }
+                    else if(index <= sizeof(strings) / sizeof(strings[0])){
+                        int length = strlen(strings[index - 1]);
+                        descriptor[0] = 2 + 2 * length;
+                        for(int i=0; i<length; i++){
+                            descriptor[2 + 2 * i] = strings[index - 1][i];
+                        }
+                    }
+                    else{
+                        return false;
+                    }
+                    return ep0_write(fd, descriptor, request->wLength < descriptor[0] ? request->wLength : descriptor[0]) >= 0;
+                }
+                default:
+                    return false;
+            }
+        case USB_REQ_SET_CONFIGURATION:
+            if(ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, config_descriptor.config.bMaxPower) || ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0)){
+                return false;
+            }
+            return ep0_read(fd, NULL, 0) >= 0;
+        case USB_REQ_GET_CONFIGURATION: {
+            uint8_t configuration = 1;
+            return ep0_write(fd, &configuration, 1) >= 0;
+        }
+        case USB_REQ_SET_INTERFACE:
+            return ep0_read(fd, NULL, 0) >= 0;
+        case USB_REQ_GET_INTERFACE: {
+            uint8_t alternate = 0;
+            return ep0_write(fd, &alternate, 1) >= 0;
+        }
+        case USB_REQ_GET_STATUS: {
+            uint8_t status[2] = {0};
+            return ep0_write(fd, status, sizeof(status)) >= 0;
+        }
+        default:
+            return false;
+    }
+}
+
+static bool handle_vendor_request(int fd, const struct usb_ctrlrequest* request, bool accessory, bool* started){
+    uint8_t data[MAX_TRANSFER_SIZE];
+    int length;
+
+    switch(request->bRequest){
+        case ACCESSORY_GET_PROTOCOL: {
+            uint8_t protocol[2] = {ACCESSORY_PROTOCOL_VERSION, 0};
+            return ep0_write(fd, protocol, sizeof(protocol)) >= 0;
+        }
+        case ACCESSORY_SEND_STRING:
+            length = ep0_read(fd, data, request->wLength);
+            if(length < 0){
+                return false;
+            }
+            data[length > 0 ? length - 1 : 0] = '\0';
+            printf("string %d %s\n", request->wIndex, (char*)data);
+            return true;
+        case ACCESSORY_START:
+            *started = !accessory;
+            return ep0_read(fd, NULL, 0) >= 0;
+        case ACCESSORY_REGISTER_HID:
+            if(!accessory || request->wIndex > sizeof(hid_descriptor)){
+                return false;
+            }
+            hid_descriptor_size = request->wIndex;
+            hid_descriptor_received = 0;
+            return ep0_read(fd, NULL, 0) >= 0;
+        case ACCESSORY_UNREGISTER_HID:
+            hid_descriptor_size = 0;
+            return ep0_read(fd, NULL, 0) >= 0;
+        case ACCESSORY_SET_HID_REPORT_DESC:
+            // Pieces come in order, wIndex is the offset of this one
+            if(!hid_descriptor_size || request->wIndex != hid_descriptor_received || request->wIndex + request->wLength > hid_descriptor_size){
+                return false;
+            }
+            length = ep0_read(fd, hid_descriptor + request->wIndex, request->wLength);
+            if(length < 0){
+                return false;
+            }
+            hid_descriptor_received += length;
+            if(hid_descriptor_received == hid_descriptor_size){
+                print_hex("descriptor", hid_descriptor, hid_descriptor_size);
+            }
+            return true;
+        case ACCESSORY_SEND_HID_EVENT:
+            if(!hid_descriptor_size || hid_descriptor_received != hid_descriptor_size){
+                return false;
+            }
+            length = ep0_read(fd, data, request->wLength);
+            if(length < 0){
+                return false;
+            }
+            print_hex("report", data, length);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int ep0_write(int fd, const void* data, int length){
+    struct ep0_io io = {.io.length = length};
+    memcpy(io.data, data, length);
+    int ret = ioctl(fd, USB_RAW_IOCTL_EP0_WRITE, &io);
+    if(ret < 0){
+        fprintf(stderr, "phone_emulator - Error writing to endpoint 0: %s\n", strerror(errno));
+    }
+    return ret;
+}
+
+// A length of 0 acknowledges a request without data
+static int ep0_read(int fd, void* data, int length){
+    struct ep0_io io = {.io.length = length};
+    int ret = ioctl(fd, USB_RAW_IOCTL_EP0_READ, &io);
+    if(ret < 0){
+        fprintf(stderr, "phone_emulator - Error reading from endpoint 0: %s\n", strerror(errno));
+        return ret;
+    }
+    if(data){
+        memcpy(data, io.data, ret);
+    }
+    return ret;
+}
+
+static void print_hex(const char* label, const uint8_t* data, int length){
+    printf("%s", label);
+    for(int i=0; i<length; i++){
+        printf(" %02x", data[i]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,102 @@
+#!/bin/sh
+# Runs aoa-hid-cused against a phone emulated with raw_gadget on a dummy_hcd bus and checks what reaches the phone
+set -u
+cd "$(dirname "$0")"
+
+DAEMON=../aoa-hid-cused
+EMULATOR=./phone_emulator
+LOG=$(mktemp)
+FAILED=0
+
+fail(){
+    echo "FAIL: $1"
+    FAILED=1
+}
+
+cleanup(){
+    [ -n "${DAEMON_PID:-}" ] && kill "$DAEMON_PID" 2>/dev/null
+    [ -n "${EMULATOR_PID:-}" ] && kill "$EMULATOR_PID" 2>/dev/null
+    wait 2>/dev/null
+    rm -f "$LOG"
+}
+trap cleanup EXIT
+
+# Reports of a write arrive in order, so the lines have to follow each other in the log
+expect_reports(){
+    name=$1
+    shift
+    expected=$(printf 'report %s\n' "$@")
+    if ! grep '^report' "$LOG" | tr '\n' '|' | grep -qF "$(echo "$expected" | tr '\n' '|')"; then
+        fail "$name, expected:"
+        echo "$expected"
+    fi
+}
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "SKIP: needs root"
+    exit 77
+fi
+
+if grep -q '^aoa_hid_driver ' /proc/modules; then
+    echo "SKIP: aoa_hid_driver is loaded and would take the emulated phone"
+    exit 77
+fi
+
+if ! modprobe dummy_hcd || ! modprobe raw_gadget || ! modprobe cuse; then
+    echo "SKIP: dummy_hcd, raw_gadget or cuse is not available"
+    exit 77
+fi
+
+"$EMULATOR" >"$LOG" &
+EMULATOR_PID=$!
+"$DAEMON" -d 18d1:4ee7 -g 1000 &
+DAEMON_PID=$!
+
+for i in $(seq 100); do
+    [ -e /dev/android_gamepad0 ] && break
+    sleep 0.1
+done
+if [ ! -e /dev/android_gamepad0 ]; then
+    fail "device files did not appear"
+    cat "$LOG"
+    exit 1
+fi
+
+# The daemon registers the driver's collections: keyboard, mouse, consumer and gamepad
+for report_id in 01 02 03 04; do
+    grep '^descriptor' "$LOG" | grep -q " 85 $report_id" || fail "descriptor does not declare report ID $report_id"
+done
+
+printf 'ab' >/dev/android_keyboard0
+# x 5, y -3
+printf '\005\375\000\000\000\000\000\000' >/dev/android_mouse0
+# 127 notches and 32767 units of vertical scrolling do not fit one report and are split like in the driver
+printf '\000\000\177\000\377\177\000\000' >/dev/android_mouse0
+printf '\001' >/dev/android_volume0
+# Button 1 with the hat centered
+printf '\001\000\010\000\000\000\000\000\000\000\000\000' >/dev/android_gamepad0
+sleep 1
+
+expect_reports "keyboard" "01 00 04" "01 00 00" "01 00 05" "01 00 00"
+expect_reports "mouse movement" "02 00 05 fd 00 00 00 00"
+expect_reports "mouse scrolling" "02 00 00 00 ff 7f 00 00" "02 00 00 00 88 3b 00 00"
+expect_reports "volume" "03 e9 00" "03 00 00"
+expect_reports "gamepad" "04 01 00 08 00 00 00 00 00 00"
+
+# Completion records and the driver's ioctls are not implemented and have to fail instead of blocking
+python3 - <<'PYTHON' || fail "reads and ioctls do not fail with EOPNOTSUPP"
+import errno, fcntl, os
+fd = os.open("/dev/android_mouse0", os.O_RDWR)
+for operation in (lambda: os.read(fd, 64), lambda: fcntl.ioctl(fd, 0xAA18)):
+    try:
+        operation()
+        raise SystemExit(1)
+    except OSError as error:
+        if error.errno != errno.EOPNOTSUPP:
+            raise SystemExit(1)
+PYTHON
+
+if [ "$FAILED" -eq 0 ]; then
+    echo "PASS"
+fi
+exit "$FAILED"
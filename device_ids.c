@@ -0,0 +1,11 @@
+#include "device_ids.h"
+
+int find_device_id(const u32* ids, int count, u32 id){
+    for(int i=0; i<count; i++){
+        if(ids[i] == id){
+            return i;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,13 @@
+#ifndef DEVICE_IDS_H
+#define DEVICE_IDS_H
+
+#include <linux/kernel.h>
+
+/*
+    Lookup in tables of known device ids, (vendor id << 16) | product id
+    Pure functions without locking, the callers hold the lock of their table
+*/
+// Index of id in the first count entries of ids, -1 when it is not there
+int find_device_id(const u32* ids, int count, u32 id);
+
+#endif
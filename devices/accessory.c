@@ -0,0 +1,545 @@
+#include "accessory.h"
+#include "../usb.h"
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+// Several urbs are kept in flight in each direction so that the bus never idles while a completion is being handled
+#define ACCESSORY_URBS_PER_DIRECTION 8
+#define ACCESSORY_BUFFER_SIZE 16384
+// close() gives up on writes the app did not read within this time
+#define ACCESSORY_FLUSH_TIMEOUT_MS 5000
+
+struct accessory_state;
+
+struct accessory_buffer {
+    struct accessory_state* state;
+    struct urb* urb;
+    struct list_head list;
+    // Bytes of a completed IN transfer that have not been read yet start at offset
+    size_t offset;
+};
+
+struct accessory_state {
+    int minor;
+    // Reference to the phone taken when the file is opened, the urbs are only valid while the file is open
+    struct accessory_device* dev;
+    struct accessory_buffer in_buffers[ACCESSORY_URBS_PER_DIRECTION];
+    struct accessory_buffer out_buffers[ACCESSORY_URBS_PER_DIRECTION];
+    // Protects the lists and the errors, the completion handlers run in interrupt context
+    spinlock_t lock;
+    struct list_head filled;    // Completed IN buffers waiting to be read
+    struct list_head idle;      // OUT buffers that are not in flight
+    int in_error;
+    int out_error;
+    wait_queue_head_t wait;
+    struct mutex read_lock;
+    struct mutex write_lock;
+};
+
+/*
+    Forward declarations for private functions for this accessory.c file
+*/
+static ssize_t accessory_read_iter(struct kiocb* iocb, struct iov_iter* to);
+static ssize_t accessory_write_iter(struct kiocb* iocb, struct iov_iter* from);
+static __poll_t accessory_poll(struct file* File, poll_table* wait);
+static int accessory_fsync(struct file* File, loff_t start, loff_t end, int datasync);
+static int accessory_flush(struct file* File, fl_owner_t id);
+static int driver_open(struct inode* device_file, struct file* instance);
+static int driver_close(struct inode* device_file, struct file* instance);
+static int alloc_accessory_buffers(struct accessory_state* state);
+static void free_accessory_buffers(struct accessory_state* state);
+static void accessory_in_complete(struct urb* urb);
+static void accessory_out_complete(struct urb* urb);
+static int wait_accessory_writes(struct accessory_state* state, long timeout);
+static int count_idle_buffers(struct accessory_state* state);
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = driver_open,
+    .release = driver_close,
+    .read_iter = accessory_read_iter,
+    .write_iter = accessory_write_iter,
+    // sendfile and splice go through read_iter and write_iter, the data is copied straight into the urb buffers
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .poll = accessory_poll,
+    .fsync = accessory_fsync,
+    .flush = accessory_flush
+};
+
+static dev_t accessory_device_nr;
+static struct cdev accessory_device;
+static struct class* accessory_device_class;
+
+static unsigned int file_is_open[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static struct accessory_state* accessory_states[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+
+int setup_accessory(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        accessory_states[i] = NULL;
+        file_is_open[i] = 0;
+    }
+
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        accessory_states[i] = kzalloc(sizeof(struct accessory_state), GFP_KERNEL);
+        if(!accessory_states[i]){
+            goto setup_accessory_error0;
+        }
+
+        struct accessory_state* state = accessory_states[i];
+        state->minor = i;
+        spin_lock_init(&state->lock);
+        INIT_LIST_HEAD(&state->filled);
+        INIT_LIST_HEAD(&state->idle);
+        init_waitqueue_head(&state->wait);
+        mutex_init(&state->read_lock);
+        mutex_init(&state->write_lock);
+    }
+
+    if(alloc_chrdev_region(&accessory_device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, "android_accessories") < 0){
+        printk("aoa_hid_driver - accessory_device_nr could not be allocated\n");
+        goto setup_accessory_error0;
+    }
+
+    if(!(accessory_device_class = class_create("android_accessory"))){
+        printk("aoa_hid_driver - Error creating class for android accessory");
+        goto setup_accessory_error1;
+    }
+
+    cdev_init(&accessory_device, &fops);
+    if(cdev_add(&accessory_device, accessory_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES)){
+        printk("aoa_hid_driver - Error adding accessory device\n");
+        goto setup_accessory_error2;
+    }
+
+    return 0;
+
+setup_accessory_error2:
+    class_destroy(accessory_device_class);
+
+setup_accessory_error1:
+    unregister_chrdev_region(accessory_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+
+setup_accessory_error0:
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(accessory_states[i]){
+            kfree(accessory_states[i]);
+        }
+    }
+
+    return -1;
+}
+
+void cleanup_accessory(void){
+    cdev_del(&accessory_device);
+    class_destroy(accessory_device_class);
+    unregister_chrdev_region(accessory_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        kfree(accessory_states[i]);
+    }
+}
+
+int add_accessory_device(int minor){
+    struct accessory_device* dev = get_accessory_device(minor);
+    if(!dev){
+        return -1;
+    }
+
+    // Only phones whose accessory mode product id has the bulk endpoints get a data channel
+    bool has_bulk_endpoints = dev->bulk_in_address && dev->bulk_out_address;
+    put_accessory_device(dev);
+    if(!has_bulk_endpoints){
+        return 0;
+    }
+
+    if(device_create(accessory_device_class, NULL, accessory_device_nr + minor, NULL, "android_accessory%d", minor)==NULL){
+        printk("aoa_hid_driver - Can not create device file for minor %d\n", minor);
+        goto add_accessory_device_error0;
+    }
+
+    return 0;
+
+add_accessory_device_error0:
+    return -1;
+}
+
+void remove_accessory_device(int minor){
+    // The urbs of an open file have already been killed with the rest of the phone's urbs, this only wakes the waiters
+    wake_up_interruptible(&accessory_states[minor]->wait);
+    device_destroy(accessory_device_class, accessory_device_nr + minor);
+}
+
+static ssize_t accessory_read_iter(struct kiocb* iocb, struct iov_iter* to){
+    struct file* File = iocb->ki_filp;
+    struct accessory_state* state = accessory_states[iminor(file_inode(File))];
+    bool nonblock = (File->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    ssize_t copied = 0;
+
+    if(mutex_lock_interruptible(&state->read_lock)){
+        return -ERESTARTSYS;
+    }
+
+    while(iov_iter_count(to)){
+        unsigned long flags;
+        spin_lock_irqsave(&state->lock, flags);
+        struct accessory_buffer* buffer = list_first_entry_or_null(&state->filled, struct accessory_buffer, list);
+        int error = state->in_error;
+        spin_unlock_irqrestore(&state->lock, flags);
+
+        if(!buffer){
+            // Return what is there instead of waiting for more
+            if(copied){
+                break;
+            }
+            if(error){
+                copied = error;
+                break;
+            }
+            if(READ_ONCE(state->dev->disconnected)){
+                copied = -ENODEV;
+                break;
+            }
+            if(nonblock){
+                copied = -EAGAIN;
+                break;
+            }
+            if(wait_event_interruptible(state->wait, !list_empty(&state->filled) || READ_ONCE(state->in_error) || READ_ONCE(state->dev->disconnected))){
+                copied = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        // Only this reader removes buffers from filled, so buffer stays valid without the lock
+        size_t available = buffer->urb->actual_length - buffer->offset;
+        size_t n = copy_to_iter((char*)buffer->urb->transfer_buffer + buffer->offset, available, to);
+        if(n == 0 && available){
+            copied = copied ? copied : -EFAULT;
+            break;
+        }
+        buffer->offset += n;
+        copied += n;
+
+        if(buffer->offset == buffer->urb->actual_length){
+            spin_lock_irqsave(&state->lock, flags);
+            list_del(&buffer->list);
+            spin_unlock_irqrestore(&state->lock, flags);
+
+            buffer->offset = 0;
+            int ret = submit_accessory_urb(state->dev, buffer->urb);
+            if(ret){
+                spin_lock_irqsave(&state->lock, flags);
+                if(!state->in_error){
+                    state->in_error = ret;
+                }
+                spin_unlock_irqrestore(&state->lock, flags);
+            }
+        }
+    }
+
+    mutex_unlock(&state->read_lock);
+    return copied;
+}
+
+static ssize_t accessory_write_iter(struct kiocb* iocb, struct iov_iter* from){
+    struct file* File = iocb->ki_filp;
+    struct accessory_state* state = accessory_states[iminor(file_inode(File))];
+    bool nonblock = (File->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    ssize_t written = 0;
+
+    if(mutex_lock_interruptible(&state->write_lock)){
+        return -ERESTARTSYS;
+    }
+
+    while(iov_iter_count(from)){
+        unsigned long flags;
+        spin_lock_irqsave(&state->lock, flags);
+        struct accessory_buffer* buffer = list_first_entry_or_null(&state->idle, struct accessory_buffer, list);
+        if(buffer){
+            list_del(&buffer->list);
+        }
+        // An error of an earlier asynchronous write is reported once, by the next write
+        int error = state->out_error;
+        state->out_error = 0;
+        spin_unlock_irqrestore(&state->lock, flags);
+
+        if(error){
+            if(buffer){
+                spin_lock_irqsave(&state->lock, flags);
+                list_add(&buffer->list, &state->idle);
+                spin_unlock_irqrestore(&state->lock, flags);
+            }
+            written = written ? written : error;
+            break;
+        }
+
+        if(!buffer){
+            if(READ_ONCE(state->dev->disconnected)){
+                written = written ? written : -ENODEV;
+                break;
+            }
+            if(nonblock){
+                written = written ? written : -EAGAIN;
+                break;
+            }
+            if(wait_event_interruptible(state->wait, count_idle_buffers(state) || READ_ONCE(state->out_error) || READ_ONCE(state->dev->disconnected))){
+                written = written ? written : -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        size_t n = copy_from_iter(buffer->urb->transfer_buffer, ACCESSORY_BUFFER_SIZE, from);
+        int ret = n ? 0 : -EFAULT;
+        if(n){
+            buffer->urb->transfer_buffer_length = n;
+            ret = submit_accessory_urb(state->dev, buffer->urb);
+        }
+
+        if(ret){
+            spin_lock_irqsave(&state->lock, flags);
+            list_add(&buffer->list, &state->idle);
+            spin_unlock_irqrestore(&state->lock, flags);
+            written = written ? written : ret;
+            break;
+        }
+        written += n;
+    }
+
+    mutex_unlock(&state->write_lock);
+    return written;
+}
+
+static __poll_t accessory_poll(struct file* File, poll_table* wait){
+    struct accessory_state* state = accessory_states[iminor(file_inode(File))];
+    __poll_t mask = 0;
+
+    poll_wait(File, &state->wait, wait);
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    if(!list_empty(&state->filled)){
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if(!list_empty(&state->idle)){
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    if(state->in_error || state->out_error){
+        mask |= EPOLLERR;
+    }
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    if(READ_ONCE(state->dev->disconnected)){
+        mask |= EPOLLHUP;
+    }
+
+    return mask;
+}
+
+static int accessory_fsync(struct file* File, loff_t start, loff_t end, int datasync){
+    struct accessory_state* state = accessory_states[iminor(file_inode(File))];
+    return wait_accessory_writes(state, MAX_SCHEDULE_TIMEOUT);
+}
+
+static int accessory_flush(struct file* File, fl_owner_t id){
+    struct accessory_state* state = accessory_states[iminor(file_inode(File))];
+    // close() reports errors of writes that were still in flight, a signal or an app that stopped reading stops waiting for them
+    return wait_accessory_writes(state, msecs_to_jiffies(ACCESSORY_FLUSH_TIMEOUT_MS));
+}
+
+static int wait_accessory_writes(struct accessory_state* state, long timeout){
+    long remaining = wait_event_interruptible_timeout(state->wait, count_idle_buffers(state) == ACCESSORY_URBS_PER_DIRECTION || READ_ONCE(state->dev->disconnected), timeout);
+    if(remaining < 0){
+        return -ERESTARTSYS;
+    }
+
+    if(!remaining){
+        printk("aoa_hid_driver - Error waiting for accessory writes on minor %d, the app did not read them in time, discarding them\n", state->minor);
+        for(int i=0; i<ACCESSORY_URBS_PER_DIRECTION; i++){
+            usb_kill_urb(state->out_buffers[i].urb);
+        }
+
+        // Killing the urbs set out_error, the timeout is the error to report
+        unsigned long flags;
+        spin_lock_irqsave(&state->lock, flags);
+        state->out_error = 0;
+        spin_unlock_irqrestore(&state->lock, flags);
+        return -ETIMEDOUT;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    int error = state->out_error;
+    state->out_error = 0;
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    if(!error && count_idle_buffers(state) != ACCESSORY_URBS_PER_DIRECTION){
+        return -ENODEV;
+    }
+
+    return error;
+}
+
+static int count_idle_buffers(struct accessory_state* state){
+    int count = 0;
+    struct accessory_buffer* buffer;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    list_for_each_entry(buffer, &state->idle, list){
+        count++;
+    }
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    return count;
+}
+
+static int alloc_accessory_buffers(struct accessory_state* state){
+    struct usb_device* usb_dev = state->dev->usb_dev;
+
+    for(int i=0; i<ACCESSORY_URBS_PER_DIRECTION; i++){
+        struct accessory_buffer* in = &state->in_buffers[i];
+        struct accessory_buffer* out = &state->out_buffers[i];
+        in->state = state;
+        out->state = state;
+
+        in->urb = usb_alloc_urb(0, GFP_KERNEL);
+        out->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if(!in->urb || !out->urb){
+            return -ENOMEM;
+        }
+
+        void* in_data = kmalloc(ACCESSORY_BUFFER_SIZE, GFP_KERNEL);
+        if(!in_data){
+            return -ENOMEM;
+        }
+        usb_fill_bulk_urb(in->urb, usb_dev, usb_rcvbulkpipe(usb_dev, state->dev->bulk_in_address), in_data, ACCESSORY_BUFFER_SIZE, accessory_in_complete, in);
+
+        void* out_data = kmalloc(ACCESSORY_BUFFER_SIZE, GFP_KERNEL);
+        if(!out_data){
+            return -ENOMEM;
+        }
+        usb_fill_bulk_urb(out->urb, usb_dev, usb_sndbulkpipe(usb_dev, state->dev->bulk_out_address), out_data, ACCESSORY_BUFFER_SIZE, accessory_out_complete, out);
+        // Every write ends with a short packet so that the app on the phone sees where it ends
+        out->urb->transfer_flags |= URB_ZERO_PACKET;
+        list_add_tail(&out->list, &state->idle);
+    }
+
+    return 0;
+}
+
+static void free_accessory_buffers(struct accessory_state* state){
+    for(int i=0; i<ACCESSORY_URBS_PER_DIRECTION; i++){
+        struct accessory_buffer* buffers[] = {&state->in_buffers[i], &state->out_buffers[i]};
+        for(int j=0; j<2; j++){
+            if(buffers[j]->urb){
+                usb_kill_urb(buffers[j]->urb);
+                kfree(buffers[j]->urb->transfer_buffer);
+                usb_free_urb(buffers[j]->urb);
+                buffers[j]->urb = NULL;
+            }
+            buffers[j]->offset = 0;
+        }
+    }
+
+    INIT_LIST_HEAD(&state->filled);
+    INIT_LIST_HEAD(&state->idle);
+    state->in_error = 0;
+    state->out_error = 0;
+}
+
+static void accessory_in_complete(struct urb* urb){
+    struct accessory_buffer* buffer = urb->context;
+    struct accessory_state* state = buffer->state;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    if(urb->status == 0){
+        buffer->offset = 0;
+        list_add_tail(&buffer->list, &state->filled);
+    }
+    else if(urb->status != -ENOENT && urb->status != -ECONNRESET && urb->status != -ESHUTDOWN){
+        // The buffer is not resubmitted, reads return what was received before and then the error
+        if(!state->in_error){
+            state->in_error = urb->status;
+        }
+    }
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    wake_up_interruptible(&state->wait);
+}
+
+static void accessory_out_complete(struct urb* urb){
+    struct accessory_buffer* buffer = urb->context;
+    struct accessory_state* state = buffer->state;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    if(urb->status && !state->out_error){
+        // Urbs are only unlinked when the phone is unplugged or the file is closed
+        bool unlinked = urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN;
+        state->out_error = unlinked ? -ENODEV : urb->status;
+    }
+    list_add_tail(&buffer->list, &state->idle);
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    wake_up_interruptible(&state->wait);
+}
+
+static int driver_open(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+    struct accessory_state* state = accessory_states[minor];
+
+    if(atomic_cmpxchg((atomic_t*)&file_is_open[minor], 0, 1)){
+        printk("aoa_hid_driver - Error opening accessory device, device is already open\n");
+        return -EBUSY;
+    }
+
+    state->dev = get_accessory_device(minor);
+    if(!state->dev){
+        goto driver_open_error0;
+    }
+
+    if(alloc_accessory_buffers(state)){
+        printk("aoa_hid_driver - Error allocating buffers for accessory device\n");
+        goto driver_open_error1;
+    }
+
+    // Reading starts right away so that data from the phone is already waiting when read is called
+    for(int i=0; i<ACCESSORY_URBS_PER_DIRECTION; i++){
+        if(submit_accessory_urb(state->dev, state->in_buffers[i].urb)){
+            goto driver_open_error1;
+        }
+    }
+
+    return 0;
+
+driver_open_error1:
+    free_accessory_buffers(state);
+    put_accessory_device(state->dev);
+    state->dev = NULL;
+
+driver_open_error0:
+    atomic_set((atomic_t*)&file_is_open[minor], 0);
+    return -ENODEV;
+}
+
+static int driver_close(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+    struct accessory_state* state = accessory_states[minor];
+
+    free_accessory_buffers(state);
+    put_accessory_device(state->dev);
+    state->dev = NULL;
+
+    if(!atomic_cmpxchg((atomic_t*)&file_is_open[minor], 1, 0)){
+        printk("aoa_hid_driver - Error closing accessory device, device is already closed\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
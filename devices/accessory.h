@@ -0,0 +1,13 @@
+#ifndef ACCESSORY_H
+#define ACCESSORY_H
+
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+
+int setup_accessory(void);
+void cleanup_accessory(void);
+
+int add_accessory_device(int minor);
+void remove_accessory_device(int minor);
+
+#endif
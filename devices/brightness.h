@@ -1,13 +1,8 @@
 #ifndef BRIGHTNESS_H
 #define BRIGHTNESS_H
 
-#include <linux/uaccess.h>
-#include <linux/cdev.h>
+#include "function.h"
 
-int setup_brightness(void);
-void cleanup_brightness(void);
+extern const struct hid_function brightness_function;
 
-int add_brightness_device(int minor);
-void remove_brightness_device(int minor);
-
-#endif
\ No newline at end of file
+#endif
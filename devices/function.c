@@ -0,0 +1,424 @@
+#include "function.h"
+#include "keyboard.h"
+#include "mouse.h"
+#include "volume.h"
+#include "brightness.h"
+#include "gamepad.h"
+#include "../usb.h"
+#include "../transfer.h"
+#include "../completion_channel.h"
+#include "../reattach.h"
+#include "../aoa_hid_driver.h"
+
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+static const struct hid_function* hid_functions[] = {
+    &keyboard_function,
+    &mouse_function,
+    &volume_function,
+    &brightness_function,
+    &gamepad_function,
+};
+
+#define NUM_HID_FUNCTIONS ARRAY_SIZE(hid_functions)
+
+// State of the device file of a function for one phone
+struct function_device {
+    const struct hid_function* function;
+    int minor;
+    unsigned int file_is_open;
+    // Serializes writes, they share the buffers below
+    struct mutex lock;
+    u8* write;
+    u8 reports[HID_FUNCTION_MAX_REPORTS * AOA_HID_MAX_REPORT_SIZE];
+    struct completion_channel completions;
+    bool completions_allocated;
+};
+
+// Device files of a function for all phones, a chrdev region and class per function like the modules of their own
+struct function_class {
+    const struct hid_function* function;
+    char* region_name;
+    char* class_name;
+    dev_t device_nr;
+    struct cdev cdev;
+    struct class* class;
+    struct function_device* devices[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+};
+
+/*
+    Forward declarations for private functions for this function.c file
+*/
+static ssize_t function_read(struct file* File, char* user_buffer, size_t count, loff_t* offs);
+static ssize_t function_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs);
+static __poll_t function_poll(struct file* File, poll_table* wait);
+static long function_ioctl(struct file* File, unsigned int cmd, unsigned long arg);
+static int driver_open(struct inode* device_file, struct file* instance);
+static int driver_close(struct inode* device_file, struct file* instance);
+static int setup_function_class(struct function_class* function_class, const struct hid_function* function);
+static void cleanup_function_class(struct function_class* function_class);
+static void free_function_devices(struct function_class* function_class);
+static int send_function_reports(struct function_device* device, int num_reports);
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = driver_open,
+    .release = driver_close,
+    .read = function_read,
+    .write = function_write,
+    .poll = function_poll,
+    .unlocked_ioctl = function_ioctl
+};
+
+static struct function_class function_classes[NUM_HID_FUNCTIONS];
+
+int get_num_hid_functions(void){
+    return NUM_HID_FUNCTIONS;
+}
+
+const struct hid_function* get_hid_function(int index){
+    return hid_functions[index];
+}
+
+const struct hid_function* get_first_hid_function(u8 report_id){
+    for(int i=0; i<NUM_HID_FUNCTIONS; i++){
+        if(hid_functions[i]->report_id == report_id){
+            return hid_functions[i];
+        }
+    }
+
+    return NULL;
+}
+
+int get_report_class(u8 report_id){
+    const struct hid_function* function = get_first_hid_function(report_id);
+    return function ? function->transfer_class : TRANSFER_CLASS_BULK;
+}
+
+void send_release_report(int minor, const struct hid_function* function){
+    u8 report[AOA_HID_MAX_REPORT_SIZE];
+
+    if(function->encode_release){
+        function->encode_release(function, report);
+    }
+    else{
+        memset(report, 0, function->report_size);
+        report[0] = function->report_id;
+    }
+
+    send_hid_event_atomic(minor, (const char*)report, function->report_size, NULL, NULL);
+}
+
+void send_release_reports(int minor){
+    for(int i=0; i<NUM_HID_FUNCTIONS; i++){
+        // Functions sharing a report ID share the release report as well
+        if(get_first_hid_function(hid_functions[i]->report_id) == hid_functions[i]){
+            send_release_report(minor, hid_functions[i]);
+        }
+    }
+}
+
+int setup_functions(void){
+    int i;
+    for(i=0; i<NUM_HID_FUNCTIONS; i++){
+        function_classes[i].function = hid_functions[i];
+        if(!hid_functions[i]->parse_write){
+            continue;
+        }
+
+        if(setup_function_class(&function_classes[i], hid_functions[i])){
+            printk("aoa_hid_driver - Error setting up %s\n", hid_functions[i]->name);
+            goto setup_functions_error0;
+        }
+    }
+
+    return 0;
+
+setup_functions_error0:
+    while(--i >= 0){
+        if(hid_functions[i]->parse_write){
+            cleanup_function_class(&function_classes[i]);
+        }
+    }
+
+    return -1;
+}
+
+void cleanup_functions(void){
+    for(int i=NUM_HID_FUNCTIONS-1; i>=0; i--){
+        if(hid_functions[i]->parse_write){
+            cleanup_function_class(&function_classes[i]);
+        }
+    }
+}
+
+int add_function_devices(int minor){
+    int i;
+    for(i=0; i<NUM_HID_FUNCTIONS; i++){
+        struct function_class* function_class = &function_classes[i];
+        if(!hid_functions[i]->parse_write){
+            continue;
+        }
+
+        if(device_create(function_class->class, NULL, function_class->device_nr + minor, NULL, "android_%s%d", hid_functions[i]->name, minor)==NULL){
+            printk("aoa_hid_driver - Can not create %s device file for minor %d\n", hid_functions[i]->name, minor);
+            goto add_function_devices_error0;
+        }
+    }
+
+    return 0;
+
+add_function_devices_error0:
+    while(--i >= 0){
+        if(hid_functions[i]->parse_write){
+            device_destroy(function_classes[i].class, function_classes[i].device_nr + minor);
+        }
+    }
+
+    return -1;
+}
+
+void detach_function_devices(int minor){
+    for(int i=0; i<NUM_HID_FUNCTIONS; i++){
+        struct function_class* function_class = &function_classes[i];
+        if(!hid_functions[i]->parse_write){
+            continue;
+        }
+
+        disconnect_completion_channel(&function_class->devices[minor]->completions);
+    }
+}
+
+void remove_function_devices(int minor){
+    detach_function_devices(minor);
+    for(int i=0; i<NUM_HID_FUNCTIONS; i++){
+        if(hid_functions[i]->parse_write){
+            device_destroy(function_classes[i].class, function_classes[i].device_nr + minor);
+        }
+    }
+}
+
+static int setup_function_class(struct function_class* function_class, const struct hid_function* function){
+    const char* name = function->name;
+
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        struct function_device* device = kzalloc(sizeof(struct function_device), GFP_KERNEL);
+        function_class->devices[i] = device;
+        if(!device){
+            goto setup_function_class_error0;
+        }
+
+        device->function = function;
+        device->minor = i;
+        mutex_init(&device->lock);
+        device->write = kmalloc(function->write_size, GFP_KERNEL);
+        if(!device->write){
+            goto setup_function_class_error0;
+        }
+
+        if(alloc_completion_channel(&device->completions, i)){
+            goto setup_function_class_error0;
+        }
+        device->completions_allocated = true;
+    }
+
+    // Same names as the modules that used to create these files, android_mouses for the region and android_mouse for the class
+    function_class->region_name = kasprintf(GFP_KERNEL, "android_%ss", name);
+    function_class->class_name = kasprintf(GFP_KERNEL, "android_%s", name);
+    if(!function_class->region_name || !function_class->class_name){
+        goto setup_function_class_error1;
+    }
+
+    if(alloc_chrdev_region(&function_class->device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, function_class->region_name) < 0){
+        printk("aoa_hid_driver - %s device_nr could not be allocated\n", name);
+        goto setup_function_class_error1;
+    }
+
+    if(!(function_class->class = class_create(function_class->class_name))){
+        printk("aoa_hid_driver - Error creating class for android %s\n", name);
+        goto setup_function_class_error2;
+    }
+
+    cdev_init(&function_class->cdev, &fops);
+    if(cdev_add(&function_class->cdev, function_class->device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES)){
+        printk("aoa_hid_driver - Error adding %s device\n", name);
+        goto setup_function_class_error3;
+    }
+
+    return 0;
+
+setup_function_class_error3:
+    class_destroy(function_class->class);
+
+setup_function_class_error2:
+    unregister_chrdev_region(function_class->device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+
+setup_function_class_error1:
+    kfree(function_class->region_name);
+    kfree(function_class->class_name);
+
+setup_function_class_error0:
+    free_function_devices(function_class);
+
+    return -1;
+}
+
+static void cleanup_function_class(struct function_class* function_class){
+    cdev_del(&function_class->cdev);
+    class_destroy(function_class->class);
+    unregister_chrdev_region(function_class->device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+    kfree(function_class->region_name);
+    kfree(function_class->class_name);
+    free_function_devices(function_class);
+}
+
+static void free_function_devices(struct function_class* function_class){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        struct function_device* device = function_class->devices[i];
+        if(!device){
+            continue;
+        }
+
+        if(device->completions_allocated){
+            free_completion_channel(&device->completions);
+        }
+        kfree(device->write);
+        kfree(device);
+        function_class->devices[i] = NULL;
+    }
+}
+
+static ssize_t function_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs){
+    struct function_device* device = File->private_data;
+    const struct hid_function* function = device->function;
+
+    struct completion_ticket ticket;
+    begin_completion(&device->completions, &ticket);
+
+    int ret = -EINVAL;
+    if(count != function->write_size && (!function->short_write_size || count != function->short_write_size)){
+        printk("aoa_hid_driver - Error writing to %s device, a write has to be %d bytes: %s\n", function->name, (int)function->write_size, function->write_format);
+        goto function_write_error0;
+    }
+
+    ret = wait_for_reattach(device->minor, File->f_flags & O_NONBLOCK);
+    if(ret){
+        goto function_write_error0;
+    }
+
+    ret = -ERESTARTSYS;
+    if(mutex_lock_interruptible(&device->lock)){
+        goto function_write_error0;
+    }
+
+    ret = -EFAULT;
+    if(copy_from_user(device->write, user_buffer, count)){
+        goto function_write_exit;
+    }
+    memset(device->write + count, 0, function->write_size - count);
+
+    int num_reports = function->parse_write(function, device->write, device->reports);
+    if(num_reports < 0){
+        printk("aoa_hid_driver - Error writing to %s device, a write has to be %d bytes: %s\n", function->name, (int)function->write_size, function->write_format);
+        ret = num_reports;
+        goto function_write_exit;
+    }
+
+    // Shaped writers that must not block find out before anything is sent, so a press never goes out without its release
+    if((File->f_flags & O_NONBLOCK) && !has_transfer_tokens(device->minor, function->transfer_class, num_reports)){
+        ret = -EAGAIN;
+        goto function_write_exit;
+    }
+
+    ret = send_function_reports(device, num_reports);
+
+function_write_exit:
+    mutex_unlock(&device->lock);
+
+function_write_error0:
+    // The write has its record already, a restarted write would get a second one
+    if(ret == -ERESTARTSYS){
+        ret = -EINTR;
+    }
+    end_completion(&device->completions, &ticket, ret);
+    return ret ? ret : count;
+}
+
+static int send_function_reports(struct function_device* device, int num_reports){
+    const struct hid_function* function = device->function;
+
+    for(int i=0; i<num_reports; i++){
+        if(i > 0 && function->paced){
+            wait_hid_event_gap(device->minor);
+        }
+
+        int ret = send_hid_event(device->minor, (char*)device->reports + i * function->report_size, function->report_size);
+        if(ret){
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t function_read(struct file* File, char* user_buffer, size_t count, loff_t* offs){
+    struct function_device* device = File->private_data;
+    return read_completions(&device->completions, File, user_buffer, count);
+}
+
+static __poll_t function_poll(struct file* File, poll_table* wait){
+    struct function_device* device = File->private_data;
+    return poll_completions(&device->completions, File, wait) | EPOLLOUT | EPOLLWRNORM;
+}
+
+static long function_ioctl(struct file* File, unsigned int cmd, unsigned long arg){
+    struct function_device* device = File->private_data;
+
+    switch(cmd){
+        case AOA_HID_IOCTL_CANCEL:
+            // Writes are sent synchronously, so nothing is queued and only a press without its release can be left over
+            send_release_report(device->minor, device->function);
+            return 0;
+        default:
+            return completion_ioctl(&device->completions, cmd, arg);
+    }
+}
+
+static int driver_open(struct inode* device_file, struct file* instance){
+    struct function_class* function_class = container_of(device_file->i_cdev, struct function_class, cdev);
+    struct function_device* device = function_class->devices[iminor(device_file)];
+
+    if(atomic_cmpxchg((atomic_t*)&device->file_is_open, 0, 1)){
+        printk("aoa_hid_driver - Error opening %s device, device is already open\n", device->function->name);
+        return -EBUSY;
+    }
+
+    instance->private_data = device;
+    reset_completion_channel(&device->completions);
+
+    return 0;
+}
+
+static int driver_close(struct inode* device_file, struct file* instance){
+    struct function_device* device = instance->private_data;
+
+    if(!atomic_cmpxchg((atomic_t*)&device->file_is_open, 1, 0)){
+        printk("aoa_hid_driver - Error closing %s device, device is already closed\n", device->function->name);
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+int parse_step_write(const struct hid_function* function, const u8* write, u8* reports){
+    const u16* usages = function->data;
+    u16 usage;
+    if(get_step_usage(write[0], usages[0], usages[1], &usage)){
+        return -EINVAL;
+    }
+
+    encode_consumer_report(reports, usage);
+    encode_consumer_report(reports + function->report_size, 0x00);
+    return 2;
+}
@@ -0,0 +1,57 @@
+#ifndef FUNCTION_H
+#define FUNCTION_H
+
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+#include "../reports.h"
+#include "../transfer.h"
+
+// Most reports a single write can turn into, a press and its release for most functions
+#define HID_FUNCTION_MAX_REPORTS 4
+
+/*
+    A HID function is a kind of input the phone sees, with its collection in the HID descriptor and a device file per phone
+    Functions with a write parser get their device files from function.c, which copies the write, encodes it with the parser and
+    sends the reports. Functions whose writes need more than that, like the keyboard typing in the background, have a module of
+    their own and only contribute their collection here.
+*/
+struct hid_function {
+    const char* name;                                   // Device files are /dev/android_<name>N
+    u8 report_id;
+    u16 report_size;                                    // Including the report ID, checked against the collection at setup
+    const struct report_descriptor* descriptor;         // Shared by functions with the same report ID
+    int transfer_class;                                 // TRANSFER_CLASS_* of the reports
+    size_t write_size;
+    size_t short_write_size;                            // Also accepted and zero extended to write_size, 0 when there is none
+    const char* write_format;                           // Describes a valid write for the error message of an invalid one
+    // Encodes a write into reports of report_size bytes each, returns how many or -EINVAL for an invalid write
+    int (*parse_write)(const struct hid_function* function, const u8* write, u8* reports);
+    // Waits for the pacing gap between reports, phones miss releases sent right after the press of a consumer control
+    bool paced;
+    const void* data;                                   // For the parser, for example the usages of volume and brightness
+    // Encodes the report with nothing pressed, a report of zeros after the report ID when NULL
+    void (*encode_release)(const struct hid_function* function, u8* report);
+};
+
+// Registered functions in the order of their collections in the descriptor
+int get_num_hid_functions(void);
+const struct hid_function* get_hid_function(int index);
+// The function whose collection declares the report ID
+const struct hid_function* get_first_hid_function(u8 report_id);
+// Sends the report with nothing pressed for the function, or for every function, without waiting for tokens or their turn
+void send_release_report(int minor, const struct hid_function* function);
+void send_release_reports(int minor);
+// Transmission class of reports with the report ID, TRANSFER_CLASS_BULK for report IDs of no function
+int get_report_class(u8 report_id);
+
+// Parser for a single byte write of 0x01 or 0xFF, pressing and releasing the usage in data[0] or data[1], which are u16
+int parse_step_write(const struct hid_function* function, const u8* write, u8* reports);
+
+int setup_functions(void);
+void cleanup_functions(void);
+
+int add_function_devices(int minor);
+void detach_function_devices(int minor);
+void remove_function_devices(int minor);
+
+#endif
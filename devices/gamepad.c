@@ -0,0 +1,446 @@
+#include "gamepad.h"
+#include "../usb.h"
+#include "../transfer.h"
+#include "../reattach.h"
+#include "../reports.h"
+#include "../aoa_hid_driver.h"
+
+#include <linux/hrtimer.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+
+#define GAMEPAD_DEFAULT_RATE_HZ 125
+#define GAMEPAD_MAX_RATE_HZ 1000
+
+struct gamepad_state {
+    int minor;
+    // Protects everything below, the flush hrtimer takes it from interrupt context
+    spinlock_t lock;
+    // Latest snapshot written and the snapshot the phone last got, dirty while they differ
+    struct aoa_hid_gamepad_state pending;
+    struct aoa_hid_gamepad_state sent;
+    bool dirty;
+    bool flush_scheduled;
+    // Snapshot of the report on the bus, it only becomes sent once all its transfers completed, later snapshots are coalesced meanwhile
+    struct aoa_hid_gamepad_state sending;
+    u32 in_flight;
+    // Earliest time the next report may be sent
+    ktime_t next_flush;
+    u64 interval_ns;
+    struct hrtimer flush_timer;
+    wait_queue_head_t wait;
+};
+
+/*
+    Forward declarations for private functions for this gamepad.c file
+*/
+static ssize_t gamepad_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs);
+static __poll_t gamepad_poll(struct file* File, poll_table* wait);
+static long gamepad_ioctl(struct file* File, unsigned int cmd, unsigned long arg);
+static int driver_open(struct inode* device_file, struct file* instance);
+static int driver_close(struct inode* device_file, struct file* instance);
+static int update_gamepad_state(struct gamepad_state* state, const struct aoa_hid_gamepad_state* snapshot, bool nonblock);
+static bool has_unsent_buttons(struct gamepad_state* state);
+static bool same_buttons(const struct aoa_hid_gamepad_state* a, const struct aoa_hid_gamepad_state* b);
+static bool same_gamepad_state(const struct aoa_hid_gamepad_state* a, const struct aoa_hid_gamepad_state* b);
+static void reset_gamepad_state(struct gamepad_state* state);
+static enum hrtimer_restart flush_timer_callback(struct hrtimer* timer);
+static void gamepad_report_complete(void* context, int status);
+static void put_gamepad_report(struct gamepad_state* state);
+static void encode_gamepad_release(const struct hid_function* function, u8* report);
+
+const struct hid_function gamepad_function = {
+    .name = "gamepad",
+    .report_id = GAMEPAD_REPORT_ID,
+    .report_size = GAMEPAD_REPORT_SIZE,
+    .descriptor = &gamepad_report_descriptor,
+    .transfer_class = TRANSFER_CLASS_POINTER,
+    .encode_release = encode_gamepad_release
+};
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = driver_open,
+    .release = driver_close,
+    .write = gamepad_write,
+    .poll = gamepad_poll,
+    .unlocked_ioctl = gamepad_ioctl
+};
+
+static dev_t gamepad_device_nr;
+static struct cdev gamepad_device;
+static struct class* gamepad_device_class;
+
+static unsigned int file_is_open[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static struct gamepad_state* gamepad_states[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+
+int setup_gamepad(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        gamepad_states[i] = NULL;
+        file_is_open[i] = 0;
+    }
+
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        gamepad_states[i] = kzalloc(sizeof(struct gamepad_state), GFP_KERNEL);
+        if(!gamepad_states[i]){
+            goto setup_gamepad_error0;
+        }
+
+        struct gamepad_state* state = gamepad_states[i];
+        state->minor = i;
+        spin_lock_init(&state->lock);
+        init_waitqueue_head(&state->wait);
+        hrtimer_setup(&state->flush_timer, flush_timer_callback, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        state->interval_ns = NSEC_PER_SEC / GAMEPAD_DEFAULT_RATE_HZ;
+        reset_gamepad_state(state);
+    }
+
+    if(alloc_chrdev_region(&gamepad_device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, "android_gamepads") < 0){
+        printk("aoa_hid_driver - gamepad_device_nr could not be allocated\n");
+        goto setup_gamepad_error0;
+    }
+
+    if(!(gamepad_device_class = class_create("android_gamepad"))){
+        printk("aoa_hid_driver - Error creating class for android gamepad");
+        goto setup_gamepad_error1;
+    }
+
+    cdev_init(&gamepad_device, &fops);
+    if(cdev_add(&gamepad_device, gamepad_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES)){
+        printk("aoa_hid_driver - Error adding gamepad device\n");
+        goto setup_gamepad_error2;
+    }
+
+    return 0;
+
+setup_gamepad_error2:
+    class_destroy(gamepad_device_class);
+
+setup_gamepad_error1:
+    unregister_chrdev_region(gamepad_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+
+setup_gamepad_error0:
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(gamepad_states[i]){
+            kfree(gamepad_states[i]);
+        }
+    }
+
+    return -1;
+}
+
+void cleanup_gamepad(void){
+    cdev_del(&gamepad_device);
+    class_destroy(gamepad_device_class);
+    unregister_chrdev_region(gamepad_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        hrtimer_cancel(&gamepad_states[i]->flush_timer);
+        kfree(gamepad_states[i]);
+    }
+}
+
+int add_gamepad_device(int minor){
+    // A newly attached phone starts out with everything released and centered
+    unsigned long flags;
+    spin_lock_irqsave(&gamepad_states[minor]->lock, flags);
+    reset_gamepad_state(gamepad_states[minor]);
+    spin_unlock_irqrestore(&gamepad_states[minor]->lock, flags);
+
+    if(device_create(gamepad_device_class, NULL, gamepad_device_nr + minor, NULL, "android_gamepad%d", minor)==NULL){
+        printk("aoa_hid_driver - Can not create device file for minor %d\n", minor);
+        goto add_gamepad_device_error0;
+    }
+
+    return 0;
+
+add_gamepad_device_error0:
+    return -1;
+}
+
+int cancel_gamepad_input(int minor){
+    struct gamepad_state* state = gamepad_states[minor];
+
+    hrtimer_cancel(&state->flush_timer);
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    int discarded = state->dirty ? 1 : 0;
+    // The phone is told about the neutral state by the release report that follows a cancel
+    reset_gamepad_state(state);
+    state->flush_scheduled = false;
+    spin_unlock_irqrestore(&state->lock, flags);
+    wake_up_interruptible(&state->wait);
+    wake_flush_waiters(minor);
+
+    return discarded;
+}
+
+bool has_pending_gamepad_input(int minor){
+    return READ_ONCE(gamepad_states[minor]->dirty);
+}
+
+void detach_gamepad_device(int minor){
+    struct gamepad_state* state = gamepad_states[minor];
+
+    hrtimer_cancel(&state->flush_timer);
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    state->dirty = false;
+    state->flush_scheduled = false;
+    spin_unlock_irqrestore(&state->lock, flags);
+    wake_up_interruptible(&state->wait);
+    wake_flush_waiters(minor);
+}
+
+void remove_gamepad_device(int minor){
+    detach_gamepad_device(minor);
+    device_destroy(gamepad_device_class, gamepad_device_nr + minor);
+}
+
+static ssize_t gamepad_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs){
+    if(count == 0 || count % sizeof(struct aoa_hid_gamepad_state)){
+        printk("aoa_hid_driver - Error writing to gamepad device, a write has to be a multiple of %d bytes but attempted to write %d bytes instead\n", (int)sizeof(struct aoa_hid_gamepad_state), (int)count);
+        return -EINVAL;
+    }
+
+    int minor = iminor(file_inode(File));
+    struct gamepad_state* state = gamepad_states[minor];
+
+    int ret = wait_for_reattach(minor, File->f_flags & O_NONBLOCK);
+    if(ret){
+        return ret;
+    }
+
+    if(get_transfer_health(minor) == TRANSFER_FAILED){
+        return -EIO;
+    }
+
+    size_t written = 0;
+    while(written < count){
+        struct aoa_hid_gamepad_state snapshot;
+        if(copy_from_user(&snapshot, user_buffer + written, sizeof(snapshot))){
+            return written ? written : -EFAULT;
+        }
+
+        if(snapshot.hat > AOA_HID_GAMEPAD_HAT_CENTERED){
+            printk("aoa_hid_driver - Error writing to gamepad device, hat has to be between 0 and %d but was %d\n", AOA_HID_GAMEPAD_HAT_CENTERED, (int)snapshot.hat);
+            return written ? written : -EINVAL;
+        }
+
+        ret = update_gamepad_state(state, &snapshot, File->f_flags & O_NONBLOCK);
+        if(ret){
+            return written ? written : ret;
+        }
+        written += sizeof(snapshot);
+    }
+
+    return written;
+}
+
+static __poll_t gamepad_poll(struct file* File, poll_table* wait){
+    int minor = iminor(file_inode(File));
+    struct gamepad_state* state = gamepad_states[minor];
+
+    poll_wait(File, &state->wait, wait);
+
+    // Conservative: a write that does not touch the buttons would not block either
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    bool writable = !has_unsent_buttons(state);
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    return writable ? EPOLLOUT | EPOLLWRNORM : 0;
+}
+
+static long gamepad_ioctl(struct file* File, unsigned int cmd, unsigned long arg){
+    int minor = iminor(file_inode(File));
+    struct gamepad_state* state = gamepad_states[minor];
+
+    switch(cmd){
+        case AOA_HID_IOCTL_GAMEPAD_SET_RATE: {
+            u32 rate_hz;
+            if(get_user(rate_hz, (u32 __user*)arg)){
+                return -EFAULT;
+            }
+            if(rate_hz == 0 || rate_hz > GAMEPAD_MAX_RATE_HZ){
+                return -EINVAL;
+            }
+
+            unsigned long flags;
+            spin_lock_irqsave(&state->lock, flags);
+            state->interval_ns = NSEC_PER_SEC / rate_hz;
+            spin_unlock_irqrestore(&state->lock, flags);
+            return 0;
+        }
+        case AOA_HID_IOCTL_CANCEL: {
+            int discarded = cancel_gamepad_input(minor);
+            send_release_report(minor, &gamepad_function);
+            return discarded;
+        }
+        case AOA_HID_IOCTL_CANCEL_PHONE:
+            return cancel_phone_input(minor);
+        case AOA_HID_IOCTL_FLUSH:
+            return flush_phone_input(minor);
+        default:
+            return -ENOTTY;
+    }
+}
+
+static int update_gamepad_state(struct gamepad_state* state, const struct aoa_hid_gamepad_state* snapshot, bool nonblock){
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+
+    // Axes may be coalesced, but a button press that the phone never saw would be lost completely
+    while(has_unsent_buttons(state) && !same_buttons(snapshot, &state->pending)){
+        spin_unlock_irqrestore(&state->lock, flags);
+
+        if(nonblock){
+            return -EAGAIN;
+        }
+
+        if(wait_event_interruptible(state->wait, !READ_ONCE(state->dirty) || !get_usb_device(state->minor))){
+            return -ERESTARTSYS;
+        }
+
+        if(!get_usb_device(state->minor)){
+            return -ENODEV;
+        }
+
+        spin_lock_irqsave(&state->lock, flags);
+    }
+
+    state->pending = *snapshot;
+    state->dirty = !same_gamepad_state(&state->pending, &state->sent);
+    // A report in flight schedules the next flush when it completes
+    if(state->dirty && !state->flush_scheduled && !state->in_flight){
+        ktime_t now = ktime_get();
+        state->flush_scheduled = true;
+        hrtimer_start(&state->flush_timer, ktime_after(state->next_flush, now) ? state->next_flush : now, HRTIMER_MODE_ABS);
+    }
+
+    spin_unlock_irqrestore(&state->lock, flags);
+    return 0;
+}
+
+// Must be called with state->lock held
+static bool has_unsent_buttons(struct gamepad_state* state){
+    return state->dirty && !same_buttons(&state->pending, &state->sent);
+}
+
+static bool same_buttons(const struct aoa_hid_gamepad_state* a, const struct aoa_hid_gamepad_state* b){
+    return a->buttons == b->buttons && a->hat == b->hat;
+}
+
+static bool same_gamepad_state(const struct aoa_hid_gamepad_state* a, const struct aoa_hid_gamepad_state* b){
+    return same_buttons(a, b) &&
+        a->left_x == b->left_x && a->left_y == b->left_y &&
+        a->right_x == b->right_x && a->right_y == b->right_y &&
+        a->left_trigger == b->left_trigger && a->right_trigger == b->right_trigger;
+}
+
+// Must be called with state->lock held, a report still in flight completes into the reset state
+static void reset_gamepad_state(struct gamepad_state* state){
+    memset(&state->sent, 0, sizeof(state->sent));
+    state->sent.hat = AOA_HID_GAMEPAD_HAT_CENTERED;
+    state->pending = state->sent;
+    state->sending = state->sent;
+    state->dirty = false;
+    state->next_flush = 0;
+}
+
+static enum hrtimer_restart flush_timer_callback(struct hrtimer* timer){
+    struct gamepad_state* state = container_of(timer, struct gamepad_state, flush_timer);
+    char report[GAMEPAD_REPORT_SIZE];
+    bool send = false;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    state->flush_scheduled = false;
+    // At most one report per gamepad is on the bus, a stalled phone can not pile up urbs
+    if(state->dirty && !state->in_flight){
+        encode_gamepad_report((u8*)report, &state->pending);
+        state->sending = state->pending;
+        // Held by this callback until it knows how many transfers the report took
+        state->in_flight = 1;
+        state->next_flush = ktime_add_ns(ktime_get(), state->interval_ns);
+        send = true;
+    }
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    if(send){
+        // Errors are left to the transfer health tracking, writes to a failed phone fail with -EIO
+        int transfers = send_hid_event_atomic(state->minor, report, GAMEPAD_REPORT_SIZE, gamepad_report_complete, state);
+
+        spin_lock_irqsave(&state->lock, flags);
+        state->in_flight += max(transfers, 0);
+        put_gamepad_report(state);
+        spin_unlock_irqrestore(&state->lock, flags);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+static void gamepad_report_complete(void* context, int status){
+    struct gamepad_state* state = context;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    put_gamepad_report(state);
+    spin_unlock_irqrestore(&state->lock, flags);
+}
+
+/*
+    Drops one transfer of the report in flight, must be called with state->lock held
+    The last one makes the report sent, also when it failed, and flushes what was coalesced meanwhile
+    A failed report is not resent, the phone's health decides whether further writes fail
+*/
+static void put_gamepad_report(struct gamepad_state* state){
+    if(--state->in_flight){
+        return;
+    }
+
+    state->sent = state->sending;
+    state->dirty = !same_gamepad_state(&state->pending, &state->sent);
+    if(state->dirty && !state->flush_scheduled && get_usb_device(state->minor)){
+        ktime_t now = ktime_get();
+        state->flush_scheduled = true;
+        hrtimer_start(&state->flush_timer, ktime_after(state->next_flush, now) ? state->next_flush : now, HRTIMER_MODE_ABS);
+    }
+
+    wake_up_interruptible(&state->wait);
+    wake_flush_waiters(state->minor);
+}
+
+// A zero hat would be pointing up
+static void encode_gamepad_release(const struct hid_function* function, u8* report){
+    struct aoa_hid_gamepad_state neutral = {
+        .hat = AOA_HID_GAMEPAD_HAT_CENTERED
+    };
+    encode_gamepad_report(report, &neutral);
+}
+
+static int driver_open(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    if(atomic_cmpxchg((atomic_t*)&file_is_open[minor], 0, 1)){
+        printk("aoa_hid_driver - Error opening gamepad device, device is already open\n");
+        return -EBUSY;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&gamepad_states[minor]->lock, flags);
+    gamepad_states[minor]->interval_ns = NSEC_PER_SEC / GAMEPAD_DEFAULT_RATE_HZ;
+    spin_unlock_irqrestore(&gamepad_states[minor]->lock, flags);
+
+    return 0;
+}
+
+static int driver_close(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    if(!atomic_cmpxchg((atomic_t*)&file_is_open[minor], 1, 0)){
+        printk("aoa_hid_driver - Error closing gamepad device, device is already closed\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef GAMEPAD_H
+#define GAMEPAD_H
+
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+#include "function.h"
+
+int setup_gamepad(void);
+void cleanup_gamepad(void);
+
+int add_gamepad_device(int minor);
+void detach_gamepad_device(int minor);
+void remove_gamepad_device(int minor);
+
+// Drops the snapshot that was not sent yet and forgets the state the phone has, returns 1 when a snapshot was dropped
+int cancel_gamepad_input(int minor);
+bool has_pending_gamepad_input(int minor);
+
+// Writes are handled by this module, the function only contributes the collection to the descriptor
+extern const struct hid_function gamepad_function;
+
+#endif
@@ -1,20 +1,81 @@
 #include "keyboard.h"
 #include "../usb.h"
+#include "../transfer.h"
+#include "../completion_channel.h"
+#include "../reattach.h"
+#include "../reports.h"
+#include "../aoa_hid_driver.h"
 
-#define MAX_ACCEPTED_WRITE_SIZE 32
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+
+// Characters written to the keyboard are queued here and typed by a work item, writes block while the ring is full
+#define KEYBOARD_RING_SIZE 4096
+// Writes that are queued but not typed completely yet, a writer blocks while this many are outstanding
+#define KEYBOARD_MAX_BATCHES 64
+
+// A write gets its completion record once the ring has been typed up to end
+struct keyboard_batch {
+    struct completion_ticket ticket;
+    u64 end;
+};
+
+struct keyboard_state {
+    int minor;
+    struct kfifo ring;
+    struct mutex write_lock;
+    wait_queue_head_t wait;
+    struct delayed_work work;
+    // Protects typing, which is true while the work item is scheduled or running
+    spinlock_t lock;
+    bool typing;
+    // True between sending the press and the release of a character
+    bool key_pressed;
+    // Keeps start_typing from queueing the work item while cancel_keyboard_input waits for it
+    bool cancelling;
+
+    // Also protected by lock: characters ever queued and ever typed, skipped or discarded, and the outstanding writes
+    u64 queued;
+    u64 typed;
+    int typing_error;
+    DECLARE_KFIFO(batches, struct keyboard_batch, KEYBOARD_MAX_BATCHES);
+    struct completion_channel completions;
+};
 
 /*
     Forward declarations for private functions for this keyboard.c file
 */
+static ssize_t keyboard_read(struct file* File, char* user_buffer, size_t count, loff_t* offs);
 static ssize_t keyboard_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs);
+static __poll_t keyboard_poll(struct file* File, poll_table* wait);
+static long keyboard_ioctl(struct file* File, unsigned int cmd, unsigned long arg);
 static int driver_open(struct inode* device_file, struct file* instance);
 static int driver_close(struct inode* device_file, struct file* instance);
+static void start_typing(struct keyboard_state* state);
+static void discard_typing(struct keyboard_state* state);
+static void keyboard_work(struct work_struct* work);
+static void finish_typed_characters(struct keyboard_state* state, u64 count, int status);
+static void complete_typed_batches(struct keyboard_state* state);
+static void discard_batches(struct keyboard_state* state, int status);
+
+const struct hid_function keyboard_function = {
+    .name = "keyboard",
+    .report_id = KEYBOARD_REPORT_ID,
+    .report_size = KEYBOARD_REPORT_SIZE,
+    .descriptor = &keyboard_report_descriptor,
+    .transfer_class = TRANSFER_CLASS_BULK
+};
 
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = driver_open,
     .release = driver_close,
-    .write = keyboard_write
+    .read = keyboard_read,
+    .write = keyboard_write,
+    .poll = keyboard_poll,
+    .unlocked_ioctl = keyboard_ioctl
 };
 
 static dev_t keyboard_device_nr;
@@ -22,20 +83,45 @@ static struct cdev keyboard_device;
 static struct class* keyboard_device_class;
 
 static unsigned int file_is_open[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
-static char buffer[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES][MAX_ACCEPTED_WRITE_SIZE];
+static struct keyboard_state* keyboard_states[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
 static char* keyboard_hid_events[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
 
 int setup_keyboard(void){
     for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        keyboard_states[i] = NULL;
         keyboard_hid_events[i] = NULL;
         file_is_open[i] = 0;
     }
 
     for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
-        keyboard_hid_events[i] = kmalloc(3, GFP_KERNEL);
+        keyboard_hid_events[i] = kmalloc(KEYBOARD_REPORT_SIZE, GFP_KERNEL);
         if(!keyboard_hid_events[i]){
             goto setup_keyboard_error0;
         }
+
+        keyboard_states[i] = kzalloc(sizeof(struct keyboard_state), GFP_KERNEL);
+        if(!keyboard_states[i]){
+            goto setup_keyboard_error0;
+        }
+
+        struct keyboard_state* state = keyboard_states[i];
+        if(kfifo_alloc(&state->ring, KEYBOARD_RING_SIZE, GFP_KERNEL)){
+            goto setup_keyboard_error0;
+        }
+
+        if(alloc_completion_channel(&state->completions, i)){
+            kfifo_free(&state->ring);
+            kfree(state);
+            keyboard_states[i] = NULL;
+            goto setup_keyboard_error0;
+        }
+
+        state->minor = i;
+        mutex_init(&state->write_lock);
+        spin_lock_init(&state->lock);
+        init_waitqueue_head(&state->wait);
+        INIT_DELAYED_WORK(&state->work, keyboard_work);
+        INIT_KFIFO(state->batches);
     }
 
     if(alloc_chrdev_region(&keyboard_device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, "android_keyboards") < 0){
@@ -67,6 +153,11 @@ setup_keyboard_error0:
         if(keyboard_hid_events[i]){
             kfree(keyboard_hid_events[i]);
         }
+        if(keyboard_states[i]){
+            kfifo_free(&keyboard_states[i]->ring);
+            free_completion_channel(&keyboard_states[i]->completions);
+            kfree(keyboard_states[i]);
+        }
     }
 
     return -1;
@@ -77,6 +168,10 @@ void cleanup_keyboard(void){
     class_destroy(keyboard_device_class);
     unregister_chrdev_region(keyboard_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
     for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        cancel_delayed_work_sync(&keyboard_states[i]->work);
+        kfifo_free(&keyboard_states[i]->ring);
+        free_completion_channel(&keyboard_states[i]->completions);
+        kfree(keyboard_states[i]);
         kfree(keyboard_hid_events[i]);
     }
 }
@@ -93,60 +188,318 @@ add_keyboard_device_error0:
     return -1;
 }
 
+int cancel_keyboard_input(int minor){
+    struct keyboard_state* state = keyboard_states[minor];
+
+    spin_lock(&state->lock);
+    state->cancelling = true;
+    spin_unlock(&state->lock);
+
+    // The work item may be in a transfer, which cancel_hid_events cuts short for a cancel of the whole phone
+    cancel_delayed_work_sync(&state->work);
+
+    spin_lock(&state->lock);
+    int discarded = kfifo_len(&state->ring) + (state->key_pressed ? 1 : 0);
+    kfifo_reset_out(&state->ring);
+    state->typing = false;
+    state->key_pressed = false;
+    state->cancelling = false;
+    discard_batches(state, -ECANCELED);
+    spin_unlock(&state->lock);
+    wake_up_interruptible(&state->wait);
+    wake_flush_waiters(minor);
+
+    // Text written while the work item was being cancelled is typed as usual
+    if(!kfifo_is_empty(&state->ring)){
+        start_typing(state);
+    }
+
+    return discarded;
+}
+
+bool has_pending_keyboard_input(int minor){
+    struct keyboard_state* state = keyboard_states[minor];
+    return !kfifo_is_empty(&state->ring) || READ_ONCE(state->key_pressed);
+}
+
+void detach_keyboard_device(int minor){
+    struct keyboard_state* state = keyboard_states[minor];
+
+    cancel_delayed_work_sync(&state->work);
+    spin_lock(&state->lock);
+    kfifo_reset_out(&state->ring);
+    state->typing = false;
+    state->key_pressed = false;
+    discard_batches(state, -ENODEV);
+    spin_unlock(&state->lock);
+    wake_up_interruptible(&state->wait);
+    disconnect_completion_channel(&state->completions);
+}
+
 void remove_keyboard_device(int minor){
+    detach_keyboard_device(minor);
     device_destroy(keyboard_device_class, keyboard_device_nr + minor);
 }
 
 static ssize_t keyboard_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs){
-    if(count > MAX_ACCEPTED_WRITE_SIZE){
-        printk("aoa_hid_driver - Error writing to keyboard device, a single write to the keyboard can handle at most %d characters but attempted to write %d characters instead\n", MAX_ACCEPTED_WRITE_SIZE, (int)count);
-        return -EINVAL;
+    int minor = iminor(file_inode(File));
+    struct keyboard_state* state = keyboard_states[minor];
+    struct completion_ticket ticket;
+    size_t written = 0;
+    int fault = 0;
+
+    // A phone that is reattaching keeps its files, the write waits for it or fails per the reattach policy
+    int ret = wait_for_reattach(minor, File->f_flags & O_NONBLOCK);
+    if(ret){
+        return ret;
     }
 
-    int minor = iminor(file_inode(File));
-    int not_copied = copy_from_user(buffer[minor], user_buffer, count);
-
-    for(int i=0; i<count; i++){
-        unsigned char keyindex1 = 0;
-        unsigned char keyindex2 = 0;
-        // https://usb.org/sites/default/files/hut1_21.pdf page 82-83
-        switch(buffer[minor][i]){
-            case 'a' ... 'z':
-                keyindex1 = 0x00;
-                keyindex2 = (buffer[minor][i] - 'a') + 0x04;
-                break;
-            case 'A' ... 'Z':
-                keyindex1 = 0x02;
-                keyindex2 = (buffer[minor][i] - 'A') + 0x04;
-                break;
-            case '0':
-                keyindex1 = 0x00;
-                keyindex2 = 0x27;
+    if(get_transfer_health(minor) == TRANSFER_FAILED){
+        return -EIO;
+    }
+
+    // Several threads may share the file, the ring only supports a single producer
+    if(mutex_lock_interruptible(&state->write_lock)){
+        return -ERESTARTSYS;
+    }
+
+    // Every write needs a batch slot for its completion record, only this writer adds batches so the slot stays free
+    if(kfifo_is_full(&state->batches)){
+        if(File->f_flags & O_NONBLOCK){
+            mutex_unlock(&state->write_lock);
+            return -EAGAIN;
+        }
+
+        if(wait_event_interruptible(state->wait, !kfifo_is_full(&state->batches) || !get_usb_device(minor) || get_transfer_health(minor) == TRANSFER_FAILED)){
+            mutex_unlock(&state->write_lock);
+            return -ERESTARTSYS;
+        }
+    }
+
+    while(written < count && get_usb_device(minor) && get_transfer_health(minor) != TRANSFER_FAILED){
+        if(kfifo_is_full(&state->ring)){
+            if(File->f_flags & O_NONBLOCK){
                 break;
-            case '1' ... '9':
-                keyindex1 = 0x00;
-                keyindex2 = (buffer[minor][i] - '1') + 0x1E;
+            }
+
+            if(wait_event_interruptible(state->wait, !kfifo_is_full(&state->ring) || !get_usb_device(minor) || get_transfer_health(minor) == TRANSFER_FAILED)){
                 break;
-            default:
+            }
+
+            if(!get_usb_device(minor) || get_transfer_health(minor) == TRANSFER_FAILED){
                 break;
+            }
+        }
+
+        unsigned int copied = 0;
+        fault = kfifo_from_user(&state->ring, user_buffer + written, count - written, &copied);
+        if(written == 0 && copied){
+            begin_completion(&state->completions, &ticket);
+        }
+        spin_lock(&state->lock);
+        state->queued += copied;
+        spin_unlock(&state->lock);
+        written += copied;
+        if(fault){
+            break;
+        }
+
+        // Typing starts as soon as the first characters are queued, while the rest of the write is still being copied
+        start_typing(state);
+    }
+
+    if(written){
+        struct keyboard_batch batch = {
+            .ticket = ticket,
+            .end = 0
+        };
+
+        // The characters may have been typed already while the rest of the write was being copied
+        spin_lock(&state->lock);
+        batch.end = state->queued;
+        kfifo_put(&state->batches, batch);
+        complete_typed_batches(state);
+        spin_unlock(&state->lock);
+    }
+
+    mutex_unlock(&state->write_lock);
+
+    if(written == 0){
+        if(fault){
+            return fault;
+        }
+        if(!get_usb_device(minor)){
+            return -ENODEV;
+        }
+        if(get_transfer_health(minor) == TRANSFER_FAILED){
+            return -EIO;
+        }
+        return (File->f_flags & O_NONBLOCK) ? -EAGAIN : -ERESTARTSYS;
+    }
+
+    return written;
+}
+
+static ssize_t keyboard_read(struct file* File, char* user_buffer, size_t count, loff_t* offs){
+    int minor = iminor(file_inode(File));
+    return read_completions(&keyboard_states[minor]->completions, File, user_buffer, count);
+}
+
+static __poll_t keyboard_poll(struct file* File, poll_table* wait){
+    int minor = iminor(file_inode(File));
+    struct keyboard_state* state = keyboard_states[minor];
+
+    __poll_t mask = poll_completions(&state->completions, File, wait);
+    poll_wait(File, &state->wait, wait);
+
+    if(!kfifo_is_full(&state->ring) && !kfifo_is_full(&state->batches)){
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+static long keyboard_ioctl(struct file* File, unsigned int cmd, unsigned long arg){
+    int minor = iminor(file_inode(File));
+    struct keyboard_state* state = keyboard_states[minor];
+
+    switch(cmd){
+        case AOA_HID_IOCTL_KEYBOARD_PENDING:
+            // A character counts as pending until its release has been sent
+            return put_user(kfifo_len(&state->ring) + (READ_ONCE(state->key_pressed) ? 1 : 0), (u32 __user*)arg);
+        case AOA_HID_IOCTL_CANCEL: {
+            int discarded = cancel_keyboard_input(minor);
+            send_release_report(minor, &keyboard_function);
+            return discarded;
+        }
+        default:
+            return completion_ioctl(&state->completions, cmd, arg);
+    }
+}
+
+static void start_typing(struct keyboard_state* state){
+    // Only kick an idle work item, requeueing a running one would skip the gap it schedules after a report
+    spin_lock(&state->lock);
+    if(!state->typing && !state->cancelling){
+        state->typing = true;
+        queue_delayed_work(get_transfer_workqueue(), &state->work, 0);
+    }
+    spin_unlock(&state->lock);
+}
+
+// Called from the work item when the phone is marked failed, the queued text can never be typed
+static void discard_typing(struct keyboard_state* state){
+    spin_lock(&state->lock);
+    kfifo_reset_out(&state->ring);
+    state->typing = false;
+    discard_batches(state, -EIO);
+    spin_unlock(&state->lock);
+
+    wake_up_interruptible(&state->wait);
+    wake_flush_waiters(state->minor);
+}
+
+static void keyboard_work(struct work_struct* work){
+    struct keyboard_state* state = container_of(to_delayed_work(work), struct keyboard_state, work);
+    int minor = state->minor;
+    char* hid_event = keyboard_hid_events[minor];
+
+    if(state->key_pressed){
+        encode_keyboard_report((u8*)hid_event, 0x00, 0x00);
+        int ret = send_hid_event(minor, hid_event, KEYBOARD_REPORT_SIZE);
+        WRITE_ONCE(state->key_pressed, false);
+        wake_flush_waiters(minor);
+        if(ret == -EIO){
+            discard_typing(state);
+            return;
+        }
+        finish_typed_characters(state, 1, ret);
+        queue_delayed_work(get_transfer_workqueue(), &state->work, usecs_to_jiffies(get_hid_event_gap_us(minor)));
+        return;
+    }
+
+    char character;
+    u64 skipped = 0;
+    while(kfifo_get(&state->ring, &character)){
+        unsigned char modifier = 0;
+        unsigned char keycode = 0;
+        if(!get_keyboard_keys(character, &modifier, &keycode)){
+            skipped++;
+            continue;
+        }
+        if(skipped){
+            finish_typed_characters(state, skipped, 0);
         }
 
-        if(keyindex1 != 0 || keyindex2 != 0){
-            keyboard_hid_events[minor][0] = 0x01;
-            keyboard_hid_events[minor][1] = keyindex1;
-            keyboard_hid_events[minor][2] = keyindex2;
-            usb_control_msg(get_usb_device(minor), usb_sndctrlpipe(get_usb_device(minor), 0), ACCESSORY_SEND_HID_EVENT, USB_DIR_OUT | USB_TYPE_VENDOR, 1, 0, keyboard_hid_events[minor], 3, 1000);
-            msleep(100);
-            keyboard_hid_events[minor][0] = 0x01;
-            keyboard_hid_events[minor][1] = 0x00;
-            keyboard_hid_events[minor][2] = 0x00;
-            usb_control_msg(get_usb_device(minor), usb_sndctrlpipe(get_usb_device(minor), 0), ACCESSORY_SEND_HID_EVENT, USB_DIR_OUT | USB_TYPE_VENDOR, 1, 0, keyboard_hid_events[minor], 3, 1000);
-            msleep(100);
+        encode_keyboard_report((u8*)hid_event, modifier, keycode);
+        WRITE_ONCE(state->key_pressed, true);
+        wake_up_interruptible(&state->wait);
+        int ret = send_hid_event(minor, hid_event, KEYBOARD_REPORT_SIZE);
+        if(ret == -EIO){
+            WRITE_ONCE(state->key_pressed, false);
+            discard_typing(state);
+            return;
         }
+        if(ret){
+            // The character is only done after its release, but the error belongs to the write it came from
+            finish_typed_characters(state, 0, ret);
+        }
+        queue_delayed_work(get_transfer_workqueue(), &state->work, usecs_to_jiffies(get_hid_event_gap_us(minor)));
+        return;
+    }
+
+    if(skipped){
+        finish_typed_characters(state, skipped, 0);
+    }
+
+    spin_lock(&state->lock);
+    if(kfifo_is_empty(&state->ring)){
+        state->typing = false;
     }
+    else{
+        queue_delayed_work(get_transfer_workqueue(), &state->work, 0);
+    }
+    spin_unlock(&state->lock);
+
+    wake_up_interruptible(&state->wait);
+    wake_flush_waiters(minor);
+}
+
+// Called from the work item once characters are done, either released or skipped because they can not be typed
+static void finish_typed_characters(struct keyboard_state* state, u64 count, int status){
+    spin_lock(&state->lock);
+    if(status && !state->typing_error){
+        state->typing_error = status;
+    }
+    state->typed += count;
+    complete_typed_batches(state);
+    spin_unlock(&state->lock);
+
+    wake_up_interruptible(&state->wait);
+}
 
-    int delta = count - not_copied;
-    return delta;
+// Must be called with state->lock held
+static void complete_typed_batches(struct keyboard_state* state){
+    struct keyboard_batch batch;
+    while(kfifo_peek(&state->batches, &batch) && batch.end <= state->typed){
+        kfifo_skip(&state->batches);
+        end_completion(&state->completions, &batch.ticket, state->typing_error);
+        state->typing_error = 0;
+    }
+}
+
+// Must be called with state->lock held, after the ring has been emptied
+static void discard_batches(struct keyboard_state* state, int status){
+    state->typed = state->queued;
+    if(!state->typing_error){
+        state->typing_error = status;
+    }
+
+    struct keyboard_batch batch;
+    while(kfifo_get(&state->batches, &batch)){
+        end_completion(&state->completions, &batch.ticket, state->typing_error);
+    }
+    state->typing_error = 0;
 }
 
 static int driver_open(struct inode* device_file, struct file* instance){
@@ -157,6 +510,14 @@ static int driver_open(struct inode* device_file, struct file* instance){
         return -EBUSY;
     }
 
+    // Writes of a previous opener that are still being typed do not get records in the new file
+    struct keyboard_state* state = keyboard_states[minor];
+    reset_completion_channel(&state->completions);
+    spin_lock(&state->lock);
+    kfifo_reset(&state->batches);
+    state->typing_error = 0;
+    spin_unlock(&state->lock);
+
     return 0;
 }
 
@@ -3,11 +3,20 @@
 
 #include <linux/uaccess.h>
 #include <linux/cdev.h>
+#include "function.h"
 
 int setup_keyboard(void);
 void cleanup_keyboard(void);
 
 int add_keyboard_device(int minor);
+void detach_keyboard_device(int minor);
 void remove_keyboard_device(int minor);
 
+// Discards the queued text, returns the number of characters that were not typed, the key may still be pressed afterwards
+int cancel_keyboard_input(int minor);
+bool has_pending_keyboard_input(int minor);
+
+// Writes are handled by this module, the function only contributes the collection to the descriptor
+extern const struct hid_function keyboard_function;
+
 #endif
\ No newline at end of file
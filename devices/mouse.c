@@ -1,156 +1,36 @@
 #include "mouse.h"
-#include "../usb.h"
 
-// Input is a four-tuple: ([-127, 127],[-127, 127],[-127,127],[0,1]) => 4 bytes
-#define ACCEPTED_WRITE_SIZE 4
+// Input is a four-tuple: ([-127, 127],[-127, 127],[-127,127],[0,1]) => MOUSE_SHORT_WRITE_SIZE bytes
+// Optionally followed by vertical and horizontal scrolling: ([-32768, 32767],[-32768, 32767]) little endian => MOUSE_WRITE_SIZE bytes
 
 /*
     Forward declarations for private functions for this mouse.c file
 */
-static ssize_t mouse_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs);
-static int driver_open(struct inode* device_file, struct file* instance);
-static int driver_close(struct inode* device_file, struct file* instance);
-
-static struct file_operations fops = {
-    .owner = THIS_MODULE,
-    .open = driver_open,
-    .release = driver_close,
-    .write = mouse_write
+static int parse_mouse_write(const struct hid_function* function, const u8* write, u8* reports);
+
+const struct hid_function mouse_function = {
+    .name = "mouse",
+    .report_id = MOUSE_REPORT_ID,
+    .report_size = MOUSE_REPORT_SIZE,
+    .descriptor = &mouse_report_descriptor,
+    .transfer_class = TRANSFER_CLASS_POINTER,
+    .write_size = MOUSE_WRITE_SIZE,
+    .short_write_size = MOUSE_SHORT_WRITE_SIZE,
+    .write_format = "x, y and wheel between -127 and 127 and 0 or 1 for a click, optionally followed by 16 bit vertical and horizontal scrolling",
+    .parse_write = parse_mouse_write
 };
 
-static dev_t mouse_device_nr;
-static struct cdev mouse_device;
-static struct class* mouse_device_class;
-
-static unsigned int file_is_open[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
-static char buffer[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES][ACCEPTED_WRITE_SIZE];
-static char* mouse_hid_events[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
-
-int setup_mouse(void){
-    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
-        mouse_hid_events[i] = NULL;
-        file_is_open[i] = 0;
-    }
-
-    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
-        mouse_hid_events[i] = kmalloc(5, GFP_KERNEL);
-        if(!mouse_hid_events[i]){
-            goto setup_mouse_error0;
-        }
-    }
-
-    if(alloc_chrdev_region(&mouse_device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, "android_mouses") < 0){
-		printk("aoa_hid_driver - mouse_device_nr could not be allocated\n");
-		goto setup_mouse_error0;
-	}
-
-    if(!(mouse_device_class = class_create("android_mouse"))){
-        printk("aoa_hid_driver - Error creating class for android mouse");
-        goto setup_mouse_error1;
-    }
-
-    cdev_init(&mouse_device, &fops);
-    if(cdev_add(&mouse_device, mouse_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES)){
-        printk("aoa_hid_driver - Error adding mouse device\n");
-        goto setup_mouse_error2;
-    }
-
-    return 0;
-
-setup_mouse_error2:
-    class_destroy(mouse_device_class);
-
-setup_mouse_error1:
-    unregister_chrdev_region(mouse_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
-
-setup_mouse_error0:
-    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
-        if(mouse_hid_events[i]){
-            kfree(mouse_hid_events[i]);
-        }
-    }
-
-    return -1;
-}
-
-void cleanup_mouse(void){
-    cdev_del(&mouse_device);
-    class_destroy(mouse_device_class);
-    unregister_chrdev_region(mouse_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
-    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
-        kfree(mouse_hid_events[i]);
-    }
-}
-
-int add_mouse_device(int minor){
-    if(device_create(mouse_device_class, NULL, mouse_device_nr + minor, NULL, "android_mouse%d", minor)==NULL){
-		printk("aoa_hid_driver - Can not create device file for minor %d\n", minor);
-		goto add_mouse_device_error0;
-	}
-
-    return 0;
-
-add_mouse_device_error0:
-    return -1;
-}
-
-void remove_mouse_device(int minor){
-    device_destroy(mouse_device_class, mouse_device_nr + minor);
-}
-
-static ssize_t mouse_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs){
-    if(count != ACCEPTED_WRITE_SIZE){
-        printk("aoa_hid_driver - Error writing to mouse device, a single write to the mouse can handle %d characters but attempted to write %d characters instead\n", ACCEPTED_WRITE_SIZE, (int)count);
+static int parse_mouse_write(const struct hid_function* function, const u8* write, u8* reports){
+    int num_reports = encode_mouse_write(write, reports);
+    if(num_reports < 0){
         return -EINVAL;
     }
 
-    int minor = iminor(file_inode(File));
-    int not_copied = copy_from_user(buffer[minor], user_buffer, count);
-
-    if(buffer[minor][3] != 0 && buffer[minor][3] != 1){
-        printk("aoa_hid_driver - Error writing to mouse device, the fourth byte of the write must be either 0 or 1\n");
-        return -EINVAL;
+    // A click is the movement and scrolling with the button pressed followed by the release
+    if(write[3] == 1){
+        encode_mouse_report(reports + num_reports * MOUSE_REPORT_SIZE, 0x00, 0, 0, 0, 0);
+        num_reports++;
     }
 
-    mouse_hid_events[minor][0] = 0x02;
-    mouse_hid_events[minor][1] = buffer[minor][3];
-    mouse_hid_events[minor][2] = buffer[minor][0];
-    mouse_hid_events[minor][3] = buffer[minor][1];
-    mouse_hid_events[minor][4] = buffer[minor][2];
-
-    usb_control_msg(get_usb_device(minor), usb_sndctrlpipe(get_usb_device(minor), 0), ACCESSORY_SEND_HID_EVENT, USB_DIR_OUT | USB_TYPE_VENDOR, 1, 0, mouse_hid_events[minor], 5, 1000);
-
-    if(buffer[minor][3] == 1){
-        mouse_hid_events[minor][0] = 0x02;
-        mouse_hid_events[minor][1] = 0x00;
-        mouse_hid_events[minor][2] = 0x00;
-        mouse_hid_events[minor][3] = 0x00;
-        mouse_hid_events[minor][4] = 0x00;
-        usb_control_msg(get_usb_device(minor), usb_sndctrlpipe(get_usb_device(minor), 0), ACCESSORY_SEND_HID_EVENT, USB_DIR_OUT | USB_TYPE_VENDOR, 1, 0, mouse_hid_events[minor], 5, 1000);
-    }
-
-    int delta = count - not_copied;
-    return delta;
-}
-
-static int driver_open(struct inode* device_file, struct file* instance){
-    int minor = iminor(device_file);
-
-    if(atomic_cmpxchg((atomic_t*)&file_is_open[minor], 0, 1)){
-        printk("aoa_hid_driver - Error opening mouse device, device is already open\n");
-        return -EBUSY;
-    }
-
-    return 0;
+    return num_reports;
 }
-
-static int driver_close(struct inode* device_file, struct file* instance){
-    int minor = iminor(device_file);
-
-    if(!atomic_cmpxchg((atomic_t*)&file_is_open[minor], 1, 0)){
-        printk("aoa_hid_driver - Error closing mouse device, device is already closed\n");
-        return -EBUSY;
-    }
-
-    return 0;
-}
\ No newline at end of file
@@ -1,13 +1,8 @@
 #ifndef MOUSE_H
 #define MOUSE_H
 
-#include <linux/uaccess.h>
-#include <linux/cdev.h>
+#include "function.h"
 
-int setup_mouse(void);
-void cleanup_mouse(void);
+extern const struct hid_function mouse_function;
 
-int add_mouse_device(int minor);
-void remove_mouse_device(int minor);
-
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,417 @@
+#include "raw.h"
+#include "../usb.h"
+#include "../transfer.h"
+#include "../hid_descriptor.h"
+#include "../completion_channel.h"
+#include "../reattach.h"
+#include "../aoa_hid_driver.h"
+#include "function.h"
+
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+// Batches are copied from userspace in chunks of this many entries
+#define RAW_BATCH_CHUNK_SIZE 16
+
+/*
+    Forward declarations for private functions for this raw.c file
+*/
+static ssize_t raw_read(struct file* File, char* user_buffer, size_t count, loff_t* offs);
+static ssize_t raw_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs);
+static __poll_t raw_poll(struct file* File, poll_table* wait);
+static long raw_ioctl(struct file* File, unsigned int cmd, unsigned long arg);
+static int driver_open(struct inode* device_file, struct file* instance);
+static int driver_close(struct inode* device_file, struct file* instance);
+static int submit_raw_batch(int minor, bool nonblock, struct aoa_hid_raw_batch __user* user_batch);
+static int reregister_raw_descriptor(int minor, struct aoa_hid_descriptor __user* user_descriptor);
+static bool is_valid_raw_report(int minor, const u8* report, size_t size);
+static int raw_delay(int minor, u32 delay_us, int generation);
+static bool is_raw_cancelled(int minor, int generation);
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = driver_open,
+    .release = driver_close,
+    .read = raw_read,
+    .write = raw_write,
+    .poll = raw_poll,
+    .unlocked_ioctl = raw_ioctl
+};
+
+static dev_t raw_device_nr;
+static struct cdev raw_device;
+static struct class* raw_device_class;
+
+static unsigned int file_is_open[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static char* raw_hid_events[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static struct mutex raw_locks[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+// Woken on disconnect so that a batch sleeping between reports does not outlive the phone
+static wait_queue_head_t raw_waits[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static struct completion_channel completion_channels[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+// Entries of the running batch that were not sent yet
+static u32 raw_remaining[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+// Bumped by every cancel, a batch is cancelled once it differs from the value seen before the batch waited for the lock
+static atomic_t raw_cancel_generations[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static bool completion_channel_allocated[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+
+int setup_raw(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        raw_hid_events[i] = NULL;
+        completion_channel_allocated[i] = false;
+        file_is_open[i] = 0;
+        mutex_init(&raw_locks[i]);
+        init_waitqueue_head(&raw_waits[i]);
+        atomic_set(&raw_cancel_generations[i], 0);
+    }
+
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        raw_hid_events[i] = kmalloc(AOA_HID_MAX_REPORT_SIZE, GFP_KERNEL);
+        if(!raw_hid_events[i]){
+            goto setup_raw_error0;
+        }
+
+        if(alloc_completion_channel(&completion_channels[i], i)){
+            goto setup_raw_error0;
+        }
+        completion_channel_allocated[i] = true;
+    }
+
+    if(alloc_chrdev_region(&raw_device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, "android_raws") < 0){
+        printk("aoa_hid_driver - raw_device_nr could not be allocated\n");
+        goto setup_raw_error0;
+    }
+
+    if(!(raw_device_class = class_create("android_raw"))){
+        printk("aoa_hid_driver - Error creating class for android raw");
+        goto setup_raw_error1;
+    }
+
+    cdev_init(&raw_device, &fops);
+    if(cdev_add(&raw_device, raw_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES)){
+        printk("aoa_hid_driver - Error adding raw device\n");
+        goto setup_raw_error2;
+    }
+
+    return 0;
+
+setup_raw_error2:
+    class_destroy(raw_device_class);
+
+setup_raw_error1:
+    unregister_chrdev_region(raw_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+
+setup_raw_error0:
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(raw_hid_events[i]){
+            kfree(raw_hid_events[i]);
+        }
+        if(completion_channel_allocated[i]){
+            free_completion_channel(&completion_channels[i]);
+        }
+    }
+
+    return -1;
+}
+
+void cleanup_raw(void){
+    cdev_del(&raw_device);
+    class_destroy(raw_device_class);
+    unregister_chrdev_region(raw_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        kfree(raw_hid_events[i]);
+        free_completion_channel(&completion_channels[i]);
+    }
+}
+
+int add_raw_device(int minor){
+    if(device_create(raw_device_class, NULL, raw_device_nr + minor, NULL, "android_raw%d", minor)==NULL){
+        printk("aoa_hid_driver - Can not create device file for minor %d\n", minor);
+        goto add_raw_device_error0;
+    }
+
+    return 0;
+
+add_raw_device_error0:
+    return -1;
+}
+
+int cancel_raw_input(int minor){
+    atomic_inc(&raw_cancel_generations[minor]);
+    wake_up_interruptible(&raw_waits[minor]);
+    return READ_ONCE(raw_remaining[minor]);
+}
+
+bool has_pending_raw_input(int minor){
+    return READ_ONCE(raw_remaining[minor]) != 0;
+}
+
+void detach_raw_device(int minor){
+    wake_up_interruptible(&raw_waits[minor]);
+    disconnect_completion_channel(&completion_channels[minor]);
+}
+
+void remove_raw_device(int minor){
+    detach_raw_device(minor);
+    device_destroy(raw_device_class, raw_device_nr + minor);
+}
+
+static ssize_t raw_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs){
+    int minor = iminor(file_inode(File));
+
+    struct completion_ticket ticket;
+    begin_completion(&completion_channels[minor], &ticket);
+
+    int ret = -EINVAL;
+    if(count == 0 || count > AOA_HID_MAX_REPORT_SIZE){
+        printk("aoa_hid_driver - Error writing to raw device, a report has to be between 1 and %d bytes but attempted to write %d bytes instead\n", AOA_HID_MAX_REPORT_SIZE, (int)count);
+        goto raw_write_error0;
+    }
+
+    ret = wait_for_reattach(minor, File->f_flags & O_NONBLOCK);
+    if(ret){
+        goto raw_write_error0;
+    }
+
+    ret = -ERESTARTSYS;
+    if(mutex_lock_interruptible(&raw_locks[minor])){
+        goto raw_write_error0;
+    }
+
+    ret = -EFAULT;
+    if(copy_from_user(raw_hid_events[minor], user_buffer, count)){
+        goto raw_write_error1;
+    }
+
+    ret = -EINVAL;
+    if(!is_valid_raw_report(minor, (u8*)raw_hid_events[minor], count)){
+        printk("aoa_hid_driver - Error writing to raw device, report ID %d with %d bytes does not match the HID descriptor\n", (int)(u8)raw_hid_events[minor][0], (int)count);
+        goto raw_write_error1;
+    }
+
+    ret = send_hid_event(minor, raw_hid_events[minor], count);
+
+raw_write_error1:
+    mutex_unlock(&raw_locks[minor]);
+
+raw_write_error0:
+    // The write has its record already, a restarted write would get a second one
+    if(ret == -ERESTARTSYS){
+        ret = -EINTR;
+    }
+    end_completion(&completion_channels[minor], &ticket, ret);
+
+    if(ret){
+        return ret;
+    }
+
+    return count;
+}
+
+static ssize_t raw_read(struct file* File, char* user_buffer, size_t count, loff_t* offs){
+    int minor = iminor(file_inode(File));
+    return read_completions(&completion_channels[minor], File, user_buffer, count);
+}
+
+static __poll_t raw_poll(struct file* File, poll_table* wait){
+    int minor = iminor(file_inode(File));
+    return poll_completions(&completion_channels[minor], File, wait) | EPOLLOUT | EPOLLWRNORM;
+}
+
+static long raw_ioctl(struct file* File, unsigned int cmd, unsigned long arg){
+    int minor = iminor(file_inode(File));
+    int ret;
+
+    switch(cmd){
+        case AOA_HID_IOCTL_RAW_SUBMIT:
+            return submit_raw_batch(minor, File->f_flags & O_NONBLOCK, (struct aoa_hid_raw_batch __user*)arg);
+        case AOA_HID_IOCTL_RAW_REREGISTER:
+            return reregister_raw_descriptor(minor, (struct aoa_hid_descriptor __user*)arg);
+        case AOA_HID_IOCTL_CANCEL:
+            // Reports of any ID may have been cut off, so everything is released
+            ret = cancel_raw_input(minor);
+            send_release_reports(minor);
+            return ret;
+        default:
+            return completion_ioctl(&completion_channels[minor], cmd, arg);
+    }
+}
+
+static int submit_raw_batch(int minor, bool nonblock, struct aoa_hid_raw_batch __user* user_batch){
+    // Taken before any waiting, so a cancel issued while the batch waits for the phone or for a running batch cancels it too
+    int generation = atomic_read(&raw_cancel_generations[minor]);
+
+    // The whole batch gets a single completion record, also when it fails before anything was sent
+    struct completion_ticket ticket;
+    begin_completion(&completion_channels[minor], &ticket);
+
+    struct aoa_hid_raw_batch batch;
+    u32 submitted = 0;
+    int ret = -EFAULT;
+    if(copy_from_user(&batch, user_batch, sizeof(batch))){
+        goto submit_raw_batch_error0;
+    }
+
+    ret = -ENOMEM;
+    struct aoa_hid_raw_entry* entries = kmalloc_array(RAW_BATCH_CHUNK_SIZE, sizeof(struct aoa_hid_raw_entry), GFP_KERNEL);
+    if(!entries){
+        goto submit_raw_batch_error0;
+    }
+
+    ret = wait_for_reattach(minor, nonblock);
+    if(ret){
+        goto submit_raw_batch_error1;
+    }
+
+    ret = -ERESTARTSYS;
+    if(mutex_lock_interruptible(&raw_locks[minor])){
+        goto submit_raw_batch_error1;
+    }
+
+    struct aoa_hid_raw_entry __user* user_entries = u64_to_user_ptr(batch.entries);
+    ret = 0;
+    WRITE_ONCE(raw_remaining[minor], batch.count);
+
+    while(submitted < batch.count && !ret){
+        u32 chunk = min_t(u32, batch.count - submitted, RAW_BATCH_CHUNK_SIZE);
+        if(copy_from_user(entries, user_entries + submitted, chunk * sizeof(struct aoa_hid_raw_entry))){
+            ret = -EFAULT;
+            break;
+        }
+
+        // The whole chunk is validated before any of it is sent
+        for(u32 i=0; i<chunk; i++){
+            if(!is_valid_raw_report(minor, entries[i].report, entries[i].size)){
+                printk("aoa_hid_driver - Error submitting raw batch, entry %u does not match the HID descriptor\n", submitted + i);
+                ret = -EINVAL;
+                break;
+            }
+        }
+
+        for(u32 i=0; i<chunk && !ret; i++){
+            if(is_raw_cancelled(minor, generation)){
+                ret = -ECANCELED;
+                break;
+            }
+
+            memcpy(raw_hid_events[minor], entries[i].report, entries[i].size);
+            ret = send_hid_event(minor, raw_hid_events[minor], entries[i].size);
+            if(ret){
+                break;
+            }
+            submitted++;
+            WRITE_ONCE(raw_remaining[minor], batch.count - submitted);
+
+            if(entries[i].delay_us){
+                ret = raw_delay(minor, entries[i].delay_us, generation);
+            }
+        }
+    }
+
+    WRITE_ONCE(raw_remaining[minor], 0);
+    wake_flush_waiters(minor);
+    mutex_unlock(&raw_locks[minor]);
+
+submit_raw_batch_error1:
+    kfree(entries);
+
+submit_raw_batch_error0:
+    // The batch has its record already, a restarted call would get a second one
+    if(ret == -ERESTARTSYS){
+        ret = -EINTR;
+    }
+    end_completion(&completion_channels[minor], &ticket, ret);
+
+    if(put_user(submitted, &user_batch->submitted)){
+        return -EFAULT;
+    }
+
+    // Partially submitted batches are reported through the submitted field
+    if(ret && submitted == 0){
+        return ret;
+    }
+
+    return 0;
+}
+
+static int reregister_raw_descriptor(int minor, struct aoa_hid_descriptor __user* user_descriptor){
+    struct aoa_hid_descriptor request;
+    if(copy_from_user(&request, user_descriptor, sizeof(request))){
+        return -EFAULT;
+    }
+
+    switch(request.mode){
+        case AOA_HID_DESCRIPTOR_KEEP:
+            return reregister_hid(minor, NULL, 0);
+        case AOA_HID_DESCRIPTOR_DEFAULT:
+            return reregister_hid(minor, (const u8*)get_hid_descriptor(), get_hid_descriptor_size());
+        case AOA_HID_DESCRIPTOR_SET:
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if(request.size == 0 || request.size > AOA_HID_MAX_DESCRIPTOR_SIZE){
+        return -EINVAL;
+    }
+
+    u8* descriptor = memdup_user(u64_to_user_ptr(request.descriptor), request.size);
+    if(IS_ERR(descriptor)){
+        return PTR_ERR(descriptor);
+    }
+
+    int ret = reregister_hid(minor, descriptor, request.size);
+    kfree(descriptor);
+    return ret;
+}
+
+static bool is_valid_raw_report(int minor, const u8* report, size_t size){
+    if(size == 0 || size > AOA_HID_MAX_REPORT_SIZE){
+        return false;
+    }
+
+    return get_accessory_report_size(minor, report[0]) == size;
+}
+
+static int raw_delay(int minor, u32 delay_us, int generation){
+    // An hrtimer based sleep keeps the requested spacing accurate to a few microseconds, unlike msleep
+    ktime_t timeout = ns_to_ktime((u64)delay_us * NSEC_PER_USEC);
+    int ret = wait_event_interruptible_hrtimeout(raw_waits[minor], !get_usb_device(minor) || is_raw_cancelled(minor, generation), timeout);
+    if(ret == -ETIME){
+        return 0;
+    }
+
+    if(ret){
+        return -EINTR;
+    }
+
+    return get_usb_device(minor) ? -ECANCELED : -ENODEV;
+}
+
+static bool is_raw_cancelled(int minor, int generation){
+    return atomic_read(&raw_cancel_generations[minor]) != generation;
+}
+
+static int driver_open(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    if(atomic_cmpxchg((atomic_t*)&file_is_open[minor], 0, 1)){
+        printk("aoa_hid_driver - Error opening raw device, device is already open\n");
+        return -EBUSY;
+    }
+
+    reset_completion_channel(&completion_channels[minor]);
+
+    return 0;
+}
+
+static int driver_close(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    if(!atomic_cmpxchg((atomic_t*)&file_is_open[minor], 1, 0)){
+        printk("aoa_hid_driver - Error closing raw device, device is already closed\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef RAW_H
+#define RAW_H
+
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+
+int setup_raw(void);
+void cleanup_raw(void);
+
+int add_raw_device(int minor);
+void detach_raw_device(int minor);
+void remove_raw_device(int minor);
+
+// Stops the batch that is being submitted, returns the number of its entries that were not sent
+int cancel_raw_input(int minor);
+bool has_pending_raw_input(int minor);
+
+#endif
@@ -0,0 +1,587 @@
+#include "record.h"
+#include "../usb.h"
+#include "../transfer.h"
+#include "../reattach.h"
+#include "../aoa_hid_driver.h"
+#include "function.h"
+
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+
+#define CAPTURE_BUFFER_SIZE 16384
+#define REPLAY_BUFFER_SIZE 16384
+#define REPLAY_RECORD_SIZE (sizeof(struct aoa_hid_record_header) + AOA_HID_MAX_REPORT_SIZE)
+// Records sent from one timer expiry before the timer is re-armed, so a long burst of due records does not hog the interrupt
+#define REPLAY_RECORDS_PER_EXPIRY 16
+// Transfers of replayed reports on the bus at a time, the replay waits for them instead of piling up urbs against a stalled phone
+#define REPLAY_MAX_IN_FLIGHT 1
+
+struct record_state {
+    int minor;
+
+    struct kfifo capture_fifo;
+    spinlock_t capture_lock;
+    bool capturing;
+    u32 capture_dropped;
+    wait_queue_head_t capture_wait;
+
+    // Replay is driven from an hrtimer so that the pacing does not depend on userspace scheduling
+    struct kfifo replay_fifo;
+    spinlock_t replay_lock;
+    struct hrtimer replay_timer;
+    bool replaying;
+    bool replay_anchored;
+    ktime_t replay_base;
+    u64 replay_first_timestamp;
+    wait_queue_head_t replay_wait;
+    // Protected by replay_lock, the completion of the last transfer restarts a deferred replay
+    u32 replay_in_flight;
+    bool replay_deferred;
+    // Incremented whenever the replay is discarded, a writer waiting for room then drops its partial record
+    u32 replay_generation;
+
+    // The record being written, it only enters the replay fifo once it is complete and its size was checked
+    struct mutex write_lock;
+    u8 pending_record[REPLAY_RECORD_SIZE];
+    u16 pending_length;
+};
+
+/*
+    Forward declarations for private functions for this record.c file
+*/
+static ssize_t record_read(struct file* File, char* user_buffer, size_t count, loff_t* offs);
+static ssize_t record_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs);
+static __poll_t record_poll(struct file* File, poll_table* wait);
+static long record_ioctl(struct file* File, unsigned int cmd, unsigned long arg);
+static int driver_open(struct inode* device_file, struct file* instance);
+static int driver_close(struct inode* device_file, struct file* instance);
+static enum hrtimer_restart replay_timer_callback(struct hrtimer* timer);
+static void replay_report_complete(void* context, int status);
+static void put_replay_report(struct record_state* state);
+static void start_replay(struct record_state* state);
+static void cancel_replay(struct record_state* state);
+static void discard_replay(struct record_state* state);
+static int count_replay_records(struct record_state* state);
+static size_t pending_record_size(struct record_state* state);
+static void discard_pending_record(struct record_state* state);
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = driver_open,
+    .release = driver_close,
+    .read = record_read,
+    .write = record_write,
+    .poll = record_poll,
+    .unlocked_ioctl = record_ioctl
+};
+
+static dev_t record_device_nr;
+static struct cdev record_device;
+static struct class* record_device_class;
+
+static unsigned int file_is_open[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static struct record_state* record_states[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+
+int setup_record(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        record_states[i] = NULL;
+        file_is_open[i] = 0;
+    }
+
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        record_states[i] = kzalloc(sizeof(struct record_state), GFP_KERNEL);
+        if(!record_states[i]){
+            goto setup_record_error0;
+        }
+
+        struct record_state* state = record_states[i];
+        if(kfifo_alloc(&state->capture_fifo, CAPTURE_BUFFER_SIZE, GFP_KERNEL)){
+            goto setup_record_error0;
+        }
+
+        if(kfifo_alloc(&state->replay_fifo, REPLAY_BUFFER_SIZE, GFP_KERNEL)){
+            goto setup_record_error0;
+        }
+
+        state->minor = i;
+        spin_lock_init(&state->capture_lock);
+        init_waitqueue_head(&state->capture_wait);
+        spin_lock_init(&state->replay_lock);
+        init_waitqueue_head(&state->replay_wait);
+        mutex_init(&state->write_lock);
+        hrtimer_setup(&state->replay_timer, replay_timer_callback, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    }
+
+    if(alloc_chrdev_region(&record_device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, "android_records") < 0){
+        printk("aoa_hid_driver - record_device_nr could not be allocated\n");
+        goto setup_record_error0;
+    }
+
+    if(!(record_device_class = class_create("android_record"))){
+        printk("aoa_hid_driver - Error creating class for android record");
+        goto setup_record_error1;
+    }
+
+    cdev_init(&record_device, &fops);
+    if(cdev_add(&record_device, record_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES)){
+        printk("aoa_hid_driver - Error adding record device\n");
+        goto setup_record_error2;
+    }
+
+    return 0;
+
+setup_record_error2:
+    class_destroy(record_device_class);
+
+setup_record_error1:
+    unregister_chrdev_region(record_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+
+setup_record_error0:
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(record_states[i]){
+            // kfifo_free is safe on a kfifo that was never allocated since the state is zeroed
+            kfifo_free(&record_states[i]->capture_fifo);
+            kfifo_free(&record_states[i]->replay_fifo);
+            kfree(record_states[i]);
+            record_states[i] = NULL;
+        }
+    }
+
+    return -1;
+}
+
+void cleanup_record(void){
+    cdev_del(&record_device);
+    class_destroy(record_device_class);
+    unregister_chrdev_region(record_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        hrtimer_cancel(&record_states[i]->replay_timer);
+        kfifo_free(&record_states[i]->capture_fifo);
+        kfifo_free(&record_states[i]->replay_fifo);
+        kfree(record_states[i]);
+    }
+}
+
+int add_record_device(int minor){
+    if(device_create(record_device_class, NULL, record_device_nr + minor, NULL, "android_record%d", minor)==NULL){
+        printk("aoa_hid_driver - Can not create device file for minor %d\n", minor);
+        goto add_record_device_error0;
+    }
+
+    return 0;
+
+add_record_device_error0:
+    return -1;
+}
+
+void detach_record_device(int minor){
+    struct record_state* state = record_states[minor];
+
+    WRITE_ONCE(state->capturing, false);
+    cancel_replay(state);
+    wake_up_interruptible(&state->capture_wait);
+}
+
+void remove_record_device(int minor){
+    detach_record_device(minor);
+    device_destroy(record_device_class, record_device_nr + minor);
+}
+
+int cancel_replay_input(int minor){
+    struct record_state* state = record_states[minor];
+
+    hrtimer_cancel(&state->replay_timer);
+    int discarded = count_replay_records(state);
+    discard_replay(state);
+    discard_pending_record(state);
+
+    return discarded;
+}
+
+bool has_pending_replay_input(int minor){
+    // A record that is still being written does not count, it would keep a flush waiting forever
+    return READ_ONCE(record_states[minor]->replaying);
+}
+
+void record_hid_event(int minor, const char* event, u16 size){
+    struct record_state* state = record_states[minor];
+    if(!READ_ONCE(state->capturing)){
+        return;
+    }
+
+    struct aoa_hid_record_header header = {
+        .timestamp_ns = ktime_get_ns(),
+        .size = size
+    };
+
+    // Reports can be sent from process context and from the replay hrtimer, so the producer side needs a lock
+    unsigned long flags;
+    spin_lock_irqsave(&state->capture_lock, flags);
+    if(kfifo_avail(&state->capture_fifo) >= sizeof(header) + size){
+        kfifo_in(&state->capture_fifo, &header, sizeof(header));
+        kfifo_in(&state->capture_fifo, event, size);
+    }
+    else{
+        state->capture_dropped++;
+    }
+    spin_unlock_irqrestore(&state->capture_lock, flags);
+
+    wake_up_interruptible(&state->capture_wait);
+}
+
+static ssize_t record_read(struct file* File, char* user_buffer, size_t count, loff_t* offs){
+    int minor = iminor(file_inode(File));
+    struct record_state* state = record_states[minor];
+
+    if(kfifo_is_empty(&state->capture_fifo)){
+        if(File->f_flags & O_NONBLOCK){
+            return -EAGAIN;
+        }
+
+        if(wait_event_interruptible(state->capture_wait, !kfifo_is_empty(&state->capture_fifo) || !get_usb_device(minor))){
+            return -ERESTARTSYS;
+        }
+    }
+
+    // The device file is opened at most once, so there is a single consumer and no lock is needed here
+    unsigned int copied = 0;
+    int ret = kfifo_to_user(&state->capture_fifo, user_buffer, count, &copied);
+    if(ret){
+        return ret;
+    }
+
+    return copied;
+}
+
+static ssize_t record_write(struct file* File, const char* user_buffer, size_t count, loff_t* offs){
+    int minor = iminor(file_inode(File));
+    struct record_state* state = record_states[minor];
+
+    int ret = wait_for_reattach(minor, File->f_flags & O_NONBLOCK);
+    if(ret){
+        return ret;
+    }
+
+    // Writers share pending_record, a second one waits until the first is done with it
+    if(mutex_lock_interruptible(&state->write_lock)){
+        return -ERESTARTSYS;
+    }
+
+    // Records can be split across writes in any way, their bytes are collected in pending_record until the record is complete
+    u32 generation = READ_ONCE(state->replay_generation);
+    ssize_t written = 0;
+    while(written < count){
+        size_t record_size = pending_record_size(state);
+        size_t chunk = min(count - written, record_size - state->pending_length);
+        bool completes_record = state->pending_length + chunk == record_size && record_size > sizeof(struct aoa_hid_record_header);
+
+        // The bytes that complete a record are only taken once the record fits in the replay fifo
+        if(completes_record && kfifo_avail(&state->replay_fifo) < record_size){
+            if(written){
+                break;
+            }
+
+            if(File->f_flags & O_NONBLOCK){
+                written = -EAGAIN;
+                break;
+            }
+
+            if(wait_event_interruptible(state->replay_wait, kfifo_avail(&state->replay_fifo) >= record_size || !get_usb_device(minor) || READ_ONCE(state->replay_generation) != generation)){
+                written = -ERESTARTSYS;
+                break;
+            }
+
+            // Cancelled or detached while waiting, the partial record goes with the rest of the replay
+            if(READ_ONCE(state->replay_generation) != generation){
+                state->pending_length = 0;
+                written = get_usb_device(minor) ? -ECANCELED : -ENODEV;
+                break;
+            }
+
+            if(kfifo_avail(&state->replay_fifo) < record_size){
+                written = -ENODEV;
+                break;
+            }
+        }
+
+        if(copy_from_user(state->pending_record + state->pending_length, user_buffer + written, chunk)){
+            written = written ? written : -EFAULT;
+            break;
+        }
+        state->pending_length += chunk;
+        written += chunk;
+
+        if(state->pending_length == sizeof(struct aoa_hid_record_header)){
+            struct aoa_hid_record_header* header = (struct aoa_hid_record_header*)state->pending_record;
+            if(!header->size || header->size > AOA_HID_MAX_REPORT_SIZE){
+                printk("aoa_hid_driver - Error writing record on minor %d, record of %d bytes is empty or exceeds the maximum report size\n", minor, (int)header->size);
+                state->pending_length = 0;
+                // A header is always completed by a single chunk, the records before it were queued and are reported as written
+                written -= chunk;
+                written = written ? written : -EINVAL;
+                break;
+            }
+        }
+
+        if(state->pending_length == pending_record_size(state)){
+            kfifo_in(&state->replay_fifo, state->pending_record, state->pending_length);
+            state->pending_length = 0;
+            start_replay(state);
+        }
+    }
+
+    mutex_unlock(&state->write_lock);
+    return written;
+}
+
+static __poll_t record_poll(struct file* File, poll_table* wait){
+    int minor = iminor(file_inode(File));
+    struct record_state* state = record_states[minor];
+    __poll_t mask = 0;
+
+    poll_wait(File, &state->capture_wait, wait);
+    poll_wait(File, &state->replay_wait, wait);
+
+    if(!kfifo_is_empty(&state->capture_fifo)){
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if(kfifo_avail(&state->replay_fifo) >= REPLAY_RECORD_SIZE){
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+static long record_ioctl(struct file* File, unsigned int cmd, unsigned long arg){
+    int minor = iminor(file_inode(File));
+    struct record_state* state = record_states[minor];
+
+    switch(cmd){
+        case AOA_HID_IOCTL_CAPTURE_START:
+            state->capture_dropped = 0;
+            WRITE_ONCE(state->capturing, true);
+            return 0;
+        case AOA_HID_IOCTL_CAPTURE_STOP:
+            WRITE_ONCE(state->capturing, false);
+            return 0;
+        case AOA_HID_IOCTL_CAPTURE_DROPPED:
+            return put_user(state->capture_dropped, (u32 __user*)arg);
+        case AOA_HID_IOCTL_REPLAY_CANCEL:
+            cancel_replay(state);
+            return 0;
+        case AOA_HID_IOCTL_CANCEL: {
+            // Replayed reports can have any ID, so everything is released
+            int discarded = cancel_replay_input(minor);
+            send_release_reports(minor);
+            return discarded;
+        }
+        case AOA_HID_IOCTL_CANCEL_PHONE:
+            return cancel_phone_input(minor);
+        case AOA_HID_IOCTL_FLUSH:
+            return flush_phone_input(minor);
+        default:
+            return -ENOTTY;
+    }
+}
+
+static void start_replay(struct record_state* state){
+    unsigned long flags;
+    spin_lock_irqsave(&state->replay_lock, flags);
+    if(!state->replaying){
+        state->replaying = true;
+        hrtimer_start(&state->replay_timer, ktime_get(), HRTIMER_MODE_ABS);
+    }
+    spin_unlock_irqrestore(&state->replay_lock, flags);
+}
+
+static void cancel_replay(struct record_state* state){
+    hrtimer_cancel(&state->replay_timer);
+    discard_replay(state);
+    discard_pending_record(state);
+}
+
+// Also called from the replay timer itself, so it must not wait for the timer
+static void discard_replay(struct record_state* state){
+    unsigned long flags;
+    spin_lock_irqsave(&state->replay_lock, flags);
+    kfifo_reset_out(&state->replay_fifo);
+    state->replaying = false;
+    state->replay_anchored = false;
+    state->replay_deferred = false;
+    state->replay_generation++;
+    spin_unlock_irqrestore(&state->replay_lock, flags);
+
+    wake_up_interruptible(&state->replay_wait);
+    wake_flush_waiters(state->minor);
+}
+
+// Whole records waiting for replay, called with the replay timer stopped, a record that is still being written is not counted
+static int count_replay_records(struct record_state* state){
+    struct aoa_hid_record_header header;
+    char report[AOA_HID_MAX_REPORT_SIZE];
+    int records = 0;
+
+    // The records are consumed while counting, the caller discards the rest of the fifo anyway
+    unsigned long flags;
+    spin_lock_irqsave(&state->replay_lock, flags);
+    while(kfifo_out(&state->replay_fifo, &header, sizeof(header)) == sizeof(header)){
+        u16 remaining = header.size;
+        while(remaining){
+            unsigned int copied = kfifo_out(&state->replay_fifo, report, min_t(u16, remaining, sizeof(report)));
+            if(!copied){
+                break;
+            }
+            remaining -= copied;
+        }
+
+        if(remaining){
+            break;
+        }
+        records++;
+    }
+    spin_unlock_irqrestore(&state->replay_lock, flags);
+
+    return records;
+}
+
+// Size of the record being written, until its header is complete only the header is known to be needed
+static size_t pending_record_size(struct record_state* state){
+    if(state->pending_length < sizeof(struct aoa_hid_record_header)){
+        return sizeof(struct aoa_hid_record_header);
+    }
+
+    return sizeof(struct aoa_hid_record_header) + ((struct aoa_hid_record_header*)state->pending_record)->size;
+}
+
+// Waits for a writer that is still copying, one that waits for room gives up since the replay was discarded first
+static void discard_pending_record(struct record_state* state){
+    mutex_lock(&state->write_lock);
+    state->pending_length = 0;
+    mutex_unlock(&state->write_lock);
+}
+
+static enum hrtimer_restart replay_timer_callback(struct hrtimer* timer){
+    struct record_state* state = container_of(timer, struct record_state, replay_timer);
+    struct aoa_hid_record_header header;
+    char report[AOA_HID_MAX_REPORT_SIZE];
+
+    for(int sent=0; sent<REPLAY_RECORDS_PER_EXPIRY; sent++){
+        unsigned long flags;
+        spin_lock_irqsave(&state->replay_lock, flags);
+        if(state->replay_in_flight >= REPLAY_MAX_IN_FLIGHT){
+            state->replay_deferred = true;
+            spin_unlock_irqrestore(&state->replay_lock, flags);
+            return HRTIMER_NORESTART;
+        }
+
+        bool has_header = kfifo_out_peek(&state->replay_fifo, &header, sizeof(header)) == sizeof(header);
+
+        // record_write only queues checked records, this keeps a corrupted fifo from stalling the replay for good
+        if(has_header && header.size > AOA_HID_MAX_REPORT_SIZE){
+            spin_unlock_irqrestore(&state->replay_lock, flags);
+            printk("aoa_hid_driver - Error replaying on minor %d, record of %d bytes exceeds the maximum report size, discarding replay\n", state->minor, (int)header.size);
+            discard_replay(state);
+            return HRTIMER_NORESTART;
+        }
+
+        if(!has_header || kfifo_len(&state->replay_fifo) < sizeof(header) + header.size){
+            // Out of complete records, the next write restarts the timer and the timing is anchored again
+            state->replaying = false;
+            state->replay_anchored = false;
+            spin_unlock_irqrestore(&state->replay_lock, flags);
+            wake_up_interruptible(&state->replay_wait);
+            wake_flush_waiters(state->minor);
+            return HRTIMER_NORESTART;
+        }
+        spin_unlock_irqrestore(&state->replay_lock, flags);
+
+        if(!state->replay_anchored){
+            state->replay_base = ktime_get();
+            state->replay_first_timestamp = header.timestamp_ns;
+            state->replay_anchored = true;
+        }
+
+        // Records that are older than the first record of the session are sent immediately
+        s64 offset = header.timestamp_ns > state->replay_first_timestamp ? (s64)(header.timestamp_ns - state->replay_first_timestamp) : 0;
+        ktime_t deadline = ktime_add_ns(state->replay_base, offset);
+        if(ktime_after(deadline, ktime_get())){
+            hrtimer_set_expires(timer, deadline);
+            return HRTIMER_RESTART;
+        }
+
+        if(kfifo_out(&state->replay_fifo, &header, sizeof(header)) != sizeof(header) || kfifo_out(&state->replay_fifo, report, header.size) != header.size){
+            continue;
+        }
+
+        // Held by this callback until it knows how many transfers the report took
+        spin_lock_irqsave(&state->replay_lock, flags);
+        state->replay_in_flight++;
+        spin_unlock_irqrestore(&state->replay_lock, flags);
+
+        int transfers = send_hid_event_atomic(state->minor, report, header.size, replay_report_complete, state);
+
+        spin_lock_irqsave(&state->replay_lock, flags);
+        state->replay_in_flight += max(transfers, 0);
+        put_replay_report(state);
+        spin_unlock_irqrestore(&state->replay_lock, flags);
+
+        if(transfers == -EIO){
+            printk("aoa_hid_driver - Error replaying on minor %d, phone is marked failed, discarding replay\n", state->minor);
+            discard_replay(state);
+            return HRTIMER_NORESTART;
+        }
+        wake_up_interruptible(&state->replay_wait);
+    }
+
+    // More records may be due, they are sent from the next expiry
+    hrtimer_set_expires(timer, ktime_get());
+    return HRTIMER_RESTART;
+}
+
+static void replay_report_complete(void* context, int status){
+    struct record_state* state = context;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->replay_lock, flags);
+    put_replay_report(state);
+    spin_unlock_irqrestore(&state->replay_lock, flags);
+}
+
+// Must be called with state->replay_lock held, a failed transfer is left to the phone's health like any other
+static void put_replay_report(struct record_state* state){
+    state->replay_in_flight--;
+    if(state->replay_deferred && state->replay_in_flight < REPLAY_MAX_IN_FLIGHT){
+        state->replay_deferred = false;
+        hrtimer_start(&state->replay_timer, ktime_get(), HRTIMER_MODE_ABS);
+    }
+}
+
+static int driver_open(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    if(atomic_cmpxchg((atomic_t*)&file_is_open[minor], 0, 1)){
+        printk("aoa_hid_driver - Error opening record device, device is already open\n");
+        return -EBUSY;
+    }
+
+    // A record the previous writer left unfinished would swallow the start of this one's session
+    discard_pending_record(record_states[minor]);
+
+    return 0;
+}
+
+static int driver_close(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    // Replay continues after closing so that "cat session > /dev/android_recordN" replays the whole session
+    if(!atomic_cmpxchg((atomic_t*)&file_is_open[minor], 1, 0)){
+        printk("aoa_hid_driver - Error closing record device, device is already closed\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
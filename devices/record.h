@@ -0,0 +1,21 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+
+int setup_record(void);
+void cleanup_record(void);
+
+int add_record_device(int minor);
+void detach_record_device(int minor);
+void remove_record_device(int minor);
+
+// Discards the reports waiting for replay, returns the number of discarded records
+int cancel_replay_input(int minor);
+bool has_pending_replay_input(int minor);
+
+// Called for every report that is sent to a phone, appends it to the capture buffer when capturing is enabled
+void record_hid_event(int minor, const char* event, u16 size);
+
+#endif
@@ -0,0 +1,747 @@
+#include "script.h"
+#include "../usb.h"
+#include "../transfer.h"
+#include "../reports.h"
+#include "../aoa_hid_driver.h"
+
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#define MAX_LOADED_SCRIPTS 32
+// Steps without a delay in between are executed back to back, but the work item yields after this many
+#define MAX_STEPS_PER_WORK 64
+
+struct script {
+    struct kref ref;
+    u32 size;
+    u8 bytecode[];
+};
+
+struct script_loop {
+    u32 start;
+    u16 remaining;
+};
+
+struct script_runner {
+    int minor;
+    struct mutex lock;
+    struct delayed_work work;
+    wait_queue_head_t wait;
+    char* hid_event;
+    char* release_event;
+
+    // The lock is not held while the work item sends a report, so status and cancel do not wait behind the transfer
+    // run tells the work item whether the script it was sending for is still the one running afterwards
+    u32 run;
+    bool sending;
+    bool release_pending;
+
+    struct script* script;
+    u32 handle;
+    u32 state;
+    int error;
+
+    // Execution position, phase counts the reports already sent for the current instruction
+    u32 pc;
+    u32 phase;
+    u32 repeat_pc;
+    u16 repeat_remaining;
+    struct script_loop loops[AOA_HID_SCRIPT_MAX_LOOP_DEPTH];
+    int loop_depth;
+};
+
+/*
+    Forward declarations for private functions for this script.c file
+*/
+static ssize_t script_read(struct file* File, char* user_buffer, size_t count, loff_t* offs);
+static __poll_t script_poll(struct file* File, poll_table* wait);
+static long script_ioctl(struct file* File, unsigned int cmd, unsigned long arg);
+static int driver_open(struct inode* device_file, struct file* instance);
+static int driver_close(struct inode* device_file, struct file* instance);
+static int load_script(struct aoa_hid_script_load __user* user_load);
+static int unload_script(u32 handle);
+static int run_script(struct script_runner* runner, u32 handle);
+static bool cancel_script(struct script_runner* runner, bool release_all);
+static void release_script(struct kref* ref);
+static void get_script_status(struct script_runner* runner, struct aoa_hid_script_status* status);
+static int get_instruction_size(const u8* bytecode, u32 size, u32 pc);
+static int validate_script(const u8* bytecode, u32 size);
+static void send_release_events(struct script_runner* runner);
+static int execute_step(struct script_runner* runner, unsigned int* delay_us, u16* report_size);
+static void next_instruction(struct script_runner* runner, int instruction_size);
+static void finish_script(struct script_runner* runner, u32 state, int error);
+static void script_work(struct work_struct* work);
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = driver_open,
+    .release = driver_close,
+    .read = script_read,
+    .poll = script_poll,
+    .unlocked_ioctl = script_ioctl
+};
+
+static dev_t script_device_nr;
+static struct cdev script_device;
+static struct class* script_device_class;
+
+static unsigned int file_is_open[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static struct script_runner* script_runners[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+
+// Loaded scripts are shared by all phones, handle i+1 refers to loaded_scripts[i]
+static struct script* loaded_scripts[MAX_LOADED_SCRIPTS];
+static DEFINE_MUTEX(loaded_scripts_lock);
+
+int setup_script(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        script_runners[i] = NULL;
+        file_is_open[i] = 0;
+    }
+
+    for(int i=0; i<MAX_LOADED_SCRIPTS; i++){
+        loaded_scripts[i] = NULL;
+    }
+
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        script_runners[i] = kzalloc(sizeof(struct script_runner), GFP_KERNEL);
+        if(!script_runners[i]){
+            goto setup_script_error0;
+        }
+
+        struct script_runner* runner = script_runners[i];
+        runner->hid_event = kmalloc(AOA_HID_MAX_REPORT_SIZE, GFP_KERNEL);
+        if(!runner->hid_event){
+            goto setup_script_error0;
+        }
+
+        runner->release_event = kmalloc(AOA_HID_MAX_REPORT_SIZE, GFP_KERNEL);
+        if(!runner->release_event){
+            goto setup_script_error0;
+        }
+
+        runner->minor = i;
+        runner->state = AOA_HID_SCRIPT_STATE_IDLE;
+        mutex_init(&runner->lock);
+        INIT_DELAYED_WORK(&runner->work, script_work);
+        init_waitqueue_head(&runner->wait);
+    }
+
+    if(alloc_chrdev_region(&script_device_nr, 0, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES, "android_scripts") < 0){
+        printk("aoa_hid_driver - script_device_nr could not be allocated\n");
+        goto setup_script_error0;
+    }
+
+    if(!(script_device_class = class_create("android_script"))){
+        printk("aoa_hid_driver - Error creating class for android script");
+        goto setup_script_error1;
+    }
+
+    cdev_init(&script_device, &fops);
+    if(cdev_add(&script_device, script_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES)){
+        printk("aoa_hid_driver - Error adding script device\n");
+        goto setup_script_error2;
+    }
+
+    return 0;
+
+setup_script_error2:
+    class_destroy(script_device_class);
+
+setup_script_error1:
+    unregister_chrdev_region(script_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+
+setup_script_error0:
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(script_runners[i]){
+            kfree(script_runners[i]->hid_event);
+            kfree(script_runners[i]->release_event);
+            kfree(script_runners[i]);
+            script_runners[i] = NULL;
+        }
+    }
+
+    return -1;
+}
+
+void cleanup_script(void){
+    cdev_del(&script_device);
+    class_destroy(script_device_class);
+    unregister_chrdev_region(script_device_nr, NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        cancel_script(script_runners[i], false);
+    }
+    for(int i=0; i<MAX_LOADED_SCRIPTS; i++){
+        if(loaded_scripts[i]){
+            kref_put(&loaded_scripts[i]->ref, release_script);
+        }
+    }
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        kfree(script_runners[i]->hid_event);
+        kfree(script_runners[i]->release_event);
+        kfree(script_runners[i]);
+    }
+}
+
+int add_script_device(int minor){
+    if(device_create(script_device_class, NULL, script_device_nr + minor, NULL, "android_script%d", minor)==NULL){
+        printk("aoa_hid_driver - Can not create device file for minor %d\n", minor);
+        goto add_script_device_error0;
+    }
+
+    return 0;
+
+add_script_device_error0:
+    return -1;
+}
+
+int cancel_script_input(int minor){
+    return cancel_script(script_runners[minor], false) ? 1 : 0;
+}
+
+bool has_pending_script_input(int minor){
+    return READ_ONCE(script_runners[minor]->state) == AOA_HID_SCRIPT_STATE_RUNNING;
+}
+
+void detach_script_device(int minor){
+    cancel_script(script_runners[minor], false);
+}
+
+void remove_script_device(int minor){
+    detach_script_device(minor);
+    device_destroy(script_device_class, script_device_nr + minor);
+}
+
+static ssize_t script_read(struct file* File, char* user_buffer, size_t count, loff_t* offs){
+    int minor = iminor(file_inode(File));
+    struct script_runner* runner = script_runners[minor];
+
+    if(count < sizeof(struct aoa_hid_script_status)){
+        return -EINVAL;
+    }
+
+    if(READ_ONCE(runner->state) == AOA_HID_SCRIPT_STATE_RUNNING){
+        if(File->f_flags & O_NONBLOCK){
+            return -EAGAIN;
+        }
+
+        if(wait_event_interruptible(runner->wait, READ_ONCE(runner->state) != AOA_HID_SCRIPT_STATE_RUNNING)){
+            return -ERESTARTSYS;
+        }
+    }
+
+    struct aoa_hid_script_status status;
+    get_script_status(runner, &status);
+
+    if(copy_to_user(user_buffer, &status, sizeof(status))){
+        return -EFAULT;
+    }
+
+    return sizeof(status);
+}
+
+static __poll_t script_poll(struct file* File, poll_table* wait){
+    int minor = iminor(file_inode(File));
+    struct script_runner* runner = script_runners[minor];
+
+    poll_wait(File, &runner->wait, wait);
+
+    if(READ_ONCE(runner->state) != AOA_HID_SCRIPT_STATE_RUNNING){
+        return EPOLLIN | EPOLLRDNORM;
+    }
+
+    return 0;
+}
+
+static long script_ioctl(struct file* File, unsigned int cmd, unsigned long arg){
+    int minor = iminor(file_inode(File));
+    struct script_runner* runner = script_runners[minor];
+    struct aoa_hid_script_status status;
+    u32 handle;
+
+    switch(cmd){
+        case AOA_HID_IOCTL_SCRIPT_LOAD:
+            return load_script((struct aoa_hid_script_load __user*)arg);
+        case AOA_HID_IOCTL_SCRIPT_UNLOAD:
+            if(get_user(handle, (u32 __user*)arg)){
+                return -EFAULT;
+            }
+            return unload_script(handle);
+        case AOA_HID_IOCTL_SCRIPT_RUN:
+            if(get_user(handle, (u32 __user*)arg)){
+                return -EFAULT;
+            }
+            return run_script(runner, handle);
+        case AOA_HID_IOCTL_SCRIPT_CANCEL:
+            cancel_script(runner, true);
+            return 0;
+        case AOA_HID_IOCTL_CANCEL:
+            return cancel_script(runner, true) ? 1 : 0;
+        case AOA_HID_IOCTL_CANCEL_PHONE:
+            return cancel_phone_input(minor);
+        case AOA_HID_IOCTL_FLUSH:
+            return flush_phone_input(minor);
+        case AOA_HID_IOCTL_SCRIPT_STATUS:
+            get_script_status(runner, &status);
+            if(copy_to_user((void __user*)arg, &status, sizeof(status))){
+                return -EFAULT;
+            }
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+static int load_script(struct aoa_hid_script_load __user* user_load){
+    struct aoa_hid_script_load load;
+    if(copy_from_user(&load, user_load, sizeof(load))){
+        return -EFAULT;
+    }
+
+    if(load.size == 0 || load.size > AOA_HID_SCRIPT_MAX_SIZE){
+        printk("aoa_hid_driver - Error loading script, size %u is not between 1 and %d\n", load.size, AOA_HID_SCRIPT_MAX_SIZE);
+        return -EINVAL;
+    }
+
+    struct script* script = kmalloc(sizeof(struct script) + load.size, GFP_KERNEL);
+    if(!script){
+        return -ENOMEM;
+    }
+
+    if(copy_from_user(script->bytecode, u64_to_user_ptr(load.bytecode), load.size)){
+        kfree(script);
+        return -EFAULT;
+    }
+
+    int ret = validate_script(script->bytecode, load.size);
+    if(ret){
+        printk("aoa_hid_driver - Error loading script, bytecode is invalid at offset %d\n", -ret - 1);
+        kfree(script);
+        return -EINVAL;
+    }
+
+    kref_init(&script->ref);
+    script->size = load.size;
+
+    mutex_lock(&loaded_scripts_lock);
+    int i;
+    for(i = 0; i < MAX_LOADED_SCRIPTS; i++){
+        if(!loaded_scripts[i]){
+            loaded_scripts[i] = script;
+            break;
+        }
+    }
+    mutex_unlock(&loaded_scripts_lock);
+
+    if(i == MAX_LOADED_SCRIPTS){
+        printk("aoa_hid_driver - No more space for additional scripts\n");
+        kfree(script);
+        return -ENOMEM;
+    }
+
+    load.handle = i + 1;
+    if(put_user(load.handle, &user_load->handle)){
+        unload_script(load.handle);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static int unload_script(u32 handle){
+    if(handle == 0 || handle > MAX_LOADED_SCRIPTS){
+        return -EINVAL;
+    }
+
+    mutex_lock(&loaded_scripts_lock);
+    struct script* script = loaded_scripts[handle - 1];
+    loaded_scripts[handle - 1] = NULL;
+    mutex_unlock(&loaded_scripts_lock);
+
+    if(!script){
+        return -EINVAL;
+    }
+
+    // Phones still running the script hold their own reference
+    kref_put(&script->ref, release_script);
+    return 0;
+}
+
+static int run_script(struct script_runner* runner, u32 handle){
+    if(!get_usb_device(runner->minor)){
+        return -ENODEV;
+    }
+
+    if(handle == 0 || handle > MAX_LOADED_SCRIPTS){
+        return -EINVAL;
+    }
+
+    mutex_lock(&loaded_scripts_lock);
+    struct script* script = loaded_scripts[handle - 1];
+    if(script){
+        kref_get(&script->ref);
+    }
+    mutex_unlock(&loaded_scripts_lock);
+
+    if(!script){
+        return -EINVAL;
+    }
+
+    mutex_lock(&runner->lock);
+    if(runner->state == AOA_HID_SCRIPT_STATE_RUNNING){
+        mutex_unlock(&runner->lock);
+        kref_put(&script->ref, release_script);
+        return -EBUSY;
+    }
+
+    runner->script = script;
+    runner->handle = handle;
+    runner->error = 0;
+    runner->pc = 0;
+    runner->phase = 0;
+    runner->repeat_remaining = 0;
+    runner->loop_depth = 0;
+    runner->run++;
+    WRITE_ONCE(runner->state, AOA_HID_SCRIPT_STATE_RUNNING);
+    queue_delayed_work(get_transfer_workqueue(), &runner->work, 0);
+    mutex_unlock(&runner->lock);
+
+    return 0;
+}
+
+static bool cancel_script(struct script_runner* runner, bool release_all){
+    mutex_lock(&runner->lock);
+    bool was_running = runner->state == AOA_HID_SCRIPT_STATE_RUNNING;
+    if(was_running){
+        finish_script(runner, AOA_HID_SCRIPT_STATE_CANCELLED, 0);
+    }
+
+    // A report that is being sent may be a press, its release has to follow it, so the work item sends the releases when it is done
+    bool sending = runner->sending;
+    if(was_running && release_all && sending){
+        runner->release_pending = true;
+    }
+    mutex_unlock(&runner->lock);
+
+    // Detaching and unloading need the work item gone, the phone's transfers are killed there so the wait is short
+    if(!release_all){
+        cancel_delayed_work_sync(&runner->work);
+        return was_running;
+    }
+
+    // A work item that still runs finds the script cancelled once it has the lock again
+    cancel_delayed_work(&runner->work);
+
+    // The script may have been cancelled between a press and its release
+    if(was_running && !sending){
+        send_release_events(runner);
+    }
+
+    return was_running;
+}
+
+static void release_script(struct kref* ref){
+    kfree(container_of(ref, struct script, ref));
+}
+
+static void get_script_status(struct script_runner* runner, struct aoa_hid_script_status* status){
+    mutex_lock(&runner->lock);
+    status->handle = runner->handle;
+    status->state = runner->state;
+    status->error = runner->error;
+    status->offset = runner->pc;
+    mutex_unlock(&runner->lock);
+}
+
+// Uses release_event so that it does not race with a new run of the work item that fills hid_event
+static void send_release_events(struct script_runner* runner){
+    encode_keyboard_report((u8*)runner->release_event, 0x00, 0x00);
+    send_hid_event(runner->minor, runner->release_event, KEYBOARD_REPORT_SIZE);
+    encode_mouse_report((u8*)runner->release_event, 0x00, 0, 0, 0, 0);
+    send_hid_event(runner->minor, runner->release_event, MOUSE_REPORT_SIZE);
+    encode_consumer_report((u8*)runner->release_event, 0x00);
+    send_hid_event(runner->minor, runner->release_event, CONSUMER_REPORT_SIZE);
+}
+
+static int get_instruction_size(const u8* bytecode, u32 size, u32 pc){
+    int instruction_size;
+    switch(bytecode[pc]){
+        case AOA_HID_SCRIPT_OP_END:
+        case AOA_HID_SCRIPT_OP_CLICK:
+        case AOA_HID_SCRIPT_OP_END_LOOP:
+            instruction_size = 1;
+            break;
+        case AOA_HID_SCRIPT_OP_REPEAT:
+            instruction_size = 2;
+            break;
+        case AOA_HID_SCRIPT_OP_KEY:
+        case AOA_HID_SCRIPT_OP_CONSUMER:
+        case AOA_HID_SCRIPT_OP_DELAY:
+        case AOA_HID_SCRIPT_OP_LOOP:
+            instruction_size = 3;
+            break;
+        case AOA_HID_SCRIPT_OP_POINTER:
+            instruction_size = 4;
+            break;
+        case AOA_HID_SCRIPT_OP_TEXT:
+            if(pc + 1 >= size){
+                return -1;
+            }
+            instruction_size = 2 + bytecode[pc + 1];
+            break;
+        default:
+            return -1;
+    }
+
+    if(pc + instruction_size > size){
+        return -1;
+    }
+
+    return instruction_size;
+}
+
+// Returns 0 for valid bytecode, otherwise -(offset+1) of the offending instruction
+static int validate_script(const u8* bytecode, u32 size){
+    int loop_depth = 0;
+    bool repeat_target = false;
+    u32 pc = 0;
+
+    while(pc < size){
+        int instruction_size = get_instruction_size(bytecode, size, pc);
+        if(instruction_size < 0){
+            return -(int)pc - 1;
+        }
+
+        u8 opcode = bytecode[pc];
+        if(repeat_target && (opcode == AOA_HID_SCRIPT_OP_END || opcode == AOA_HID_SCRIPT_OP_LOOP || opcode == AOA_HID_SCRIPT_OP_END_LOOP || opcode == AOA_HID_SCRIPT_OP_REPEAT)){
+            return -(int)pc - 1;
+        }
+        repeat_target = false;
+
+        switch(opcode){
+            case AOA_HID_SCRIPT_OP_LOOP:
+                if((bytecode[pc + 1] | (bytecode[pc + 2] << 8)) == 0 || ++loop_depth > AOA_HID_SCRIPT_MAX_LOOP_DEPTH){
+                    return -(int)pc - 1;
+                }
+                break;
+            case AOA_HID_SCRIPT_OP_END_LOOP:
+                if(--loop_depth < 0){
+                    return -(int)pc - 1;
+                }
+                break;
+            case AOA_HID_SCRIPT_OP_REPEAT:
+                if(bytecode[pc + 1] == 0){
+                    return -(int)pc - 1;
+                }
+                repeat_target = true;
+                break;
+            default:
+                break;
+        }
+
+        pc += instruction_size;
+    }
+
+    if(loop_depth != 0 || repeat_target){
+        return -(int)size - 1;
+    }
+
+    return 0;
+}
+
+// Encodes at most one report into hid_event and sets report_size for it, returns 1 when the script has finished
+static int execute_step(struct script_runner* runner, unsigned int* delay_us, u16* report_size){
+    const u8* bytecode = runner->script->bytecode;
+    u32 size = runner->script->size;
+    u32 pc = runner->pc;
+    char* event = runner->hid_event;
+
+    if(pc >= size){
+        return 1;
+    }
+
+    int instruction_size = get_instruction_size(bytecode, size, pc);
+    unsigned char modifier, keycode;
+
+    switch(bytecode[pc]){
+        case AOA_HID_SCRIPT_OP_END:
+            return 1;
+        case AOA_HID_SCRIPT_OP_KEY:
+            if(runner->phase < 2){
+                if(runner->phase == 0){
+                    encode_keyboard_report((u8*)event, bytecode[pc + 1], bytecode[pc + 2]);
+                }
+                else{
+                    encode_keyboard_report((u8*)event, 0x00, 0x00);
+                }
+                runner->phase++;
+                *delay_us = get_hid_event_gap_us(runner->minor);
+                *report_size = KEYBOARD_REPORT_SIZE;
+                return 0;
+            }
+            break;
+        case AOA_HID_SCRIPT_OP_TEXT:
+            while(runner->phase < 2 * bytecode[pc + 1]){
+                if(!get_keyboard_keys(bytecode[pc + 2 + runner->phase / 2], &modifier, &keycode)){
+                    runner->phase += 2;
+                    continue;
+                }
+
+                if(runner->phase % 2 == 0){
+                    encode_keyboard_report((u8*)event, modifier, keycode);
+                }
+                else{
+                    encode_keyboard_report((u8*)event, 0x00, 0x00);
+                }
+                runner->phase++;
+                *delay_us = get_hid_event_gap_us(runner->minor);
+                *report_size = KEYBOARD_REPORT_SIZE;
+                return 0;
+            }
+            break;
+        case AOA_HID_SCRIPT_OP_POINTER:
+            encode_mouse_report((u8*)event, 0x00, bytecode[pc + 1], bytecode[pc + 2], (s8)bytecode[pc + 3] * MOUSE_SCROLL_UNITS_PER_NOTCH, 0);
+            next_instruction(runner, instruction_size);
+            *report_size = MOUSE_REPORT_SIZE;
+            return 0;
+        case AOA_HID_SCRIPT_OP_CLICK:
+            if(runner->phase < 2){
+                encode_mouse_report((u8*)event, (runner->phase == 0) ? 0x01 : 0x00, 0, 0, 0, 0);
+                runner->phase++;
+                *report_size = MOUSE_REPORT_SIZE;
+                return 0;
+            }
+            break;
+        case AOA_HID_SCRIPT_OP_CONSUMER:
+            if(runner->phase < 2){
+                encode_consumer_report((u8*)event, (runner->phase == 0) ? (bytecode[pc + 1] | (bytecode[pc + 2] << 8)) : 0x00);
+                runner->phase++;
+                *delay_us = get_hid_event_gap_us(runner->minor);
+                *report_size = CONSUMER_REPORT_SIZE;
+                return 0;
+            }
+            break;
+        case AOA_HID_SCRIPT_OP_DELAY:
+            *delay_us = (bytecode[pc + 1] | (bytecode[pc + 2] << 8)) * USEC_PER_MSEC;
+            break;
+        case AOA_HID_SCRIPT_OP_LOOP:
+            runner->loops[runner->loop_depth].start = pc + instruction_size;
+            runner->loops[runner->loop_depth].remaining = bytecode[pc + 1] | (bytecode[pc + 2] << 8);
+            runner->loop_depth++;
+            break;
+        case AOA_HID_SCRIPT_OP_END_LOOP:
+            if(--runner->loops[runner->loop_depth - 1].remaining > 0){
+                runner->pc = runner->loops[runner->loop_depth - 1].start;
+                runner->phase = 0;
+                return 0;
+            }
+            runner->loop_depth--;
+            break;
+        case AOA_HID_SCRIPT_OP_REPEAT:
+            runner->repeat_pc = pc + instruction_size;
+            runner->repeat_remaining = bytecode[pc + 1];
+            break;
+    }
+
+    next_instruction(runner, instruction_size);
+    return 0;
+}
+
+static void next_instruction(struct script_runner* runner, int instruction_size){
+    runner->phase = 0;
+
+    if(runner->repeat_remaining > 0 && runner->pc == runner->repeat_pc){
+        runner->repeat_remaining--;
+        if(runner->repeat_remaining > 0){
+            return;
+        }
+    }
+
+    runner->pc += instruction_size;
+}
+
+// Must be called with the runner lock held
+static void finish_script(struct script_runner* runner, u32 state, int error){
+    kref_put(&runner->script->ref, release_script);
+    runner->script = NULL;
+    runner->error = error;
+    WRITE_ONCE(runner->state, state);
+    wake_up_interruptible(&runner->wait);
+    wake_flush_waiters(runner->minor);
+}
+
+static void script_work(struct work_struct* work){
+    struct script_runner* runner = container_of(to_delayed_work(work), struct script_runner, work);
+
+    mutex_lock(&runner->lock);
+    if(runner->state != AOA_HID_SCRIPT_STATE_RUNNING){
+        mutex_unlock(&runner->lock);
+        return;
+    }
+
+    u32 run = runner->run;
+    unsigned int delay_us = 0;
+    for(int i=0; i<MAX_STEPS_PER_WORK && delay_us == 0; i++){
+        u16 report_size = 0;
+        int finished = execute_step(runner, &delay_us, &report_size);
+
+        if(report_size){
+            runner->sending = true;
+            mutex_unlock(&runner->lock);
+            int ret = send_hid_event(runner->minor, runner->hid_event, report_size);
+            mutex_lock(&runner->lock);
+            runner->sending = false;
+
+            // Cancelled while sending, the releases that cancel_script left to the work item go out after the report
+            if(runner->state != AOA_HID_SCRIPT_STATE_RUNNING || runner->run != run){
+                bool release_pending = runner->release_pending;
+                runner->release_pending = false;
+                mutex_unlock(&runner->lock);
+                if(release_pending){
+                    send_release_events(runner);
+                }
+                return;
+            }
+
+            if(ret < 0){
+                printk("aoa_hid_driver - Error running script on minor %d, transfer failed with %d at offset %u\n", runner->minor, ret, runner->pc);
+                finish_script(runner, AOA_HID_SCRIPT_STATE_FAILED, ret);
+                mutex_unlock(&runner->lock);
+                return;
+            }
+        }
+
+        if(finished){
+            finish_script(runner, AOA_HID_SCRIPT_STATE_DONE, 0);
+            mutex_unlock(&runner->lock);
+            return;
+        }
+    }
+
+    queue_delayed_work(get_transfer_workqueue(), &runner->work, usecs_to_jiffies(delay_us));
+    mutex_unlock(&runner->lock);
+}
+
+static int driver_open(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    if(atomic_cmpxchg((atomic_t*)&file_is_open[minor], 0, 1)){
+        printk("aoa_hid_driver - Error opening script device, device is already open\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+static int driver_close(struct inode* device_file, struct file* instance){
+    int minor = iminor(device_file);
+
+    if(!atomic_cmpxchg((atomic_t*)&file_is_open[minor], 1, 0)){
+        printk("aoa_hid_driver - Error closing script device, device is already closed\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+
+int setup_script(void);
+void cleanup_script(void);
+
+int add_script_device(int minor);
+void detach_script_device(int minor);
+void remove_script_device(int minor);
+
+// Stops the running script without releasing anything, returns 1 when a script was running
+int cancel_script_input(int minor);
+bool has_pending_script_input(int minor);
+
+#endif
@@ -0,0 +1,349 @@
+#include "sync.h"
+#include "../usb.h"
+#include "../transfer.h"
+#include "../aoa_hid_driver.h"
+
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/slab.h>
+
+struct sync_dispatch;
+
+struct sync_phone {
+    struct sync_dispatch* dispatch;
+    int minor;
+    int status;
+    bool acknowledged;
+    ktime_t first_completion;
+    struct urb* urbs[AOA_HID_SYNC_MAX_ENTRIES];
+};
+
+struct sync_dispatch {
+    // Releases entry released for every phone and rearms itself for the next entry
+    struct hrtimer timer;
+    u32 count;
+    u32 released;
+    bool timer_done;
+    u32 delays_us[AOA_HID_SYNC_MAX_ENTRIES];
+    int num_phones;
+    struct sync_phone phones[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+    // Protects the results in phones, completion handlers of different phones run concurrently
+    spinlock_t lock;
+    // One for every urb in flight plus one held by the timer until it has released the last entry
+    atomic_t outstanding;
+    struct completion done;
+};
+
+/*
+    Forward declarations for private functions for this sync.c file
+*/
+static long sync_ioctl(struct file* File, unsigned int cmd, unsigned long arg);
+static int submit_sync(struct aoa_hid_sync_submit __user* user_submit);
+static int stage_sync_dispatch(struct sync_dispatch* dispatch, u64 minors, const struct aoa_hid_raw_entry* entries);
+static void free_sync_dispatch(struct sync_dispatch* dispatch);
+static void collect_sync_results(struct sync_dispatch* dispatch, struct aoa_hid_sync_submit* submit);
+static enum hrtimer_restart sync_timer_callback(struct hrtimer* timer);
+static void sync_event_complete(void* context, int status);
+static void set_phone_status(struct sync_phone* phone, int status);
+static void put_outstanding(struct sync_dispatch* dispatch);
+
+static struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = sync_ioctl
+};
+
+static dev_t sync_device_nr;
+static struct cdev sync_device;
+static struct class* sync_device_class;
+
+int setup_sync(void){
+    BUILD_BUG_ON(AOA_HID_MAX_PHONES != NUM_POSSIBLE_ACCESSORY_MODE_DEVICES);
+
+    if(alloc_chrdev_region(&sync_device_nr, 0, 1, "android_sync") < 0){
+        printk("aoa_hid_driver - sync_device_nr could not be allocated\n");
+        goto setup_sync_error0;
+    }
+
+    if(!(sync_device_class = class_create("android_sync"))){
+        printk("aoa_hid_driver - Error creating class for android sync");
+        goto setup_sync_error1;
+    }
+
+    cdev_init(&sync_device, &fops);
+    if(cdev_add(&sync_device, sync_device_nr, 1)){
+        printk("aoa_hid_driver - Error adding sync device\n");
+        goto setup_sync_error2;
+    }
+
+    if(device_create(sync_device_class, NULL, sync_device_nr, NULL, "android_sync")==NULL){
+        printk("aoa_hid_driver - Can not create device file for sync\n");
+        goto setup_sync_error3;
+    }
+
+    return 0;
+
+setup_sync_error3:
+    cdev_del(&sync_device);
+
+setup_sync_error2:
+    class_destroy(sync_device_class);
+
+setup_sync_error1:
+    unregister_chrdev_region(sync_device_nr, 1);
+
+setup_sync_error0:
+    return -1;
+}
+
+void cleanup_sync(void){
+    device_destroy(sync_device_class, sync_device_nr);
+    cdev_del(&sync_device);
+    class_destroy(sync_device_class);
+    unregister_chrdev_region(sync_device_nr, 1);
+}
+
+static long sync_ioctl(struct file* File, unsigned int cmd, unsigned long arg){
+    switch(cmd){
+        case AOA_HID_IOCTL_SYNC_SUBMIT:
+            return submit_sync((struct aoa_hid_sync_submit __user*)arg);
+        default:
+            return -ENOTTY;
+    }
+}
+
+static int submit_sync(struct aoa_hid_sync_submit __user* user_submit){
+    struct aoa_hid_sync_submit* submit = kmalloc(sizeof(struct aoa_hid_sync_submit), GFP_KERNEL);
+    if(!submit){
+        return -ENOMEM;
+    }
+
+    int ret = -EFAULT;
+    if(copy_from_user(submit, user_submit, sizeof(struct aoa_hid_sync_submit))){
+        goto submit_sync_error0;
+    }
+
+    ret = -EINVAL;
+    if(submit->count == 0 || submit->count > AOA_HID_SYNC_MAX_ENTRIES || submit->minors == 0){
+        goto submit_sync_error0;
+    }
+
+    ret = -ENOMEM;
+    struct aoa_hid_raw_entry* entries = kmalloc_array(submit->count, sizeof(struct aoa_hid_raw_entry), GFP_KERNEL);
+    if(!entries){
+        goto submit_sync_error0;
+    }
+
+    ret = -EFAULT;
+    if(copy_from_user(entries, u64_to_user_ptr(submit->entries), submit->count * sizeof(struct aoa_hid_raw_entry))){
+        goto submit_sync_error1;
+    }
+
+    ret = -EINVAL;
+    for(u32 i=0; i<submit->count; i++){
+        if(entries[i].size == 0 || entries[i].size > AOA_HID_MAX_REPORT_SIZE){
+            printk("aoa_hid_driver - Error submitting sync dispatch, entry %u has an invalid size\n", i);
+            goto submit_sync_error1;
+        }
+
+        // Phones can have different descriptors registered, every selected phone that is attached has to declare the report
+        for(int minor=0; minor<AOA_HID_MAX_PHONES; minor++){
+            if((submit->minors & (1ULL << minor)) && get_usb_device(minor) && get_accessory_report_size(minor, entries[i].report[0]) != entries[i].size){
+                printk("aoa_hid_driver - Error submitting sync dispatch, entry %u does not match the HID descriptor of phone %d\n", i, minor);
+                goto submit_sync_error1;
+            }
+        }
+    }
+
+    ret = -ENOMEM;
+    struct sync_dispatch* dispatch = kzalloc(sizeof(struct sync_dispatch), GFP_KERNEL);
+    if(!dispatch){
+        goto submit_sync_error1;
+    }
+
+    spin_lock_init(&dispatch->lock);
+    init_completion(&dispatch->done);
+    hrtimer_setup(&dispatch->timer, sync_timer_callback, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    dispatch->count = submit->count;
+    for(u32 i=0; i<submit->count; i++){
+        dispatch->delays_us[i] = entries[i].delay_us;
+    }
+
+    // All allocations happen here, the timer only has to submit
+    ret = stage_sync_dispatch(dispatch, submit->minors, entries);
+    if(ret){
+        goto submit_sync_error2;
+    }
+
+    atomic_set(&dispatch->outstanding, 1);
+    hrtimer_start(&dispatch->timer, ns_to_ktime(submit->deadline_ns), HRTIMER_MODE_ABS);
+
+    if(wait_for_completion_interruptible(&dispatch->done)){
+        // Reports that were already released may have reached some phones, so this can not be restarted
+        hrtimer_cancel(&dispatch->timer);
+        if(!dispatch->timer_done){
+            put_outstanding(dispatch);
+        }
+        for(int i=0; i<dispatch->num_phones; i++){
+            for(u32 j=0; j<dispatch->count; j++){
+                usb_kill_urb(dispatch->phones[i].urbs[j]);
+            }
+        }
+        wait_for_completion(&dispatch->done);
+        ret = -EINTR;
+        goto submit_sync_error2;
+    }
+
+    collect_sync_results(dispatch, submit);
+    ret = 0;
+    if(copy_to_user(user_submit, submit, sizeof(struct aoa_hid_sync_submit))){
+        ret = -EFAULT;
+    }
+
+submit_sync_error2:
+    free_sync_dispatch(dispatch);
+
+submit_sync_error1:
+    kfree(entries);
+
+submit_sync_error0:
+    kfree(submit);
+    return ret;
+}
+
+// Fails with -ENODEV only when none of the selected phones is attached
+static int stage_sync_dispatch(struct sync_dispatch* dispatch, u64 minors, const struct aoa_hid_raw_entry* entries){
+    int attached = 0;
+    for(int minor=0; minor<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; minor++){
+        if(!(minors & BIT_ULL(minor))){
+            continue;
+        }
+
+        struct sync_phone* phone = &dispatch->phones[dispatch->num_phones++];
+        phone->dispatch = dispatch;
+        phone->minor = minor;
+
+        for(u32 i=0; i<dispatch->count; i++){
+            struct urb* urb = stage_hid_event(minor, entries[i].report, entries[i].size, sync_event_complete, phone);
+
+            // A phone that is not attached is left out and reported in its result, the others are still dispatched
+            if(urb == ERR_PTR(-ENODEV)){
+                phone->status = -ENODEV;
+                break;
+            }
+
+            if(IS_ERR(urb)){
+                return PTR_ERR(urb);
+            }
+            phone->urbs[i] = urb;
+        }
+
+        if(!phone->status){
+            attached++;
+        }
+    }
+
+    return attached ? 0 : -ENODEV;
+}
+
+static void free_sync_dispatch(struct sync_dispatch* dispatch){
+    for(int i=0; i<dispatch->num_phones; i++){
+        for(u32 j=0; j<dispatch->count; j++){
+            if(dispatch->phones[i].urbs[j]){
+                free_staged_hid_event(dispatch->phones[i].urbs[j]);
+            }
+        }
+    }
+
+    kfree(dispatch);
+}
+
+static void collect_sync_results(struct sync_dispatch* dispatch, struct aoa_hid_sync_submit* submit){
+    s64 earliest = S64_MAX;
+    s64 latest = S64_MIN;
+    ktime_t deadline = ns_to_ktime(submit->deadline_ns);
+
+    memset(submit->results, 0, sizeof(submit->results));
+    for(int i=0; i<dispatch->num_phones; i++){
+        struct sync_phone* phone = &dispatch->phones[i];
+        struct aoa_hid_sync_result* result = &submit->results[phone->minor];
+
+        result->status = phone->status;
+        if(phone->acknowledged){
+            result->offset_ns = ktime_to_ns(ktime_sub(phone->first_completion, deadline));
+        }
+
+        if(!phone->status){
+            earliest = min(earliest, result->offset_ns);
+            latest = max(latest, result->offset_ns);
+        }
+    }
+
+    submit->skew_ns = latest >= earliest ? latest - earliest : 0;
+}
+
+static enum hrtimer_restart sync_timer_callback(struct hrtimer* timer){
+    struct sync_dispatch* dispatch = container_of(timer, struct sync_dispatch, timer);
+    u32 entry = dispatch->released;
+
+    for(int i=0; i<dispatch->num_phones; i++){
+        struct sync_phone* phone = &dispatch->phones[i];
+
+        // A phone that failed does not get the rest of the reports, and a report the report hook dropped has no urb
+        if(READ_ONCE(phone->status) || !phone->urbs[entry]){
+            continue;
+        }
+
+        atomic_inc(&dispatch->outstanding);
+        int ret = release_hid_event(phone->urbs[entry]);
+        if(ret){
+            set_phone_status(phone, ret);
+            put_outstanding(dispatch);
+        }
+    }
+
+    dispatch->released++;
+    if(dispatch->released < dispatch->count){
+        hrtimer_set_expires(timer, ktime_add_us(hrtimer_get_expires(timer), dispatch->delays_us[entry]));
+        return HRTIMER_RESTART;
+    }
+
+    dispatch->timer_done = true;
+    put_outstanding(dispatch);
+    return HRTIMER_NORESTART;
+}
+
+static void sync_event_complete(void* context, int status){
+    struct sync_phone* phone = context;
+    struct sync_dispatch* dispatch = phone->dispatch;
+    ktime_t now = ktime_get();
+
+    // Transfers to one phone complete in order, so the first completion belongs to the first report
+    unsigned long flags;
+    spin_lock_irqsave(&dispatch->lock, flags);
+    if(!phone->acknowledged){
+        phone->acknowledged = true;
+        phone->first_completion = now;
+    }
+    spin_unlock_irqrestore(&dispatch->lock, flags);
+
+    if(status){
+        set_phone_status(phone, status);
+    }
+
+    put_outstanding(dispatch);
+}
+
+static void set_phone_status(struct sync_phone* phone, int status){
+    unsigned long flags;
+    spin_lock_irqsave(&phone->dispatch->lock, flags);
+    if(!phone->status){
+        WRITE_ONCE(phone->status, status);
+    }
+    spin_unlock_irqrestore(&phone->dispatch->lock, flags);
+}
+
+static void put_outstanding(struct sync_dispatch* dispatch){
+    if(atomic_dec_and_test(&dispatch->outstanding)){
+        complete(&dispatch->done);
+    }
+}
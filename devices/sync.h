@@ -0,0 +1,11 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include <linux/uaccess.h>
+#include <linux/cdev.h>
+
+// Unlike the other device files there is a single /dev/android_sync for all phones
+int setup_sync(void);
+void cleanup_sync(void);
+
+#endif
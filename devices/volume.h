@@ -1,13 +1,8 @@
 #ifndef VOLUME_H
 #define VOLUME_H
 
-#include <linux/uaccess.h>
-#include <linux/cdev.h>
+#include "function.h"
 
-int setup_volume(void);
-void cleanup_volume(void);
+extern const struct hid_function volume_function;
 
-int add_volume_device(int minor);
-void remove_volume_device(int minor);
-
-#endif
\ No newline at end of file
+#endif
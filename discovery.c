@@ -0,0 +1,157 @@
+#include "discovery.h"
+
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+
+#define DISCOVERY_CACHE_SIZE 64
+#define DISCOVERY_SERIAL_SIZE 64
+// Phones keep their answer, other devices are asked again after a while in case their firmware changed
+#define DISCOVERY_POSITIVE_EXPIRY_S (24 * 60 * 60)
+#define DISCOVERY_NEGATIVE_EXPIRY_S (10 * 60)
+
+struct discovery_entry {
+    bool used;
+    u32 id;
+    char serial[DISCOVERY_SERIAL_SIZE];
+    u16 protocol;
+    unsigned long expires;
+};
+
+/*
+    Forward declarations for private functions for this discovery.c file
+*/
+static bool is_phone_interface_class(u8 interface_class);
+static struct discovery_entry* find_entry(u32 id, const char* serial);
+
+static bool auto_discovery = false;
+static struct discovery_entry discovery_cache[DISCOVERY_CACHE_SIZE];
+static DEFINE_SPINLOCK(discovery_cache_lock);
+
+bool is_auto_discovery_enabled(void){
+    return READ_ONCE(auto_discovery);
+}
+
+void set_auto_discovery(bool enabled){
+    WRITE_ONCE(auto_discovery, enabled);
+}
+
+bool is_discovery_candidate(struct usb_device* usb_dev){
+    if(usb_dev->descriptor.bDeviceClass == USB_CLASS_HUB || !usb_dev->actconfig){
+        return false;
+    }
+
+    bool has_phone_interface = false;
+    for(int i = 0; i < usb_dev->actconfig->desc.bNumInterfaces; i++){
+        struct usb_interface* interface = usb_dev->actconfig->interface[i];
+        if(!interface || !interface->cur_altsetting){
+            continue;
+        }
+
+        // Phones do not expose HID interfaces, keyboards and mice answer vendor requests slowly if at all
+        u8 interface_class = interface->cur_altsetting->desc.bInterfaceClass;
+        if(interface_class == USB_CLASS_HID){
+            return false;
+        }
+        has_phone_interface |= is_phone_interface_class(interface_class);
+    }
+
+    return has_phone_interface;
+}
+
+// MTP and PTP, ADB and vendor functions, USB tethering
+static bool is_phone_interface_class(u8 interface_class){
+    switch(interface_class){
+        case USB_CLASS_STILL_IMAGE:
+        case USB_CLASS_VENDOR_SPEC:
+        case USB_CLASS_COMM:
+        case USB_CLASS_CDC_DATA:
+        case USB_CLASS_WIRELESS_CONTROLLER:
+        case USB_CLASS_MISC:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool lookup_discovery_cache(u32 id, const char* serial, u16* protocol){
+    unsigned long flags;
+    spin_lock_irqsave(&discovery_cache_lock, flags);
+
+    struct discovery_entry* entry = find_entry(id, serial);
+    bool found = entry && time_before(jiffies, entry->expires);
+    if(found){
+        *protocol = entry->protocol;
+    }
+
+    spin_unlock_irqrestore(&discovery_cache_lock, flags);
+    return found;
+}
+
+void add_discovery_cache(u32 id, const char* serial, u16 protocol){
+    unsigned long flags;
+    spin_lock_irqsave(&discovery_cache_lock, flags);
+
+    // Replaces the entry of the device, a free or expired one, or else the one that expires first
+    struct discovery_entry* entry = find_entry(id, serial);
+    for(int i = 0; !entry && i < DISCOVERY_CACHE_SIZE; i++){
+        if(!discovery_cache[i].used || time_after_eq(jiffies, discovery_cache[i].expires)){
+            entry = &discovery_cache[i];
+        }
+    }
+    if(!entry){
+        entry = &discovery_cache[0];
+        for(int i = 1; i < DISCOVERY_CACHE_SIZE; i++){
+            if(time_before(discovery_cache[i].expires, entry->expires)){
+                entry = &discovery_cache[i];
+            }
+        }
+    }
+
+    entry->used = true;
+    entry->id = id;
+    strscpy(entry->serial, serial ? serial : "", DISCOVERY_SERIAL_SIZE);
+    entry->protocol = protocol;
+    entry->expires = jiffies + (protocol >= 2 ? DISCOVERY_POSITIVE_EXPIRY_S : DISCOVERY_NEGATIVE_EXPIRY_S) * HZ;
+
+    spin_unlock_irqrestore(&discovery_cache_lock, flags);
+}
+
+void clear_discovery_cache(void){
+    unsigned long flags;
+    spin_lock_irqsave(&discovery_cache_lock, flags);
+    memset(discovery_cache, 0, sizeof(discovery_cache));
+    spin_unlock_irqrestore(&discovery_cache_lock, flags);
+}
+
+int show_discovery_cache(char* buffer){
+    int offset = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&discovery_cache_lock, flags);
+
+    for(int i = 0; i < DISCOVERY_CACHE_SIZE; i++){
+        struct discovery_entry* entry = &discovery_cache[i];
+        if(!entry->used || time_after_eq(jiffies, entry->expires)){
+            continue;
+        }
+
+        offset += sysfs_emit_at(buffer, offset, "%04x:%04x %s protocol=%u expires_s=%lu\n", entry->id >> 16, entry->id & 0xFFFF,
+            entry->serial[0] ? entry->serial : "-", entry->protocol, (entry->expires - jiffies) / HZ);
+    }
+
+    spin_unlock_irqrestore(&discovery_cache_lock, flags);
+    return offset;
+}
+
+// Serial numbers are truncated to the size of the cache entries on both sides of the comparison
+static struct discovery_entry* find_entry(u32 id, const char* serial){
+    for(int i = 0; i < DISCOVERY_CACHE_SIZE; i++){
+        struct discovery_entry* entry = &discovery_cache[i];
+        if(entry->used && entry->id == id && !strncmp(entry->serial, serial ? serial : "", DISCOVERY_SERIAL_SIZE - 1)){
+            return entry;
+        }
+    }
+
+    return NULL;
+}
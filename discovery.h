@@ -0,0 +1,27 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <linux/kernel.h>
+#include <linux/usb.h>
+
+// GET_PROTOCOL timeout for devices that are not known, a keyboard or hub that ignores the request only stalls its probe this long
+#define DISCOVERY_GET_PROTOCOL_TIMEOUT_MS 100
+
+/*
+    Auto discovery lets the default probe send GET_PROTOCOL to devices without a known id, off by default
+    The answers are cached per id and serial number so a device that is plugged in again is not asked again
+*/
+bool is_auto_discovery_enabled(void);
+void set_auto_discovery(bool enabled);
+
+// Whether the interfaces of the device look like those of a phone, hubs, HID devices and devices without any phone interface are skipped
+bool is_discovery_candidate(struct usb_device* usb_dev);
+
+// Returns whether the device is cached and not expired, protocol is the AOA protocol it reported, 0 for none
+bool lookup_discovery_cache(u32 id, const char* serial, u16* protocol);
+void add_discovery_cache(u32 id, const char* serial, u16 protocol);
+void clear_discovery_cache(void);
+// Writes one line per cached device to buffer, which is a sysfs page
+int show_discovery_cache(char* buffer);
+
+#endif
@@ -0,0 +1,157 @@
+#include "flight_recorder.h"
+#include "usb.h"
+
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+
+// Power of two so the position of a record is a mask of the ring's counter
+#define FLIGHT_RECORDER_SIZE 128
+// Payload kept per record, every report of the driver's own descriptor fits
+#define FLIGHT_RECORD_DATA_SIZE 16
+
+/*
+    Writers claim a slot by incrementing the ring's counter and publish it by setting sequence to the claimed position + 1
+    sequence is 0 while a record is written, readers skip records whose sequence changed while they copied them
+*/
+struct flight_record {
+    u32 sequence;
+    s16 status;
+    u8 size;
+    u8 data[FLIGHT_RECORD_DATA_SIZE];
+    u32 duration_us;
+    u64 submitted_ns;
+};
+
+struct flight_recorder {
+    atomic_t next;
+    bool frozen;
+    struct flight_record records[FLIGHT_RECORDER_SIZE];
+};
+
+/*
+    Forward declarations for private functions for this flight_recorder.c file
+*/
+static bool is_recorded_error(int status);
+static void clear_flight_recorder(struct flight_recorder* recorder);
+static int flight_recorder_show(struct seq_file* file, void* data);
+static int flight_recorder_open(struct inode* inode, struct file* file);
+static ssize_t flight_recorder_write(struct file* file, const char __user* buffer, size_t count, loff_t* offset);
+
+static struct flight_recorder flight_recorders[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static bool freeze_on_error = false;
+static struct dentry* debugfs_directory = NULL;
+
+static const struct file_operations flight_recorder_fops = {
+    .owner = THIS_MODULE,
+    .open = flight_recorder_open,
+    .read = seq_read,
+    .write = flight_recorder_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Failing to create debugfs files only costs the dumps, so the results are not checked like everywhere else in the kernel
+int setup_flight_recorder(void){
+    debugfs_directory = debugfs_create_dir("aoa_hid_driver", NULL);
+    debugfs_create_bool("freeze_on_error", 0660, debugfs_directory, &freeze_on_error);
+
+    struct dentry* recorder_directory = debugfs_create_dir("flight_recorder", debugfs_directory);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        char name[4];
+        snprintf(name, sizeof(name), "%d", i);
+        debugfs_create_file(name, 0660, recorder_directory, &flight_recorders[i], &flight_recorder_fops);
+    }
+
+    return 0;
+}
+
+void cleanup_flight_recorder(void){
+    debugfs_remove_recursive(debugfs_directory);
+}
+
+struct dentry* get_debugfs_directory(void){
+    return debugfs_directory;
+}
+
+void record_transfer(int minor, const char* event, u16 size, ktime_t submitted, int status){
+    struct flight_recorder* recorder = &flight_recorders[minor];
+    if(READ_ONCE(recorder->frozen)){
+        return;
+    }
+
+    u32 position = (u32)atomic_inc_return(&recorder->next) - 1;
+    struct flight_record* record = &recorder->records[position & (FLIGHT_RECORDER_SIZE - 1)];
+
+    WRITE_ONCE(record->sequence, 0);
+    smp_wmb();
+    record->status = status;
+    record->size = size;
+    memcpy(record->data, event, min_t(u16, size, FLIGHT_RECORD_DATA_SIZE));
+    record->submitted_ns = ktime_to_ns(submitted);
+    record->duration_us = (u32)ktime_us_delta(ktime_get(), submitted);
+    smp_store_release(&record->sequence, position + 1);
+
+    if(is_recorded_error(status) && READ_ONCE(freeze_on_error)){
+        WRITE_ONCE(recorder->frozen, true);
+    }
+}
+
+void reset_flight_recorder(int minor){
+    if(!READ_ONCE(flight_recorders[minor].frozen)){
+        clear_flight_recorder(&flight_recorders[minor]);
+    }
+}
+
+// Disconnects and cancellations kill transfers on purpose, they are recorded but do not freeze the ring
+static bool is_recorded_error(int status){
+    return status && status != -ENODEV && status != -ECANCELED && status != -ENOENT && status != -ECONNRESET && status != -ESHUTDOWN;
+}
+
+static void clear_flight_recorder(struct flight_recorder* recorder){
+    for(int i=0; i<FLIGHT_RECORDER_SIZE; i++){
+        WRITE_ONCE(recorder->records[i].sequence, 0);
+    }
+    atomic_set(&recorder->next, 0);
+    WRITE_ONCE(recorder->frozen, false);
+}
+
+// One line per record from the oldest, submission time, report, result and time until the transfer finished
+static int flight_recorder_show(struct seq_file* file, void* data){
+    struct flight_recorder* recorder = file->private;
+    u32 next = (u32)atomic_read(&recorder->next);
+    u32 first = next > FLIGHT_RECORDER_SIZE ? next - FLIGHT_RECORDER_SIZE : 0;
+
+    if(READ_ONCE(recorder->frozen)){
+        seq_puts(file, "frozen\n");
+    }
+
+    for(u32 position=first; position!=next; position++){
+        struct flight_record* slot = &recorder->records[position & (FLIGHT_RECORDER_SIZE - 1)];
+        struct flight_record record;
+
+        u32 sequence = smp_load_acquire(&slot->sequence);
+        memcpy(&record, slot, sizeof(record));
+        smp_rmb();
+        if(sequence != position + 1 || READ_ONCE(slot->sequence) != sequence){
+            continue;
+        }
+
+        seq_printf(file, "%llu id=%02x size=%u data=%*phN status=%d duration_us=%u\n", record.submitted_ns, record.data[0], record.size,
+            min_t(int, record.size, FLIGHT_RECORD_DATA_SIZE), record.data, record.status, record.duration_us);
+    }
+
+    return 0;
+}
+
+static int flight_recorder_open(struct inode* inode, struct file* file){
+    return single_open(file, flight_recorder_show, inode->i_private);
+}
+
+static ssize_t flight_recorder_write(struct file* file, const char __user* buffer, size_t count, loff_t* offset){
+    struct seq_file* seq = file->private_data;
+    clear_flight_recorder(seq->private);
+    return count;
+}
@@ -0,0 +1,23 @@
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+
+/*
+    Ring of the most recent reports sent to each phone with the outcome of their transfers, always on
+    Recording takes no lock and is safe from completion handlers, the rings are read from debugfs:
+    /sys/kernel/debug/aoa_hid_driver/flight_recorder/<minor>, writing anything to the file clears it
+    With freeze_on_error set a ring stops recording at the first failed transfer, so the reports before it are kept
+*/
+int setup_flight_recorder(void);
+void cleanup_flight_recorder(void);
+// The driver's directory in debugfs, the other debugfs files are created in it as well and go with it in cleanup_flight_recorder
+struct dentry* get_debugfs_directory(void);
+
+// Records a finished transfer, status is its result and submitted the time it was handed to the USB core
+void record_transfer(int minor, const char* event, u16 size, ktime_t submitted, int status);
+// Clears the ring of a newly attached phone unless it is frozen, a frozen ring holds what happened to the previous phone
+void reset_flight_recorder(int minor);
+
+#endif
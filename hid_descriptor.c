@@ -1,85 +1,74 @@
 #include "hid_descriptor.h"
+#include "aoa_hid_driver.h"
+#include "devices/function.h"
 #include <linux/slab.h>
+#include <linux/overflow.h>
 
-// https://usb.org/sites/default/files/hut1_21.pdf
-static char hid_descriptor[] = {
-    0x05, 0x01,                     // Usage Page (Generic Desktop Ctrls)
-    0x09, 0x06,                     // Usage (Keyboard)
-    0xA1, 0x01,                     // Collection (Application)
-    0x85, 0x01,                     //   Report ID (1)
-    0x05, 0x07,                     //   Usage Page (Kbrd/Keypad)
-    0x75, 0x01,                     //   Report Size (1)
-    0x95, 0x08,                     //   Report Count (8)
-    0x19, 0xE0,                     //   Usage Minimum (0xE0)
-    0x29, 0xE7,                     //   Usage Maximum (0xE7)
-    0x15, 0x00,                     //   Logical Minimum (0)
-    0x25, 0x01,                     //   Logical Maximum (1)
-    0x81, 0x02,                     //   Input (Data,Var,Absolute)
-    0x95, 0x01,                     //   Report Count (1)
-    0x75, 0x08,                     //   Report Size (8)
-    0x15, 0x00,                     //   Logical Minimum (0)
-    0x25, 0x64,                     //   Logical Maximum (100)
-    0x05, 0x07,                     //   Usage Page (Kbrd/Keypad)
-    0x19, 0x00,                     //   Usage Minimum (0x00)
-    0x29, 0x65,                     //   Usage Maximum (0x65)
-    0x81, 0x00,                     //   Input (Data,Array,Absolute)
-    0xC0,                           // End Collection
-
-    0x05, 0x01,                     // USAGE_PAGE (Generic Desktop)
-    0x09, 0x02,                     // USAGE (Mouse)
-    0xa1, 0x01,                     // COLLECTION (Application)
-    0x85, 0x02,                     //   Report ID (2)
-    0x09, 0x01,                     //   USAGE (Pointer)
-    0xA1, 0x00,                     //   COLLECTION (Physical)
-    0x05, 0x09,                     //     USAGE_PAGE (Button)
-    0x19, 0x01,                     //     USAGE_MINIMUM
-    0x29, 0x03,                     //     USAGE_MAXIMUM
-    0x15, 0x00,                     //     LOGICAL_MINIMUM (0)
-    0x25, 0x01,                     //     LOGICAL_MAXIMUM (1)
-    0x95, 0x03,                     //     REPORT_COUNT (3)
-    0x75, 0x01,                     //     REPORT_SIZE (1)
-    0x81, 0x02,                     //     INPUT (Data,Var,Abs)
-    0x95, 0x01,                     //     REPORT_COUNT (1)
-    0x75, 0x05,                     //     REPORT_SIZE (5)
-    0x81, 0x03,                     //     INPUT (Const,Var,Abs)
-    0x05, 0x01,                     //     USAGE_PAGE (Generic Desktop)
-    0x09, 0x30,                     //     USAGE (X)
-    0x09, 0x31,                     //     USAGE (Y)
-    0x09, 0x38,                     //     USAGE (Wheel)
-    0x15, 0x81,                     //     LOGICAL_MINIMUM (-127)
-    0x25, 0x7F,                     //     LOGICAL_MAXIMUM (127)
-    0x75, 0x08,                     //     REPORT_SIZE (8)
-    0x95, 0x03,                     //     REPORT_COUNT (3)
-    0x81, 0x06,                     //     INPUT (Data,Var,Rel)
-    0xC0,                           //   END_COLLECTION
-    0xC0,                           // END COLLECTION
-
-    0x05, 0x0c,                     // Usage Page (Consumer Devices)
-    0x09, 0x01,                     // Usage (Consumer Control)
-    0xa1, 0x01,                     // Collection (Application)
-    0x85, 0x03,                     //   Report ID (3)
-    0x19, 0x00,                     //   Usage Minimum (0),
-    0x2A, 0xCD, 0x02,               //   Usage Maximum (0x23C),
-    0x15, 0x00,                     //   Logical Minimum (0)
-    0x26, 0x3C, 0x02,               //   Logical Maximum (0x23C)
-    0x75, 0x10,                     //   Report Size (10)
-    0x95, 0x01,                     //   Report Count (1)
-    0x81, 0x00,                     //   Input (Data,Array,Absolute)
-    0xC0,                           // End Collection
+// Push items the parser keeps track of, deeper nesting is rejected
+#define HID_GLOBAL_STACK_SIZE 8
+
+// The global items that influence the input report layout, saved by Push and restored by Pop
+struct hid_global_state {
+    u32 report_size;
+    u32 report_count;
+    u8 report_id;
 };
 
+// Sizes in bytes of the input reports declared by the descriptor including the report ID byte if it has one, 0 for undeclared IDs
+static u16 input_report_sizes[256];
+
+// The descriptor is put together from the collections of the HID functions, kmalloc'ed so that it can be sent with usb_control_msg
 static char* dynamically_allocated_hid_descriptor = NULL;
+static u16 hid_descriptor_size = 0;
 
 int setup_hid_descriptor(void){
-    dynamically_allocated_hid_descriptor = kmalloc(sizeof(hid_descriptor), GFP_KERNEL);
+    // Functions sharing a report ID, like volume and brightness, share its collection, which is only added once
+    u32 size = 0;
+    for(int i=0; i<get_num_hid_functions(); i++){
+        const struct hid_function* function = get_hid_function(i);
+        if(get_first_hid_function(function->report_id) == function){
+            size += function->descriptor->size;
+        }
+    }
+
+    if(size > AOA_HID_MAX_DESCRIPTOR_SIZE){
+        printk("aoa_hid_driver - Error setting up HID descriptor, the functions need %u bytes\n", size);
+        goto setup_hid_descriptor_error0;
+    }
+
+    dynamically_allocated_hid_descriptor = kmalloc(size, GFP_KERNEL);
     if(!dynamically_allocated_hid_descriptor){
         goto setup_hid_descriptor_error0;
     }
 
-    memcpy(dynamically_allocated_hid_descriptor, hid_descriptor, sizeof(hid_descriptor));
+    hid_descriptor_size = 0;
+    for(int i=0; i<get_num_hid_functions(); i++){
+        const struct hid_function* function = get_hid_function(i);
+        if(get_first_hid_function(function->report_id) == function){
+            memcpy(dynamically_allocated_hid_descriptor + hid_descriptor_size, function->descriptor->data, function->descriptor->size);
+            hid_descriptor_size += function->descriptor->size;
+        }
+    }
+
+    if(parse_hid_report_sizes((const u8*)dynamically_allocated_hid_descriptor, hid_descriptor_size, input_report_sizes)){
+        printk("aoa_hid_driver - Error parsing HID descriptor\n");
+        goto setup_hid_descriptor_error1;
+    }
+
+    // Catches a function whose encoder and collection disagree before any phone gets the descriptor
+    for(int i=0; i<get_num_hid_functions(); i++){
+        const struct hid_function* function = get_hid_function(i);
+        if(input_report_sizes[function->report_id] != function->report_size){
+            printk("aoa_hid_driver - Error setting up HID descriptor, the %s report has %d bytes instead of %d\n", function->name, (int)input_report_sizes[function->report_id], (int)function->report_size);
+            goto setup_hid_descriptor_error1;
+        }
+    }
 
     return 0;
 
+setup_hid_descriptor_error1:
+    kfree(dynamically_allocated_hid_descriptor);
+
 setup_hid_descriptor_error0:
     return -1;
 }
@@ -93,5 +82,112 @@ char* get_hid_descriptor(void){
 }
 
 u16 get_hid_descriptor_size(void){
-    return (u16)sizeof(hid_descriptor);
+    return hid_descriptor_size;
+}
+
+u16 get_hid_report_size(u8 report_id){
+    return input_report_sizes[report_id];
+}
+
+// Only the items that influence the input report layout are interpreted, https://www.usb.org/sites/default/files/hid1_11.pdf section 6.2.2
+int parse_hid_report_sizes(const u8* descriptor, u16 size, u16* report_sizes){
+    // Too large for the stack
+    u32* report_bits = kcalloc(256, sizeof(u32), GFP_KERNEL);
+    if(!report_bits){
+        return -1;
+    }
+
+    int ret = -1;
+    struct hid_global_state global = {0};
+    struct hid_global_state stack[HID_GLOBAL_STACK_SIZE];
+    int stack_depth = 0;
+    // Reports of a descriptor without Report ID items are sent without the ID byte, they all end up as report 0
+    bool has_report_ids = false;
+
+    u16 i = 0;
+    while(i < size){
+        u8 prefix = descriptor[i];
+        if(prefix == 0xFE){
+            // Long items never describe report layout, skip them
+            if(i + 2 >= size){
+                goto parse_hid_report_sizes_exit;
+            }
+            i += 3 + descriptor[i + 1];
+            continue;
+        }
+
+        u8 data_size = (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+        if(i + 1 + data_size > size){
+            goto parse_hid_report_sizes_exit;
+        }
+
+        u32 data = 0;
+        for(int j=0; j<data_size; j++){
+            data |= ((u32)descriptor[i + 1 + j]) << (8 * j);
+        }
+
+        switch(prefix & 0xFC){
+            case 0x74:  // Report Size
+                global.report_size = data;
+                break;
+            case 0x94:  // Report Count
+                global.report_count = data;
+                break;
+            case 0x84:  // Report ID
+                if(data == 0 || data > 255){
+                    goto parse_hid_report_sizes_exit;
+                }
+                global.report_id = data;
+                has_report_ids = true;
+                break;
+            case 0xA4:  // Push
+                if(stack_depth == HID_GLOBAL_STACK_SIZE){
+                    goto parse_hid_report_sizes_exit;
+                }
+                stack[stack_depth++] = global;
+                break;
+            case 0xB4:  // Pop
+                if(stack_depth == 0){
+                    goto parse_hid_report_sizes_exit;
+                }
+                global = stack[--stack_depth];
+                break;
+            case 0x80: {    // Input
+                // Sizes a phone would never accept are rejected before they can wrap around
+                u32 bits;
+                if(check_mul_overflow(global.report_size, global.report_count, &bits) || check_add_overflow(report_bits[global.report_id], bits, &report_bits[global.report_id])){
+                    goto parse_hid_report_sizes_exit;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+
+        i += 1 + data_size;
+    }
+
+    // Once a descriptor uses report IDs every input report needs one
+    if(has_report_ids && report_bits[0]){
+        goto parse_hid_report_sizes_exit;
+    }
+
+    for(int id=0; id<256; id++){
+        u32 report_bytes = DIV_ROUND_UP(report_bits[id], 8);
+        u32 id_bytes = has_report_ids ? 1 : 0;
+        if(report_bytes == 0){
+            report_sizes[id] = 0;
+        }
+        else if(report_bytes + id_bytes > AOA_HID_MAX_REPORT_SIZE){
+            goto parse_hid_report_sizes_exit;
+        }
+        else{
+            report_sizes[id] = report_bytes + id_bytes;
+        }
+    }
+    ret = 0;
+
+parse_hid_report_sizes_exit:
+    kfree(report_bits);
+    return ret;
 }
\ No newline at end of file
@@ -9,4 +9,11 @@ void cleanup_hid_descriptor(void);
 char* get_hid_descriptor(void);
 u16 get_hid_descriptor_size(void);
 
+// Returns the size of the input report with the given ID including the ID byte, or 0 when the descriptor does not declare it
+u16 get_hid_report_size(u8 report_id);
+
+// Fills report_sizes, 256 entries indexed by report ID, for another descriptor, fails when a report does not fit AOA_HID_MAX_REPORT_SIZE
+// A descriptor without Report ID items declares a single report 0 without the ID byte, Push and Pop nest at most 8 deep
+int parse_hid_report_sizes(const u8* descriptor, u16 size, u16* report_sizes);
+
 #endif
\ No newline at end of file
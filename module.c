@@ -2,6 +2,8 @@
 #include <linux/init.h>
 #include "sys_files.h"
 #include "usb.h"
+#include "netlink.h"
+#include "report_hook.h"
 
 static int aoa_hid_driver_module_init(void){
 	printk("aoa_hid_driver - aoa_hid_driver_module_init\n");
@@ -10,12 +12,25 @@ static int aoa_hid_driver_module_init(void){
 		goto module_init_error0;
 	}
 
-	if(setup_usb()){
+	// Phones can attach as soon as the USB drivers are registered, their events need the netlink family
+	if(setup_netlink()){
 		goto module_init_error1;
 	}
 
+	// BPF programs can attach to the report hook before the first phone, the kfuncs go away with the module
+	if(setup_report_hook()){
+		goto module_init_error2;
+	}
+
+	if(setup_usb()){
+		goto module_init_error2;
+	}
+
 	return 0;
 
+module_init_error2:
+	cleanup_netlink();
+
 module_init_error1:
 	cleanup_sysfs();
 
@@ -29,6 +44,7 @@ static void aoa_hid_driver_module_exit(void){
 
 	cleanup_sysfs();
 	cleanup_usb();
+	cleanup_netlink();
 }
 
 module_init(aoa_hid_driver_module_init);
@@ -0,0 +1,242 @@
+#include "netlink.h"
+#include "sys_files.h"
+#include "usb.h"
+#include "transfer.h"
+#include "aoa_hid_driver.h"
+
+#include <net/genetlink.h>
+
+/*
+    Forward declarations for private functions for this netlink.c file
+*/
+static int add_known_doit(struct sk_buff* skb, struct genl_info* info);
+static int remove_known_doit(struct sk_buff* skb, struct genl_info* info);
+static int get_known_doit(struct sk_buff* skb, struct genl_info* info);
+static int get_phones_dumpit(struct sk_buff* skb, struct netlink_callback* cb);
+static int collect_device_ids(struct genl_info* info, u32* ids);
+static int put_phone_attributes(struct sk_buff* skb, struct usb_device* usb_dev, int minor);
+
+static const struct nla_policy aoa_hid_genl_policy[AOA_HID_ATTR_MAX + 1] = {
+    [AOA_HID_ATTR_DEVICE_ID] = {.type = NLA_U32},
+    [AOA_HID_ATTR_MINOR] = {.type = NLA_U32},
+    [AOA_HID_ATTR_SERIAL] = {.type = NLA_NUL_STRING},
+    [AOA_HID_ATTR_PATH] = {.type = NLA_NUL_STRING},
+    [AOA_HID_ATTR_HEALTH] = {.type = NLA_U32},
+    [AOA_HID_ATTR_EVENT] = {.type = NLA_U32},
+    [AOA_HID_ATTR_ERROR] = {.type = NLA_S32},
+};
+
+static const struct genl_ops aoa_hid_genl_ops[] = {
+    {
+        .cmd = AOA_HID_CMD_ADD_KNOWN,
+        .flags = GENL_ADMIN_PERM,
+        .doit = add_known_doit,
+    },
+    {
+        .cmd = AOA_HID_CMD_REMOVE_KNOWN,
+        .flags = GENL_ADMIN_PERM,
+        .doit = remove_known_doit,
+    },
+    {
+        .cmd = AOA_HID_CMD_GET_KNOWN,
+        .doit = get_known_doit,
+    },
+    {
+        .cmd = AOA_HID_CMD_GET_PHONES,
+        .dumpit = get_phones_dumpit,
+    },
+};
+
+static const struct genl_multicast_group aoa_hid_genl_groups[] = {
+    {.name = AOA_HID_GENL_EVENTS},
+};
+
+static struct genl_family aoa_hid_genl_family = {
+    .name = AOA_HID_GENL_NAME,
+    .version = AOA_HID_GENL_VERSION,
+    .maxattr = AOA_HID_ATTR_MAX,
+    .policy = aoa_hid_genl_policy,
+    .module = THIS_MODULE,
+    .ops = aoa_hid_genl_ops,
+    .n_ops = ARRAY_SIZE(aoa_hid_genl_ops),
+    .resv_start_op = AOA_HID_CMD_UNSPEC + 1,
+    .mcgrps = aoa_hid_genl_groups,
+    .n_mcgrps = ARRAY_SIZE(aoa_hid_genl_groups),
+};
+
+static bool family_registered = false;
+
+int setup_netlink(void){
+    if(genl_register_family(&aoa_hid_genl_family)){
+        printk("aoa_hid_driver - Error registering generic netlink family\n");
+        return -1;
+    }
+
+    WRITE_ONCE(family_registered, true);
+
+    return 0;
+}
+
+void cleanup_netlink(void){
+    WRITE_ONCE(family_registered, false);
+    genl_unregister_family(&aoa_hid_genl_family);
+}
+
+void notify_phone_event(u32 event, struct usb_device* usb_dev, int minor, int error){
+    // Events are dropped while nobody listens, so an idle farm costs no allocations
+    if(!READ_ONCE(family_registered) || !genl_has_listeners(&aoa_hid_genl_family, &init_net, 0)){
+        return;
+    }
+
+    struct sk_buff* skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_ATOMIC);
+    if(!skb){
+        return;
+    }
+
+    void* header = genlmsg_put(skb, 0, 0, &aoa_hid_genl_family, 0, AOA_HID_CMD_EVENT);
+    if(!header){
+        goto notify_phone_event_error0;
+    }
+
+    if(nla_put_u32(skb, AOA_HID_ATTR_EVENT, event) || put_phone_attributes(skb, usb_dev, minor)){
+        goto notify_phone_event_error0;
+    }
+
+    if(error && nla_put_s32(skb, AOA_HID_ATTR_ERROR, error)){
+        goto notify_phone_event_error0;
+    }
+
+    genlmsg_end(skb, header);
+    genlmsg_multicast(&aoa_hid_genl_family, skb, 0, 0, GFP_ATOMIC);
+    return;
+
+notify_phone_event_error0:
+    nlmsg_free(skb);
+}
+
+static int add_known_doit(struct sk_buff* skb, struct genl_info* info){
+    u32 ids[MAX_ANDROID_DEVICE_IDS];
+    int count = collect_device_ids(info, ids);
+    if(count < 0){
+        return count;
+    }
+
+    return add_known_devices(ids, count);
+}
+
+static int remove_known_doit(struct sk_buff* skb, struct genl_info* info){
+    u32 ids[MAX_ANDROID_DEVICE_IDS];
+    int count = collect_device_ids(info, ids);
+    if(count < 0){
+        return count;
+    }
+
+    remove_known_devices(ids, count);
+
+    return 0;
+}
+
+static int get_known_doit(struct sk_buff* skb, struct genl_info* info){
+    u32 ids[MAX_ANDROID_DEVICE_IDS];
+    int count = get_known_devices(ids, MAX_ANDROID_DEVICE_IDS);
+
+    struct sk_buff* reply = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+    if(!reply){
+        return -ENOMEM;
+    }
+
+    void* header = genlmsg_put_reply(reply, info, &aoa_hid_genl_family, 0, AOA_HID_CMD_GET_KNOWN);
+    if(!header){
+        goto get_known_doit_error0;
+    }
+
+    for(int i=0; i<count; i++){
+        if(nla_put_u32(reply, AOA_HID_ATTR_DEVICE_ID, ids[i])){
+            goto get_known_doit_error0;
+        }
+    }
+
+    genlmsg_end(reply, header);
+    return genlmsg_reply(reply, info);
+
+get_known_doit_error0:
+    nlmsg_free(reply);
+    return -EMSGSIZE;
+}
+
+static int get_phones_dumpit(struct sk_buff* skb, struct netlink_callback* cb){
+    // cb->args[0] is the minor the next message of the dump starts at
+    int minor;
+    for(minor=cb->args[0]; minor<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; minor++){
+        struct accessory_device* dev = get_accessory_device(minor);
+        if(!dev){
+            continue;
+        }
+
+        void* header = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq, &aoa_hid_genl_family, NLM_F_MULTI, AOA_HID_CMD_GET_PHONES);
+        if(!header){
+            put_accessory_device(dev);
+            break;
+        }
+
+        if(put_phone_attributes(skb, dev->usb_dev, minor) || nla_put_u32(skb, AOA_HID_ATTR_HEALTH, get_transfer_health(minor))){
+            genlmsg_cancel(skb, header);
+            put_accessory_device(dev);
+            break;
+        }
+
+        genlmsg_end(skb, header);
+        put_accessory_device(dev);
+    }
+
+    cb->args[0] = minor;
+    return skb->len;
+}
+
+// Returns the number of AOA_HID_ATTR_DEVICE_ID attributes copied to ids, the request may repeat the attribute
+static int collect_device_ids(struct genl_info* info, u32* ids){
+    int count = 0;
+    const struct nlattr* attr;
+    int remaining;
+
+    nla_for_each_attr(attr, genlmsg_data(info->genlhdr), genlmsg_len(info->genlhdr), remaining){
+        if(nla_type(attr) != AOA_HID_ATTR_DEVICE_ID){
+            continue;
+        }
+
+        if(count == MAX_ANDROID_DEVICE_IDS){
+            NL_SET_ERR_MSG(info->extack, "Too many device ids");
+            return -E2BIG;
+        }
+
+        ids[count++] = nla_get_u32(attr);
+    }
+
+    if(count == 0){
+        NL_SET_ERR_MSG(info->extack, "No device ids");
+        return -EINVAL;
+    }
+
+    return count;
+}
+
+static int put_phone_attributes(struct sk_buff* skb, struct usb_device* usb_dev, int minor){
+    if(minor >= 0 && nla_put_u32(skb, AOA_HID_ATTR_MINOR, minor)){
+        return -EMSGSIZE;
+    }
+
+    if(!usb_dev){
+        return 0;
+    }
+
+    u32 id = (((u32)le16_to_cpu(usb_dev->descriptor.idVendor)) << 16) | le16_to_cpu(usb_dev->descriptor.idProduct);
+    if(nla_put_u32(skb, AOA_HID_ATTR_DEVICE_ID, id) || nla_put_string(skb, AOA_HID_ATTR_PATH, dev_name(&usb_dev->dev))){
+        return -EMSGSIZE;
+    }
+
+    if(usb_dev->serial && nla_put_string(skb, AOA_HID_ATTR_SERIAL, usb_dev->serial)){
+        return -EMSGSIZE;
+    }
+
+    return 0;
+}
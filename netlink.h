@@ -0,0 +1,15 @@
+#ifndef NETLINK_H
+#define NETLINK_H
+
+#include <linux/usb.h>
+
+int setup_netlink(void);
+void cleanup_netlink(void);
+
+/*
+    Multicasts an AOA_HID_EVENT_* to the event group, safe to call from atomic context
+    minor is -1 before the phone got one, usb_dev may be NULL when only the minor is known
+*/
+void notify_phone_event(u32 event, struct usb_device* usb_dev, int minor, int error);
+
+#endif
@@ -0,0 +1,190 @@
+#include "reattach.h"
+#include "usb.h"
+
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#define REATTACH_SERIAL_SIZE 64
+
+struct minor_reservation {
+    bool reserved;
+    char serial[REATTACH_SERIAL_SIZE];
+    unsigned long expires;
+    struct delayed_work work;
+};
+
+/*
+    Forward declarations for private functions for this reattach.c file
+*/
+static void reservation_work(struct work_struct* work);
+
+static u32 reattach_grace_ms = REATTACH_DEFAULT_GRACE_MS;
+static int reattach_policy = REATTACH_POLICY_QUEUE;
+static struct minor_reservation reservations[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static wait_queue_head_t reattach_waits[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static DEFINE_SPINLOCK(reservations_lock);
+
+void setup_reattach(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        reservations[i].reserved = false;
+        INIT_DELAYED_WORK(&reservations[i].work, reservation_work);
+        init_waitqueue_head(&reattach_waits[i]);
+    }
+}
+
+// Reservations still running are ended by cleanup_usb before, this only makes sure no work item is left
+void cleanup_reattach(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        cancel_delayed_work_sync(&reservations[i].work);
+    }
+}
+
+u32 get_reattach_grace_ms(void){
+    return READ_ONCE(reattach_grace_ms);
+}
+
+void set_reattach_grace_ms(u32 grace_ms){
+    WRITE_ONCE(reattach_grace_ms, min_t(u32, grace_ms, REATTACH_MAX_GRACE_MS));
+}
+
+int get_reattach_policy(void){
+    return READ_ONCE(reattach_policy);
+}
+
+void set_reattach_policy(int policy){
+    WRITE_ONCE(reattach_policy, policy);
+
+    // Writers already waiting follow the new policy
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        wake_up_interruptible(&reattach_waits[i]);
+    }
+}
+
+bool reserve_minor(int minor, const char* serial){
+    u32 grace_ms = get_reattach_grace_ms();
+    if(!grace_ms || !serial || !serial[0]){
+        return false;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&reservations_lock, flags);
+    struct minor_reservation* reservation = &reservations[minor];
+    reservation->reserved = true;
+    strscpy(reservation->serial, serial, REATTACH_SERIAL_SIZE);
+    reservation->expires = jiffies + msecs_to_jiffies(grace_ms);
+    spin_unlock_irqrestore(&reservations_lock, flags);
+
+    mod_delayed_work(system_wq, &reservation->work, msecs_to_jiffies(grace_ms));
+    return true;
+}
+
+// Serial numbers are truncated to the size of the reservations on both sides of the comparison
+int claim_reserved_minor(const char* serial){
+    if(!serial || !serial[0]){
+        return -1;
+    }
+
+    int minor = -1;
+    unsigned long flags;
+    spin_lock_irqsave(&reservations_lock, flags);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(reservations[i].reserved && !strncmp(reservations[i].serial, serial, REATTACH_SERIAL_SIZE - 1)){
+            reservations[i].reserved = false;
+            minor = i;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&reservations_lock, flags);
+
+    // A work item that already started finds the reservation gone and leaves the device files alone
+    if(minor >= 0){
+        cancel_delayed_work(&reservations[minor].work);
+    }
+
+    return minor;
+}
+
+bool is_minor_reserved(int minor){
+    unsigned long flags;
+    spin_lock_irqsave(&reservations_lock, flags);
+    bool reserved = reservations[minor].reserved;
+    spin_unlock_irqrestore(&reservations_lock, flags);
+    return reserved;
+}
+
+bool is_phone_present(int minor){
+    return get_usb_device(minor) || is_minor_reserved(minor);
+}
+
+bool drop_reserved_minor(int minor){
+    unsigned long flags;
+    spin_lock_irqsave(&reservations_lock, flags);
+    bool reserved = reservations[minor].reserved;
+    reservations[minor].reserved = false;
+    spin_unlock_irqrestore(&reservations_lock, flags);
+
+    // Waiting writers see the phone gone for good
+    if(reserved){
+        cancel_delayed_work(&reservations[minor].work);
+        wake_up_interruptible(&reattach_waits[minor]);
+    }
+
+    return reserved;
+}
+
+void wake_reattach_waiters(int minor){
+    wake_up_interruptible(&reattach_waits[minor]);
+}
+
+int wait_for_reattach(int minor, bool nonblock){
+    if(get_usb_device(minor)){
+        return 0;
+    }
+
+    if(!is_minor_reserved(minor)){
+        return -ENODEV;
+    }
+
+    if(nonblock || get_reattach_policy() == REATTACH_POLICY_FAIL){
+        return -EAGAIN;
+    }
+
+    if(wait_event_interruptible(reattach_waits[minor], get_usb_device(minor) || !is_minor_reserved(minor) || get_reattach_policy() == REATTACH_POLICY_FAIL)){
+        return -ERESTARTSYS;
+    }
+
+    if(get_usb_device(minor)){
+        return 0;
+    }
+
+    return is_minor_reserved(minor) ? -EAGAIN : -ENODEV;
+}
+
+int show_reserved_minors(char* buffer){
+    int offset = 0;
+    unsigned long flags;
+    spin_lock_irqsave(&reservations_lock, flags);
+
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        struct minor_reservation* reservation = &reservations[i];
+        if(!reservation->reserved){
+            continue;
+        }
+
+        unsigned long remaining = time_after(reservation->expires, jiffies) ? reservation->expires - jiffies : 0;
+        offset += sysfs_emit_at(buffer, offset, "%d %s expires_ms=%u\n", i, reservation->serial, jiffies_to_msecs(remaining));
+    }
+
+    spin_unlock_irqrestore(&reservations_lock, flags);
+    return offset;
+}
+
+static void reservation_work(struct work_struct* work){
+    struct minor_reservation* reservation = container_of(to_delayed_work(work), struct minor_reservation, work);
+    expire_reserved_minor(reservation - reservations);
+}
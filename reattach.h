@@ -0,0 +1,48 @@
+#ifndef REATTACH_H
+#define REATTACH_H
+
+#include <linux/kernel.h>
+
+#define REATTACH_DEFAULT_GRACE_MS 30000
+#define REATTACH_MAX_GRACE_MS (10 * 60 * 1000)
+
+// What writes to the device files of a phone within its grace period do
+#define REATTACH_POLICY_QUEUE 0     // Block until the phone is back, non-blocking writers get -EAGAIN
+#define REATTACH_POLICY_FAIL 1      // Fail with -EAGAIN right away
+#define NUM_REATTACH_POLICIES 2
+
+/*
+    A phone that drops off the bus keeps its minor and its device files for a grace period, reserved for its serial number
+    When a phone with that serial number attaches again within the grace period it gets the same minor back and the open files
+    keep working, otherwise the device files are removed once the grace period is over
+*/
+void setup_reattach(void);
+void cleanup_reattach(void);
+
+u32 get_reattach_grace_ms(void);
+void set_reattach_grace_ms(u32 grace_ms);
+int get_reattach_policy(void);
+void set_reattach_policy(int policy);
+
+// Reserves the minor for the serial number, returns false when there is no grace period or no serial number to match
+bool reserve_minor(int minor, const char* serial);
+// Takes back the minor reserved for the serial number, returns -1 when there is none
+int claim_reserved_minor(const char* serial);
+bool is_minor_reserved(int minor);
+// Whether the phone is attached or within its grace period, readers of its device files keep waiting in both cases
+bool is_phone_present(int minor);
+// Ends the reservation without waiting for the grace period, returns whether the minor was reserved
+bool drop_reserved_minor(int minor);
+// Wakes the writers waiting for the phone, called once it attached again
+void wake_reattach_waiters(int minor);
+
+/*
+    Called by writers before they queue input for a phone, returns 0 once the phone is attached, -ENODEV when it is gone for
+    good and -EAGAIN while it is within its grace period for non-blocking writers or under REATTACH_POLICY_FAIL
+*/
+int wait_for_reattach(int minor, bool nonblock);
+
+// Writes one line per reserved minor to buffer, which is a sysfs page
+int show_reserved_minors(char* buffer);
+
+#endif
@@ -0,0 +1,99 @@
+#include "report_hook.h"
+
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/error-injection.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+/*
+    Forward declarations for private functions for this report_hook.c file
+*/
+static int fill_report_ctx(int minor, const char* event, u16 size, struct aoa_hid_report_ctx* ctx);
+
+#if IS_ENABLED(CONFIG_BPF_SYSCALL) && IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES)
+
+/*
+    Attach point for fmod_ret programs, called once per report just before it is transferred
+    Returning 0 sends the report, a positive count sends it that many times and a negative errno drops it silently
+    Without a program attached this is a call that returns 0
+*/
+__bpf_hook_start();
+
+noinline int aoa_hid_bpf_report_event(struct aoa_hid_report_ctx* ctx){
+    return 0;
+}
+ALLOW_ERROR_INJECTION(aoa_hid_bpf_report_event, ERRNO);
+
+__bpf_hook_end();
+
+__bpf_kfunc_start_defs();
+
+// Writable pointer to rdwr_buf_size bytes of the report from offset, NULL when they are not all inside the report
+__bpf_kfunc u8* aoa_hid_bpf_get_data(struct aoa_hid_report_ctx* ctx, unsigned int offset, const size_t rdwr_buf_size){
+    if(offset > ctx->size || rdwr_buf_size > ctx->size - offset){
+        return NULL;
+    }
+
+    return ctx->data + offset;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(report_hook_kfunc_ids)
+BTF_ID_FLAGS(func, aoa_hid_bpf_get_data, KF_RET_NULL)
+BTF_KFUNCS_END(report_hook_kfunc_ids)
+
+static const struct btf_kfunc_id_set report_hook_kfunc_set = {
+    .owner = THIS_MODULE,
+    .set = &report_hook_kfunc_ids,
+};
+
+int setup_report_hook(void){
+    int ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &report_hook_kfunc_set);
+    if(ret){
+        printk("aoa_hid_driver - Error registering BPF kfuncs for the report hook, register_btf_kfunc_id_set returned %d\n", ret);
+    }
+
+    return ret;
+}
+
+int run_report_hook(int minor, const char* event, u16 size, struct aoa_hid_report_ctx* ctx){
+    int ret = fill_report_ctx(minor, event, size, ctx);
+    if(ret){
+        return ret;
+    }
+
+    // A drop is the program's decision and not a failed write, the sender sends no copies and reports success
+    ret = aoa_hid_bpf_report_event(ctx);
+    if(ret < 0){
+        return 0;
+    }
+
+    return ret == 0 ? 1 : min(ret, REPORT_HOOK_MAX_COPIES);
+}
+
+#else
+
+int setup_report_hook(void){
+    return 0;
+}
+
+int run_report_hook(int minor, const char* event, u16 size, struct aoa_hid_report_ctx* ctx){
+    int ret = fill_report_ctx(minor, event, size, ctx);
+    return ret ? ret : 1;
+}
+
+#endif
+
+static int fill_report_ctx(int minor, const char* event, u16 size, struct aoa_hid_report_ctx* ctx){
+    if(size == 0 || size > AOA_HID_MAX_REPORT_SIZE){
+        return -EINVAL;
+    }
+
+    ctx->minor = minor;
+    ctx->report_id = event[0];
+    ctx->size = size;
+    memcpy(ctx->data, event, size);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef REPORT_HOOK_H
+#define REPORT_HOOK_H
+
+#include <linux/kernel.h>
+#include "aoa_hid_driver.h"
+
+// Most copies of one report a hook can ask for
+#define REPORT_HOOK_MAX_COPIES 8
+
+/*
+    A report on its way to a phone as seen by BPF programs attached to aoa_hid_bpf_report_event
+    Programs read the fields through BTF and get a writable pointer to data from the aoa_hid_bpf_get_data kfunc
+*/
+struct aoa_hid_report_ctx {
+    u32 minor;
+    u8 report_id;
+    u16 size;
+    u8 data[AOA_HID_MAX_REPORT_SIZE];
+};
+
+// Registers the kfuncs for the programs, without BPF support in the kernel there is nothing to register and reports pass unchanged
+int setup_report_hook(void);
+
+/*
+    Copies the report into ctx and lets the attached programs modify it, returns how many times ctx->data is to be sent
+    A negative errno from a program drops the report and returns 0, a negative value is only returned for a report of invalid size
+*/
+int run_report_hook(int minor, const char* event, u16 size, struct aoa_hid_report_ctx* ctx);
+
+#endif
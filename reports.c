@@ -0,0 +1,262 @@
+#include "reports.h"
+
+#include <linux/errno.h>
+
+// https://usb.org/sites/default/files/hut1_21.pdf
+static const u8 keyboard_collection[] = {
+    0x05, 0x01,                     // Usage Page (Generic Desktop Ctrls)
+    0x09, 0x06,                     // Usage (Keyboard)
+    0xA1, 0x01,                     // Collection (Application)
+    0x85, 0x01,                     //   Report ID (1)
+    0x05, 0x07,                     //   Usage Page (Kbrd/Keypad)
+    0x75, 0x01,                     //   Report Size (1)
+    0x95, 0x08,                     //   Report Count (8)
+    0x19, 0xE0,                     //   Usage Minimum (0xE0)
+    0x29, 0xE7,                     //   Usage Maximum (0xE7)
+    0x15, 0x00,                     //   Logical Minimum (0)
+    0x25, 0x01,                     //   Logical Maximum (1)
+    0x81, 0x02,                     //   Input (Data,Var,Absolute)
+    0x95, 0x01,                     //   Report Count (1)
+    0x75, 0x08,                     //   Report Size (8)
+    0x15, 0x00,                     //   Logical Minimum (0)
+    0x25, 0x64,                     //   Logical Maximum (100)
+    0x05, 0x07,                     //   Usage Page (Kbrd/Keypad)
+    0x19, 0x00,                     //   Usage Minimum (0x00)
+    0x29, 0x65,                     //   Usage Maximum (0x65)
+    0x81, 0x00,                     //   Input (Data,Array,Absolute)
+    0xC0,                           // End Collection
+};
+const struct report_descriptor keyboard_report_descriptor = {keyboard_collection, sizeof(keyboard_collection)};
+
+static const u8 mouse_collection[] = {
+    0x05, 0x01,                     // USAGE_PAGE (Generic Desktop)
+    0x09, 0x02,                     // USAGE (Mouse)
+    0xa1, 0x01,                     // COLLECTION (Application)
+    0x85, 0x02,                     //   Report ID (2)
+    0x09, 0x01,                     //   USAGE (Pointer)
+    0xA1, 0x00,                     //   COLLECTION (Physical)
+    0x05, 0x09,                     //     USAGE_PAGE (Button)
+    0x19, 0x01,                     //     USAGE_MINIMUM
+    0x29, 0x03,                     //     USAGE_MAXIMUM
+    0x15, 0x00,                     //     LOGICAL_MINIMUM (0)
+    0x25, 0x01,                     //     LOGICAL_MAXIMUM (1)
+    0x95, 0x03,                     //     REPORT_COUNT (3)
+    0x75, 0x01,                     //     REPORT_SIZE (1)
+    0x81, 0x02,                     //     INPUT (Data,Var,Abs)
+    0x95, 0x01,                     //     REPORT_COUNT (1)
+    0x75, 0x05,                     //     REPORT_SIZE (5)
+    0x81, 0x03,                     //     INPUT (Const,Var,Abs)
+    0x05, 0x01,                     //     USAGE_PAGE (Generic Desktop)
+    0x09, 0x30,                     //     USAGE (X)
+    0x09, 0x31,                     //     USAGE (Y)
+    0x15, 0x81,                     //     LOGICAL_MINIMUM (-127)
+    0x25, 0x7F,                     //     LOGICAL_MAXIMUM (127)
+    0x75, 0x08,                     //     REPORT_SIZE (8)
+    0x95, 0x02,                     //     REPORT_COUNT (2)
+    0x81, 0x06,                     //     INPUT (Data,Var,Rel)
+    // Phones set the multipliers to their maximum and count a notch as 120 units, like Linux counts high resolution scrolling
+    0xA1, 0x02,                     //     COLLECTION (Logical)
+    0x09, 0x48,                     //       USAGE (Resolution Multiplier)
+    0x15, 0x00,                     //       LOGICAL_MINIMUM (0)
+    0x25, 0x01,                     //       LOGICAL_MAXIMUM (1)
+    0x35, 0x01,                     //       PHYSICAL_MINIMUM (1)
+    0x45, 0x78,                     //       PHYSICAL_MAXIMUM (120)
+    0x75, 0x02,                     //       REPORT_SIZE (2)
+    0x95, 0x01,                     //       REPORT_COUNT (1)
+    0xB1, 0x02,                     //       FEATURE (Data,Var,Abs)
+    0x35, 0x00,                     //       PHYSICAL_MINIMUM (0)
+    0x45, 0x00,                     //       PHYSICAL_MAXIMUM (0)
+    0x09, 0x38,                     //       USAGE (Wheel)
+    0x16, 0x01, 0x80,               //       LOGICAL_MINIMUM (-32767)
+    0x26, 0xFF, 0x7F,               //       LOGICAL_MAXIMUM (32767)
+    0x75, 0x10,                     //       REPORT_SIZE (16)
+    0x95, 0x01,                     //       REPORT_COUNT (1)
+    0x81, 0x06,                     //       INPUT (Data,Var,Rel)
+    0xC0,                           //     END_COLLECTION
+    0xA1, 0x02,                     //     COLLECTION (Logical)
+    0x09, 0x48,                     //       USAGE (Resolution Multiplier)
+    0x15, 0x00,                     //       LOGICAL_MINIMUM (0)
+    0x25, 0x01,                     //       LOGICAL_MAXIMUM (1)
+    0x35, 0x01,                     //       PHYSICAL_MINIMUM (1)
+    0x45, 0x78,                     //       PHYSICAL_MAXIMUM (120)
+    0x75, 0x02,                     //       REPORT_SIZE (2)
+    0x95, 0x01,                     //       REPORT_COUNT (1)
+    0xB1, 0x02,                     //       FEATURE (Data,Var,Abs)
+    0x35, 0x00,                     //       PHYSICAL_MINIMUM (0)
+    0x45, 0x00,                     //       PHYSICAL_MAXIMUM (0)
+    0x75, 0x04,                     //       REPORT_SIZE (4)
+    0xB1, 0x03,                     //       FEATURE (Const,Var,Abs)
+    0x05, 0x0C,                     //       USAGE_PAGE (Consumer Devices)
+    0x0A, 0x38, 0x02,               //       USAGE (AC Pan)
+    0x16, 0x01, 0x80,               //       LOGICAL_MINIMUM (-32767)
+    0x26, 0xFF, 0x7F,               //       LOGICAL_MAXIMUM (32767)
+    0x75, 0x10,                     //       REPORT_SIZE (16)
+    0x95, 0x01,                     //       REPORT_COUNT (1)
+    0x81, 0x06,                     //       INPUT (Data,Var,Rel)
+    0xC0,                           //     END_COLLECTION
+    0xC0,                           //   END_COLLECTION
+    0xC0,                           // END COLLECTION
+};
+const struct report_descriptor mouse_report_descriptor = {mouse_collection, sizeof(mouse_collection)};
+
+static const u8 consumer_collection[] = {
+    0x05, 0x0c,                     // Usage Page (Consumer Devices)
+    0x09, 0x01,                     // Usage (Consumer Control)
+    0xa1, 0x01,                     // Collection (Application)
+    0x85, 0x03,                     //   Report ID (3)
+    0x19, 0x00,                     //   Usage Minimum (0),
+    0x2A, 0xCD, 0x02,               //   Usage Maximum (0x23C),
+    0x15, 0x00,                     //   Logical Minimum (0)
+    0x26, 0x3C, 0x02,               //   Logical Maximum (0x23C)
+    0x75, 0x10,                     //   Report Size (10)
+    0x95, 0x01,                     //   Report Count (1)
+    0x81, 0x00,                     //   Input (Data,Array,Absolute)
+    0xC0,                           // End Collection
+};
+const struct report_descriptor consumer_report_descriptor = {consumer_collection, sizeof(consumer_collection)};
+
+static const u8 gamepad_collection[] = {
+    0x05, 0x01,                     // Usage Page (Generic Desktop Ctrls)
+    0x09, 0x05,                     // Usage (Game Pad)
+    0xA1, 0x01,                     // Collection (Application)
+    0x85, 0x04,                     //   Report ID (4)
+    0x05, 0x09,                     //   Usage Page (Button)
+    0x19, 0x01,                     //   Usage Minimum (1)
+    0x29, 0x10,                     //   Usage Maximum (16)
+    0x15, 0x00,                     //   Logical Minimum (0)
+    0x25, 0x01,                     //   Logical Maximum (1)
+    0x75, 0x01,                     //   Report Size (1)
+    0x95, 0x10,                     //   Report Count (16)
+    0x81, 0x02,                     //   Input (Data,Var,Abs)
+    0x05, 0x01,                     //   Usage Page (Generic Desktop Ctrls)
+    0x09, 0x39,                     //   Usage (Hat switch)
+    0x15, 0x00,                     //   Logical Minimum (0)
+    0x25, 0x07,                     //   Logical Maximum (7)
+    0x35, 0x00,                     //   Physical Minimum (0)
+    0x46, 0x3B, 0x01,               //   Physical Maximum (315)
+    0x65, 0x14,                     //   Unit (Eng Rot: Degrees)
+    0x75, 0x04,                     //   Report Size (4)
+    0x95, 0x01,                     //   Report Count (1)
+    0x81, 0x42,                     //   Input (Data,Var,Abs,Null State)
+    0x65, 0x00,                     //   Unit (None)
+    0x45, 0x00,                     //   Physical Maximum (0)
+    0x75, 0x04,                     //   Report Size (4)
+    0x95, 0x01,                     //   Report Count (1)
+    0x81, 0x03,                     //   Input (Const,Var,Abs)
+    0x09, 0x30,                     //   Usage (X)
+    0x09, 0x31,                     //   Usage (Y)
+    0x09, 0x32,                     //   Usage (Z)
+    0x09, 0x35,                     //   Usage (Rz)
+    0x15, 0x81,                     //   Logical Minimum (-127)
+    0x25, 0x7F,                     //   Logical Maximum (127)
+    0x75, 0x08,                     //   Report Size (8)
+    0x95, 0x04,                     //   Report Count (4)
+    0x81, 0x02,                     //   Input (Data,Var,Abs)
+    0x05, 0x02,                     //   Usage Page (Sim Ctrls)
+    0x09, 0xC5,                     //   Usage (Brake)
+    0x09, 0xC4,                     //   Usage (Accelerator)
+    0x15, 0x00,                     //   Logical Minimum (0)
+    0x26, 0xFF, 0x00,               //   Logical Maximum (255)
+    0x75, 0x08,                     //   Report Size (8)
+    0x95, 0x02,                     //   Report Count (2)
+    0x81, 0x02,                     //   Input (Data,Var,Abs)
+    0xC0,                           // End Collection
+};
+const struct report_descriptor gamepad_report_descriptor = {gamepad_collection, sizeof(gamepad_collection)};
+
+bool get_keyboard_keys(char character, unsigned char* modifier, unsigned char* keycode){
+    // https://usb.org/sites/default/files/hut1_21.pdf page 82-83
+    switch(character){
+        case 'a' ... 'z':
+            *modifier = 0x00;
+            *keycode = (character - 'a') + 0x04;
+            return true;
+        case 'A' ... 'Z':
+            *modifier = 0x02;
+            *keycode = (character - 'A') + 0x04;
+            return true;
+        case '0':
+            *modifier = 0x00;
+            *keycode = 0x27;
+            return true;
+        case '1' ... '9':
+            *modifier = 0x00;
+            *keycode = (character - '1') + 0x1E;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void encode_keyboard_report(u8* report, u8 modifier, u8 keycode){
+    report[0] = KEYBOARD_REPORT_ID;
+    report[1] = modifier;
+    report[2] = keycode;
+}
+
+void encode_mouse_report(u8* report, u8 buttons, s8 x, s8 y, s16 wheel, s16 pan){
+    report[0] = MOUSE_REPORT_ID;
+    report[1] = buttons;
+    report[2] = x;
+    report[3] = y;
+    report[4] = (u16)wheel & 0xFF;
+    report[5] = (u16)wheel >> 8;
+    report[6] = (u16)pan & 0xFF;
+    report[7] = (u16)pan >> 8;
+}
+
+int encode_mouse_write(const u8* write, u8* reports){
+    if(write[3] != 0 && write[3] != 1){
+        return -EINVAL;
+    }
+
+    int vertical = (s8)write[2] * MOUSE_SCROLL_UNITS_PER_NOTCH + (s16)(write[4] | (write[5] << 8));
+    int horizontal = (s16)(write[6] | (write[7] << 8));
+
+    // The movement goes with the first report, scrolling beyond the range of one report continues in the next
+    int num_reports = 0;
+    do{
+        s16 wheel = clamp(vertical, -MOUSE_SCROLL_MAX, MOUSE_SCROLL_MAX);
+        s16 pan = clamp(horizontal, -MOUSE_SCROLL_MAX, MOUSE_SCROLL_MAX);
+        encode_mouse_report(reports + num_reports * MOUSE_REPORT_SIZE, write[3], num_reports ? 0 : write[0], num_reports ? 0 : write[1], wheel, pan);
+        vertical -= wheel;
+        horizontal -= pan;
+        num_reports++;
+    } while(vertical || horizontal);
+
+    return num_reports;
+}
+
+void encode_consumer_report(u8* report, u16 usage){
+    // The descriptor declares a single 16 bit usage, little endian like all HID fields
+    report[0] = CONSUMER_REPORT_ID;
+    report[1] = usage & 0xFF;
+    report[2] = usage >> 8;
+}
+
+int get_step_usage(u8 step, u16 up_usage, u16 down_usage, u16* usage){
+    switch(step){
+        case 0x01:
+            *usage = up_usage;
+            return 0;
+        case 0xFF:
+            *usage = down_usage;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+void encode_gamepad_report(u8* report, const struct aoa_hid_gamepad_state* snapshot){
+    report[0] = GAMEPAD_REPORT_ID;
+    report[1] = snapshot->buttons & 0xFF;
+    report[2] = snapshot->buttons >> 8;
+    // A hat value outside of the logical range is the null state, which is how centered is reported
+    report[3] = snapshot->hat & 0x0F;
+    report[4] = snapshot->left_x;
+    report[5] = snapshot->left_y;
+    report[6] = snapshot->right_x;
+    report[7] = snapshot->right_y;
+    report[8] = snapshot->left_trigger;
+    report[9] = snapshot->right_trigger;
+}
@@ -0,0 +1,69 @@
+#ifndef REPORTS_H
+#define REPORTS_H
+
+#include <linux/kernel.h>
+#include "aoa_hid_driver.h"
+
+/*
+    Encoding of the input reports declared in hid_descriptor.c
+    These functions only fill in buffers, the device files do the copying from userspace and the transfers
+*/
+#define KEYBOARD_REPORT_ID AOA_HID_REPORT_ID_KEYBOARD
+#define MOUSE_REPORT_ID AOA_HID_REPORT_ID_MOUSE
+#define CONSUMER_REPORT_ID AOA_HID_REPORT_ID_CONSUMER
+#define GAMEPAD_REPORT_ID AOA_HID_REPORT_ID_GAMEPAD
+
+// Sizes including the report ID
+#define KEYBOARD_REPORT_SIZE AOA_HID_REPORT_SIZE_KEYBOARD
+#define MOUSE_REPORT_SIZE AOA_HID_REPORT_SIZE_MOUSE
+#define CONSUMER_REPORT_SIZE AOA_HID_REPORT_SIZE_CONSUMER
+#define GAMEPAD_REPORT_SIZE AOA_HID_REPORT_SIZE_GAMEPAD     // 16 buttons, hat and padding, 4 stick axes, 2 triggers
+
+#define MOUSE_SCROLL_UNITS_PER_NOTCH AOA_HID_SCROLL_UNITS_PER_NOTCH
+// Logical range of wheel and pan, -32768 is left out to keep it symmetric
+#define MOUSE_SCROLL_MAX 32767
+// The wheel of a write adds up to 127 notches to its 16 bit vertical scrolling, both fit in two reports
+#define MOUSE_WRITE_MAX_REPORTS 2
+// Writes to /dev/android_mouseN: x, y, wheel and click, optionally followed by vertical and horizontal scrolling
+#define MOUSE_SHORT_WRITE_SIZE 4
+#define MOUSE_WRITE_SIZE 8
+
+// https://usb.org/sites/default/files/hut1_21.pdf chapter 15
+#define CONSUMER_USAGE_BRIGHTNESS_UP 0x6F
+#define CONSUMER_USAGE_BRIGHTNESS_DOWN 0x70
+#define CONSUMER_USAGE_VOLUME_UP 0xE9
+#define CONSUMER_USAGE_VOLUME_DOWN 0xEA
+
+// Collection declaring a report, the descriptor sent to the phones is put together from the collections of the HID functions
+struct report_descriptor {
+    const u8* data;
+    u16 size;
+};
+
+extern const struct report_descriptor keyboard_report_descriptor;
+extern const struct report_descriptor mouse_report_descriptor;
+extern const struct report_descriptor consumer_report_descriptor;
+extern const struct report_descriptor gamepad_report_descriptor;
+
+// Translates a character to the modifier and keycode of a keyboard report, returns false for unsupported characters
+bool get_keyboard_keys(char character, unsigned char* modifier, unsigned char* keycode);
+// A report with no key pressed releases all keys
+void encode_keyboard_report(u8* report, u8 modifier, u8 keycode);
+
+// Wheel and pan are in 1/MOUSE_SCROLL_UNITS_PER_NOTCH of a notch and at most MOUSE_SCROLL_MAX either way
+void encode_mouse_report(u8* report, u8 buttons, s8 x, s8 y, s16 wheel, s16 pan);
+/*
+    Encodes a write to /dev/android_mouseN: x, y, wheel in notches, 0 or 1 for a click, then vertical and horizontal scrolling as
+    16 bit little endian in 1/MOUSE_SCROLL_UNITS_PER_NOTCH of a notch, the short write of the first four bytes is zero extended
+    Returns the number of reports, at most MOUSE_WRITE_MAX_REPORTS, fails with -EINVAL for click values other than 0 and 1
+*/
+int encode_mouse_write(const u8* write, u8* reports);
+
+// A report with usage 0 releases the control
+void encode_consumer_report(u8* report, u16 usage);
+// Picks the usage for a write to /dev/android_volumeN or /dev/android_brightnessN: 0x01 steps up, 0xFF steps down
+int get_step_usage(u8 step, u16 up_usage, u16 down_usage, u16* usage);
+
+void encode_gamepad_report(u8* report, const struct aoa_hid_gamepad_state* snapshot);
+
+#endif
@@ -1,18 +1,39 @@
 #include "sys_files.h"
+#include "usb.h"
+#include "transfer.h"
+#include "discovery.h"
+#include "reattach.h"
+#include "device_ids.h"
 #include <linux/fs.h>
 #include <linux/sysfs.h>
 #include <linux/device.h>
 #include <linux/kobject.h>
 #include <linux/spinlock.h>
 
-#define MAX_ANDROID_DEVICE_IDS 25
-
 /*
 	Forward declarations for private functions for this sys_files.c file
 */
 static ssize_t add_known_device_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
 static ssize_t remove_known_device_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
 static ssize_t show_known_devices_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t pacing_min_gap_us_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t pacing_min_gap_us_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t pacing_max_gap_us_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t pacing_max_gap_us_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t show_pacing_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t show_health_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t reset_health_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t reregister_hid_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t shaping_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t auto_discovery_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t auto_discovery_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t show_discovery_cache_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t clear_discovery_cache_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t reattach_grace_ms_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t reattach_grace_ms_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t reattach_policy_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
+static ssize_t reattach_policy_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count);
+static ssize_t show_reserved_minors_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer);
 
 static u32 known_device_ids[MAX_ANDROID_DEVICE_IDS];
 static int num_known_device_ids = 0;
@@ -22,6 +43,22 @@ spinlock_t known_device_ids_lock;
 static struct kobj_attribute add_known_device_attr = __ATTR(add_known_device, 0660, NULL, add_known_device_store);
 static struct kobj_attribute remove_known_device_attr = __ATTR(remove_known_device, 0660, NULL, remove_known_device_store);
 static struct kobj_attribute show_known_devices_attr = __ATTR(show_known_devices, 0660, show_known_devices_show, NULL);
+static struct kobj_attribute pacing_min_gap_us_attr = __ATTR(pacing_min_gap_us, 0660, pacing_min_gap_us_show, pacing_min_gap_us_store);
+static struct kobj_attribute pacing_max_gap_us_attr = __ATTR(pacing_max_gap_us, 0660, pacing_max_gap_us_show, pacing_max_gap_us_store);
+static struct kobj_attribute show_pacing_attr = __ATTR(show_pacing, 0660, show_pacing_show, NULL);
+static struct kobj_attribute show_health_attr = __ATTR(show_health, 0660, show_health_show, NULL);
+static struct kobj_attribute reset_health_attr = __ATTR(reset_health, 0660, NULL, reset_health_store);
+static struct kobj_attribute reregister_hid_attr = __ATTR(reregister_hid, 0660, NULL, reregister_hid_store);
+static struct kobj_attribute shaping_attr = __ATTR(shaping, 0660, NULL, shaping_store);
+static struct kobj_attribute auto_discovery_attr = __ATTR(auto_discovery, 0660, auto_discovery_show, auto_discovery_store);
+static struct kobj_attribute show_discovery_cache_attr = __ATTR(show_discovery_cache, 0660, show_discovery_cache_show, NULL);
+static struct kobj_attribute clear_discovery_cache_attr = __ATTR(clear_discovery_cache, 0660, NULL, clear_discovery_cache_store);
+static struct kobj_attribute reattach_grace_ms_attr = __ATTR(reattach_grace_ms, 0660, reattach_grace_ms_show, reattach_grace_ms_store);
+static struct kobj_attribute reattach_policy_attr = __ATTR(reattach_policy, 0660, reattach_policy_show, reattach_policy_store);
+static struct kobj_attribute show_reserved_minors_attr = __ATTR(show_reserved_minors, 0660, show_reserved_minors_show, NULL);
+
+// Indexed by REATTACH_POLICY_*
+static const char* reattach_policy_names[] = {"queue", "fail"};
 
 int setup_sysfs(void){
 	if(!(android_usb_kobj = kobject_create_and_add("android_usb", kernel_kobj))){
@@ -44,10 +81,114 @@ int setup_sysfs(void){
 		goto setup_sysfs_error3;
 	}
 
+	if(sysfs_create_file(android_usb_kobj, &pacing_min_gap_us_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/pacing_min_gap_us\n");
+		goto setup_sysfs_error4;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &pacing_max_gap_us_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/pacing_max_gap_us\n");
+		goto setup_sysfs_error5;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &show_pacing_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/show_pacing\n");
+		goto setup_sysfs_error6;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &show_health_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/show_health\n");
+		goto setup_sysfs_error7;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &reset_health_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/reset_health\n");
+		goto setup_sysfs_error8;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &reregister_hid_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/reregister_hid\n");
+		goto setup_sysfs_error9;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &shaping_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/shaping\n");
+		goto setup_sysfs_error10;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &auto_discovery_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/auto_discovery\n");
+		goto setup_sysfs_error11;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &show_discovery_cache_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/show_discovery_cache\n");
+		goto setup_sysfs_error12;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &clear_discovery_cache_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/clear_discovery_cache\n");
+		goto setup_sysfs_error13;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &reattach_grace_ms_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/reattach_grace_ms\n");
+		goto setup_sysfs_error14;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &reattach_policy_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/reattach_policy\n");
+		goto setup_sysfs_error15;
+	}
+
+	if(sysfs_create_file(android_usb_kobj, &show_reserved_minors_attr.attr)){
+		printk("aoa_hid_driver - Error creating /sys/kernel/android_usb/show_reserved_minors\n");
+		goto setup_sysfs_error16;
+	}
+
 	spin_lock_init(&known_device_ids_lock);
 
 	return 0;
 
+setup_sysfs_error16:
+	sysfs_remove_file(android_usb_kobj, &reattach_policy_attr.attr);
+
+setup_sysfs_error15:
+	sysfs_remove_file(android_usb_kobj, &reattach_grace_ms_attr.attr);
+
+setup_sysfs_error14:
+	sysfs_remove_file(android_usb_kobj, &clear_discovery_cache_attr.attr);
+
+setup_sysfs_error13:
+	sysfs_remove_file(android_usb_kobj, &show_discovery_cache_attr.attr);
+
+setup_sysfs_error12:
+	sysfs_remove_file(android_usb_kobj, &auto_discovery_attr.attr);
+
+setup_sysfs_error11:
+	sysfs_remove_file(android_usb_kobj, &shaping_attr.attr);
+
+setup_sysfs_error10:
+	sysfs_remove_file(android_usb_kobj, &reregister_hid_attr.attr);
+
+setup_sysfs_error9:
+	sysfs_remove_file(android_usb_kobj, &reset_health_attr.attr);
+
+setup_sysfs_error8:
+	sysfs_remove_file(android_usb_kobj, &show_health_attr.attr);
+
+setup_sysfs_error7:
+	sysfs_remove_file(android_usb_kobj, &show_pacing_attr.attr);
+
+setup_sysfs_error6:
+	sysfs_remove_file(android_usb_kobj, &pacing_max_gap_us_attr.attr);
+
+setup_sysfs_error5:
+	sysfs_remove_file(android_usb_kobj, &pacing_min_gap_us_attr.attr);
+
+setup_sysfs_error4:
+	sysfs_remove_file(android_usb_kobj, &show_known_devices_attr.attr);
+
 setup_sysfs_error3:
 	sysfs_remove_file(android_usb_kobj, &remove_known_device_attr.attr);
 
@@ -62,6 +203,19 @@ setup_sysfs_error0:
 }
 
 void cleanup_sysfs(void){
+	sysfs_remove_file(android_usb_kobj, &show_reserved_minors_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &reattach_policy_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &reattach_grace_ms_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &clear_discovery_cache_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &show_discovery_cache_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &auto_discovery_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &shaping_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &reregister_hid_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &reset_health_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &show_health_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &show_pacing_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &pacing_max_gap_us_attr.attr);
+	sysfs_remove_file(android_usb_kobj, &pacing_min_gap_us_attr.attr);
 	sysfs_remove_file(android_usb_kobj, &show_known_devices_attr.attr);
 	sysfs_remove_file(android_usb_kobj, &remove_known_device_attr.attr);
 	sysfs_remove_file(android_usb_kobj, &add_known_device_attr.attr);
@@ -77,20 +231,12 @@ static ssize_t add_known_device_store(struct kobject* kobj, struct kobj_attribut
 		return -EINVAL;
 	}
 
-	unsigned long flags;
-	spin_lock_irqsave(&known_device_ids_lock, flags);
-
-	if(num_known_device_ids >= MAX_ANDROID_DEVICE_IDS){
-		printk("aoa_hid_driver - No more space for additional known devices\n");
-		spin_unlock_irqrestore(&known_device_ids_lock, flags);
-		return -ENOMEM;
+	u32 id = (((u32)id_vendor) << 16) | ((u32)id_product);
+	ret = add_known_devices(&id, 1);
+	if(ret){
+		return ret;
 	}
 
-	known_device_ids[num_known_device_ids] = (((u32)id_vendor) << 16) | ((u32)id_product);
-	num_known_device_ids++;
-
-	spin_unlock_irqrestore(&known_device_ids_lock, flags);
-
 	return count;
 }
 
@@ -104,24 +250,67 @@ static ssize_t remove_known_device_store(struct kobject* kobj, struct kobj_attri
 	}
 
 	u32 id = (((u32)id_vendor) << 16) | ((u32)id_product);
-	int i;
-	for(i = 0; i < num_known_device_ids; i++){
-		if(known_device_ids[i] == id){
-			break;
-		}
-	}
-
-	if(i == num_known_device_ids){
+	if(remove_known_devices(&id, 1) == 0){
 		printk("aoa_hid_driver - Device %04x:%04x not found in known devices\n", id_vendor, id_product);
 		return -EINVAL;
 	}
 
+	return count;
+}
+
+int add_known_devices(const u32* ids, int count){
 	unsigned long flags;
 	spin_lock_irqsave(&known_device_ids_lock, flags);
 
-	known_device_ids[i] = known_device_ids[num_known_device_ids - 1];
-	known_device_ids[num_known_device_ids - 1] = 0;
-	num_known_device_ids--;
+	// All of the ids are added or none of them
+	if(num_known_device_ids + count > MAX_ANDROID_DEVICE_IDS){
+		printk("aoa_hid_driver - No more space for additional known devices\n");
+		spin_unlock_irqrestore(&known_device_ids_lock, flags);
+		return -ENOMEM;
+	}
+
+	for(int i = 0; i < count; i++){
+		known_device_ids[num_known_device_ids] = ids[i];
+		num_known_device_ids++;
+	}
+
+	spin_unlock_irqrestore(&known_device_ids_lock, flags);
+
+	return 0;
+}
+
+int remove_known_devices(const u32* ids, int count){
+	int removed = 0;
+
+	unsigned long flags;
+	spin_lock_irqsave(&known_device_ids_lock, flags);
+
+	for(int i = 0; i < count; i++){
+		int j = find_device_id(known_device_ids, num_known_device_ids, ids[i]);
+		if(j < 0){
+			continue;
+		}
+
+		known_device_ids[j] = known_device_ids[num_known_device_ids - 1];
+		known_device_ids[num_known_device_ids - 1] = 0;
+		num_known_device_ids--;
+		removed++;
+	}
+
+	spin_unlock_irqrestore(&known_device_ids_lock, flags);
+
+	return removed;
+}
+
+int get_known_devices(u32* ids, int max){
+	int count = 0;
+
+	unsigned long flags;
+	spin_lock_irqsave(&known_device_ids_lock, flags);
+
+	for(int i = 0; i < num_known_device_ids && count < max; i++){
+		ids[count++] = known_device_ids[i];
+	}
 
 	spin_unlock_irqrestore(&known_device_ids_lock, flags);
 
@@ -138,18 +327,184 @@ static ssize_t show_known_devices_show(struct kobject* kobj, struct kobj_attribu
 	return offset;
 }
 
-bool is_android_device(u16 id_vendor, u16 id_product){
-	u32 id = (((u32)id_vendor) << 16) | ((u32)id_product);
-	for(int i = 0; i < num_known_device_ids; i++){
-		unsigned int known_id = known_device_ids[i];
+static ssize_t pacing_min_gap_us_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	u32 min_gap_us, max_gap_us;
+	get_pacing_bounds(&min_gap_us, &max_gap_us);
+	return sysfs_emit(buffer, "%u\n", min_gap_us);
+}
 
-		if(known_id == 0){
-			break;
+static ssize_t pacing_min_gap_us_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	u32 min_gap_us, max_gap_us;
+	get_pacing_bounds(&min_gap_us, &max_gap_us);
+
+	if(kstrtou32(buffer, 10, &min_gap_us) || set_pacing_bounds(min_gap_us, max_gap_us)){
+		printk("aoa_hid_driver - Invalid input \"%s\" for pacing_min_gap_us\n", buffer);
+		return -EINVAL;
+	}
+
+	return count;
+}
+
+static ssize_t pacing_max_gap_us_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	u32 min_gap_us, max_gap_us;
+	get_pacing_bounds(&min_gap_us, &max_gap_us);
+	return sysfs_emit(buffer, "%u\n", max_gap_us);
+}
+
+static ssize_t pacing_max_gap_us_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	u32 min_gap_us, max_gap_us;
+	get_pacing_bounds(&min_gap_us, &max_gap_us);
+
+	if(kstrtou32(buffer, 10, &max_gap_us) || set_pacing_bounds(min_gap_us, max_gap_us)){
+		printk("aoa_hid_driver - Invalid input \"%s\" for pacing_max_gap_us\n", buffer);
+		return -EINVAL;
+	}
+
+	return count;
+}
+
+static ssize_t show_pacing_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	int offset = 0;
+	for(int i = 0; i < NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+		if(!get_usb_device(i)){
+			continue;
 		}
-		else if(known_id == id){
-			return true;
+
+		u32 gap_us, rtt_us, errors;
+		get_transfer_pacing(i, &gap_us, &rtt_us, &errors);
+		offset += sysfs_emit_at(buffer, offset, "%d gap_us=%u rtt_us=%u errors=%u\n", i, gap_us, rtt_us, errors);
+	}
+
+	return offset;
+}
+
+static ssize_t show_health_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	static const char* health_names[] = {"healthy", "degraded", "failed"};
+	int offset = 0;
+	for(int i = 0; i < NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+		if(!get_usb_device(i)){
+			continue;
 		}
+
+		int health;
+		u32 consecutive_failures;
+		get_transfer_health_details(i, &health, &consecutive_failures);
+		offset += sysfs_emit_at(buffer, offset, "%d %s consecutive_failures=%u\n", i, health_names[health], consecutive_failures);
+	}
+
+	return offset;
+}
+
+static ssize_t reset_health_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	int minor;
+	if(kstrtoint(buffer, 10, &minor) || minor < 0 || minor >= NUM_POSSIBLE_ACCESSORY_MODE_DEVICES){
+		printk("aoa_hid_driver - Invalid input \"%s\" for reset_health\n", buffer);
+		return -EINVAL;
+	}
+
+	reset_transfer_health(minor);
+
+	return count;
+}
+
+static ssize_t reregister_hid_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	int minor;
+	if(kstrtoint(buffer, 10, &minor) || minor < 0 || minor >= NUM_POSSIBLE_ACCESSORY_MODE_DEVICES){
+		printk("aoa_hid_driver - Invalid input \"%s\" for reregister_hid\n", buffer);
+		return -EINVAL;
+	}
+
+	int ret = reregister_hid(minor, NULL, 0);
+	if(ret){
+		return ret;
+	}
+
+	return count;
+}
+
+bool is_android_device(u16 id_vendor, u16 id_product){
+	u32 id = (((u32)id_vendor) << 16) | ((u32)id_product);
+	return find_device_id(known_device_ids, READ_ONCE(num_known_device_ids), id) >= 0;
+}
+
+// Input is "<minor> <class> <rate> <burst>", for example "0 bulk 50 4"
+static ssize_t shaping_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	int minor;
+	char class_name[16];
+	u32 rate, burst;
+	if(sscanf(buffer, "%d %15s %u %u", &minor, class_name, &rate, &burst) != 4 || minor < 0 || minor >= NUM_POSSIBLE_ACCESSORY_MODE_DEVICES){
+		printk("aoa_hid_driver - Invalid input \"%s\" for shaping\n", buffer);
+		return -EINVAL;
+	}
+
+	int transfer_class = match_string(transfer_class_names, NUM_TRANSFER_CLASSES, class_name);
+	if(transfer_class < 0 || set_transfer_shaping(minor, transfer_class, rate, burst)){
+		printk("aoa_hid_driver - Invalid input \"%s\" for shaping\n", buffer);
+		return -EINVAL;
 	}
 
-	return false;
-}
\ No newline at end of file
+	return count;
+}
+
+static ssize_t auto_discovery_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	return sysfs_emit(buffer, "%d\n", is_auto_discovery_enabled());
+}
+
+static ssize_t auto_discovery_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	bool enabled;
+	if(kstrtobool(buffer, &enabled)){
+		printk("aoa_hid_driver - Invalid input \"%s\" for auto_discovery\n", buffer);
+		return -EINVAL;
+	}
+
+	set_auto_discovery(enabled);
+
+	return count;
+}
+
+static ssize_t show_discovery_cache_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	return show_discovery_cache(buffer);
+}
+
+static ssize_t clear_discovery_cache_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	clear_discovery_cache();
+
+	return count;
+}
+
+static ssize_t reattach_grace_ms_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	return sysfs_emit(buffer, "%u\n", get_reattach_grace_ms());
+}
+
+static ssize_t reattach_grace_ms_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	u32 grace_ms;
+	if(kstrtou32(buffer, 0, &grace_ms) || grace_ms > REATTACH_MAX_GRACE_MS){
+		printk("aoa_hid_driver - Invalid input \"%s\" for reattach_grace_ms\n", buffer);
+		return -EINVAL;
+	}
+
+	// Phones that are already gone keep the grace period they got
+	set_reattach_grace_ms(grace_ms);
+
+	return count;
+}
+
+static ssize_t reattach_policy_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	return sysfs_emit(buffer, "%s\n", reattach_policy_names[get_reattach_policy()]);
+}
+
+static ssize_t reattach_policy_store(struct kobject* kobj, struct kobj_attribute *attr, const char* buffer, size_t count){
+	int policy = sysfs_match_string(reattach_policy_names, buffer);
+	if(policy < 0){
+		printk("aoa_hid_driver - Invalid input \"%s\" for reattach_policy\n", buffer);
+		return -EINVAL;
+	}
+
+	set_reattach_policy(policy);
+
+	return count;
+}
+
+static ssize_t show_reserved_minors_show(struct kobject* kobj, struct kobj_attribute *attr, char* buffer){
+	return show_reserved_minors(buffer);
+}
@@ -3,8 +3,17 @@
 
 #include <linux/kernel.h>
 
+#define MAX_ANDROID_DEVICE_IDS 25
+
 bool is_android_device(u16 id_vendor, u16 id_product);
 
+// Known device ids are (vendor id << 16) | product id
+// Adds all of the ids or, when they do not fit, none of them
+int add_known_devices(const u32* ids, int count);
+// Returns how many of the ids were known and removed
+int remove_known_devices(const u32* ids, int count);
+int get_known_devices(u32* ids, int max);
+
 int setup_sysfs(void);
 void cleanup_sysfs(void);
 
@@ -0,0 +1,90 @@
+// The function under test is included so that the test module does not share objects with aoa_hid_driver.ko
+#include "../device_ids.c"
+#include "../sys_files.h"
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#define BENCHMARK_ITERATIONS 1000000
+// Far above what a scan of a full table costs on any machine, only a gross regression of the probe path fails
+#define BENCHMARK_MAX_NS_PER_LOOKUP 1000
+
+#define DEVICE_ID(vendor, product) (((u32)(vendor) << 16) | (product))
+
+/*
+    Forward declarations for private functions for this device_ids_test.c file
+*/
+static void fill_device_ids(u32* ids, int count);
+
+static void find_device_id_test(struct kunit* test){
+    const u32 ids[] = {DEVICE_ID(0x18D1, 0x4EE1), DEVICE_ID(0x04E8, 0x6860), DEVICE_ID(0x2717, 0xFF48)};
+
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, ARRAY_SIZE(ids), DEVICE_ID(0x18D1, 0x4EE1)), 0);
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, ARRAY_SIZE(ids), DEVICE_ID(0x2717, 0xFF48)), 2);
+
+    // Vendor and product are both part of the id
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, ARRAY_SIZE(ids), DEVICE_ID(0x18D1, 0x6860)), -1);
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, ARRAY_SIZE(ids), DEVICE_ID(0x4EE1, 0x18D1)), -1);
+}
+
+static void find_device_id_count_test(struct kunit* test){
+    const u32 ids[] = {DEVICE_ID(0x18D1, 0x4EE1), DEVICE_ID(0x04E8, 0x6860), 0};
+
+    // Entries past count are stale, removing a known id leaves a zero behind
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, 1, DEVICE_ID(0x04E8, 0x6860)), -1);
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, 2, 0), -1);
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, 0, DEVICE_ID(0x18D1, 0x4EE1)), -1);
+}
+
+static void find_device_id_first_test(struct kunit* test){
+    const u32 ids[] = {DEVICE_ID(0x04E8, 0x6860), DEVICE_ID(0x18D1, 0x4EE1), DEVICE_ID(0x04E8, 0x6860)};
+
+    KUNIT_EXPECT_EQ(test, find_device_id(ids, ARRAY_SIZE(ids), DEVICE_ID(0x04E8, 0x6860)), 0);
+}
+
+static void lookup_benchmark(struct kunit* test){
+    u32 ids[MAX_ANDROID_DEVICE_IDS];
+    int found = 0;
+
+    fill_device_ids(ids, MAX_ANDROID_DEVICE_IDS);
+
+    // Every device that is plugged in is looked up, the worst case is a full table and a device that is not in it
+    u64 start = ktime_get_ns();
+    for(int i=0; i<BENCHMARK_ITERATIONS; i++){
+        u32 id = (i & 1) ? ids[MAX_ANDROID_DEVICE_IDS - 1] : DEVICE_ID(0xFFFF, (u16)i);
+        OPTIMIZER_HIDE_VAR(id);
+        found += find_device_id(ids, MAX_ANDROID_DEVICE_IDS, id) >= 0;
+    }
+    u64 ps_per_lookup = div_u64((ktime_get_ns() - start) * 1000, BENCHMARK_ITERATIONS);
+    u32 ps_remainder;
+    u64 ns_per_lookup = div_u64_rem(ps_per_lookup, 1000, &ps_remainder);
+
+    kunit_info(test, "full table of %d ids: %llu.%03u ns/lookup\n", MAX_ANDROID_DEVICE_IDS, ns_per_lookup, ps_remainder);
+    KUNIT_EXPECT_EQ(test, found, BENCHMARK_ITERATIONS / 2);
+    KUNIT_EXPECT_LT(test, ps_per_lookup, (u64)BENCHMARK_MAX_NS_PER_LOOKUP * 1000);
+}
+
+static void fill_device_ids(u32* ids, int count){
+    for(int i=0; i<count; i++){
+        ids[i] = DEVICE_ID(0x18D1, 0x4E00 + i);
+    }
+}
+
+static struct kunit_case device_ids_test_cases[] = {
+    KUNIT_CASE(find_device_id_test),
+    KUNIT_CASE(find_device_id_count_test),
+    KUNIT_CASE(find_device_id_first_test),
+    KUNIT_CASE_SLOW(lookup_benchmark),
+    {}
+};
+
+static struct kunit_suite device_ids_test_suite = {
+    .name = "aoa_hid_device_ids",
+    .test_cases = device_ids_test_cases
+};
+
+kunit_test_suite(device_ids_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for the report encoders and the known id lookup of aoa_hid_driver");
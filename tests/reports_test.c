@@ -0,0 +1,294 @@
+// The functions under test are included so that the test module does not share objects with aoa_hid_driver.ko
+#include "../reports.c"
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+// Iterations of the benchmarks, enough for the time of one iteration to be well above the resolution of the clock
+#define BENCHMARK_ITERATIONS 1000000
+// Far above what an encoder costs on any machine, only a gross regression of a hot path fails
+#define BENCHMARK_MAX_NS_PER_EVENT 1000
+
+/*
+    Forward declarations for private functions for this reports_test.c file
+*/
+static void run_mouse_write(struct kunit* test, const u8* write, u8* reports, int expected_reports);
+static void check_benchmark(struct kunit* test, const char* name, u64 elapsed_ns, u32 checksum);
+
+static void keyboard_keys_test(struct kunit* test){
+    unsigned char modifier, keycode;
+
+    KUNIT_ASSERT_TRUE(test, get_keyboard_keys('a', &modifier, &keycode));
+    KUNIT_EXPECT_EQ(test, modifier, 0x00);
+    KUNIT_EXPECT_EQ(test, keycode, 0x04);
+
+    KUNIT_ASSERT_TRUE(test, get_keyboard_keys('z', &modifier, &keycode));
+    KUNIT_EXPECT_EQ(test, modifier, 0x00);
+    KUNIT_EXPECT_EQ(test, keycode, 0x1D);
+
+    KUNIT_ASSERT_TRUE(test, get_keyboard_keys('A', &modifier, &keycode));
+    KUNIT_EXPECT_EQ(test, modifier, 0x02);
+    KUNIT_EXPECT_EQ(test, keycode, 0x04);
+
+    KUNIT_ASSERT_TRUE(test, get_keyboard_keys('Z', &modifier, &keycode));
+    KUNIT_EXPECT_EQ(test, modifier, 0x02);
+    KUNIT_EXPECT_EQ(test, keycode, 0x1D);
+
+    // 0 comes after 9 on the keyboard page
+    KUNIT_ASSERT_TRUE(test, get_keyboard_keys('1', &modifier, &keycode));
+    KUNIT_EXPECT_EQ(test, keycode, 0x1E);
+    KUNIT_ASSERT_TRUE(test, get_keyboard_keys('9', &modifier, &keycode));
+    KUNIT_EXPECT_EQ(test, keycode, 0x26);
+    KUNIT_ASSERT_TRUE(test, get_keyboard_keys('0', &modifier, &keycode));
+    KUNIT_EXPECT_EQ(test, modifier, 0x00);
+    KUNIT_EXPECT_EQ(test, keycode, 0x27);
+
+    KUNIT_EXPECT_FALSE(test, get_keyboard_keys('\0', &modifier, &keycode));
+    KUNIT_EXPECT_FALSE(test, get_keyboard_keys('@', &modifier, &keycode));
+    KUNIT_EXPECT_FALSE(test, get_keyboard_keys('[', &modifier, &keycode));
+    KUNIT_EXPECT_FALSE(test, get_keyboard_keys('`', &modifier, &keycode));
+    KUNIT_EXPECT_FALSE(test, get_keyboard_keys('{', &modifier, &keycode));
+    KUNIT_EXPECT_FALSE(test, get_keyboard_keys((char)0xE9, &modifier, &keycode));
+}
+
+static void keyboard_report_test(struct kunit* test){
+    u8 report[KEYBOARD_REPORT_SIZE];
+    const u8 press[] = {KEYBOARD_REPORT_ID, 0x02, 0x04};
+    const u8 release[] = {KEYBOARD_REPORT_ID, 0x00, 0x00};
+
+    encode_keyboard_report(report, 0x02, 0x04);
+    KUNIT_EXPECT_MEMEQ(test, report, press, sizeof(press));
+
+    encode_keyboard_report(report, 0x00, 0x00);
+    KUNIT_EXPECT_MEMEQ(test, report, release, sizeof(release));
+}
+
+static void mouse_report_test(struct kunit* test){
+    u8 report[MOUSE_REPORT_SIZE];
+    const u8 moved[] = {MOUSE_REPORT_ID, 0x01, 0x05, 0xFB, 0x78, 0x00, 0x88, 0xFF};
+    const u8 limits[] = {MOUSE_REPORT_ID, 0x00, 0x7F, 0x80, 0xFF, 0x7F, 0x01, 0x80};
+
+    // Wheel and pan are 16 bit little endian two's complement
+    encode_mouse_report(report, 0x01, 5, -5, MOUSE_SCROLL_UNITS_PER_NOTCH, -MOUSE_SCROLL_UNITS_PER_NOTCH);
+    KUNIT_EXPECT_MEMEQ(test, report, moved, sizeof(moved));
+
+    encode_mouse_report(report, 0x00, 127, -128, MOUSE_SCROLL_MAX, -MOUSE_SCROLL_MAX);
+    KUNIT_EXPECT_MEMEQ(test, report, limits, sizeof(limits));
+}
+
+static void mouse_write_test(struct kunit* test){
+    u8 reports[MOUSE_WRITE_MAX_REPORTS * MOUSE_REPORT_SIZE];
+
+    // The short write of x, y, wheel and click, the wheel is in notches
+    const u8 short_write[] = {0x05, 0xFB, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00};
+    const u8 short_report[] = {MOUSE_REPORT_ID, 0x01, 0x05, 0xFB, 0x78, 0x00, 0x00, 0x00};
+    run_mouse_write(test, short_write, reports, 1);
+    KUNIT_EXPECT_MEMEQ(test, reports, short_report, sizeof(short_report));
+
+    // High resolution scrolling adds to the notches of the wheel, pan only comes in units
+    const u8 fine_write[] = {0x00, 0x00, 0xFF, 0x00, 0x3C, 0x00, 0xC4, 0xFF};
+    const u8 fine_report[] = {MOUSE_REPORT_ID, 0x00, 0x00, 0x00, 0xC4, 0xFF, 0xC4, 0xFF};
+    run_mouse_write(test, fine_write, reports, 1);
+    KUNIT_EXPECT_MEMEQ(test, reports, fine_report, sizeof(fine_report));
+
+    // 127 notches and 32767 units do not fit one report, the movement only goes with the first one
+    const u8 split_write[] = {0x0A, 0x0B, 0x7F, 0x01, 0xFF, 0x7F, 0x00, 0x00};
+    const u8 split_reports[] = {
+        MOUSE_REPORT_ID, 0x01, 0x0A, 0x0B, 0xFF, 0x7F, 0x00, 0x00,
+        MOUSE_REPORT_ID, 0x01, 0x00, 0x00, 0x88, 0x3B, 0x00, 0x00
+    };
+    run_mouse_write(test, split_write, reports, 2);
+    KUNIT_EXPECT_MEMEQ(test, reports, split_reports, sizeof(split_reports));
+
+    // Down as far as it goes, -32768 is left out of the logical range
+    const u8 down_write[] = {0x00, 0x00, 0x81, 0x00, 0x00, 0x80, 0x00, 0x80};
+    const u8 down_reports[] = {
+        MOUSE_REPORT_ID, 0x00, 0x00, 0x00, 0x01, 0x80, 0x01, 0x80,
+        MOUSE_REPORT_ID, 0x00, 0x00, 0x00, 0x77, 0xC4, 0xFF, 0xFF
+    };
+    run_mouse_write(test, down_write, reports, 2);
+    KUNIT_EXPECT_MEMEQ(test, reports, down_reports, sizeof(down_reports));
+
+    const u8 bad_click[] = {0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00};
+    KUNIT_EXPECT_EQ(test, encode_mouse_write(bad_click, reports), -EINVAL);
+}
+
+static void consumer_report_test(struct kunit* test){
+    u8 report[CONSUMER_REPORT_SIZE];
+    const u8 volume_up[] = {CONSUMER_REPORT_ID, 0xE9, 0x00};
+    const u8 wide_usage[] = {CONSUMER_REPORT_ID, 0x34, 0x12};
+
+    encode_consumer_report(report, CONSUMER_USAGE_VOLUME_UP);
+    KUNIT_EXPECT_MEMEQ(test, report, volume_up, sizeof(volume_up));
+
+    // The usage is 16 bit, the high byte must not be dropped
+    encode_consumer_report(report, 0x1234);
+    KUNIT_EXPECT_MEMEQ(test, report, wide_usage, sizeof(wide_usage));
+}
+
+static void step_usage_test(struct kunit* test){
+    u16 usage = 0;
+
+    KUNIT_EXPECT_EQ(test, get_step_usage(0x01, CONSUMER_USAGE_VOLUME_UP, CONSUMER_USAGE_VOLUME_DOWN, &usage), 0);
+    KUNIT_EXPECT_EQ(test, usage, CONSUMER_USAGE_VOLUME_UP);
+
+    // 0xFF steps down, volume and brightness once rejected it where char is signed
+    KUNIT_EXPECT_EQ(test, get_step_usage(0xFF, CONSUMER_USAGE_BRIGHTNESS_UP, CONSUMER_USAGE_BRIGHTNESS_DOWN, &usage), 0);
+    KUNIT_EXPECT_EQ(test, usage, CONSUMER_USAGE_BRIGHTNESS_DOWN);
+
+    KUNIT_EXPECT_EQ(test, get_step_usage(0x00, CONSUMER_USAGE_VOLUME_UP, CONSUMER_USAGE_VOLUME_DOWN, &usage), -EINVAL);
+    KUNIT_EXPECT_EQ(test, get_step_usage(0x02, CONSUMER_USAGE_VOLUME_UP, CONSUMER_USAGE_VOLUME_DOWN, &usage), -EINVAL);
+    KUNIT_EXPECT_EQ(test, get_step_usage(0xFE, CONSUMER_USAGE_VOLUME_UP, CONSUMER_USAGE_VOLUME_DOWN, &usage), -EINVAL);
+}
+
+static void gamepad_report_test(struct kunit* test){
+    u8 report[GAMEPAD_REPORT_SIZE];
+    struct aoa_hid_gamepad_state snapshot = {
+        .buttons = 0x8001,
+        .hat = 3,
+        .left_x = -128,
+        .left_y = 127,
+        .right_x = -1,
+        .right_y = 1,
+        .left_trigger = 0x00,
+        .right_trigger = 0xFF
+    };
+    const u8 pressed[] = {GAMEPAD_REPORT_ID, 0x01, 0x80, 0x03, 0x80, 0x7F, 0xFF, 0x01, 0x00, 0xFF};
+    const u8 centered[] = {GAMEPAD_REPORT_ID, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+    encode_gamepad_report(report, &snapshot);
+    KUNIT_EXPECT_MEMEQ(test, report, pressed, sizeof(pressed));
+
+    // Anything outside of the hat's logical range reports centered, only the low nibble is used
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.hat = 0xF0 | AOA_HID_GAMEPAD_HAT_CENTERED;
+    encode_gamepad_report(report, &snapshot);
+    KUNIT_EXPECT_MEMEQ(test, report, centered, sizeof(centered));
+}
+
+static void report_descriptors_test(struct kunit* test){
+    const struct report_descriptor* descriptors[] = {&keyboard_report_descriptor, &mouse_report_descriptor, &consumer_report_descriptor, &gamepad_report_descriptor};
+    const u8 report_ids[] = {KEYBOARD_REPORT_ID, MOUSE_REPORT_ID, CONSUMER_REPORT_ID, GAMEPAD_REPORT_ID};
+
+    // Every collection is an application collection that declares the report ID its encoder writes
+    for(int i=0; i<ARRAY_SIZE(descriptors); i++){
+        const u8* data = descriptors[i]->data;
+        u16 size = descriptors[i]->size;
+        bool has_report_id = false;
+
+        KUNIT_ASSERT_GT(test, size, 0);
+        KUNIT_EXPECT_EQ(test, data[size - 1], 0xC0);
+        for(int j=0; j+1<size; j++){
+            if(data[j] == 0x85 && data[j + 1] == report_ids[i]){
+                has_report_id = true;
+            }
+        }
+        KUNIT_EXPECT_TRUE_MSG(test, has_report_id, "collection %d does not declare report ID %d", i, report_ids[i]);
+    }
+}
+
+static void keyboard_benchmark(struct kunit* test){
+    static const char text[] = "The quick brown fox jumps over the lazy dog 0123456789";
+    u8 report[KEYBOARD_REPORT_SIZE];
+    unsigned char modifier, keycode;
+    u32 checksum = 0;
+
+    // One event is the lookup of a character and the encoding of its press
+    u64 start = ktime_get_ns();
+    for(int i=0; i<BENCHMARK_ITERATIONS; i++){
+        char character = text[i % (sizeof(text) - 1)];
+        OPTIMIZER_HIDE_VAR(character);
+        if(get_keyboard_keys(character, &modifier, &keycode)){
+            encode_keyboard_report(report, modifier, keycode);
+            checksum += report[2];
+        }
+    }
+    check_benchmark(test, "keyboard", ktime_get_ns() - start, checksum);
+}
+
+static void mouse_write_benchmark(struct kunit* test){
+    u8 write[MOUSE_WRITE_SIZE] = {0x05, 0xFB, 0x01, 0x00, 0x3C, 0x00, 0x00, 0x00};
+    u8 reports[MOUSE_WRITE_MAX_REPORTS * MOUSE_REPORT_SIZE];
+    u32 checksum = 0;
+
+    u64 start = ktime_get_ns();
+    for(int i=0; i<BENCHMARK_ITERATIONS; i++){
+        write[0] = i;
+        OPTIMIZER_HIDE_VAR(write[0]);
+        checksum += encode_mouse_write(write, reports) + reports[2];
+    }
+    check_benchmark(test, "mouse write", ktime_get_ns() - start, checksum);
+}
+
+static void consumer_benchmark(struct kunit* test){
+    u8 report[CONSUMER_REPORT_SIZE];
+    u16 usage = 0;
+    u32 checksum = 0;
+
+    // One event is a write to the volume device: the step to its usage, then the report
+    u64 start = ktime_get_ns();
+    for(int i=0; i<BENCHMARK_ITERATIONS; i++){
+        u8 step = (i & 1) ? 0x01 : 0xFF;
+        OPTIMIZER_HIDE_VAR(step);
+        if(!get_step_usage(step, CONSUMER_USAGE_VOLUME_UP, CONSUMER_USAGE_VOLUME_DOWN, &usage)){
+            encode_consumer_report(report, usage);
+            checksum += report[1];
+        }
+    }
+    check_benchmark(test, "consumer", ktime_get_ns() - start, checksum);
+}
+
+static void gamepad_benchmark(struct kunit* test){
+    struct aoa_hid_gamepad_state snapshot = {.hat = AOA_HID_GAMEPAD_HAT_CENTERED};
+    u8 report[GAMEPAD_REPORT_SIZE];
+    u32 checksum = 0;
+
+    u64 start = ktime_get_ns();
+    for(int i=0; i<BENCHMARK_ITERATIONS; i++){
+        snapshot.left_x = i;
+        OPTIMIZER_HIDE_VAR(snapshot.left_x);
+        encode_gamepad_report(report, &snapshot);
+        checksum += report[4];
+    }
+    check_benchmark(test, "gamepad", ktime_get_ns() - start, checksum);
+}
+
+static void run_mouse_write(struct kunit* test, const u8* write, u8* reports, int expected_reports){
+    memset(reports, 0xAA, MOUSE_WRITE_MAX_REPORTS * MOUSE_REPORT_SIZE);
+    KUNIT_ASSERT_EQ(test, encode_mouse_write(write, reports), expected_reports);
+}
+
+// Prints the time per event with picosecond digits, an encoder takes a few nanoseconds
+static void check_benchmark(struct kunit* test, const char* name, u64 elapsed_ns, u32 checksum){
+    u64 ps_per_event = div_u64(elapsed_ns * 1000, BENCHMARK_ITERATIONS);
+    // A plain 64 bit modulo would need libgcc's __umoddi3 on 32 bit architectures
+    u32 ps_remainder;
+    u64 ns_per_event = div_u64_rem(ps_per_event, 1000, &ps_remainder);
+
+    kunit_info(test, "%s: %llu.%03u ns/event (checksum %u)\n", name, ns_per_event, ps_remainder, checksum);
+    KUNIT_EXPECT_LT(test, ps_per_event, (u64)BENCHMARK_MAX_NS_PER_EVENT * 1000);
+}
+
+static struct kunit_case reports_test_cases[] = {
+    KUNIT_CASE(keyboard_keys_test),
+    KUNIT_CASE(keyboard_report_test),
+    KUNIT_CASE(mouse_report_test),
+    KUNIT_CASE(mouse_write_test),
+    KUNIT_CASE(consumer_report_test),
+    KUNIT_CASE(step_usage_test),
+    KUNIT_CASE(gamepad_report_test),
+    KUNIT_CASE(report_descriptors_test),
+    KUNIT_CASE_SLOW(keyboard_benchmark),
+    KUNIT_CASE_SLOW(mouse_write_benchmark),
+    KUNIT_CASE_SLOW(consumer_benchmark),
+    KUNIT_CASE_SLOW(gamepad_benchmark),
+    {}
+};
+
+static struct kunit_suite reports_test_suite = {
+    .name = "aoa_hid_reports",
+    .test_cases = reports_test_cases
+};
+
+kunit_test_suite(reports_test_suite);
@@ -0,0 +1,923 @@
+#include "transfer.h"
+#include "usb.h"
+#include "netlink.h"
+#include "report_hook.h"
+#include "flight_recorder.h"
+#include "aoa_hid_driver.h"
+#include "devices/record.h"
+#include "devices/function.h"
+
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/timer.h>
+#include <linux/sched/signal.h>
+
+#define HID_EVENT_TIMEOUT_MS 1000
+// A degraded phone gets a shorter timeout so that a phone that stopped responding does not cost a second per report
+#define HID_EVENT_DEGRADED_TIMEOUT_MS 250
+// Transient errors are retried with exponential backoff: 10 ms, 20 ms
+#define HID_EVENT_MAX_RETRIES 2
+#define HID_EVENT_RETRY_BACKOFF_MS 10
+// Number of consecutive failed reports, after retries, before a phone is marked failed
+#define HEALTH_FAILED_THRESHOLD 3
+
+#define PACING_INITIAL_GAP_US 100000
+#define PACING_DEFAULT_MIN_GAP_US 10000
+#define PACING_DEFAULT_MAX_GAP_US 200000
+#define PACING_LIMIT_GAP_US 1000000
+// The gap shrinks by a fixed step after every successful transfer and doubles after a failed one (AIMD)
+#define PACING_DECREASE_STEP_US 1000
+// The gap never goes below this multiple of the smoothed round-trip time, a phone that is slow to accept reports is slow to process them
+#define PACING_RTT_FACTOR 4
+// Weight of a new round-trip sample in the smoothed round-trip time is 1/2^PACING_RTT_EWMA_SHIFT
+#define PACING_RTT_EWMA_SHIFT 3
+
+// Bounds of the token bucket settings, a rate above the limit could not be reached over ep0 anyway
+#define SHAPING_MAX_RATE 100000
+#define SHAPING_MAX_BURST 1000
+// Tokens are counted in units of 1/NSEC_PER_SEC of a token so that refilling at rate tokens per second is exact per nanosecond
+#define SHAPING_TOKEN NSEC_PER_SEC
+
+// Who waits for a transfer and frees it
+#define HID_EVENT_ASYNCHRONOUS 0    // Nobody, the completion handler tells the callback if there is one and frees it
+#define HID_EVENT_SYNCHRONOUS 1     // A sender waits on done and frees it
+#define HID_EVENT_STAGED 2          // Submitted later by release_hid_event, the callback is told and free_staged_hid_event frees it
+
+// Setup packet and report share one allocation so the completion handler only has to free one buffer
+struct hid_event_transfer {
+    int minor;
+    int mode;
+    struct completion done;
+    // Only for staged transfers, which keep the phone referenced from staging until they are freed
+    struct accessory_device* dev;
+    hid_event_callback callback;
+    void* context;
+    ktime_t submitted;
+    // Only for asynchronous transfers, nobody waits for them so a timer unlinks those the phone does not take in time
+    struct urb* urb;
+    struct timer_list timeout;
+    bool timed_out;
+    struct usb_ctrlrequest setup;
+    char data[];
+};
+
+struct transfer_state {
+    spinlock_t lock;
+    u32 gap_us;
+    u32 rtt_ewma_us;
+    u32 errors;
+    int health;
+    u32 consecutive_failures;
+    // Taken by a sender for the duration of one transfer, waiting senders are let in by class
+    bool wire_busy;
+    u32 wire_waiting[NUM_TRANSFER_CLASSES];
+    wait_queue_head_t wire_wait;
+    u64 reports[NUM_TRANSFER_CLASSES];
+    u64 total_latency_ns[NUM_TRANSFER_CLASSES];
+    u64 max_latency_ns[NUM_TRANSFER_CLASSES];
+    // Reports the BPF report hook dropped, they count neither as sent nor as failed
+    u64 dropped[NUM_TRANSFER_CLASSES];
+    u32 shaping_rate[NUM_TRANSFER_CLASSES];
+    u32 shaping_burst[NUM_TRANSFER_CLASSES];
+    u64 shaping_tokens[NUM_TRANSFER_CLASSES];
+    ktime_t shaping_refilled[NUM_TRANSFER_CLASSES];
+    // Incremented by cancel_hid_events, senders that started before give up instead of sending
+    u32 cancel_generation;
+    atomic_t in_flight;
+};
+
+/*
+    Forward declarations for private functions for this transfer.c file
+*/
+static struct urb* alloc_hid_event_urb(struct accessory_device* dev, int minor, const char* event, u16 size, int mode, gfp_t mem_flags);
+static int transmit_hid_event(struct accessory_device* dev, int minor, const char* event, u16 size, int transfer_class, u32 generation);
+static int transfer_hid_event(struct accessory_device* dev, int minor, const char* event, u16 size, int timeout_ms, u32 generation);
+static int submit_hid_event_transfer(struct accessory_device* dev, struct urb* urb);
+static void hid_event_transfer_complete(struct urb* urb);
+static void hid_event_timeout_callback(struct timer_list* timer);
+static int get_hid_event_timeout_ms(int minor);
+static bool is_cancelled(int minor, u32 generation);
+static void update_pacing(int minor, ktime_t submitted, int status);
+static void update_health(int minor, int status);
+static bool is_transient_error(int status);
+static int acquire_wire(int minor, int transfer_class, u32 generation);
+static bool try_acquire_wire(struct transfer_state* state, int transfer_class);
+static void release_wire(int minor);
+static void update_latency(int minor, int transfer_class, ktime_t queued);
+static void count_dropped_report(int minor, const char* event);
+static int wait_for_token(struct accessory_device* dev, int minor, int transfer_class, u32 generation);
+static u64 take_tokens(struct transfer_state* state, int transfer_class, int count, bool take);
+static int transfer_latency_show(struct seq_file* file, void* data);
+static int transfer_shaping_show(struct seq_file* file, void* data);
+
+DEFINE_SHOW_ATTRIBUTE(transfer_latency);
+DEFINE_SHOW_ATTRIBUTE(transfer_shaping);
+
+const char* const transfer_class_names[NUM_TRANSFER_CLASSES] = {"pointer", "consumer", "bulk"};
+
+static struct workqueue_struct* transfer_workqueue = NULL;
+static struct transfer_state transfer_states[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static u32 pacing_min_gap_us = PACING_DEFAULT_MIN_GAP_US;
+static u32 pacing_max_gap_us = PACING_DEFAULT_MAX_GAP_US;
+static DEFINE_SPINLOCK(pacing_bounds_lock);
+
+int setup_transfer(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        spin_lock_init(&transfer_states[i].lock);
+        init_waitqueue_head(&transfer_states[i].wire_wait);
+        atomic_set(&transfer_states[i].in_flight, 0);
+        add_transfer_device(i);
+    }
+
+    transfer_workqueue = alloc_workqueue("aoa_hid_transfer", WQ_UNBOUND, 0);
+    if(!transfer_workqueue){
+        printk("aoa_hid_driver - Error allocating transfer workqueue\n");
+        return -1;
+    }
+
+    setup_flight_recorder();
+    // Files instead of sysfs attributes, a line per phone would not fit a page with every minor attached
+    debugfs_create_file("latency", 0440, get_debugfs_directory(), NULL, &transfer_latency_fops);
+    debugfs_create_file("shaping", 0440, get_debugfs_directory(), NULL, &transfer_shaping_fops);
+
+    return 0;
+}
+
+void cleanup_transfer(void){
+    cleanup_flight_recorder();
+    destroy_workqueue(transfer_workqueue);
+}
+
+struct workqueue_struct* get_transfer_workqueue(void){
+    return transfer_workqueue;
+}
+
+void add_transfer_device(int minor){
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    transfer_states[minor].gap_us = clamp_t(u32, PACING_INITIAL_GAP_US, READ_ONCE(pacing_min_gap_us), READ_ONCE(pacing_max_gap_us));
+    transfer_states[minor].rtt_ewma_us = 0;
+    transfer_states[minor].errors = 0;
+    transfer_states[minor].health = TRANSFER_HEALTHY;
+    transfer_states[minor].consecutive_failures = 0;
+    // The wire is left alone, a sender of the previous phone at this minor may still be finishing with it
+    for(int i=0; i<NUM_TRANSFER_CLASSES; i++){
+        transfer_states[minor].reports[i] = 0;
+        transfer_states[minor].total_latency_ns[i] = 0;
+        transfer_states[minor].max_latency_ns[i] = 0;
+        transfer_states[minor].dropped[i] = 0;
+        transfer_states[minor].shaping_rate[i] = 0;
+        transfer_states[minor].shaping_burst[i] = 0;
+    }
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+
+    reset_flight_recorder(minor);
+}
+
+int get_transfer_health(int minor){
+    return READ_ONCE(transfer_states[minor].health);
+}
+
+void get_transfer_health_details(int minor, int* health, u32* consecutive_failures){
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    *health = transfer_states[minor].health;
+    *consecutive_failures = transfer_states[minor].consecutive_failures;
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+}
+
+void reset_transfer_health(int minor){
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    transfer_states[minor].health = TRANSFER_HEALTHY;
+    transfer_states[minor].consecutive_failures = 0;
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+}
+
+void get_transfer_latency(int minor, int transfer_class, u64* reports, u32* average_us, u32* max_us, u64* dropped){
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    *reports = transfer_states[minor].reports[transfer_class];
+    *dropped = transfer_states[minor].dropped[transfer_class];
+    *average_us = *reports ? div64_u64(transfer_states[minor].total_latency_ns[transfer_class], *reports) / NSEC_PER_USEC : 0;
+    *max_us = div_u64(transfer_states[minor].max_latency_ns[transfer_class], NSEC_PER_USEC);
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+}
+
+u32 get_hid_event_gap_us(int minor){
+    return READ_ONCE(transfer_states[minor].gap_us);
+}
+
+void wait_hid_event_gap(int minor){
+    fsleep(get_hid_event_gap_us(minor));
+}
+
+void get_transfer_pacing(int minor, u32* gap_us, u32* rtt_us, u32* errors){
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    *gap_us = transfer_states[minor].gap_us;
+    *rtt_us = transfer_states[minor].rtt_ewma_us;
+    *errors = transfer_states[minor].errors;
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+}
+
+int set_pacing_bounds(u32 min_gap_us, u32 max_gap_us){
+    if(min_gap_us > max_gap_us || max_gap_us > PACING_LIMIT_GAP_US){
+        return -EINVAL;
+    }
+
+    spin_lock(&pacing_bounds_lock);
+    WRITE_ONCE(pacing_min_gap_us, min_gap_us);
+    WRITE_ONCE(pacing_max_gap_us, max_gap_us);
+    spin_unlock(&pacing_bounds_lock);
+
+    // Current gaps are pulled into the new bounds right away instead of after the next transfer
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        unsigned long flags;
+        spin_lock_irqsave(&transfer_states[i].lock, flags);
+        transfer_states[i].gap_us = clamp(transfer_states[i].gap_us, min_gap_us, max_gap_us);
+        spin_unlock_irqrestore(&transfer_states[i].lock, flags);
+    }
+
+    return 0;
+}
+
+void get_pacing_bounds(u32* min_gap_us, u32* max_gap_us){
+    spin_lock(&pacing_bounds_lock);
+    *min_gap_us = pacing_min_gap_us;
+    *max_gap_us = pacing_max_gap_us;
+    spin_unlock(&pacing_bounds_lock);
+}
+
+int set_transfer_shaping(int minor, int transfer_class, u32 rate, u32 burst){
+    if(rate > SHAPING_MAX_RATE || burst > SHAPING_MAX_BURST || (rate && !burst)){
+        return -EINVAL;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    transfer_states[minor].shaping_rate[transfer_class] = rate;
+    transfer_states[minor].shaping_burst[transfer_class] = burst;
+    // A new bucket starts full
+    transfer_states[minor].shaping_tokens[transfer_class] = (u64)burst * SHAPING_TOKEN;
+    transfer_states[minor].shaping_refilled[transfer_class] = ktime_get();
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+
+    return 0;
+}
+
+void get_transfer_shaping(int minor, int transfer_class, u32* rate, u32* burst){
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    *rate = transfer_states[minor].shaping_rate[transfer_class];
+    *burst = transfer_states[minor].shaping_burst[transfer_class];
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+}
+
+bool has_transfer_tokens(int minor, int transfer_class, int count){
+    unsigned long flags;
+    spin_lock_irqsave(&transfer_states[minor].lock, flags);
+    u64 wait_ns = take_tokens(&transfer_states[minor], transfer_class, count, false);
+    spin_unlock_irqrestore(&transfer_states[minor].lock, flags);
+
+    return !wait_ns;
+}
+
+int cancel_hid_events(int minor){
+    struct transfer_state* state = &transfer_states[minor];
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    state->cancel_generation++;
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    // Senders waiting for a token or their turn see the new generation and give up
+    wake_up_all(&state->wire_wait);
+
+    struct accessory_device* dev = get_accessory_device(minor);
+    if(!dev){
+        return 0;
+    }
+
+    int killed = atomic_read(&state->in_flight);
+    usb_kill_anchored_urbs(&dev->hid_anchor);
+    put_accessory_device(dev);
+
+    return killed;
+}
+
+u32 get_hid_events_in_flight(int minor){
+    return atomic_read(&transfer_states[minor].in_flight);
+}
+
+int send_hid_event(int minor, char* event, u16 size){
+    struct accessory_device* dev = get_accessory_device(minor);
+    if(!dev){
+        return -ENODEV;
+    }
+
+    // A failed phone is not worth waiting for, writers find out immediately
+    if(get_transfer_health(minor) == TRANSFER_FAILED){
+        put_accessory_device(dev);
+        return -EIO;
+    }
+
+    // Attached BPF programs see the report first, they may change it, drop it or ask for copies of it
+    struct aoa_hid_report_ctx report;
+    int copies = run_report_hook(minor, event, size, &report);
+    if(copies < 0){
+        put_accessory_device(dev);
+        return copies;
+    }
+
+    if(copies == 0){
+        count_dropped_report(minor, event);
+    }
+
+    int transfer_class = get_report_class(report.data[0]);
+    u32 generation = READ_ONCE(transfer_states[minor].cancel_generation);
+
+    int ret = 0;
+    for(int copy=0; copy<copies && !ret; copy++){
+        ret = transmit_hid_event(dev, minor, (const char*)report.data, size, transfer_class, generation);
+    }
+
+    put_accessory_device(dev);
+    return ret;
+}
+
+int send_hid_event_atomic(int minor, const char* event, u16 size, hid_event_callback callback, void* context){
+    struct accessory_device* dev = get_accessory_device(minor);
+    if(!dev){
+        return -ENODEV;
+    }
+
+    int ret = -EIO;
+    if(get_transfer_health(minor) == TRANSFER_FAILED){
+        goto send_hid_event_atomic_error0;
+    }
+
+    struct aoa_hid_report_ctx report;
+    int copies = run_report_hook(minor, event, size, &report);
+    if(copies < 0){
+        ret = copies;
+        goto send_hid_event_atomic_error0;
+    }
+
+    if(copies == 0){
+        count_dropped_report(minor, event);
+    }
+
+    ret = 0;
+    int submitted = 0;
+    for(int copy=0; copy<copies && !ret; copy++){
+        struct urb* urb = alloc_hid_event_urb(dev, minor, (const char*)report.data, size, HID_EVENT_ASYNCHRONOUS, GFP_ATOMIC);
+        if(!urb){
+            ret = -ENOMEM;
+            break;
+        }
+
+        record_hid_event(minor, (const char*)report.data, size);
+
+        struct hid_event_transfer* transfer = urb->context;
+        transfer->callback = callback;
+        transfer->context = context;
+        transfer->submitted = ktime_get();
+        // Armed before submitting, the completion handler deletes it and may run before usb_submit_urb returns
+        mod_timer(&transfer->timeout, jiffies + msecs_to_jiffies(get_hid_event_timeout_ms(minor)));
+        ret = submit_hid_event_transfer(dev, urb);
+        if(ret){
+            timer_delete_sync(&transfer->timeout);
+            kfree(transfer);
+        }
+        else{
+            submitted++;
+        }
+
+        // The USB core holds its own reference to the urb while it is in flight
+        usb_free_urb(urb);
+    }
+
+    if(submitted){
+        ret = submitted;
+    }
+
+send_hid_event_atomic_error0:
+    put_accessory_device(dev);
+    return ret;
+}
+
+struct urb* stage_hid_event(int minor, const char* event, u16 size, hid_event_callback callback, void* context){
+    struct accessory_device* dev = get_accessory_device(minor);
+    if(!dev){
+        return ERR_PTR(-ENODEV);
+    }
+
+    // The hook runs when the report is staged, copies it asks for are not sent so all phones still get the same reports
+    struct aoa_hid_report_ctx report;
+    int copies = run_report_hook(minor, event, size, &report);
+    if(copies < 0){
+        put_accessory_device(dev);
+        return ERR_PTR(copies);
+    }
+
+    if(copies == 0){
+        count_dropped_report(minor, event);
+        put_accessory_device(dev);
+        return NULL;
+    }
+
+    struct urb* urb = alloc_hid_event_urb(dev, minor, (const char*)report.data, size, HID_EVENT_STAGED, GFP_KERNEL);
+    if(!urb){
+        put_accessory_device(dev);
+        return ERR_PTR(-ENOMEM);
+    }
+
+    struct hid_event_transfer* transfer = urb->context;
+    transfer->dev = dev;
+    transfer->callback = callback;
+    transfer->context = context;
+    return urb;
+}
+
+int release_hid_event(struct urb* urb){
+    struct hid_event_transfer* transfer = urb->context;
+
+    if(get_transfer_health(transfer->minor) == TRANSFER_FAILED){
+        return -EIO;
+    }
+
+    record_hid_event(transfer->minor, transfer->data, urb->transfer_buffer_length);
+
+    transfer->submitted = ktime_get();
+    return submit_hid_event_transfer(transfer->dev, urb);
+}
+
+void free_staged_hid_event(struct urb* urb){
+    struct hid_event_transfer* transfer = urb->context;
+
+    usb_kill_urb(urb);
+    put_accessory_device(transfer->dev);
+    kfree(transfer);
+    usb_free_urb(urb);
+}
+
+static struct urb* alloc_hid_event_urb(struct accessory_device* dev, int minor, const char* event, u16 size, int mode, gfp_t mem_flags){
+    struct urb* urb = usb_alloc_urb(0, mem_flags);
+    if(!urb){
+        return NULL;
+    }
+
+    struct hid_event_transfer* transfer = kmalloc(sizeof(struct hid_event_transfer) + size, mem_flags);
+    if(!transfer){
+        usb_free_urb(urb);
+        return NULL;
+    }
+
+    transfer->minor = minor;
+    transfer->mode = mode;
+    transfer->dev = NULL;
+    transfer->callback = NULL;
+    transfer->context = NULL;
+    transfer->urb = urb;
+    transfer->timed_out = false;
+    if(mode == HID_EVENT_SYNCHRONOUS){
+        init_completion(&transfer->done);
+    }
+    else if(mode == HID_EVENT_ASYNCHRONOUS){
+        // Irqsafe so that the completion handler can wait for a running timer from any context
+        timer_setup(&transfer->timeout, hid_event_timeout_callback, TIMER_IRQSAFE);
+    }
+    transfer->setup.bRequestType = USB_DIR_OUT | USB_TYPE_VENDOR;
+    transfer->setup.bRequest = ACCESSORY_SEND_HID_EVENT;
+    transfer->setup.wValue = cpu_to_le16(1);
+    transfer->setup.wIndex = cpu_to_le16(0);
+    transfer->setup.wLength = cpu_to_le16(size);
+    memcpy(transfer->data, event, size);
+
+    usb_fill_control_urb(urb, dev->usb_dev, usb_sndctrlpipe(dev->usb_dev, 0), (unsigned char*)&transfer->setup, transfer->data, size, hid_event_transfer_complete, transfer);
+    return urb;
+}
+
+static int transmit_hid_event(struct accessory_device* dev, int minor, const char* event, u16 size, int transfer_class, u32 generation){
+    ktime_t queued = ktime_get();
+
+    int ret = wait_for_token(dev, minor, transfer_class, generation);
+    if(ret){
+        return ret;
+    }
+
+    record_hid_event(minor, event, size);
+
+    for(int attempt=0; ; attempt++){
+        int timeout = get_hid_event_timeout_ms(minor);
+        // The wire is only held for the transfer itself, other classes get their turn during the backoff
+        ret = acquire_wire(minor, transfer_class, generation);
+        if(!ret){
+            ret = transfer_hid_event(dev, minor, event, size, timeout, generation);
+            release_wire(minor);
+        }
+        if(ret == -ENODEV || ret == -ECANCELED){
+            // Disconnected or cancelled while waiting, this says nothing about the phone's health
+            return ret;
+        }
+
+        if(!ret || !is_transient_error(ret) || attempt >= HID_EVENT_MAX_RETRIES){
+            break;
+        }
+
+        // A killed transfer may have reached the phone already, a second movement or volume step would be applied twice
+        if(ret == -ETIMEDOUT && transfer_class != TRANSFER_CLASS_BULK){
+            break;
+        }
+
+        msleep(HID_EVENT_RETRY_BACKOFF_MS << attempt);
+    }
+
+    update_health(minor, ret);
+    if(!ret){
+        update_latency(minor, transfer_class, queued);
+    }
+    return ret;
+}
+
+static int transfer_hid_event(struct accessory_device* dev, int minor, const char* event, u16 size, int timeout_ms, u32 generation){
+    struct urb* urb = alloc_hid_event_urb(dev, minor, event, size, HID_EVENT_SYNCHRONOUS, GFP_KERNEL);
+    if(!urb){
+        return -ENOMEM;
+    }
+
+    struct hid_event_transfer* transfer = urb->context;
+    transfer->submitted = ktime_get();
+    int ret = submit_hid_event_transfer(dev, urb);
+    if(!ret){
+        if(wait_for_completion_timeout(&transfer->done, msecs_to_jiffies(timeout_ms))){
+            ret = urb->status;
+        }
+        else{
+            usb_kill_urb(urb);
+            ret = -ETIMEDOUT;
+        }
+
+        // Killed by disconnect_accessory_device or cancel_hid_events
+        if(READ_ONCE(dev->disconnected)){
+            ret = -ENODEV;
+        }
+        else if(ret && is_cancelled(minor, generation)){
+            ret = -ECANCELED;
+        }
+        else{
+            update_pacing(minor, transfer->submitted, ret);
+        }
+    }
+
+    record_transfer(minor, event, size, transfer->submitted, ret);
+
+    kfree(transfer);
+    usb_free_urb(urb);
+    return ret;
+}
+
+static int submit_hid_event_transfer(struct accessory_device* dev, struct urb* urb){
+    struct hid_event_transfer* transfer = urb->context;
+
+    // Counted before submitting, the completion handler may run before usb_submit_urb returns
+    atomic_inc(&transfer_states[transfer->minor].in_flight);
+    int ret = submit_hid_event_urb(dev, urb);
+    if(ret){
+        atomic_dec(&transfer_states[transfer->minor].in_flight);
+        wake_flush_waiters(transfer->minor);
+        // Synchronous senders record the result themselves
+        if(transfer->mode != HID_EVENT_SYNCHRONOUS){
+            record_transfer(transfer->minor, transfer->data, urb->transfer_buffer_length, transfer->submitted, ret);
+        }
+    }
+
+    return ret;
+}
+
+static void hid_event_transfer_complete(struct urb* urb){
+    struct hid_event_transfer* transfer = urb->context;
+
+    atomic_dec(&transfer_states[transfer->minor].in_flight);
+    wake_flush_waiters(transfer->minor);
+
+    if(transfer->mode == HID_EVENT_SYNCHRONOUS){
+        complete(&transfer->done);
+        return;
+    }
+
+    int status = urb->status;
+    if(transfer->mode == HID_EVENT_ASYNCHRONOUS){
+        // After this the timer can not touch the urb anymore
+        timer_delete_sync(&transfer->timeout);
+        if(status == -ECONNRESET && READ_ONCE(transfer->timed_out)){
+            status = -ETIMEDOUT;
+        }
+    }
+
+    // Unlinked urbs say nothing about the phone, unless the timer unlinked them
+    record_transfer(transfer->minor, transfer->data, urb->transfer_buffer_length, transfer->submitted, status);
+    if(status != -ENOENT && status != -ECONNRESET && status != -ESHUTDOWN){
+        update_pacing(transfer->minor, transfer->submitted, status);
+        update_health(transfer->minor, status);
+    }
+
+    if(transfer->mode == HID_EVENT_STAGED){
+        if(READ_ONCE(transfer->dev->disconnected)){
+            status = -ENODEV;
+        }
+        transfer->callback(transfer->context, status);
+        return;
+    }
+
+    if(transfer->callback){
+        transfer->callback(transfer->context, status);
+    }
+    kfree(transfer);
+}
+
+static void hid_event_timeout_callback(struct timer_list* timer){
+    struct hid_event_transfer* transfer = container_of(timer, struct hid_event_transfer, timeout);
+
+    // The completion handler reports the unlinked urb as timed out
+    WRITE_ONCE(transfer->timed_out, true);
+    usb_unlink_urb(transfer->urb);
+}
+
+// A degraded phone gets the shorter timeout
+static int get_hid_event_timeout_ms(int minor){
+    return get_transfer_health(minor) == TRANSFER_DEGRADED ? HID_EVENT_DEGRADED_TIMEOUT_MS : HID_EVENT_TIMEOUT_MS;
+}
+
+static void update_pacing(int minor, ktime_t submitted, int status){
+    s64 rtt_us = ktime_us_delta(ktime_get(), submitted);
+    u32 min_gap_us = READ_ONCE(pacing_min_gap_us);
+    u32 max_gap_us = READ_ONCE(pacing_max_gap_us);
+    struct transfer_state* p = &transfer_states[minor];
+
+    unsigned long flags;
+    spin_lock_irqsave(&p->lock, flags);
+    if(status < 0){
+        p->errors++;
+        p->gap_us = min_t(u32, max_t(u32, p->gap_us * 2, PACING_DECREASE_STEP_US), max_gap_us);
+    }
+    else{
+        if(p->rtt_ewma_us == 0){
+            p->rtt_ewma_us = rtt_us;
+        }
+        else{
+            p->rtt_ewma_us = (s64)p->rtt_ewma_us + ((rtt_us - (s64)p->rtt_ewma_us) >> PACING_RTT_EWMA_SHIFT);
+        }
+
+        u32 floor_us = max_t(u32, min_gap_us, min_t(u32, p->rtt_ewma_us * PACING_RTT_FACTOR, max_gap_us));
+        p->gap_us = p->gap_us > floor_us + PACING_DECREASE_STEP_US ? p->gap_us - PACING_DECREASE_STEP_US : floor_us;
+    }
+    spin_unlock_irqrestore(&p->lock, flags);
+}
+
+
+static void update_health(int minor, int status){
+    struct transfer_state* state = &transfer_states[minor];
+    int previous_health;
+    int health;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    previous_health = state->health;
+    if(status >= 0){
+        state->consecutive_failures = 0;
+        state->health = TRANSFER_HEALTHY;
+    }
+    else{
+        state->consecutive_failures++;
+        if(!is_transient_error(status) || state->consecutive_failures >= HEALTH_FAILED_THRESHOLD){
+            state->health = TRANSFER_FAILED;
+        }
+        else{
+            state->health = TRANSFER_DEGRADED;
+        }
+    }
+    health = state->health;
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    if(health == TRANSFER_FAILED && previous_health != TRANSFER_FAILED){
+        printk("aoa_hid_driver - Phone at minor %d marked failed after transfer error %d, further reports fail with -EIO until it is reset or reattached\n", minor, status);
+        notify_phone_event(AOA_HID_EVENT_TRANSFER_FAILED, NULL, minor, status);
+    }
+}
+
+static int acquire_wire(int minor, int transfer_class, u32 generation){
+    struct transfer_state* state = &transfer_states[minor];
+    bool acquired = false;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    state->wire_waiting[transfer_class]++;
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    // Not interruptible, the wait is bounded by the transfers ahead of it, which time out, and ends right away on a cancel
+    wait_event(state->wire_wait, (acquired = try_acquire_wire(state, transfer_class)) || is_cancelled(minor, generation));
+
+    if(!acquired){
+        spin_lock_irqsave(&state->lock, flags);
+        state->wire_waiting[transfer_class]--;
+        spin_unlock_irqrestore(&state->lock, flags);
+        // Others of a lower class may have been waiting for this one to go
+        wake_up_all(&state->wire_wait);
+        return -ECANCELED;
+    }
+
+    if(is_cancelled(minor, generation)){
+        release_wire(minor);
+        return -ECANCELED;
+    }
+
+    return 0;
+}
+
+static bool try_acquire_wire(struct transfer_state* state, int transfer_class){
+    bool acquired = false;
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    if(!state->wire_busy){
+        acquired = true;
+        for(int i=0; i<transfer_class; i++){
+            if(state->wire_waiting[i]){
+                acquired = false;
+                break;
+            }
+        }
+    }
+
+    if(acquired){
+        state->wire_busy = true;
+        state->wire_waiting[transfer_class]--;
+    }
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    return acquired;
+}
+
+static void release_wire(int minor){
+    struct transfer_state* state = &transfer_states[minor];
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    state->wire_busy = false;
+    spin_unlock_irqrestore(&state->lock, flags);
+
+    // Waiters of every class have to check again, the highest one waiting takes the wire
+    wake_up_all(&state->wire_wait);
+}
+
+static void update_latency(int minor, int transfer_class, ktime_t queued){
+    struct transfer_state* state = &transfer_states[minor];
+    u64 latency_ns = ktime_to_ns(ktime_sub(ktime_get(), queued));
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    state->reports[transfer_class]++;
+    state->total_latency_ns[transfer_class] += latency_ns;
+    state->max_latency_ns[transfer_class] = max(state->max_latency_ns[transfer_class], latency_ns);
+    spin_unlock_irqrestore(&state->lock, flags);
+}
+
+static void count_dropped_report(int minor, const char* event){
+    struct transfer_state* state = &transfer_states[minor];
+
+    unsigned long flags;
+    spin_lock_irqsave(&state->lock, flags);
+    state->dropped[get_report_class(event[0])]++;
+    spin_unlock_irqrestore(&state->lock, flags);
+}
+
+static int wait_for_token(struct accessory_device* dev, int minor, int transfer_class, u32 generation){
+    struct transfer_state* state = &transfer_states[minor];
+
+    for(;;){
+        unsigned long flags;
+        spin_lock_irqsave(&state->lock, flags);
+        u64 wait_ns = take_tokens(state, transfer_class, 1, true);
+        spin_unlock_irqrestore(&state->lock, flags);
+
+        if(!wait_ns){
+            return 0;
+        }
+
+        // Killable only, a report that is not sent could leave a key pressed, tokens come back within a second at the lowest rate
+        // Sleeping on the wire wait queue lets cancel_hid_events wake it
+        DEFINE_WAIT(wait);
+        ktime_t expires = ns_to_ktime(wait_ns);
+        prepare_to_wait(&state->wire_wait, &wait, TASK_KILLABLE);
+        if(!is_cancelled(minor, generation)){
+            schedule_hrtimeout_range(&expires, wait_ns >> 4, HRTIMER_MODE_REL);
+        }
+        finish_wait(&state->wire_wait, &wait);
+
+        if(fatal_signal_pending(current)){
+            return -EINTR;
+        }
+
+        if(READ_ONCE(dev->disconnected)){
+            return -ENODEV;
+        }
+
+        if(is_cancelled(minor, generation)){
+            return -ECANCELED;
+        }
+    }
+}
+
+/*
+    Refills the bucket of the class and takes count tokens from it when take is set
+    Returns 0 when the tokens are there, otherwise the nanoseconds until they will be, called with the lock of the state held
+*/
+static u64 take_tokens(struct transfer_state* state, int transfer_class, int count, bool take){
+    u32 rate = state->shaping_rate[transfer_class];
+    if(!rate){
+        return 0;
+    }
+
+    u64 capacity = (u64)state->shaping_burst[transfer_class] * SHAPING_TOKEN;
+    ktime_t now = ktime_get();
+    // Limited to the time it takes to fill an empty bucket so the product can not overflow
+    u64 elapsed_ns = min_t(u64, ktime_to_ns(ktime_sub(now, state->shaping_refilled[transfer_class])), NSEC_PER_SEC * SHAPING_MAX_BURST);
+    state->shaping_tokens[transfer_class] = min(state->shaping_tokens[transfer_class] + elapsed_ns * rate, capacity);
+    state->shaping_refilled[transfer_class] = now;
+
+    // More reports than fit in the bucket are checked against a full bucket, they would never fit otherwise
+    u64 needed = min((u64)count * SHAPING_TOKEN, capacity);
+    if(state->shaping_tokens[transfer_class] >= needed){
+        if(take){
+            state->shaping_tokens[transfer_class] -= needed;
+        }
+        return 0;
+    }
+
+    return DIV_ROUND_UP_ULL(needed - state->shaping_tokens[transfer_class], rate);
+}
+
+// One line per attached phone with the reports, latency and drops of each class
+static int transfer_latency_show(struct seq_file* file, void* data){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(!get_usb_device(i)){
+            continue;
+        }
+
+        seq_printf(file, "%d", i);
+        for(int j=0; j<NUM_TRANSFER_CLASSES; j++){
+            u64 reports, dropped;
+            u32 average_us, max_us;
+            get_transfer_latency(i, j, &reports, &average_us, &max_us, &dropped);
+            seq_printf(file, " %s reports=%llu avg_us=%u max_us=%u dropped=%llu", transfer_class_names[j], reports, average_us, max_us, dropped);
+        }
+        seq_putc(file, '\n');
+    }
+
+    return 0;
+}
+
+// One line per attached phone with the token bucket of each class, set with /sys/kernel/android_usb/shaping
+static int transfer_shaping_show(struct seq_file* file, void* data){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(!get_usb_device(i)){
+            continue;
+        }
+
+        seq_printf(file, "%d", i);
+        for(int j=0; j<NUM_TRANSFER_CLASSES; j++){
+            u32 rate, burst;
+            get_transfer_shaping(i, j, &rate, &burst);
+            seq_printf(file, " %s rate=%u burst=%u", transfer_class_names[j], rate, burst);
+        }
+        seq_putc(file, '\n');
+    }
+
+    return 0;
+}
+
+static bool is_cancelled(int minor, u32 generation){
+    return READ_ONCE(transfer_states[minor].cancel_generation) != generation;
+}
+
+static bool is_transient_error(int status){
+    switch(status){
+        case -ETIMEDOUT:
+        case -EPIPE:
+        case -EPROTO:
+        case -EILSEQ:
+        case -EOVERFLOW:
+        case -ECOMM:
+        case -ENOSR:
+        case -EAGAIN:
+            return true;
+        default:
+            return false;
+    }
+}
\ No newline at end of file
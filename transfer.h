@@ -0,0 +1,84 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <linux/kernel.h>
+#include <linux/usb.h>
+
+// Health of a phone, driven by the results of the transfers to it, the values are the AOA_HID_HEALTH_* of the netlink interface
+#define TRANSFER_HEALTHY 0
+#define TRANSFER_DEGRADED 1
+#define TRANSFER_FAILED 2
+
+/*
+    Transmission classes, only one report per phone is on the bus at a time and a waiting report of a lower class goes first
+    Reports of the same class keep their order, so a key press and its release never get reordered
+*/
+#define TRANSFER_CLASS_POINTER 0    // Mouse and gamepad
+#define TRANSFER_CLASS_CONSUMER 1   // Volume and brightness keys
+#define TRANSFER_CLASS_BULK 2       // Typed text and reports of unknown functions
+#define NUM_TRANSFER_CLASSES 3
+
+// Names of the transfer classes as shown and accepted by the sysfs and debugfs files, indexed by TRANSFER_CLASS_*
+extern const char* const transfer_class_names[NUM_TRANSFER_CLASSES];
+
+int setup_transfer(void);
+void cleanup_transfer(void);
+
+// Resets the per-device transfer state when a phone is attached at minor
+void add_transfer_device(int minor);
+
+// Time to wait between a key press and its release and between consecutive key presses, adapted to the phone at minor
+u32 get_hid_event_gap_us(int minor);
+// Sleeps for the current gap of the phone at minor
+void wait_hid_event_gap(int minor);
+void get_transfer_pacing(int minor, u32* gap_us, u32* rtt_us, u32* errors);
+int get_transfer_health(int minor);
+void get_transfer_health_details(int minor, int* health, u32* consecutive_failures);
+void reset_transfer_health(int minor);
+// Reports sent in a class and their latency from send_hid_event until the phone acknowledged them, also in debugfs:
+// /sys/kernel/debug/aoa_hid_driver/latency has a line per attached phone
+void get_transfer_latency(int minor, int transfer_class, u64* reports, u32* average_us, u32* max_us, u64* dropped);
+int set_pacing_bounds(u32 min_gap_us, u32 max_gap_us);
+/*
+    Token bucket per phone and class, send_hid_event waits for a token before sending a report
+    The rate is in reports per second and 0 turns shaping off, burst is the number of reports that can go out back to back
+*/
+int set_transfer_shaping(int minor, int transfer_class, u32 rate, u32 burst);
+// Also in debugfs, /sys/kernel/debug/aoa_hid_driver/shaping has a line per attached phone
+void get_transfer_shaping(int minor, int transfer_class, u32* rate, u32* burst);
+// Whether count reports of the class could be sent right now without waiting for tokens, for writers that must not block
+bool has_transfer_tokens(int minor, int transfer_class, int count);
+void get_pacing_bounds(u32* min_gap_us, u32* max_gap_us);
+
+// Workqueue for work items that send reports, they block on the USB transfers so they do not belong on the system workqueue
+struct workqueue_struct* get_transfer_workqueue(void);
+
+// Blocks until the report's class has a token and the report has been transferred, retrying transient errors, the class of the report follows from its report ID
+// Returns -EIO without transferring anything when the phone is marked failed, -EINTR when killed while waiting for a token
+// and -ECANCELED when cancel_hid_events was called while the report was waiting or in flight
+// Every report passes run_report_hook first, a report dropped there is counted for the latency file and the send returns 0
+int send_hid_event(int minor, char* event, u16 size);
+
+// Aborts the reports in flight and makes senders that are waiting give up, returns the number of reports that were in flight
+int cancel_hid_events(int minor);
+u32 get_hid_events_in_flight(int minor);
+
+// Called from the completion handler with the result of a transfer, -ETIMEDOUT when the phone did not take the report in time
+typedef void (*hid_event_callback)(void* context, int status);
+
+// Safe to call from atomic context, the report is copied and submitted asynchronously without waiting for its class's turn
+// Returns the number of transfers submitted, one per copy the report hook asked for, and callback, when not NULL, is called once for each of them
+// Transfers that the phone does not take within the timeout are unlinked and count against its health
+int send_hid_event_atomic(int minor, const char* event, u16 size, hid_event_callback callback, void* context);
+
+/*
+    Staged reports are prepared ahead of time so that releasing them, possibly from atomic context, only has to submit an urb
+    The callback is told the result of the transfer, it is not called when releasing fails
+*/
+// Returns an ERR_PTR when the phone is not attached or memory runs out, and NULL when the report hook dropped the report
+struct urb* stage_hid_event(int minor, const char* event, u16 size, hid_event_callback callback, void* context);
+int release_hid_event(struct urb* urb);
+// Kills the transfer if it is still in flight
+void free_staged_hid_event(struct urb* urb);
+
+#endif
@@ -1,13 +1,24 @@
 #include "usb.h"
 #include "sys_files.h"
 #include "devices/keyboard.h"
-#include "devices/mouse.h"
-#include "devices/volume.h"
-#include "devices/brightness.h"
+#include "devices/function.h"
+#include "devices/record.h"
+#include "devices/script.h"
+#include "devices/raw.h"
+#include "devices/gamepad.h"
+#include "devices/accessory.h"
+#include "devices/sync.h"
 #include "hid_descriptor.h"
+#include "transfer.h"
+#include "netlink.h"
+#include "discovery.h"
+#include "reattach.h"
+#include "aoa_hid_driver.h"
 
 #include <linux/device.h>
 #include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/mutex.h>
 
 #define MANUFACTURER_STRING "Not a Real Manufacturer"
 #define MODEL_STRING "Not a Real Model"
@@ -18,6 +29,8 @@ static char* manufacturer = NULL;
 static char* model = NULL;
 static char* description = NULL;
 static char* version = NULL;
+// Flushes wait here, woken by every path that completes, drops or cancels input that has_pending_input counts
+static wait_queue_head_t flush_waits[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
 
 /*
     Forward declarations for private functions for this usb.c file
@@ -26,6 +39,17 @@ static int android_default_probe(struct usb_interface* interface, const struct u
 static void android_default_disconnect(struct usb_interface* interface);
 static int android_accessory_mode_probe(struct usb_interface* interface, const struct usb_device_id* id);
 static void android_accessory_mode_disconnect(struct usb_interface* interface);
+static void disconnect_accessory_device(int minor, bool keep_minor);
+static int find_free_minor(void);
+static int add_device_files(int minor);
+static void detach_device_files(int minor);
+static void remove_device_files(int minor);
+static void release_accessory_device(struct kref* ref);
+static int register_hid(struct usb_device* usb_dev, const u8* descriptor, u16 size);
+static int unregister_hid(struct usb_device* usb_dev, int timeout_ms);
+static int submit_anchored_urb(struct accessory_device* dev, struct urb* urb, struct usb_anchor* anchor);
+static bool has_pending_input(int minor);
+static int get_unknown_device_protocol(struct usb_interface* interface, u16* protocol);
 
 static struct usb_device_id any_usb_device_table[] = {
      {.driver_info = 42},
@@ -59,7 +83,10 @@ static struct usb_driver android_accessory_mode_driver = {
     .id_table = accessory_mode_android_device_table,
 };
 
-static struct usb_device* accessory_mode_devices[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static struct accessory_device* accessory_mode_devices[NUM_POSSIBLE_ACCESSORY_MODE_DEVICES];
+static DEFINE_SPINLOCK(accessory_mode_devices_lock);
+// Serializes assigning minors and creating and removing device files between probes, disconnects and expiring reservations
+static DEFINE_MUTEX(phone_minors_lock);
 
 int setup_usb(void){
     manufacturer = kmalloc(strlen(MANUFACTURER_STRING)+1, GFP_KERNEL);
@@ -92,16 +119,23 @@ int setup_usb(void){
 
     for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
         accessory_mode_devices[i] = NULL;
+        init_waitqueue_head(&flush_waits[i]);
     }
+    setup_reattach();
 
     if(setup_hid_descriptor()){
         printk("aoa_hid_driver - Error setting up HID descriptor\n");
         goto setup_usb_error1;
     }
 
+    if(setup_transfer()){
+        printk("aoa_hid_driver - Error setting up transfer\n");
+        goto setup_usb_error2;
+    }
+
     if(usb_register(&android_default_driver)){
         printk("aoa_hid_driver - Error registering USB driver\n");
-        goto setup_usb_error2;
+        goto setup_usb_error3;
     }
 
     if(setup_keyboard()){
@@ -109,36 +143,68 @@ int setup_usb(void){
         goto setup_usb_error5;
     }
 
-    if(setup_mouse()){
-        printk("aoa_hid_driver - Error setting up mouse\n");
+    if(setup_functions()){
+        printk("aoa_hid_driver - Error setting up HID functions\n");
         goto setup_usb_error6;
     }
 
-    if(setup_volume()){
-        printk("aoa_hid_driver - Error setting up volume\n");
+    if(setup_record()){
+        printk("aoa_hid_driver - Error setting up record\n");
         goto setup_usb_error7;
     }
 
-    if(setup_brightness()){
-        printk("aoa_hid_driver - Error setting up brightness\n");
+    if(setup_script()){
+        printk("aoa_hid_driver - Error setting up script\n");
         goto setup_usb_error8;
     }
 
+    if(setup_raw()){
+        printk("aoa_hid_driver - Error setting up raw\n");
+        goto setup_usb_error9;
+    }
+
+    if(setup_gamepad()){
+        printk("aoa_hid_driver - Error setting up gamepad\n");
+        goto setup_usb_error10;
+    }
+
+    if(setup_sync()){
+        printk("aoa_hid_driver - Error setting up sync\n");
+        goto setup_usb_error11;
+    }
+
+    if(setup_accessory()){
+        printk("aoa_hid_driver - Error setting up accessory\n");
+        goto setup_usb_error12;
+    }
+
     if(usb_register(&android_accessory_mode_driver)){
         printk("aoa_hid_driver - Error registering USB driver\n");
-        goto setup_usb_error9;
+        goto setup_usb_error13;
     }
 
     return 0;
 
+setup_usb_error13:
+    cleanup_accessory();
+
+setup_usb_error12:
+    cleanup_sync();
+
+setup_usb_error11:
+    cleanup_gamepad();
+
+setup_usb_error10:
+    cleanup_raw();
+
 setup_usb_error9:
-    cleanup_brightness();
+    cleanup_script();
 
 setup_usb_error8:
-    cleanup_volume();
+    cleanup_record();
 
 setup_usb_error7:
-    cleanup_mouse();
+    cleanup_functions();
 
 setup_usb_error6:
     cleanup_keyboard();
@@ -146,6 +212,9 @@ setup_usb_error6:
 setup_usb_error5:
     usb_deregister(&android_default_driver);
 
+setup_usb_error3:
+    cleanup_transfer();
+
 setup_usb_error2:
     cleanup_hid_descriptor();
 
@@ -169,20 +238,29 @@ setup_usb_error0:
 
 void cleanup_usb(void){
     usb_deregister(&android_accessory_mode_driver);
+    mutex_lock(&phone_minors_lock);
     for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
         if(accessory_mode_devices[i]){
-            remove_keyboard_device(i);
-            remove_mouse_device(i);
-            remove_volume_device(i);
-            remove_brightness_device(i);
-            accessory_mode_devices[i] = NULL;
+            disconnect_accessory_device(i, false);
+        }
+        else if(drop_reserved_minor(i)){
+            // Listeners were told the phone might come back, like an expired reservation this ends it
+            remove_device_files(i);
+            notify_phone_event(AOA_HID_EVENT_DETACHED, NULL, i, 0);
         }
     }
-    cleanup_brightness();
-    cleanup_volume();
-    cleanup_mouse();
+    mutex_unlock(&phone_minors_lock);
+    cleanup_reattach();
+    cleanup_sync();
+    cleanup_accessory();
+    cleanup_gamepad();
+    cleanup_raw();
+    cleanup_script();
+    cleanup_record();
+    cleanup_functions();
     cleanup_keyboard();
     usb_deregister(&android_default_driver);
+    cleanup_transfer();
     cleanup_hid_descriptor();
     kfree(manufacturer);
     kfree(model);
@@ -200,12 +278,13 @@ static int android_default_probe(struct usb_interface* interface, const struct u
     u16 vendor_id = usb_dev->descriptor.idVendor;
     u16 product_id = usb_dev->descriptor.idProduct;
 
+    u16 protocol = 0;
     if(!is_android_device(vendor_id, product_id)){
-        goto android_default_probe_error0;
+        if(get_unknown_device_protocol(interface, &protocol)){
+            goto android_default_probe_error0;
+        }
     }
-
-    u16 protocol = 0;
-    if(usb_control_msg_recv(usb_dev, usb_rcvctrlpipe(usb_dev, 0), ACCESSORY_GET_PROTOCOL, USB_DIR_IN | USB_TYPE_VENDOR, 0, 0, &protocol, sizeof(protocol), 1000, GFP_KERNEL)){
+    else if(usb_control_msg_recv(usb_dev, usb_rcvctrlpipe(usb_dev, 0), ACCESSORY_GET_PROTOCOL, USB_DIR_IN | USB_TYPE_VENDOR, 0, 0, &protocol, sizeof(protocol), 1000, GFP_KERNEL)){
         printk("aoa_hid_driver - Error getting protocol from android device\n");
         goto android_default_probe_error0;
     }
@@ -215,6 +294,8 @@ static int android_default_probe(struct usb_interface* interface, const struct u
         goto android_default_probe_error0;
     }
 
+    notify_phone_event(AOA_HID_EVENT_ATTACHED, usb_dev, -1, 0);
+
     int num_bytes_send = usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0), ACCESSORY_SEND_STRING, USB_DIR_OUT | USB_TYPE_VENDOR, 0, 0, manufacturer, strlen(manufacturer)+1, 1000);
     if(num_bytes_send != strlen(manufacturer)+1){
         printk("aoa_hid_driver - Error sending manufacturer string to android device, usb_control_msg returned %d instead of %d\n", num_bytes_send, (int)strlen(manufacturer)+1);
@@ -245,12 +326,53 @@ static int android_default_probe(struct usb_interface* interface, const struct u
         goto android_default_probe_error0;
     }
 
+    notify_phone_event(AOA_HID_EVENT_HANDSHAKE_DONE, usb_dev, -1, 0);
+
     return 0;
 
 android_default_probe_error0:
     return -ENODEV;
 }
 
+/*
+    Protocol of a device without a known id, only asked when auto discovery is on and the device looks like a phone
+    Fails without logging for everything that is not an AOAv2 phone, most devices on a rack are not
+*/
+static int get_unknown_device_protocol(struct usb_interface* interface, u16* protocol){
+    struct usb_device* usb_dev = interface_to_usbdev(interface);
+    u32 id = (((u32)usb_dev->descriptor.idVendor) << 16) | usb_dev->descriptor.idProduct;
+
+    // Phones already in accessory mode belong to the accessory mode driver
+    if(!is_auto_discovery_enabled() || usb_match_id(interface, accessory_mode_android_device_table)){
+        return -ENODEV;
+    }
+
+    if(lookup_discovery_cache(id, usb_dev->serial, protocol)){
+        return *protocol == 2 ? 0 : -ENODEV;
+    }
+
+    if(!is_discovery_candidate(usb_dev)){
+        return -ENODEV;
+    }
+
+    int ret = usb_control_msg_recv(usb_dev, usb_rcvctrlpipe(usb_dev, 0), ACCESSORY_GET_PROTOCOL, USB_DIR_IN | USB_TYPE_VENDOR, 0, 0, protocol, sizeof(*protocol), DISCOVERY_GET_PROTOCOL_TIMEOUT_MS, GFP_KERNEL);
+    // A device that was only too slow to answer is asked again on the next attach instead of being remembered as no phone
+    if(ret == -ETIMEDOUT){
+        return -ENODEV;
+    }
+    if(ret){
+        *protocol = 0;
+    }
+
+    add_discovery_cache(id, usb_dev->serial, *protocol);
+    if(*protocol != 2){
+        return -ENODEV;
+    }
+
+    printk("aoa_hid_driver - Discovered AOAv2 device %04x:%04x\n", usb_dev->descriptor.idVendor, usb_dev->descriptor.idProduct);
+    return 0;
+}
+
 static void android_default_disconnect(struct usb_interface* interface){
     // Should not do anything
 }
@@ -258,84 +380,106 @@ static void android_default_disconnect(struct usb_interface* interface){
 static int android_accessory_mode_probe(struct usb_interface* interface, const struct usb_device_id* id){
     int interface_number = interface->cur_altsetting->desc.bInterfaceNumber;
     if(interface_number != 0){
-        goto android_accessory_mode_probe_error0;
+        return -ENODEV;
     }
 
     struct usb_device* usb_dev = interface_to_usbdev(interface);
 
-    unsigned int candidate_index = 0;
-    bool found_candidate = false;
-    bool found_duplicate = false;
-    for(int i=NUM_POSSIBLE_ACCESSORY_MODE_DEVICES-1; i>=0; i--){
-        if(accessory_mode_devices[i] == usb_dev){
-            found_duplicate = true;
-            break;
-        }
+    mutex_lock(&phone_minors_lock);
 
-        if(!accessory_mode_devices[i]){
-            found_candidate = true;
-            candidate_index = i;
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(accessory_mode_devices[i] && accessory_mode_devices[i]->usb_dev == usb_dev){
+            mutex_unlock(&phone_minors_lock);
+            return 0;
         }
     }
 
-    if(found_duplicate){
-        return 0;
-    }
-
-    if(!found_candidate){
-        printk("aoa_hid_driver - No more space for accessory mode devices\n");
-        goto android_accessory_mode_probe_error0;
-    }
-
-    int num_bytes_send = usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0), ACCESSORY_REGISTER_HID, USB_DIR_OUT | USB_TYPE_VENDOR, 1, get_hid_descriptor_size(), NULL, 0, 1000);
-    if(num_bytes_send != 0){
-        printk("aoa_hid_driver - Error registering HID descriptor with android device, usb_control_msg returned %d instead of 0\n", num_bytes_send);
+    if(register_hid(usb_dev, (const u8*)get_hid_descriptor(), get_hid_descriptor_size())){
         goto android_accessory_mode_probe_error0;
     }
 
-    num_bytes_send = usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0), ACCESSORY_SET_HID_REPORT_DESC, USB_DIR_OUT | USB_TYPE_VENDOR, 1, 0, get_hid_descriptor(), get_hid_descriptor_size(), 1000);
-    if(num_bytes_send != get_hid_descriptor_size()){
-        printk("aoa_hid_driver - Error setting HID report descriptor with android device, usb_control_msg returned %d instead of %d\n", num_bytes_send, (int)get_hid_descriptor_size());
-        goto android_accessory_mode_probe_error0;
+    struct accessory_device* dev = kzalloc(sizeof(struct accessory_device), GFP_KERNEL);
+    if(!dev){
+        goto android_accessory_mode_probe_error1;
     }
 
-    accessory_mode_devices[candidate_index] = usb_dev;
+    kref_init(&dev->ref);
+    init_usb_anchor(&dev->anchor);
+    init_usb_anchor(&dev->hid_anchor);
+    spin_lock_init(&dev->lock);
+    mutex_init(&dev->hid_lock);
+    dev->usb_dev = usb_get_dev(usb_dev);
 
-    if(add_keyboard_device(candidate_index)){
-        printk("aoa_hid_driver - Error adding keyboard device\n");
-        goto android_accessory_mode_probe_error1;
+    struct usb_endpoint_descriptor* bulk_in = NULL;
+    struct usb_endpoint_descriptor* bulk_out = NULL;
+    if(!usb_find_common_endpoints(interface->cur_altsetting, &bulk_in, &bulk_out, NULL, NULL)){
+        dev->bulk_in_address = bulk_in->bEndpointAddress;
+        dev->bulk_out_address = bulk_out->bEndpointAddress;
     }
 
-    if(add_mouse_device(candidate_index)){
-        printk("aoa_hid_driver - Error adding mouse device\n");
+    // A phone that comes back within its grace period gets its old minor, whose device files are still there
+    int candidate_index = claim_reserved_minor(usb_dev->serial);
+    bool reattached = candidate_index >= 0;
+    if(!reattached){
+        candidate_index = find_free_minor();
+    }
+    if(candidate_index < 0){
+        printk("aoa_hid_driver - No more space for accessory mode devices\n");
         goto android_accessory_mode_probe_error2;
     }
 
-    if(add_volume_device(candidate_index)){
-        printk("aoa_hid_driver - Error adding volume device\n");
+    add_transfer_device(candidate_index);
+
+    unsigned long flags;
+    spin_lock_irqsave(&accessory_mode_devices_lock, flags);
+    accessory_mode_devices[candidate_index] = dev;
+    spin_unlock_irqrestore(&accessory_mode_devices_lock, flags);
+
+    if(!reattached && add_device_files(candidate_index)){
         goto android_accessory_mode_probe_error3;
     }
 
-    if(add_brightness_device(candidate_index)){
-        printk("aoa_hid_driver - Error adding brightness device\n");
+    // The data channel of the accessory starts over with every connection, so its file is always created again
+    if(add_accessory_device(candidate_index)){
+        printk("aoa_hid_driver - Error adding accessory device\n");
         goto android_accessory_mode_probe_error4;
     }
 
+    mutex_unlock(&phone_minors_lock);
+
+    if(reattached){
+        printk("aoa_hid_driver - Android device %s attached again as minor %d\n", usb_dev->serial, candidate_index);
+        wake_reattach_waiters(candidate_index);
+    }
+    notify_phone_event(AOA_HID_EVENT_HID_REGISTERED, usb_dev, candidate_index, 0);
+
     return 0;
 
 android_accessory_mode_probe_error4:
-    remove_volume_device(candidate_index);
+    if(!reattached){
+        remove_device_files(candidate_index);
+    }
 
 android_accessory_mode_probe_error3:
-    remove_mouse_device(candidate_index);
+    spin_lock_irqsave(&accessory_mode_devices_lock, flags);
+    accessory_mode_devices[candidate_index] = NULL;
+    spin_unlock_irqrestore(&accessory_mode_devices_lock, flags);
+
+    // The phone may still come back properly before the grace period would have ended
+    if(reattached && !reserve_minor(candidate_index, usb_dev->serial)){
+        remove_device_files(candidate_index);
+        wake_reattach_waiters(candidate_index);
+    }
 
 android_accessory_mode_probe_error2:
-    remove_keyboard_device(candidate_index);
+    put_accessory_device(dev);
 
 android_accessory_mode_probe_error1:
-    accessory_mode_devices[candidate_index] = NULL;
+    // The phone would otherwise keep showing an input device nobody sends reports to
+    unregister_hid(usb_dev, 100);
 
 android_accessory_mode_probe_error0:
+    mutex_unlock(&phone_minors_lock);
     return -ENODEV;
 }
 
@@ -347,16 +491,277 @@ static void android_accessory_mode_disconnect(struct usb_interface* interface){
 
     struct usb_device* usb_dev = interface_to_usbdev(interface);
 
+    mutex_lock(&phone_minors_lock);
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(accessory_mode_devices[i] && accessory_mode_devices[i]->usb_dev == usb_dev){
+            disconnect_accessory_device(i, true);
+            break;
+        }
+    }
+    mutex_unlock(&phone_minors_lock);
+}
+
+// Called with phone_minors_lock held, keep_minor reserves the minor and the device files for the phone to come back
+static void disconnect_accessory_device(int minor, bool keep_minor){
+    // Reserved before the phone is gone so that writers never see it gone for good in between
+    bool reserved = keep_minor && reserve_minor(minor, accessory_mode_devices[minor]->usb_dev->serial);
+
+    unsigned long flags;
+    spin_lock_irqsave(&accessory_mode_devices_lock, flags);
+    struct accessory_device* dev = accessory_mode_devices[minor];
+    accessory_mode_devices[minor] = NULL;
+    spin_unlock_irqrestore(&accessory_mode_devices_lock, flags);
+
+    // From here on no new urb can be submitted, so killing the anchored ones leaves nothing in flight
+    spin_lock_irqsave(&dev->lock, flags);
+    dev->disconnected = true;
+    spin_unlock_irqrestore(&dev->lock, flags);
+    usb_kill_anchored_urbs(&dev->anchor);
+    usb_kill_anchored_urbs(&dev->hid_anchor);
+
+    // On unload or unbind the phone is still attached and removes its HID device right away, after an unplug there is nobody to tell
+    mutex_lock(&dev->hid_lock);
+    if(dev->usb_dev->state != USB_STATE_NOTATTACHED){
+        unregister_hid(dev->usb_dev, 100);
+    }
+    mutex_unlock(&dev->hid_lock);
+
+    // Writers woken here see the phone gone, background work fails fast instead of waiting for timeouts
+    if(reserved){
+        detach_device_files(minor);
+    }
+    else{
+        remove_device_files(minor);
+    }
+    remove_accessory_device(minor);
+    wake_flush_waiters(minor);
+
+    notify_phone_event(reserved ? AOA_HID_EVENT_DISCONNECTED : AOA_HID_EVENT_DETACHED, dev->usb_dev, minor, 0);
+    put_accessory_device(dev);
+}
+
+void expire_reserved_minor(int minor){
+    mutex_lock(&phone_minors_lock);
+    // The phone may have come back while the work item was waiting for the lock
+    if(drop_reserved_minor(minor)){
+        remove_device_files(minor);
+        notify_phone_event(AOA_HID_EVENT_DETACHED, NULL, minor, 0);
+    }
+    mutex_unlock(&phone_minors_lock);
+}
+
+// The lowest minor that is neither used nor reserved, when all free minors are reserved the lowest reservation is given up
+static int find_free_minor(void){
+    for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
+        if(!accessory_mode_devices[i] && !is_minor_reserved(i)){
+            return i;
+        }
+    }
+
     for(int i=0; i<NUM_POSSIBLE_ACCESSORY_MODE_DEVICES; i++){
-        if(accessory_mode_devices[i] == usb_dev){
-            remove_keyboard_device(i);
-            remove_mouse_device(i);
-            remove_volume_device(i);
-            remove_brightness_device(i);
-            accessory_mode_devices[i] = NULL;
-            return;
+        if(!accessory_mode_devices[i] && drop_reserved_minor(i)){
+            remove_device_files(i);
+            notify_phone_event(AOA_HID_EVENT_DETACHED, NULL, i, 0);
+            return i;
         }
     }
+
+    return -1;
+}
+
+static int add_device_files(int minor){
+    if(add_keyboard_device(minor)){
+        printk("aoa_hid_driver - Error adding keyboard device\n");
+        goto add_device_files_error0;
+    }
+
+    if(add_function_devices(minor)){
+        printk("aoa_hid_driver - Error adding HID function devices\n");
+        goto add_device_files_error1;
+    }
+
+    if(add_record_device(minor)){
+        printk("aoa_hid_driver - Error adding record device\n");
+        goto add_device_files_error2;
+    }
+
+    if(add_script_device(minor)){
+        printk("aoa_hid_driver - Error adding script device\n");
+        goto add_device_files_error3;
+    }
+
+    if(add_raw_device(minor)){
+        printk("aoa_hid_driver - Error adding raw device\n");
+        goto add_device_files_error4;
+    }
+
+    if(add_gamepad_device(minor)){
+        printk("aoa_hid_driver - Error adding gamepad device\n");
+        goto add_device_files_error5;
+    }
+
+    return 0;
+
+add_device_files_error5:
+    remove_raw_device(minor);
+
+add_device_files_error4:
+    remove_script_device(minor);
+
+add_device_files_error3:
+    remove_record_device(minor);
+
+add_device_files_error2:
+    remove_function_devices(minor);
+
+add_device_files_error1:
+    remove_keyboard_device(minor);
+
+add_device_files_error0:
+    return -1;
+}
+
+// Stops everything in progress for the phone but keeps the device files, the accessory data channel is not one of them
+static void detach_device_files(int minor){
+    detach_keyboard_device(minor);
+    detach_function_devices(minor);
+    detach_record_device(minor);
+    detach_script_device(minor);
+    detach_raw_device(minor);
+    detach_gamepad_device(minor);
+}
+
+static void remove_device_files(int minor){
+    remove_keyboard_device(minor);
+    remove_function_devices(minor);
+    remove_record_device(minor);
+    remove_script_device(minor);
+    remove_raw_device(minor);
+    remove_gamepad_device(minor);
+}
+
+static void release_accessory_device(struct kref* ref){
+    struct accessory_device* dev = container_of(ref, struct accessory_device, ref);
+    usb_put_dev(dev->usb_dev);
+    kfree(dev->hid_descriptor);
+    kfree(dev->report_sizes);
+    kfree(dev);
+}
+
+static int register_hid(struct usb_device* usb_dev, const u8* descriptor, u16 size){
+    int num_bytes_send = usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0), ACCESSORY_REGISTER_HID, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_HID_ID, size, NULL, 0, 1000);
+    if(num_bytes_send != 0){
+        printk("aoa_hid_driver - Error registering HID descriptor with android device, usb_control_msg returned %d instead of 0\n", num_bytes_send);
+        return num_bytes_send < 0 ? num_bytes_send : -EIO;
+    }
+
+    // The descriptor is kmalloc'ed, usb_control_msg needs a buffer that can be used for DMA
+    num_bytes_send = usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0), ACCESSORY_SET_HID_REPORT_DESC, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_HID_ID, 0, (void*)descriptor, size, 1000);
+    if(num_bytes_send != size){
+        printk("aoa_hid_driver - Error setting HID report descriptor with android device, usb_control_msg returned %d instead of %d\n", num_bytes_send, (int)size);
+        return num_bytes_send < 0 ? num_bytes_send : -EIO;
+    }
+
+    return 0;
+}
+
+static int unregister_hid(struct usb_device* usb_dev, int timeout_ms){
+    int num_bytes_send = usb_control_msg(usb_dev, usb_sndctrlpipe(usb_dev, 0), ACCESSORY_UNREGISTER_HID, USB_DIR_OUT | USB_TYPE_VENDOR, ACCESSORY_HID_ID, 0, NULL, 0, timeout_ms);
+    if(num_bytes_send != 0){
+        printk("aoa_hid_driver - Error unregistering HID device from android device, usb_control_msg returned %d instead of 0\n", num_bytes_send);
+        return num_bytes_send < 0 ? num_bytes_send : -EIO;
+    }
+
+    return 0;
+}
+
+int reregister_hid(int minor, const u8* descriptor, u16 size){
+    struct accessory_device* dev = get_accessory_device(minor);
+    if(!dev){
+        return -ENODEV;
+    }
+
+    // Everything that can fail without touching the phone is done first
+    int ret = -ENOMEM;
+    bool use_default = descriptor == (const u8*)get_hid_descriptor();
+    u8* new_descriptor = NULL;
+    u16* new_report_sizes = NULL;
+    if(descriptor && !use_default){
+        new_descriptor = kmemdup(descriptor, size, GFP_KERNEL);
+        new_report_sizes = kcalloc(256, sizeof(u16), GFP_KERNEL);
+        if(!new_descriptor || !new_report_sizes){
+            goto reregister_hid_error0;
+        }
+
+        ret = -EINVAL;
+        if(size == 0 || parse_hid_report_sizes(new_descriptor, size, new_report_sizes)){
+            printk("aoa_hid_driver - Error re-registering HID device, the new descriptor is invalid\n");
+            goto reregister_hid_error0;
+        }
+    }
+
+    mutex_lock(&dev->hid_lock);
+
+    ret = -ENODEV;
+    if(READ_ONCE(dev->disconnected)){
+        goto reregister_hid_error1;
+    }
+
+    if(!descriptor){
+        descriptor = dev->hid_descriptor ? dev->hid_descriptor : (const u8*)get_hid_descriptor();
+        size = dev->hid_descriptor ? dev->hid_descriptor_size : get_hid_descriptor_size();
+    }
+    else if(use_default){
+        size = get_hid_descriptor_size();
+    }
+    else{
+        descriptor = new_descriptor;
+    }
+
+    // A phone whose HID stack got confused may have dropped the device already, registering again still works then
+    unregister_hid(dev->usb_dev, 250);
+    ret = register_hid(dev->usb_dev, descriptor, size);
+    if(ret){
+        goto reregister_hid_error1;
+    }
+
+    if(new_descriptor || use_default){
+        unsigned long flags;
+        spin_lock_irqsave(&dev->lock, flags);
+        swap(dev->hid_descriptor, new_descriptor);
+        swap(dev->report_sizes, new_report_sizes);
+        dev->hid_descriptor_size = dev->hid_descriptor ? size : 0;
+        spin_unlock_irqrestore(&dev->lock, flags);
+    }
+
+    // Failures were most likely caused by the state the phone was just reset from
+    reset_transfer_health(minor);
+    notify_phone_event(AOA_HID_EVENT_HID_REGISTERED, dev->usb_dev, minor, 0);
+    ret = 0;
+
+reregister_hid_error1:
+    mutex_unlock(&dev->hid_lock);
+
+reregister_hid_error0:
+    kfree(new_descriptor);
+    kfree(new_report_sizes);
+    put_accessory_device(dev);
+    return ret;
+}
+
+u16 get_accessory_report_size(int minor, u8 report_id){
+    struct accessory_device* dev = get_accessory_device(minor);
+    if(!dev){
+        return 0;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&dev->lock, flags);
+    u16 size = dev->report_sizes ? dev->report_sizes[report_id] : get_hid_report_size(report_id);
+    spin_unlock_irqrestore(&dev->lock, flags);
+
+    put_accessory_device(dev);
+    return size;
 }
 
 struct usb_device* get_usb_device(int minor){
@@ -364,5 +769,96 @@ struct usb_device* get_usb_device(int minor){
         return NULL;
     }
 
-    return accessory_mode_devices[minor];
+    unsigned long flags;
+    spin_lock_irqsave(&accessory_mode_devices_lock, flags);
+    struct usb_device* usb_dev = accessory_mode_devices[minor] ? accessory_mode_devices[minor]->usb_dev : NULL;
+    spin_unlock_irqrestore(&accessory_mode_devices_lock, flags);
+    return usb_dev;
+}
+
+struct accessory_device* get_accessory_device(int minor){
+    if(minor < 0 || minor >= NUM_POSSIBLE_ACCESSORY_MODE_DEVICES){
+        return NULL;
+    }
+
+    unsigned long flags;
+    spin_lock_irqsave(&accessory_mode_devices_lock, flags);
+    struct accessory_device* dev = accessory_mode_devices[minor];
+    if(dev){
+        kref_get(&dev->ref);
+    }
+    spin_unlock_irqrestore(&accessory_mode_devices_lock, flags);
+    return dev;
+}
+
+void put_accessory_device(struct accessory_device* dev){
+    kref_put(&dev->ref, release_accessory_device);
+}
+
+int submit_accessory_urb(struct accessory_device* dev, struct urb* urb){
+    return submit_anchored_urb(dev, urb, &dev->anchor);
+}
+
+int submit_hid_event_urb(struct accessory_device* dev, struct urb* urb){
+    return submit_anchored_urb(dev, urb, &dev->hid_anchor);
+}
+
+int cancel_phone_input(int minor){
+    if(!get_usb_device(minor)){
+        return -ENODEV;
+    }
+
+    // Reports in flight and senders waiting for their turn give up first, so the queues below are not stuck behind a transfer
+    int discarded = cancel_hid_events(minor);
+    discarded += cancel_keyboard_input(minor);
+    discarded += cancel_script_input(minor);
+    discarded += cancel_replay_input(minor);
+    discarded += cancel_gamepad_input(minor);
+    discarded += cancel_raw_input(minor);
+
+    // Whatever was cut off may have been between a press and its release
+    send_release_reports(minor);
+
+    return discarded;
+}
+
+int flush_phone_input(int minor){
+    if(wait_event_interruptible(flush_waits[minor], !has_pending_input(minor) || !get_usb_device(minor))){
+        return -ERESTARTSYS;
+    }
+
+    return has_pending_input(minor) ? -ENODEV : 0;
+}
+
+void wake_flush_waiters(int minor){
+    // Called for every completed transfer, the check keeps the wait queue's lock off that path while nobody flushes
+    if(wq_has_sleeper(&flush_waits[minor])){
+        wake_up_interruptible(&flush_waits[minor]);
+    }
+}
+
+static bool has_pending_input(int minor){
+    return get_hid_events_in_flight(minor) ||
+        has_pending_keyboard_input(minor) ||
+        has_pending_script_input(minor) ||
+        has_pending_replay_input(minor) ||
+        has_pending_gamepad_input(minor) ||
+        has_pending_raw_input(minor);
+}
+
+static int submit_anchored_urb(struct accessory_device* dev, struct urb* urb, struct usb_anchor* anchor){
+    int ret = -ENODEV;
+
+    // Checking the flag and anchoring under the same lock closes the race with disconnect_accessory_device
+    unsigned long flags;
+    spin_lock_irqsave(&dev->lock, flags);
+    if(!dev->disconnected){
+        usb_anchor_urb(urb, anchor);
+        ret = usb_submit_urb(urb, GFP_ATOMIC);
+        if(ret){
+            usb_unanchor_urb(urb);
+        }
+    }
+    spin_unlock_irqrestore(&dev->lock, flags);
+    return ret;
 }
\ No newline at end of file
@@ -5,6 +5,9 @@
 #include <linux/fs.h>
 #include <linux/atomic.h>
 #include <linux/delay.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
 
 #define NUM_POSSIBLE_ACCESSORY_MODE_DEVICES 64
 
@@ -17,13 +20,64 @@
 #define ACCESSORY_UNREGISTER_HID 55
 #define ACCESSORY_SET_HID_REPORT_DESC 56
 #define ACCESSORY_SEND_HID_EVENT 57
-// TODO: ACCESSORY_UNREGISTER_HID is not used in the code
-// Because HID device will unregister itself probably when phone usb is disconnected
-// Ideally however this should probably be implemented
+// The driver registers a single HID device with the phone, this is its id in the AOA requests
+#define ACCESSORY_HID_ID 1
 
 int setup_usb(void);
 void cleanup_usb(void);
 
+/*
+    A phone in accessory mode, kept alive by a reference count until the last transfer using it has finished
+    Every urb sent to the phone is anchored so that disconnect can kill all of them at once instead of waiting for timeouts
+    Reports have an anchor of their own so that cancelling them leaves the accessory bulk stream alone
+*/
+struct accessory_device {
+    struct kref ref;
+    struct usb_device* usb_dev;
+    struct usb_anchor anchor;
+    struct usb_anchor hid_anchor;
+    spinlock_t lock;
+    bool disconnected;
+    // Addresses of the accessory bulk endpoints on interface 0, 0 when the product id has none
+    u8 bulk_in_address;
+    u8 bulk_out_address;
+    // Serializes registering and unregistering the HID device with the phone
+    struct mutex hid_lock;
+    // Descriptor registered with the phone and the report sizes it declares, both NULL while it is the driver's own descriptor
+    u8* hid_descriptor;
+    u16 hid_descriptor_size;
+    u16* report_sizes;
+};
+
+// Only tells whether a phone is attached, transfers have to hold a reference from get_accessory_device
 struct usb_device* get_usb_device(int minor);
 
+struct accessory_device* get_accessory_device(int minor);
+void put_accessory_device(struct accessory_device* dev);
+// Anchors and submits the urb, fails with -ENODEV once the phone is disconnected
+int submit_accessory_urb(struct accessory_device* dev, struct urb* urb);
+// Same for the urbs that send reports
+int submit_hid_event_urb(struct accessory_device* dev, struct urb* urb);
+
+// Size of the input report with the given ID in the descriptor registered with the phone, 0 when it is not declared
+u16 get_accessory_report_size(int minor, u8 report_id);
+/*
+    Unregisters the HID device on the phone and registers it again while the accessory stays connected
+    A NULL descriptor registers the current descriptor again, passing get_hid_descriptor() goes back to the driver's own descriptor
+*/
+int reregister_hid(int minor, const u8* descriptor, u16 size);
+
+/*
+    Discards the input queued for the phone on every device file, aborts its reports in flight and then releases every key and
+    button, returns the number of discarded characters, reports and scripts
+*/
+int cancel_phone_input(int minor);
+// Blocks until nothing is queued or in flight for the phone, interrupted by signals
+int flush_phone_input(int minor);
+// Must be called whenever input counted by a flush completes or is dropped, safe from any context
+void wake_flush_waiters(int minor);
+
+// Removes the device files of a phone whose reattach grace period is over, unless it came back in the meantime
+void expire_reserved_minor(int minor);
+
 #endif
\ No newline at end of file